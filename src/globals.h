@@ -16,11 +16,18 @@
 #include "audio/jack.h"
 #include "audio/midi.h"
 #include "util/datafile.h"
+#include "util/sample-pool.h"
 #include "utils.h"
 
 struct Project {
   std::string name = "Tape1";
   std::string path = "tape1.tape";
+  /// Store new tapes with a file per track, see TapeFile::planar()
+  bool planarTape = false;
+  /// Store only what is recorded on new tapes, see TapeFile::makeSparse()
+  bool sparseTape = false;
+  /// Compress the audio not played, see TapeFile::packBlock()
+  bool packTape = false;
 
   int bpm = 120;
 };
@@ -38,6 +45,8 @@ public:
     Dispatcher<> postExit;
     Dispatcher<uint> bufferSizeChanged;
     Dispatcher<uint> samplerateChanged;
+    /// On the UI thread, before drawing each frame
+    Dispatcher<> preDraw;
   } events;
 
   Project *project;
@@ -57,6 +66,9 @@ public:
 
   std::vector<MidiEventPtr> midiEvents;
 
+  /// Samples shared by the modules, before them so they can use it
+  top1::SamplePool samplePool;
+
   module::SynthModuleDispatcher synth;
   module::SynthModuleDispatcher drums;
   module::EffectModuleDispatcher effect;
@@ -13,13 +13,15 @@ namespace module {
 
 DrumSampler::DrumSampler() :
   SynthModule(&data),
-  maxSampleSize (16 * GLOB.samplerate),
-  sampleData (maxSampleSize),
+  sample (GLOB.samplePool, nVoices),
   editScreen (new DrumSampleScreen(this)) {
 
+  sample.output(GLOB.samplerate);
   GLOB.events.samplerateChanged.add([&] (uint sr) {
-    maxSampleSize = 16 * sr;
-    sampleSpeed = sampleSampleRate / float(sr);
+    sample.output(sr);
+  });
+  GLOB.events.preDraw.add([&] {
+    sample.update();
   });
 
 }
@@ -32,51 +34,21 @@ void DrumSampler::process(uint nframes) {
          auto &&voice = data.voiceData[currentVoiceIdx];
          voice.playProgress = (voice.fwd()) ? 0 : voice.length() - 1;
          voice.trigger = true;
+         sample.start(currentVoiceIdx, {static_cast<int>(voice.in),
+             static_cast<int>(voice.length()), voice.fwd(), voice.loop()});
        }
     }, [] (MidiEvent *) {});
   }
 
-  for (auto &&voice : data.voiceData) {
-
-    float playSpeed = voice.speed * sampleSpeed;
+  for (uint v = 0; v < nVoices; v++) {
+    auto &&voice = data.voiceData[v];
 
     // Process audio
-    if (voice.playProgress >= 0 && playSpeed > 0) {
-      if (voice.fwd()) {
-        if (voice.loop() && voice.trigger) {
-          for(int i = 0; i < nframes; ++i) {
-            GLOB.audioData.proc[i] += sampleData[voice.in + voice.playProgress];
-            voice.playProgress += playSpeed;
-            if (voice.playProgress >= voice.length()) {
-              voice.playProgress = 0;
-            }
-          }
-        } else {
-          int frms = std::min<int>(nframes, voice.length() - voice.playProgress);
-          for(int i = 0; i < frms; ++i) {
-            GLOB.audioData.proc[i] += sampleData[voice.in + voice.playProgress];
-            voice.playProgress += playSpeed;
-          }
-          if (voice.playProgress >= voice.length()) {
-            voice.playProgress = -1;
-          }
-        }
+    if (voice.playProgress >= 0 && voice.speed > 0) {
+      if (sample.play(v, GLOB.audioData.proc.data(), nframes, voice.speed)) {
+        voice.playProgress = sample.offset(v);
       } else {
-        if (voice.loop() && voice.trigger) {
-          for(int i = 0; i < nframes; ++i) {
-            GLOB.audioData.proc[i] += sampleData[voice.in + voice.playProgress];
-            voice.playProgress -= playSpeed;
-            if (voice.playProgress < 0) {
-              voice.playProgress = voice.length() -1;
-            }
-          }
-        } else {
-          int frms = std::min<int>(nframes, voice.playProgress);
-          for(int i = 0; i < frms; ++i) {
-            GLOB.audioData.proc[i] += sampleData[voice.in + voice.playProgress];
-            voice.playProgress -= playSpeed;
-          }
-        }
+        voice.playProgress = -1;
       }
     }
   }
@@ -84,10 +56,15 @@ void DrumSampler::process(uint nframes) {
   for (auto &&nEvent : GLOB.midiEvents) {
     nEvent.match([&] (NoteOffEvent *e) {
        if (e->channel == 1) {
-         auto &&voice = data.voiceData[e->key % nVoices];
+         uint v = e->key % nVoices;
+         auto &&voice = data.voiceData[v];
          voice.trigger = false;
          if (voice.stop()) {
            voice.playProgress = -1;
+           sample.stop(v);
+         } else {
+           // Loops play to the end of the lap
+           sample.release(v);
          }
        }
     }, [] (MidiEvent *) {});
@@ -99,15 +76,12 @@ void DrumSampler::display() {
 }
 
 void DrumSampler::load() {
-  top1::SndFile<1> sf (samplePath(data.sampleName));
-
-  size_t rs = std::min(maxSampleSize, sf.size());
-
-  sampleData.resize(rs);
-  sf.read(sampleData.data(), rs);
+  auto path = samplePath(data.sampleName);
+  // Already loaded, and unchanged on the disk
+  if (sample.current(path)) return;
+  sample.open(path);
 
-  sampleSampleRate = sf.samplerate;
-  sampleSpeed = sampleSampleRate / float(GLOB.samplerate);
+  size_t rs = sample.size();
 
   for (auto &&v : data.voiceData) {
     v.in.max = rs;
@@ -125,19 +99,24 @@ void DrumSampler::load() {
 
   auto &mwf = editScreen->mainWF;
   mwf->clear();
-  for (auto &&s : sampleData) {
-    mwf->addFrame(s);
-  }
-
   auto &wf = editScreen->topWF;
   wf->clear();
-  for (auto &&s : sampleData) {
-    wf->addFrame(s);
+  if (rs > 0) {
+    // Read through, without holding all of it
+    top1::SndFile<1> sf;
+    sf.readOnly = true;
+    sf.open(path);
+    std::vector<float> block (top1::SampleStream::RING);
+    while (uint n = sf.read(block.data(), block.size())) {
+      for (uint i = 0; i < n; i++) {
+        mwf->addFrame(block[i]);
+        wf->addFrame(block[i]);
+      }
+    }
   }
   editScreen->topWFW.viewRange = {0, wf->size() - 1};
 
-  if (sf.size() == 0) LOGD << "Empty sample file";
-  sf.close();
+  if (rs == 0) LOGD << "Empty sample file";
 }
 
 void DrumSampler::init() {
@@ -187,8 +166,9 @@ const Colour WFGrid = 0x303040;
 
 module::DrumSampleScreen::DrumSampleScreen(DrumSampler *m) :
   ModuleScreen (m),
+  // Scaled for 16 seconds
   topWF (new Waveform(
-     module->sampleData.size() / drawing::topWFsize.w / 4.0, 1.0)
+     16.0 * GLOB.samplerate / drawing::topWFsize.w / 4.0, 1.0)
          ),
   topWFW (topWF, drawing::topWFsize),
   mainWF (new Waveform(50, 1.0)),
@@ -6,7 +6,7 @@
 #include "../ui/base.h"
 #include "../ui/waveform-widget.h"
 
-#include "../util/dyn-array.h"
+#include "../util/sample-stream.h"
 
 namespace module {
 
@@ -18,14 +18,15 @@ class DrumSampleScreen; // FWDCL
 class DrumSampler : public module::SynthModule {
 public:
 
-  size_t maxSampleSize = 0;
-  top1::DynArray<float> sampleData;
-  int sampleSampleRate = 44100;
-  float sampleSpeed = 1;
+  static const uint nVoices = 24;
 
-  std::shared_ptr<DrumSampleScreen> editScreen;
+  /**
+   * Streamed from the disk, its head shared through GLOB.samplePool, and
+   * converted to the engine's sample rate
+   */
+  top1::SampleStream sample;
 
-  static const uint nVoices = 24;
+  std::shared_ptr<DrumSampleScreen> editScreen;
 
   struct Data : public module::Data {
     module::Opt<std::string> sampleName = {this, "sample name", ""};
@@ -19,20 +19,38 @@ void MixerModule::display() {
 
 // Mixing!
 
+std::array<top1::MixTrack, 4> MixerModule::mix() {
+  std::array<top1::MixTrack, 4> tracks;
+  for (uint t = 0; t < 4; t++) {
+    tracks[t] = {data.track[t].level, data.track[t].pan, data.track[t].muted};
+  }
+  return tracks;
+}
+
+void MixerModule::toggleBounce() {
+  if (bounce.running()) {
+    bounce.cancel();
+    return;
+  }
+  GLOB.tapedeck.tapeBuffer.save();
+  top1::Bounce::Settings settings;
+  settings.tape = GLOB.project->path;
+  settings.mixPath = GLOB.project->name + ".wav";
+  settings.stemsPath = GLOB.project->name;
+  settings.tracks = mix();
+  bounce.start(settings);
+}
+
 void MixerModule::process(uint nframes) {
   auto &trackBuffer = GLOB.tapedeck.trackBuffer;
-  float level[4] = {data.track[0].level, data.track[1].level,
-                    data.track[2].level, data.track[3].level};
-  float pan[4] = {data.track[0].pan, data.track[1].level,
-                  data.track[2].pan, data.track[3].pan};
+  // Shared with the bounce, so it sounds the same
+  auto tracks = mix();
   for (uint f = 0; f < nframes; f++) {
     float lMix = 0, rMix = 0;
     for (uint t = 0; t < 4 ; t++) {
-      if (!data.track[t].muted) {
-        lMix += trackBuffer[f][t] * level[t] * (1-pan[t]);
-        rMix += trackBuffer[f][t] * level[t] * (1+pan[t]);
-      }
-      trackGraph[t].add(trackBuffer[f][t] * level[t]);
+      lMix += trackBuffer[f][t] * tracks[t].left();
+      rMix += trackBuffer[f][t] * tracks[t].right();
+      trackGraph[t].add(trackBuffer[f][t] * tracks[t].level);
     }
     GLOB.audioData.outL[f] =
       lMix + GLOB.audioData.proc[f] * GLOB.tapedeck.data.procGain;
@@ -54,6 +72,15 @@ void MixerScreen::draw(drawing::Canvas& ctx) {
   drawMixerSegment(ctx, 3, 168, 32.5);
   drawMixerSegment(ctx, 4, 243, 32.5);
 
+  if (module->bounce.running()) {
+    ctx.fillStyle(Colours::White);
+    ctx.font(FONT_NORM);
+    ctx.font(20);
+    ctx.textAlign(TextAlign::Center, TextAlign::Middle);
+    ctx.fillText(fmt::format("BOUNCING {:.0f}%", module->bounce.progress() * 100),
+      160, 225);
+  }
+
 }
 
 bool MixerScreen::keypress(ui::Key key) {
@@ -80,7 +107,8 @@ bool MixerScreen::keypress(ui::Key key) {
     else module->data.track[1].level--;
     return true;
   case K_GREEN_CLICK:
-    module->data.track[1].muted.toggle();
+    if (shift) module->toggleBounce();
+    else module->data.track[1].muted.toggle();
     return true;
   case K_WHITE_UP:
     if (shift) module->data.track[2].pan++;
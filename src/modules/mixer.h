@@ -3,6 +3,7 @@
 #include "../module.h"
 #include "../ui/base.h"
 #include "../util/tapebuffer.h"
+#include "../util/bounce.h"
 
 class MixerScreen;
 
@@ -27,11 +28,20 @@ public:
 
   top1::AudioAverage trackGraph[4];
 
+  /** Renders the tape to `<project name>.wav` and stems, see `toggleBounce` */
+  top1::Bounce bounce;
+
   MixerModule();
 
   void display();
 
   void process(uint nframes);
+
+  /** The levels, pans and mutes of the tracks */
+  std::array<top1::MixTrack, 4> mix();
+
+  /** Bounce the saved tape with the current mix, or cancel the running bounce */
+  void toggleBounce();
 };
 
 class MixerScreen : public ui::ModuleScreen<MixerModule> {
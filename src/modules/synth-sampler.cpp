@@ -13,13 +13,15 @@ namespace module {
 
 SynthSampler::SynthSampler() :
   SynthModule(&data),
-  maxSampleSize (16 * GLOB.samplerate),
-  sampleData (maxSampleSize),
+  sample (GLOB.samplePool, 1),
   editScreen (new SynthSampleScreen(this)) {
 
+  sample.output(GLOB.samplerate);
   GLOB.events.samplerateChanged.add([&] (uint sr) {
-    maxSampleSize = 16 * sr;
-    sampleSpeed = sampleSampleRate / float(sr);
+    sample.output(sr);
+  });
+  GLOB.events.preDraw.add([&] {
+    sample.update();
   });
 
 }
@@ -30,49 +32,18 @@ void SynthSampler::process(uint nframes) {
        if (e->channel == 0) {
          data.playProgress = (data.fwd()) ? 0 : data.length() - 1;
          data.trigger = true;
+         sample.start(0, {static_cast<int>(data.in),
+             static_cast<int>(data.length()), data.fwd(), data.loop()});
        }
     }, [] (MidiEvent *) {});
   }
 
-  float playSpeed = data.speed * sampleSpeed;
-
   // Process audio
-  if (data.playProgress >= 0 && playSpeed > 0) {
-    if (data.fwd()) {
-      if (data.loop() && data.trigger) {
-        for(int i = 0; i < nframes; ++i) {
-          GLOB.audioData.proc[i] += sampleData[data.in + data.playProgress];
-          data.playProgress += playSpeed;
-          if (data.playProgress >= data.length()) {
-            data.playProgress = 0;
-          }
-        }
-      } else {
-        int frms = std::min<int>(nframes, data.length() - data.playProgress);
-        for(int i = 0; i < frms; ++i) {
-          GLOB.audioData.proc[i] += sampleData[data.in + data.playProgress];
-          data.playProgress += playSpeed;
-        }
-        if (data.playProgress >= data.length()) {
-          data.playProgress = -1;
-        }
-      }
+  if (data.playProgress >= 0 && data.speed > 0) {
+    if (sample.play(0, GLOB.audioData.proc.data(), nframes, data.speed)) {
+      data.playProgress = sample.offset(0);
     } else {
-      if (data.loop() && data.trigger) {
-        for(int i = 0; i < nframes; ++i) {
-          GLOB.audioData.proc[i] += sampleData[data.in + data.playProgress];
-          data.playProgress -= playSpeed;
-          if (data.playProgress < 0) {
-            data.playProgress = data.length() -1;
-          }
-        }
-      } else {
-        int frms = std::min<int>(nframes, data.playProgress);
-        for(int i = 0; i < frms; ++i) {
-          GLOB.audioData.proc[i] += sampleData[data.in + data.playProgress];
-          data.playProgress -= playSpeed;
-        }
-      }
+      data.playProgress = -1;
     }
   }
 
@@ -82,6 +53,10 @@ void SynthSampler::process(uint nframes) {
          data.trigger = false;
          if (data.stop()) {
            data.playProgress = -1;
+           sample.stop(0);
+         } else {
+           // Loops play to the end of the lap
+           sample.release(0);
          }
        }
     }, [] (MidiEvent *) {});
@@ -93,15 +68,12 @@ void SynthSampler::display() {
 }
 
 void SynthSampler::load() {
-  top1::SndFile<1> sf (samplePath(data.sampleName));
-
-  size_t rs = std::min(maxSampleSize, sf.size());
+  auto path = samplePath(data.sampleName);
+  // Already loaded, and unchanged on the disk
+  if (sample.current(path)) return;
+  sample.open(path);
 
-  sampleData.resize(rs);
-  sf.read(sampleData.data(), rs);
-
-  sampleSampleRate = sf.samplerate;
-  sampleSpeed = sampleSampleRate / float(GLOB.samplerate);
+  size_t rs = sample.size();
 
   data.in.max = rs;
   data.out.max = rs;
@@ -114,19 +86,24 @@ void SynthSampler::load() {
 
   auto &mwf = editScreen->mainWF;
   mwf->clear();
-  for (auto &&s : sampleData) {
-    mwf->addFrame(s);
-  }
-
   auto &wf = editScreen->topWF;
   wf->clear();
-  for (auto &&s : sampleData) {
-    wf->addFrame(s);
+  if (rs > 0) {
+    // Read through, without holding all of it
+    top1::SndFile<1> sf;
+    sf.readOnly = true;
+    sf.open(path);
+    std::vector<float> block (top1::SampleStream::RING);
+    while (uint n = sf.read(block.data(), block.size())) {
+      for (uint i = 0; i < n; i++) {
+        mwf->addFrame(block[i]);
+        wf->addFrame(block[i]);
+      }
+    }
   }
   editScreen->topWFW.viewRange = {0, wf->size() - 1};
 
-  if (sf.size() == 0) LOGI << "Empty sample file";
-  sf.close();
+  if (rs == 0) LOGI << "Empty sample file";
 }
 
 void SynthSampler::init() {
@@ -176,8 +153,9 @@ const Colour WFGrid = 0x303040;
 
 module::SynthSampleScreen::SynthSampleScreen(SynthSampler *m) :
   ModuleScreen (m),
+  // Scaled for 16 seconds
   topWF (new Waveform(
-     module->sampleData.size() / drawing::topWFsize.w / 4.0, 1.0)
+     16.0 * GLOB.samplerate / drawing::topWFsize.w / 4.0, 1.0)
          ),
   topWFW (topWF, drawing::topWFsize),
   mainWF (new Waveform(50, 1.0)),
@@ -6,7 +6,7 @@
 #include "../ui/base.h"
 #include "../ui/waveform-widget.h"
 
-#include "../util/dyn-array.h"
+#include "../util/sample-stream.h"
 
 namespace module {
 
@@ -18,10 +18,11 @@ class SynthSampleScreen; // FWDCL
 class SynthSampler : public module::SynthModule {
 public:
 
-  size_t maxSampleSize = 0;
-  top1::DynArray<float> sampleData;
-  int sampleSampleRate = 44100;
-  float sampleSpeed = 1;
+  /**
+   * Streamed from the disk, its head shared through GLOB.samplePool, and
+   * converted to the engine's sample rate
+   */
+  top1::SampleStream sample;
 
   std::shared_ptr<SynthSampleScreen> editScreen;
 
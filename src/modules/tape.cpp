@@ -13,6 +13,11 @@
 
 using namespace top1;
 
+/** The samples of `frames`, interleaved */
+static float *samples(AudioFrame *frames) {
+  return reinterpret_cast<float *>(frames);
+}
+
 /************************************************/
 /* TapeModule::State Implementation             */
 /************************************************/
@@ -41,6 +46,9 @@ bool TapeModule::State::doLoop() const {
 bool TapeModule::State::doJumps() const {
   return stopped();
 }
+bool TapeModule::State::doTakes() const {
+  return takes && looping && doLoop();
+}
 
 bool TapeModule::State::playing() const {
   return playType == PLAYING;
@@ -89,7 +97,8 @@ void TapeModule::State::stopRecord() {
 
 TapeModule::TapeModule() :
   Module(&data),
-  tapeScreen (new TapeScreen(this)) {}
+  tapeScreen (new TapeScreen(this)),
+  statsScreen (new TapeStatsScreen(this)) {}
 
 void TapeModule::init() {
   tapeBuffer.init();
@@ -104,6 +113,17 @@ void TapeModule::display() {
   GLOB.ui.display(tapeScreen);
 }
 
+void TapeModule::displayStats() {
+  GLOB.ui.display(statsScreen);
+}
+
+void TapeModule::stop() {
+  if (!state.stopped()) {
+    LOGI << "Tape stats:\n" << tapeBuffer.stats.summary();
+  }
+  state.stop();
+}
+
 // Looping
 
 void TapeModule::loopInHere() {
@@ -115,6 +135,7 @@ void TapeModule::loopInHere() {
   if (loopSect.in > loopSect.out) {
     loopSect.out = loopSect.in;
   }
+  if (state.takes) loopTakes.allocate(loopSect, state.track.idx);
 }
 
 void TapeModule::loopOutHere() {
@@ -129,6 +150,7 @@ void TapeModule::loopOutHere() {
   if (loopSect.in < 0) {
     loopSect.in = loopSect.out;
   }
+  if (state.takes) loopTakes.allocate(loopSect, state.track.idx);
 }
 
 void TapeModule::goToLoopIn() {
@@ -143,6 +165,45 @@ void TapeModule::goToLoopOut() {
   tapeBuffer.goTo(loopSect.out);
 }
 
+void TapeModule::toggleTakes() {
+  if (state.recording()) return;
+  state.takes = !state.takes;
+  if (state.takes) {
+    loopTakes.allocate(loopSect, state.track.idx);
+  } else {
+    loopTakes.release();
+  }
+}
+
+void TapeModule::commitTakes() {
+  if (loopTakes.committing() || loopTakes.audible() == 0) {
+    LOGD << "No takes to commit";
+    return;
+  }
+  // Undone as one step
+  tapeBuffer.checkpoint();
+  loopTakes.commit(loopTakes.audible());
+}
+
+std::string TapeModule::importPath() const {
+  return GLOB.project->name + ".import.wav";
+}
+
+void TapeModule::toggleImport() {
+  if (import.running()) {
+    import.cancel();
+    return;
+  }
+  if (!state.doTapeOps()) return;
+  Import::Settings settings;
+  settings.path = importPath();
+  settings.track = state.track;
+  settings.at = GLOB.metronome.getBarTime(GLOB.metronome.closestBar(position()));
+  settings.samplerate = GLOB.samplerate;
+  // Undone as one step
+  tapeBuffer.checkpoint();
+  import.start(settings);
+}
 
 void TapeModule::goToBar(BeatPos bar) {
   if (state.doJumps()) tapeBuffer.goTo(GLOB.metronome.getBarTime(bar));
@@ -175,6 +236,12 @@ int TapeModule::timeUntil(TapeTime tt) {
 // Audio Processing
 void TapeModule::preProcess(uint nframes) {
 
+  if (state.looping) {
+    tapeBuffer.setCues(loopSect.in, loopSect.out);
+  } else {
+    tapeBuffer.setCues(-1, -1);
+  }
+  tapeBuffer.preProcess();
   tapePosition = tapeBuffer.position();
   {
     constexpr uint time = 200; // animation time from 0 to 1 in ms
@@ -203,32 +270,55 @@ void TapeModule::preProcess(uint nframes) {
      }
     }
   }
+  tapeBuffer.setSpeed(state.playSpeed, state.nextSpeed);
 
   trackBuffer.clear();
 
-  auto playAudio = [this](uint at, uint nframes) {
-    state.forPlayDir<void>([&] {
-       uint readSize = nframes * state.playSpeed;
-       auto data = tapeBuffer.readFW(readSize);
-       if (readSize == 0) data.emplace_back(0);
-       // TODO: This is bad, its an overflow, fix it goddammit!
-       // Happens every time a loop is longer than the tapebuffer
-       while (data.size() < readSize) data.emplace_back(0);
-       for (uint i = 0; i < nframes; i++) {
-         trackBuffer[at + i] = data[i * state.playSpeed];
-       }
-     }, [&] {
-       uint readSize = nframes * -state.playSpeed;
-       if (tapeBuffer.position() == 0) readSize = 0;
-       auto data = tapeBuffer.readBW(readSize);
-       if (readSize == 0) data.emplace_back(0);
-       // TODO: This is bad, its an overflow, fix it goddammit!
-       // Happens every time a loop is longer than the tapebuffer
-       while (data.size() < readSize) data.emplace_back(0);
-       for (uint i = 0; i < nframes; i++) {
-         trackBuffer[at + i] = data[i * -state.playSpeed];
-       }
-     });
+  // The resampler's history is only continuous while playing one way
+  int playDir = state.doPlayAudio() ? (state.playSpeed > 0 ? 1 : -1) : 0;
+  if (playDir != lastPlayDir) playResampler.reset();
+  lastPlayDir = playDir;
+  playResampler.quality = state.spooling()
+    ? resampling::Quality::CUBIC : resampling::Quality::MEDIUM;
+
+  // Mix the takes into what was read, and write the ones being committed
+  // where they were just played
+  auto playTakes = [this](TapeTime pos, uint nframes, TapeBuffer::Direction dir) {
+    if (dir == TapeBuffer::Direction::BW) pos -= 1;
+    uint lane = loopTakes.track();
+    float *takes = takeBuffer.data();
+    if (loopTakes.mix(takes, nframes, pos, dir, loopTakes.audible())) {
+      for (uint i = 0; i < nframes; i++) tapeIOBuffer[i][lane] += takes[i];
+    }
+    if (loopTakes.commitInto(takes, nframes, pos, dir)) {
+      tapeBuffer.writeLane(takes, nframes, lane, dir, 0, writemode::Overdub());
+      // The whole loop is written
+      if (!loopTakes.committing()) {
+        tapeBuffer.trackSlices[lane].record(loopTakes.loop());
+      }
+    }
+  };
+
+  auto playAudio = [&](uint at, uint nframes) {
+    auto dir = state.forPlayDir<TapeBuffer::Direction>(
+      [] {return TapeBuffer::Direction::FW;},
+      [] {return TapeBuffer::Direction::BW;});
+    float speed = std::abs(state.playSpeed);
+    for (uint done = 0; done < nframes;) {
+      uint readSize = std::min<uint>(
+        playResampler.needed(nframes - done, speed), tapeIOBuffer.size());
+      TapeTime tapeAt = tapeBuffer.position();
+      uint read = tapeBuffer.readInto(tapeIOBuffer.data(), readSize, dir);
+      // Only if the disk can't keep up. Loop points are kept loaded.
+      std::fill(tapeIOBuffer.data() + read,
+        tapeIOBuffer.data() + readSize, AudioFrame());
+      if (loopTakes.takes()) playTakes(tapeAt, read, dir);
+      playResampler.push(samples(tapeIOBuffer.data()), readSize);
+      uint played = playResampler.pull(
+        samples(&trackBuffer[at + done]), nframes - done, speed);
+      if (played == 0 && readSize == 0) break;
+      done += played;
+    }
   };
 
   // Start recording by pressing a key
@@ -265,42 +355,71 @@ void TapeModule::preProcess(uint nframes) {
 void TapeModule::postProcess(uint nframes) {
   TapeTime pos = tapeBuffer.position();
   if (!state.recording() && state.recLast) {
+    punch.punchOut();
+  }
+  // Punched out, the take goes on until faded back to the tape
+  const bool fadingOut = data.punch && !state.recording() && state.playing()
+    && !punch.done();
+  if (!state.recording() && !fadingOut) {
     recSect = {0,0};
+    // Nothing left to fade, e.g. stopped while fading out
+    punch.punchOut();
+    punch.fade = 0;
+  }
+  if (state.recording() && !state.recLast) {
+    recResampler.reset();
+    punch = writemode::Punch();
+    if (state.doTakes() && !loopTakes.startPass(state.track.idx)) {
+      LOGD << "No layer left to record a take";
+      state.stopRecord();
+    }
+  }
+  if (!state.recording() && state.recLast) {
+    loopTakes.stopPass();
   }
   auto recAudio = [&](uint from, uint recFrames) {
-    std::vector<AudioFrame> buf;
+    auto dir = state.forPlayDir<TapeBuffer::Direction>(
+      [] {return TapeBuffer::Direction::FW;},
+      [] {return TapeBuffer::Direction::BW;});
+    float speed = std::abs(state.playSpeed);
+    uint track = state.track.idx;
+    recResampler.push(&GLOB.audioData.proc[from], recFrames);
+    uint writeSize = recResampler.pull(recBuffer.data(), recBuffer.size(), 1 / speed);
+    // Line the recording up with what was heard while playing it.
+    // Both resamplers hold back some frames.
+    uint offset = std::lround(
+      (nframes - from - recFrames + recResampler.latency()) * speed
+      + playResampler.latency());
+    if (state.doTakes()) {
+      TapeTime at = state.forPlayDir<TapeTime>(
+        [&] {return pos - offset - writeSize;},
+        [&] {return pos + offset + writeSize - 1;});
+      loopTakes.record(recBuffer.data(), writeSize, at, dir);
+      return;
+    }
+    float feedback = data.loopFeedback;
+    if (data.punch) {
+      tapeBuffer.writeLane(recBuffer.data(), writeSize, track, dir, offset,
+        punch);
+    } else if (state.looping && feedback < 1) {
+      tapeBuffer.writeLane(recBuffer.data(), writeSize, track, dir, offset,
+        writemode::OverdubDecay{feedback});
+    } else {
+      tapeBuffer.writeLane(recBuffer.data(), writeSize, track, dir, offset,
+        writemode::Overdub());
+    }
     state.forPlayDir<void>([&] {
-       uint writeSize = recFrames * state.playSpeed;
-       for (uint i = 0; i < writeSize; i++) {
-         buf.push_back(GLOB.audioData.proc[int(from + i / state.playSpeed)]);
-       }
-       tapeBuffer.writeFW(buf,
-        (nframes - from) * state.playSpeed - writeSize,
-        [this](AudioFrame o, AudioFrame n) {
-          o[state.track.idx] += n[state.track.idx];
-          return o;
-        });
+       recSect.out = pos - offset;
        if (recSect.size() < 1) {
-         recSect.in = pos - (nframes - from) * state.playSpeed;
+         recSect.in = recSect.out - writeSize;
        }
-       recSect.out = pos - (nframes - from) * state.playSpeed + writeSize;
      }, [&] {
-       uint writeSize = recFrames * -state.playSpeed;
-       for (uint i = 0; i < writeSize; i++) {
-         buf.push_back(GLOB.audioData.proc[int(from + i / -state.playSpeed)]);
-       }
-       tapeBuffer.writeBW(buf,
-        (nframes - from) * state.playSpeed - writeSize,
-        [this](AudioFrame o, AudioFrame n) {
-          o[state.track.idx] += n[state.track.idx];
-          return o;
-        });
+       recSect.in = pos + offset;
        if (recSect.size() < 1) {
-         recSect.out = pos + (nframes - from) * -state.playSpeed;
+         recSect.out = recSect.in + writeSize;
        }
-       recSect.in = pos + (nframes - from) * state.playSpeed + writeSize;
      });
-    tapeBuffer.trackSlices[state.track.idx].addSlice(recSect);
+    tapeBuffer.trackSlices[track].record(recSect);
   };
 
   if (state.recording()) {
@@ -314,6 +433,10 @@ void TapeModule::postProcess(uint nframes) {
           [&] {tapeBuffer.goTo(loopSect.in);},
           [&] {tapeBuffer.goTo(loopSect.out);});
         recSect = {0,0};
+        if (state.doTakes() && !loopTakes.startPass(state.track.idx)) {
+          LOGD << "No layer left to record a take";
+          state.stopRecord();
+        }
         recAudio(leftTillOut, nframes - leftTillOut);
       } else {
         recAudio(0, nframes);
@@ -321,6 +444,8 @@ void TapeModule::postProcess(uint nframes) {
     } else {
       recAudio(0, nframes);
     }
+  } else if (fadingOut) {
+    recAudio(0, nframes);
   }
   state.recLast = state.recording();
 
@@ -337,6 +462,12 @@ bool TapeScreen::keypress(ui::Key key) {
   bool shift = GLOB.ui.keys[ui::K_SHIFT];
   switch (key) {
   case ui::K_REC:
+    if (shift && !module->state.recording()) {
+      module->data.punch.toggle();
+      return true;
+    }
+    // Each take is an undo step
+    if (module->state.doStartRec()) module->tapeBuffer.checkpoint();
     module->state.startRecord();
     return true;
   case ui::K_PLAY:
@@ -365,7 +496,8 @@ bool TapeScreen::keypress(ui::Key key) {
     else module->state.spool(5);
     return true;
   case ui::K_LOOP:
-    module->state.looping = !module->state.looping;
+    if (shift) module->toggleTakes();
+    else module->state.looping = !module->state.looping;
     return true;
   case ui::K_LOOP_IN:
     if (shift) module->loopInHere();
@@ -376,16 +508,27 @@ bool TapeScreen::keypress(ui::Key key) {
     else module->goToLoopOut();
     return true;
   case ui::K_CUT:
-    if (module->state.doTapeOps())
+    if (module->state.doTapeOps()) {
+      module->tapeBuffer.checkpoint();
       module->tapeBuffer.trackSlices[module->state.track.idx].cut(
         module->tapeBuffer.position());
+    }
+    return true;
+  case ui::K_UNDO:
+    if (module->state.doTapeOps())
+      module->tapeBuffer.undo();
+    return true;
+  case ui::K_REDO:
+    if (module->state.doTapeOps())
+      module->tapeBuffer.redo();
     return true;
   case ui::K_LIFT:
     if (module->state.doTapeOps())
       module->tapeBuffer.lift(module->state.track);
     return true;
   case ui::K_DROP:
-    if (module->state.doTapeOps())
+    if (shift) module->toggleImport();
+    else if (module->state.doTapeOps())
       module->tapeBuffer.drop(module->state.track);
     return true;
   case ui::K_RED_UP:
@@ -394,6 +537,40 @@ bool TapeScreen::keypress(ui::Key key) {
   case ui::K_RED_DOWN:
     module->data.procGain.dec();
     return true;
+  case ui::K_BLUE_UP:
+    module->data.loopFeedback.inc();
+    return true;
+  case ui::K_BLUE_DOWN:
+    module->data.loopFeedback.dec();
+    return true;
+  case ui::K_WHITE_CLICK:
+    module->displayStats();
+    return true;
+  }
+  if (module->state.takes) {
+    auto &takes = module->loopTakes;
+    uint layers = takes.layers();
+    switch (key) {
+    case ui::K_WHITE_UP:
+      if (layers) selectedTake = (selectedTake + 1) % layers;
+      return true;
+    case ui::K_WHITE_DOWN:
+      if (layers) selectedTake = (selectedTake + layers - 1) % layers;
+      return true;
+    case ui::K_GREEN_UP:
+      if (selectedTake < layers)
+        takes.gain(selectedTake, std::min(takes.gain(selectedTake) + 0.05f, 2.f));
+      return true;
+    case ui::K_GREEN_DOWN:
+      if (selectedTake < layers)
+        takes.gain(selectedTake, std::max(takes.gain(selectedTake) - 0.05f, 0.f));
+      return true;
+    case ui::K_GREEN_CLICK:
+      if (shift) module->commitTakes();
+      else if (selectedTake < layers)
+        takes.mute(selectedTake, !takes.muted(selectedTake));
+      return true;
+    }
   }
   return false;
 }
@@ -410,7 +587,7 @@ bool TapeScreen::keyrelease(ui::Key key) {
     }
   case ui::K_LEFT:
   case ui::K_RIGHT:
-    module->state.stop();
+    module->stop();
     return true;
   }
   return false;
@@ -783,7 +960,7 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
 
   int timeLength = 5 * GLOB.samplerate;
 
-  Section<int> inView;
+  Section<TapeTime> inView;
   inView.in = module->tapeBuffer.position() - timeLength/2;
   inView.out = module->tapeBuffer.position() + timeLength/2;
 
@@ -792,7 +969,7 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
   int coordWidth = endCoord - startCoord;
 
   float lengthRatio = (float)coordWidth/(float)timeLength;
-  auto timeToCoord = [&](int time) -> float {
+  auto timeToCoord = [&](TapeTime time) -> float {
     if (inView.contains(time)){
       time -= inView.in;
       float coord = startCoord + time * lengthRatio;
@@ -810,7 +987,7 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
 
   // TODO: Real value
   int BPM = GLOB.metronome.data.bpm;
-  float FPB = float(GLOB.samplerate) * 60.0/((float)BPM);
+  double FPB = double(GLOB.samplerate) * 60.0/((double)BPM);
 
   // Bar Markers
   {
@@ -829,16 +1006,15 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
 
   // Tracks
   Track::foreach([&](Track t){
-    auto slices = module->tapeBuffer.trackSlices[t.idx].slicesIn(inView);
     TapeBuffer::TapeSlice current;
     float lW = 3;
-    for (auto slice : slices) {
+    module->tapeBuffer.trackSlices[t.idx].forEachIn(inView, [&] (auto slice) {
       Colour col;
       if (t == module->state.track) {
         if (slice.contains(module->tapeBuffer.position())) {
           if (!current) {
             current = slice;
-            continue;
+            return;
           } else {
             LOGE << "TapeSlice overlap at current position";
           }
@@ -853,12 +1029,12 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
           ctx.beginPath();
           ctx.strokeStyle(col);
           ctx.lineWidth(lW);
-          ctx.moveTo(timeToCoord(std::max<float>(inView.in, slice.in)), 195 + 5*t.idx);
-          ctx.lineTo(timeToCoord(std::min<float>(inView.out, slice.out)), 195 + 5*t.idx);
+          ctx.moveTo(timeToCoord(std::max<TapeTime>(inView.in, slice.in)), 195 + 5*t.idx);
+          ctx.lineTo(timeToCoord(std::min<TapeTime>(inView.out, slice.out)), 195 + 5*t.idx);
           ctx.stroke();
         }
       }
-    }
+    });
     if (module->state.recording() && module->state.track == t) {
       current = module->recSect;
     }
@@ -867,11 +1043,28 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
         ctx.beginPath();
         ctx.strokeStyle(Colours::CurrentSlice);
         ctx.lineWidth(lW);
-        ctx.moveTo(timeToCoord(std::max<float>(inView.in, current.in)), 195 + 5*t.idx);
-        ctx.lineTo(timeToCoord(std::min<float>(inView.out, current.out)), 195 + 5*t.idx);
+        ctx.moveTo(timeToCoord(std::max<TapeTime>(inView.in, current.in)), 195 + 5*t.idx);
+        ctx.lineTo(timeToCoord(std::min<TapeTime>(inView.out, current.out)), 195 + 5*t.idx);
         ctx.stroke();
       }
     }
+    // Waveform, on top of the slices
+    {
+      auto &peaks = module->tapeBuffer.peaks[t.idx];
+      float y = 195 + 5*t.idx;
+      ctx.beginPath();
+      ctx.strokeStyle(Colours::Gray70);
+      ctx.lineWidth(1);
+      for (int x = 0; x < endCoord - startCoord; x++) {
+        auto peak = peaks.peak({
+          inView.in + int(x / lengthRatio),
+          inView.in + int((x + 1) / lengthRatio)});
+        if (peak.max - peak.min < 0.01) continue;
+        ctx.moveTo(startCoord + x, y - std::min(peak.max, 1.f) * 2.5);
+        ctx.lineTo(startCoord + x, y - std::max(peak.min, -1.f) * 2.5);
+      }
+      ctx.stroke();
+    }
    });
 
   // LoopArrow
@@ -1013,7 +1206,7 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
 
   // Loop Marker
   {
-    Section<int> &loopSect = module->loopSect;
+    Section<TapeTime> &loopSect = module->loopSect;
     if (loopSect.size() >= 0 && loopSect.in > 0 && loopSect.out > 0) {
       ctx.strokeStyle(Colours::LoopMarker);
       ctx.fillStyle(Colours::LoopMarker);
@@ -1032,8 +1225,8 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
         ctx.beginPath();
         ctx.strokeStyle(Colours::LoopMarker);
         ctx.lineWidth(3);
-        ctx.moveTo(timeToCoord(std::max<float>(inView.in, loopSect.in)), 190);
-        ctx.lineTo(timeToCoord(std::min<float>(inView.out, loopSect.out)), 190);
+        ctx.moveTo(timeToCoord(std::max<TapeTime>(inView.in, loopSect.in)), 190);
+        ctx.lineTo(timeToCoord(std::min<TapeTime>(inView.out, loopSect.out)), 190);
         ctx.stroke();
       }
     }
@@ -1123,4 +1316,70 @@ void TapeScreen::draw(drawing::Canvas& ctx) {
   ctx.beginPath();
   ctx.fillText(module->state.track.str(), 30, 29);
 	
+  if (module->state.takes) drawTakes(ctx);
+
+  if (module->import.running()) {
+    ctx.fillStyle(Colours::White);
+    ctx.font(FONT_NORM);
+    ctx.font(20);
+    ctx.textAlign(TextAlign::Center, TextAlign::Middle);
+    ctx.fillText(fmt::format("IMPORTING {:.0f}%", module->import.progress() * 100),
+      160, 190);
+  }
+}
+
+void TapeScreen::drawTakes(drawing::Canvas& ctx) {
+  using namespace drawing;
+  auto &takes = module->loopTakes;
+  uint mask = takes.takes();
+  const float size = 14, space = 4;
+  float x = 160 - (takes.layers() * (size + space) - space) / 2;
+  for (uint l = 0; l < takes.layers(); l++, x += size + space) {
+    ctx.beginPath();
+    ctx.rect(x, 210, size, size * std::min(takes.gain(l), 1.f));
+    if (takes.recording() == int(l)) ctx.fillStyle(Colours::Red);
+    else if (takes.muted(l)) ctx.fillStyle(Colours::Gray70);
+    else ctx.fillStyle(Colours::White);
+    if (mask & (1u << l)) ctx.fill();
+    if (l == selectedTake) {
+      ctx.beginPath();
+      ctx.strokeStyle(Colours::LoopMarker);
+      ctx.lineWidth(1.5);
+      ctx.rect(x - 1, 209, size + 2, size + 2);
+      ctx.stroke();
+    }
+  }
+}
+
+/************************************************/
+/* TapeStatsScreen Implementation               */
+/************************************************/
+
+bool TapeStatsScreen::keypress(ui::Key key) {
+  switch (key) {
+  case ui::K_WHITE_CLICK:
+    module->display();
+    return true;
+  case ui::K_RED_CLICK:
+    module->tapeBuffer.stats.reset();
+    return true;
+  }
+  return false;
+}
+
+void TapeStatsScreen::draw(drawing::Canvas& ctx) {
+  using namespace drawing;
+
+  auto text = module->tapeBuffer.stats.summary();
+  ctx.beginPath();
+  ctx.fillStyle(Colours::White);
+  ctx.textAlign(TextAlign::Left, TextAlign::Middle);
+  ctx.font(FONT_LIGHT);
+  ctx.font(12.f);
+  float y = 20;
+  for (std::size_t from = 0, to; from < text.size(); from = to + 1, y += 20) {
+    to = text.find('\n', from);
+    if (to == std::string::npos) to = text.size();
+    ctx.fillText(text.substr(from, to - from), {10.f, y});
+  }
 }
@@ -7,6 +7,9 @@
 #include "../audio/jack.h"
 #include "../module.h"
 #include "../ui/base.h"
+#include "../util/import.h"
+#include "../util/loop-takes.h"
+#include "../util/resampler.h"
 #include "../util/tapebuffer.h"
 #include "../utils.h"
 
@@ -14,6 +17,9 @@
 
 class TapeModule : public module::Module {
   ui::ModuleScreen<TapeModule>::ptr tapeScreen;
+  ui::ModuleScreen<TapeModule>::ptr statsScreen;
+
+  static constexpr uint MAX_SPEED = 8;
 
   top1::TapeTime tapePosition; // Read from here instead of the tapebuffer
 public:
@@ -34,6 +40,7 @@ public:
     bool doStartSpool() const;
     bool doLoop() const;
     bool doJumps() const;
+    bool doTakes() const;
 
     bool readyToRec = false;
     bool recLast    = false;
@@ -42,6 +49,8 @@ public:
     float prevSpeed = 0;
     top1::Track track = top1::Track::newName(1);
     bool looping = false;
+    /// Record each pass of the loop as its own take, see LoopTakes
+    bool takes = false;
 
     template<class T>
     T forPlayDir(std::function<T ()> forward, std::function<T ()> reverse) {
@@ -64,14 +73,44 @@ public:
 
   struct Data : module::Data {
     module::Opt<float> procGain = {this, "PROC_GAIN", 0.5, 0, 1, 0.01};
+    /// How much of the tape is kept when overdubbing a loop
+    module::Opt<float> loopFeedback = {this, "LOOP_FEEDBACK", 1, 0, 1, 0.01};
+    /// Replace the track when recording, crossfading in and out
+    module::Opt<bool> punch = {this, "PUNCH", false};
   } data;
 
   top1::AudioAverage procGraph;
 
   AudioBuffer<AudioFrame> trackBuffer;
 
+  /**
+   * Frames read from or written to the tape during one cycle.
+   * Sized for playing at up to MAX_SPEED times the normal speed.
+   */
+  AudioBuffer<AudioFrame> tapeIOBuffer {MAX_SPEED};
+
+  /// The recorded track, resampled to the tape speed
+  AudioBuffer<float> recBuffer {MAX_SPEED};
+
+  /// Tape frames to played frames, all tracks at once
+  top1::Resampler<4> playResampler {top1::resampling::Quality::MEDIUM, MAX_SPEED};
+  /// Recorded frames to tape frames
+  top1::Resampler<1> recResampler {top1::resampling::Quality::MEDIUM, MAX_SPEED};
+  /// Direction played in the last cycle, 0 if not playing
+  int lastPlayDir = 0;
+  /// The fades of the take punched in, see `data.punch`
+  top1::writemode::Punch punch;
+
   top1::TapeBuffer tapeBuffer;
 
+  /// The passes of the loop, when recording takes
+  top1::LoopTakes loopTakes;
+  /// The takes of one cycle, mixed or to be committed
+  AudioBuffer<float> takeBuffer {MAX_SPEED};
+
+  /// WAVs put on the tape in the background
+  top1::Import import {tapeBuffer};
+
   TapeModule();
   TapeModule(TapeModule&) = delete;
   TapeModule(TapeModule&&) = delete;
@@ -82,12 +121,13 @@ public:
   Section<top1::TapeTime> loopSect;
   Section<top1::TapeTime> recSect;
 
-  uint overruns = 0;
-
   void preProcess(uint nframes);
   void postProcess(uint nframes); 
   void display() override;
-
+  /// Show how well the disk keeps up, see TapeStats
+  void displayStats();
+  /// Stop the tape, and log the stats of the run
+  void stop();
 
   top1::TapeTime position() const { return tapePosition; }
 
@@ -96,6 +136,17 @@ public:
   void goToLoopIn();
   void goToLoopOut();
 
+  /// Start or stop recording the loop in takes
+  void toggleTakes();
+  /// Write the takes that are not muted to the track
+  void commitTakes();
+
+  /// Where `toggleImport` imports from
+  std::string importPath() const;
+  /// Import the project's WAV on the current track at the closest bar,
+  /// or cancel the running import
+  void toggleImport();
+
   void goToBar(BeatPos bar);
   void goToBarRel(BeatPos bars);
 
@@ -104,6 +155,9 @@ public:
 
 class TapeScreen : public ui::ModuleScreen<TapeModule> {
   bool stopRecOnRelease = true;
+  /// The take changed by the green knob
+  uint selectedTake = 0;
+  void drawTakes(drawing::Canvas& ctx);
 private:
   virtual void draw(drawing::Canvas& ctx) override;
 
@@ -114,3 +168,12 @@ public:
 
   TapeScreen(TapeModule *module) : ui::ModuleScreen<TapeModule>(module) {}
 };
+
+class TapeStatsScreen : public ui::ModuleScreen<TapeModule> {
+  virtual void draw(drawing::Canvas& ctx) override;
+  virtual bool keypress(ui::Key key) override;
+
+public:
+
+  TapeStatsScreen(TapeModule *module) : ui::ModuleScreen<TapeModule>(module) {}
+};
@@ -68,6 +68,8 @@ enum Key {
   K_LIFT,
   K_DROP,
   K_CUT,
+  K_UNDO,
+  K_REDO,
 };
 
 using PressedKeys = bool[256];
@@ -53,7 +53,9 @@ static ui::Key keyboardKey(int xKey, int mods) {
 
     // Tapedeck
   case GLFW_KEY_SPACE: return K_PLAY;
-  case GLFW_KEY_Z:     return K_REC;
+  case GLFW_KEY_Z:
+    if (mods & GLFW_MOD_CONTROL) return mods & GLFW_MOD_SHIFT ? K_REDO : K_UNDO;
+    return K_REC;
   case GLFW_KEY_F1:    return K_TRACK_1;
   case GLFW_KEY_F2:    return K_TRACK_2;
   case GLFW_KEY_F3:    return K_TRACK_3;
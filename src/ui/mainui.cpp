@@ -20,6 +20,7 @@ void MainUI::exit() {
 }
 
 void MainUI::draw(drawing::Canvas& ctx) {
+  GLOB.events.preDraw();
   currentScreen->draw(ctx);
 }
 
@@ -39,7 +40,7 @@ bool MainUI::globKeyPost(ui::Key key) {
   switch (key) {
   case ui::K_PLAY:
     if (GLOB.tapedeck.state.playing()) {
-      GLOB.tapedeck.state.stop();
+      GLOB.tapedeck.stop();
     } else {
       GLOB.tapedeck.state.play();
     }
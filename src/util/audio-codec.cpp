@@ -0,0 +1,227 @@
+#include "audio-codec.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace top1 {
+namespace codec {
+
+/** Highest order of the fixed predictors */
+static constexpr uint MAX_ORDER = 3;
+/** Residuals whose quotient reaches this many are stored as is */
+static constexpr uint ESCAPE = 24;
+/** Bits of an escaped residual, more than any zigzagged residual has */
+static constexpr uint RAW_BITS = 40;
+/** The Rice parameter of partitions with only zero residuals, stored as such */
+static constexpr uint ZEROS = 63;
+
+/** The sample's bits as an integer, ordered like the floats */
+static int64_t toInt(float f) {
+  int32_t i;
+  std::memcpy(&i, &f, sizeof(i));
+  if (i < 0) i ^= 0x7FFFFFFF;
+  return i;
+}
+
+static float toFloat(int64_t x) {
+  int32_t i = int32_t(x);
+  if (i < 0) i ^= 0x7FFFFFFF;
+  float f;
+  std::memcpy(&f, &i, sizeof(f));
+  return f;
+}
+
+static int64_t predict(const int64_t *x, uint i, uint order) {
+  switch (order) {
+  case 0: return 0;
+  case 1: return x[i - 1];
+  case 2: return 2 * x[i - 1] - x[i - 2];
+  default: return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+  }
+}
+
+static uint64_t zigzag(int64_t r) {
+  return (uint64_t(r) << 1) ^ uint64_t(r >> 63);
+}
+
+static int64_t unzigzag(uint64_t u) {
+  return int64_t(u >> 1) ^ -int64_t(u & 1);
+}
+
+namespace {
+
+/** Writes bits most significant first */
+struct BitWriter {
+  std::vector<char> &out;
+  uint64_t acc = 0;
+  uint bits = 0;
+
+  BitWriter(std::vector<char> &out) : out (out) {}
+
+  /** @param n at most RAW_BITS */
+  void put(uint64_t value, uint n) {
+    acc = (acc << n) | value;
+    bits += n;
+    while (bits >= 8) {
+      bits -= 8;
+      out.push_back(char(acc >> bits));
+    }
+  }
+
+  void flush() {
+    if (bits > 0) out.push_back(char(acc << (8 - bits)));
+    bits = 0;
+  }
+};
+
+struct BitReader {
+  const unsigned char *data;
+  const unsigned char *end;
+  /** The next bits, most significant first */
+  uint64_t acc = 0;
+  int bits = 0;
+  /** Bytes read past the end, as zeros */
+  uint overrun = 0;
+
+  BitReader(const char *data, std::size_t size) :
+    data (reinterpret_cast<const unsigned char *>(data)),
+    end (this->data + size) {}
+
+  void refill() {
+    while (bits <= 56) {
+      uint64_t byte = 0;
+      if (data < end) byte = *data++;
+      else overrun++;
+      acc |= byte << (56 - bits);
+      bits += 8;
+    }
+  }
+
+  uint64_t get(uint n) {
+    refill();
+    uint64_t value = n == 0 ? 0 : acc >> (64 - n);
+    acc = n == 64 ? 0 : acc << n;
+    bits -= n;
+    return value;
+  }
+
+  /** Count the ones up to the next zero, or up to `limit` ones */
+  uint unary(uint limit) {
+    refill();
+    uint64_t zeros = ~acc;
+    uint q = zeros == 0 ? 64 : __builtin_clzll(zeros);
+    if (q >= limit) {
+      q = limit;
+      acc <<= q;
+      bits -= q;
+    } else {
+      acc <<= q + 1;
+      bits -= q + 1;
+    }
+    return q;
+  }
+
+  /** Whether more was read than there is, beyond the last byte's padding */
+  bool failed() const {
+    return overrun * 8 > uint(bits);
+  }
+};
+
+}
+
+static uint riceParameter(const uint64_t *u, uint n) {
+  uint64_t sum = 0;
+  for (uint i = 0; i < n; i++) sum += u[i];
+  uint k = 0;
+  while (k < RAW_BITS && (uint64_t(n) << (k + 1)) <= sum) k++;
+  return k;
+}
+
+void encode(const float *src, uint nframes, uint channels, std::vector<char> &out) {
+  std::vector<int64_t> x (nframes);
+  std::vector<uint64_t> u (nframes);
+  BitWriter bits (out);
+  for (uint ch = 0; ch < channels; ch++) {
+    for (uint i = 0; i < nframes; i++) x[i] = toInt(src[i * channels + ch]);
+
+    // The predictor leaving the smallest residuals
+    uint order = 0;
+    uint64_t best = UINT64_MAX;
+    for (uint o = 0; o <= std::min(MAX_ORDER, nframes); o++) {
+      uint64_t sum = 0;
+      for (uint i = o; i < nframes; i++) sum += zigzag(x[i] - predict(x.data(), i, o));
+      if (sum < best) {
+        best = sum;
+        order = o;
+      }
+    }
+    bits.put(order, 2);
+    for (uint i = 0; i < order; i++) bits.put(uint32_t(x[i]), 32);
+    for (uint i = order; i < nframes; i++) {
+      u[i] = zigzag(x[i] - predict(x.data(), i, order));
+    }
+
+    for (uint p = 0; p < nframes; p += PARTITION) {
+      uint from = std::max(p, order);
+      uint to = std::min(p + PARTITION, nframes);
+      if (from >= to) continue;
+      if (std::all_of(u.begin() + from, u.begin() + to, [] (uint64_t r) {return r == 0;})) {
+        bits.put(ZEROS, 6);
+        continue;
+      }
+      uint k = riceParameter(u.data() + from, to - from);
+      bits.put(k, 6);
+      for (uint i = from; i < to; i++) {
+        uint64_t q = u[i] >> k;
+        if (q < ESCAPE) {
+          bits.put(((uint64_t(1) << q) - 1) << 1, q + 1);
+          bits.put(u[i] & ((uint64_t(1) << k) - 1), k);
+        } else {
+          bits.put((uint64_t(1) << ESCAPE) - 1, ESCAPE);
+          bits.put(u[i], RAW_BITS);
+        }
+      }
+    }
+  }
+  bits.flush();
+}
+
+bool decode(const char *data, std::size_t size, float *dst, uint nframes,
+  uint channels) {
+  thread_local std::vector<int64_t> x;
+  x.resize(nframes);
+  BitReader bits (data, size);
+  for (uint ch = 0; ch < channels; ch++) {
+    uint order = bits.get(2);
+    if (order > std::min(MAX_ORDER, nframes)) return false;
+    for (uint i = 0; i < order; i++) x[i] = int32_t(bits.get(32));
+
+    for (uint p = 0; p < nframes; p += PARTITION) {
+      uint from = std::max(p, order);
+      uint to = std::min(p + PARTITION, nframes);
+      if (from >= to) continue;
+      uint k = bits.get(6);
+      if (k == ZEROS) {
+        for (uint i = from; i < to; i++) x[i] = predict(x.data(), i, order);
+        continue;
+      }
+      if (k > RAW_BITS) return false;
+      for (uint i = from; i < to; i++) {
+        uint64_t u;
+        uint q = bits.unary(ESCAPE);
+        if (q < ESCAPE) {
+          u = (uint64_t(q) << k) | bits.get(k);
+        } else {
+          u = bits.get(RAW_BITS);
+        }
+        x[i] = unzigzag(u) + predict(x.data(), i, order);
+      }
+    }
+    for (uint i = 0; i < nframes; i++) dst[i * channels + ch] = toFloat(x[i]);
+  }
+  return !bits.failed();
+}
+
+}
+}
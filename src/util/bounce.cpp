@@ -0,0 +1,174 @@
+#include "bounce.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <plog/Log.h>
+#include <fmt/format.h>
+
+namespace top1 {
+
+/****************************************/
+/* Bounce Implementation                */
+/****************************************/
+
+constexpr uint Bounce::BLOCK;
+
+Bounce::~Bounce() {
+  cancel();
+  wait();
+}
+
+bool Bounce::start(Settings newSettings) {
+  if (running()) {
+    LOGW << "Already bouncing '" << settings.tape << "'";
+    return false;
+  }
+  wait();
+  settings = std::move(newSettings);
+
+  TapeFile tape;
+  tape.readOnly = true;
+  tape.open(settings.tape);
+  if (tape.error.log()) return false;
+  identity = true;
+  TapeTime end = 0;
+  for (uint t = 0; t < edits.size(); t++) {
+    edits[t] = tape.editList(t);
+    identity = identity && edits[t].regions() == EditList::identity(t).regions();
+    end = std::max(end, tape.trackEnd(edits[t]));
+  }
+  if (!settings.section) settings.section = {0, end};
+  blocks = (settings.section.size() + BLOCK - 1) / BLOCK;
+  nextBlock = 0;
+  doneBlocks = 0;
+  cancelled = false;
+  failed = false;
+
+  if (!settings.mixPath.empty()) {
+    std::remove(settings.mixPath.c_str());
+    mix = std::make_unique<SndFile<2>>(settings.mixPath);
+    mix->samplerate = tape.samplerate;
+  }
+  for (uint t = 0; t < stems.size(); t++) {
+    if (settings.stemsPath.empty() || settings.tracks[t].muted) continue;
+    auto path = stemPath(settings.stemsPath, t);
+    std::remove(path.c_str());
+    stems[t] = std::make_unique<SndFile<1>>(path);
+    stems[t]->samplerate = tape.samplerate;
+  }
+
+  uint count = settings.threads;
+  if (count == 0) count = std::thread::hardware_concurrency();
+  count = std::max(1u, std::min(count, blocks));
+  LOGI << "Bouncing " << settings.section.size() << " frames of '" << settings.tape
+       << "' with " << count << " threads";
+  rendering = count;
+  activeThreads = count;
+  for (uint i = 0; i < count; i++) {
+    threads.emplace_back([this] {
+        render();
+        if (rendering.fetch_sub(1) == 1) finish();
+        activeThreads.fetch_sub(1, std::memory_order_release);
+      });
+  }
+  return true;
+}
+
+void Bounce::cancel() {
+  cancelled = true;
+}
+
+bool Bounce::wait() {
+  for (auto &thread : threads) thread.join();
+  threads.clear();
+  return !cancelled && !failed && doneBlocks == blocks;
+}
+
+float Bounce::progress() const {
+  if (blocks == 0) return running() ? 0 : 1;
+  return float(doneBlocks.load(std::memory_order_relaxed)) / blocks;
+}
+
+std::string Bounce::stemPath(std::string path, uint track) {
+  return fmt::format("{}.stem{}.wav", path, track + 1);
+}
+
+void Bounce::render() {
+  TapeFile tape;
+  tape.readOnly = true;
+  tape.open(settings.tape);
+  if (tape.error.log()) {
+    failed = true;
+    return;
+  }
+  std::array<std::vector<float>, 4> tracks;
+  for (auto &t : tracks) t.resize(BLOCK);
+  std::vector<float> out (BLOCK * 2);
+
+  while (!cancelled && !failed) {
+    uint block = nextBlock.fetch_add(1);
+    if (block >= blocks) break;
+    TapeTime in = settings.section.in + TapeTime(block) * BLOCK;
+    Section<TapeTime> section =
+      {in, std::min<TapeTime>(in + BLOCK, settings.section.out)};
+    uint n = section.size();
+
+    // Tracks not edited are read together, in a single pass over the tape
+    if (identity) {
+      tape.readLanes(section.in, {{
+            tracks[0].data(), tracks[1].data(), tracks[2].data(), tracks[3].data()
+          }}, n);
+    } else {
+      for (uint t = 0; t < tracks.size(); t++) {
+        tape.readTrack(edits[t], section, tracks[t].data());
+      }
+    }
+
+    std::fill(out.begin(), out.begin() + n * 2, 0.f);
+    for (uint t = 0; t < tracks.size(); t++) {
+      auto &mt = settings.tracks[t];
+      float left = mt.left(), right = mt.right();
+      float *track = tracks[t].data();
+      for (uint i = 0; i < n; i++) {
+        out[i * 2] += track[i] * left;
+        out[i * 2 + 1] += track[i] * right;
+        // The stem
+        track[i] *= mt.level;
+      }
+    }
+
+    std::size_t pos = section.in - settings.section.in;
+    std::lock_guard<std::mutex> lock (outLock);
+    if (mix) {
+      mix->seek(pos);
+      if (mix->write(out.data(), n) != n) failed = true;
+    }
+    for (uint t = 0; t < stems.size(); t++) {
+      if (!stems[t]) continue;
+      stems[t]->seek(pos);
+      if (stems[t]->write(tracks[t].data(), n) != n) failed = true;
+    }
+    doneBlocks.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/** Called by the last thread to finish */
+void Bounce::finish() {
+  std::vector<std::string> paths;
+  if (mix) paths.push_back(settings.mixPath);
+  for (uint t = 0; t < stems.size(); t++) {
+    if (stems[t]) paths.push_back(stemPath(settings.stemsPath, t));
+  }
+  mix = nullptr;
+  for (auto &stem : stems) stem = nullptr;
+
+  if (cancelled || failed) {
+    for (auto &path : paths) std::remove(path.c_str());
+    if (failed) LOGE << "Couldn't bounce '" << settings.tape << "'";
+    else LOGI << "Bounce of '" << settings.tape << "' cancelled";
+    return;
+  }
+  LOGI << "Bounced '" << settings.tape << "'";
+}
+
+}
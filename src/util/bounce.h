@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tapefile.h"
+
+namespace top1 {
+
+/** How a track sounds in the mix: its level, pan and mute */
+struct MixTrack {
+  float level = 0.5;
+  float pan = 0;
+  bool muted = false;
+
+  float left() const { return muted ? 0 : level * (1 - pan); }
+  float right() const { return muted ? 0 : level * (1 + pan); }
+};
+
+/**
+ * Renders a tape to WAV files, as fast as the disk and cores allow.
+ *
+ * The tape is read as it plays, edits included, and mixed like the mixer
+ * does. The section to render is cut in `BLOCK` frame blocks, rendered by
+ * a pool of threads. Each has its own read only TapeFile, so they read
+ * in parallel, and reads all four tracks of a block at once. Rendered
+ * blocks are written to the outputs as they come, in any order.
+ *
+ * Meant to run in the background: `start` returns right away, and the
+ * UI can poll `progress` and `cancel` it. Files of a bounce that didn't
+ * finish are removed.
+ */
+class Bounce {
+public:
+
+  /** Frames rendered at once by a thread */
+  static constexpr uint BLOCK = 1 << 16;
+
+  struct Settings {
+    /** The tape to render. It should be saved, see TapeBuffer::save */
+    std::string tape;
+    /** Where to write the stereo mix, none if empty */
+    std::string mixPath;
+    /**
+     * Write a stem of each track that isn't muted, a mono WAV of the
+     * track at its level, at `stemPath(stemsPath, track)`. None if empty.
+     */
+    std::string stemsPath;
+    std::array<MixTrack, 4> tracks;
+    /** The part of the tape to render. If empty, up to the longest track's end */
+    Section<TapeTime> section;
+    /** Number of threads, one per core if 0 */
+    uint threads = 0;
+  };
+
+  Bounce() {}
+  ~Bounce();
+
+  Bounce(Bounce&) = delete;
+  Bounce(Bounce&&) = delete;
+
+  /**
+   * Start rendering in the background.
+   * @return false if a bounce is running, or the tape couldn't be read
+   */
+  bool start(Settings settings);
+
+  /** Stop rendering. The files are removed */
+  void cancel();
+
+  /**
+   * Wait for the bounce to finish.
+   * @return whether all of it was written
+   */
+  bool wait();
+
+  bool running() const {
+    return activeThreads.load(std::memory_order_acquire) > 0;
+  }
+
+  /** Share of the blocks rendered, from 0 to 1 */
+  float progress() const;
+
+  static std::string stemPath(std::string path, uint track);
+
+private:
+  Settings settings;
+  std::array<EditList, 4> edits;
+  /** Whether every track is stored in its own lane, as recorded */
+  bool identity = false;
+
+  uint blocks = 0;
+  std::atomic<uint> nextBlock = {0};
+  std::atomic<uint> doneBlocks = {0};
+  /** Threads not done yet, the last one closes the outputs */
+  std::atomic<uint> rendering = {0};
+  /** Threads not returned yet */
+  std::atomic<uint> activeThreads = {0};
+  std::atomic_bool cancelled = {false};
+  std::atomic_bool failed = {false};
+
+  std::vector<std::thread> threads;
+
+  /** The outputs, written one block at a time */
+  std::mutex outLock;
+  std::unique_ptr<SndFile<2>> mix;
+  std::array<std::unique_ptr<SndFile<1>>, 4> stems;
+
+  void render();
+  void finish();
+};
+
+}
@@ -0,0 +1,117 @@
+#include "edit-list.h"
+
+#include <algorithm>
+
+namespace top1 {
+
+/****************************************/
+/* EditList Implementation              */
+/****************************************/
+
+constexpr TapeTime EditList::END;
+
+EditList EditList::identity(uint lane) {
+  return EditList({{0, END, lane, 0}});
+}
+
+Section<TapeTime> EditList::first(Section<TapeTime> section,
+  const Region *&region) const {
+  // The first region ending after section.in
+  auto it = std::upper_bound(list.begin(), list.end(), section.in,
+    [] (TapeTime time, const Region &r) { return time < r.out; });
+  if (it == list.end() || it->in >= section.out) {
+    region = nullptr;
+    return section;
+  }
+  if (it->in > section.in) {
+    region = nullptr;
+    return {section.in, it->in};
+  }
+  region = &*it;
+  return {section.in, std::min(it->out, section.out)};
+}
+
+bool EditList::isIdentity(Section<TapeTime> section, uint lane) const {
+  if (section.size() <= 0) return true;
+  const Region *region;
+  auto part = first(section, region);
+  return region != nullptr && part.out == section.out
+    && region->lane == lane && region->source == region->in;
+}
+
+void EditList::split(TapeTime time) {
+  auto it = std::upper_bound(list.begin(), list.end(), time,
+    [] (TapeTime time, const Region &r) { return time < r.out; });
+  if (it == list.end() || it->in >= time) return;
+  Region second = *it;
+  second.in = time;
+  second.source = it->sourceOf(time);
+  it->out = time;
+  list.insert(it + 1, second);
+}
+
+EditList::Clip EditList::cut(Section<TapeTime> section) {
+  split(section.in);
+  split(section.out);
+  Clip clip;
+  auto from = std::lower_bound(list.begin(), list.end(), section.in,
+    [] (const Region &r, TapeTime time) { return r.in < time; });
+  auto to = from;
+  for (; to != list.end() && to->out <= section.out; to++) {
+    Region r = *to;
+    r.in -= section.in;
+    r.out -= section.in;
+    clip.push_back(r);
+  }
+  list.erase(from, to);
+  return clip;
+}
+
+void EditList::paste(TapeTime at, const Clip &clip, TapeTime length) {
+  cut({at, at + length});
+  for (Region r : clip) {
+    r.in += at;
+    r.out += at;
+    insert(r);
+  }
+}
+
+void EditList::map(Section<TapeTime> section, uint lane, TapeTime source) {
+  cut(section);
+  insert({section.in, section.out, lane, source});
+}
+
+const EditList::Region *EditList::openEnd() const {
+  if (list.empty() || list.back().out != END) return nullptr;
+  return &list.back();
+}
+
+void EditList::close(TapeTime storageEnd) {
+  if (openEnd() == nullptr) return;
+  Region &r = list.back();
+  r.out = r.in + std::max<TapeTime>(0, storageEnd - r.source);
+  if (r.size() <= 0) list.pop_back();
+}
+
+/**
+ * Insert a region into a gap, merging it with its neighbours
+ * if the storage is contiguous.
+ */
+void EditList::insert(Region region) {
+  auto continues = [] (const Region &a, const Region &b) {
+    return a.out == b.in && a.lane == b.lane && a.sourceOf(a.out) == b.source;
+  };
+  auto it = std::lower_bound(list.begin(), list.end(), region.in,
+    [] (const Region &r, TapeTime time) { return r.in < time; });
+  it = list.insert(it, region);
+  if (it + 1 != list.end() && continues(*it, *(it + 1))) {
+    it->out = (it + 1)->out;
+    list.erase(it + 1);
+  }
+  if (it != list.begin() && continues(*(it - 1), *it)) {
+    (it - 1)->out = it->out;
+    list.erase(it);
+  }
+}
+
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "../utils.h"
+
+namespace top1 {
+
+/** A position on the tape, in frames */
+using TapeTime = int64_t;
+
+/**
+ * Where the audio of a track is stored.
+ *
+ * Edits don't move any audio. The track is a list of regions instead,
+ * each mapping a section of the tape to frames in one of the lanes of the
+ * tape file. Lifting, dropping and cutting only change the list.
+ * Parts of the tape not in any region are silent.
+ *
+ * Untouched tracks have a single open ended region, mapping the whole
+ * track to its own lane at the same time.
+ */
+class EditList {
+public:
+
+  /** The `out` of an open ended region */
+  static constexpr TapeTime END = std::numeric_limits<TapeTime>::max();
+
+  struct Region {
+    TapeTime in = 0;
+    TapeTime out = 0;
+    /** The lane of the tape file the audio is stored in */
+    uint lane = 0;
+    /** The frame in the lane `in` is stored at */
+    TapeTime source = 0;
+
+    TapeTime size() const { return out - in; }
+
+    /** The frame in the lane `time` is stored at */
+    TapeTime sourceOf(TapeTime time) const {
+      return source + (time - in);
+    }
+
+    /** The storage used, `[source, sourceEnd)` */
+    TapeTime sourceEnd() const {
+      return out == END ? END : sourceOf(out);
+    }
+
+    bool operator==(const Region &other) const {
+      return in == other.in && out == other.out && lane == other.lane
+        && source == other.source;
+    }
+    bool operator!=(const Region &other) const { return !(*this == other); }
+  };
+
+  /** Regions lifted off a track, relative to where they were lifted */
+  using Clip = std::vector<Region>;
+
+  EditList() {}
+  EditList(std::vector<Region> regions) : list (std::move(regions)) {}
+
+  /** A track stored in `lane`, at the same time */
+  static EditList identity(uint lane);
+
+  const std::vector<Region> &regions() const { return list; }
+  std::size_t size() const { return list.size(); }
+
+  /**
+   * The part of `section` from `section.in` up to where it leaves the
+   * region it starts in, or up to the next region if it starts in a gap.
+   * @param region set to the region, or nullptr in a gap.
+   */
+  Section<TapeTime> first(Section<TapeTime> section, const Region *&region) const;
+
+  /**
+   * Call `f(part, region)` for the parts of `section`, in order.
+   * `region` is nullptr for the gaps. `f` may change the list, but
+   * `region` is only valid until it does.
+   */
+  template<typename F>
+  void resolve(Section<TapeTime> section, F &&f) const {
+    while (section.size() > 0) {
+      const Region *region;
+      auto part = first(section, region);
+      f(part, region);
+      section.in = part.out;
+    }
+  }
+
+  /** Whether `section` is stored in `lane`, at the same time */
+  bool isIdentity(Section<TapeTime> section, uint lane) const;
+
+  /**
+   * Remove the regions in `section`, splitting the ones crossing its ends.
+   * @return the removed regions, relative to `section.in`
+   */
+  Clip cut(Section<TapeTime> section);
+
+  /**
+   * Replace `[at, at + length)` with `clip`.
+   * The gaps in the clip are silent, like the rest of that section.
+   */
+  void paste(TapeTime at, const Clip &clip, TapeTime length);
+
+  /** Store `section` in `lane`, starting at `source` */
+  void map(Section<TapeTime> section, uint lane, TapeTime source);
+
+  /** The last region, if it is open ended */
+  const Region *openEnd() const;
+
+  /**
+   * End the open ended region where its storage ends.
+   * The part after that was read as silence anyway.
+   */
+  void close(TapeTime storageEnd);
+
+private:
+  /** Sorted by time, never overlapping */
+  std::vector<Region> list;
+
+  void split(TapeTime time);
+  void insert(Region region);
+};
+
+}
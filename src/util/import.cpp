@@ -0,0 +1,127 @@
+#include "import.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <plog/Log.h>
+
+#include "resampler.h"
+
+namespace top1 {
+
+/****************************************/
+/* Import Implementation                */
+/****************************************/
+
+constexpr uint Import::BLOCK;
+constexpr std::size_t Import::MAX_PENDING;
+
+Import::~Import() {
+  cancel();
+  wait();
+}
+
+bool Import::start(Settings newSettings) {
+  if (running()) {
+    LOGW << "Already importing '" << settings.path << "'";
+    return false;
+  }
+  wait();
+  settings = std::move(newSettings);
+
+  file = std::make_unique<SndFile<1>>();
+  file->readOnly = true;
+  file->open(settings.path);
+  if (file->error.log()) return false;
+  auto format = file->fileFormat();
+  uint channels = file->fileChannels();
+  if (format == SampleFormat::UNKNOWN || channels == 0) {
+    LOGE << "Can't import '" << settings.path << "', its format isn't supported";
+    return false;
+  }
+  if (settings.channel >= int(channels)) {
+    LOGE << "'" << settings.path << "' has no channel " << settings.channel + 1;
+    return false;
+  }
+  if (file->samplerate == 0 || settings.samplerate == 0) return false;
+  length = std::ceil(file->size() * double(settings.samplerate) / file->samplerate);
+  done = 0;
+  cancelled = false;
+  failed = false;
+
+  LOGI << "Importing '" << settings.path << "', " << channels << " channels of "
+       << sampleformat::name(format) << " at " << file->samplerate << " Hz, to track "
+       << settings.track.str() << " at " << settings.at;
+  active = true;
+  thread = std::thread([this] {
+      run();
+      file = nullptr;
+      active.store(false, std::memory_order_release);
+    });
+  return true;
+}
+
+void Import::cancel() {
+  cancelled = true;
+}
+
+bool Import::wait() {
+  if (thread.joinable()) thread.join();
+  return !cancelled && !failed && done == length;
+}
+
+float Import::progress() const {
+  if (length == 0) return running() ? 0 : 1;
+  return float(done.load(std::memory_order_relaxed)) / length;
+}
+
+void Import::run() {
+  std::size_t size = file->size();
+  std::vector<float> mono (BLOCK);
+  file->readChannel = settings.channel;
+  file->seek(0);
+
+  float step = float(file->samplerate) / settings.samplerate;
+  Resampler<1> resampler {Resampler<1>::Quality::HIGH, std::max(8.f, step), BLOCK};
+  std::vector<float> out (std::ceil(BLOCK / step) + 1);
+  const uint track = settings.track.idx;
+
+  // Hand the resampled frames to the tape
+  auto store = [&] () {
+    while (uint n = resampler.pull(out.data(), out.size(), step)) {
+      n = std::min<std::size_t>(n, length - done);
+      if (n == 0) return;
+      while (tape.pendingImports() > MAX_PENDING && !cancelled) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+      if (cancelled) return;
+      TapeTime at = settings.at + done;
+      tape.importFrames(settings.track, at,
+        std::vector<float>(out.begin(), out.begin() + n));
+      done += n;
+      tape.trackSlices[track].addSlice({settings.at, at + n});
+    }
+  };
+
+  for (std::size_t pos = 0; pos < size && !cancelled;) {
+    uint n = file->read(mono.data(), BLOCK);
+    if (n == 0) {
+      LOGE << "Couldn't read '" << settings.path << "' at frame " << pos;
+      failed = true;
+      return;
+    }
+    resampler.push(mono.data(), n);
+    store();
+    pos += n;
+  }
+  // The end of the file is still in the filter
+  std::fill(mono.begin(), mono.end(), 0.f);
+  while (done < length && !cancelled) {
+    resampler.push(mono.data(), BLOCK);
+    store();
+  }
+  if (cancelled) LOGI << "Import of '" << settings.path << "' cancelled";
+  else LOGI << "Imported '" << settings.path << "'";
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "sndfile.h"
+#include "tapebuffer.h"
+
+namespace top1 {
+
+/**
+ * Puts a WAV on a track of the tape, in the background.
+ *
+ * Any of the formats in SampleFormat, with any number of channels and at
+ * any sample rate. The file is read in `BLOCK` frame blocks, converted to
+ * floats, mixed down to mono (or one channel picked) and resampled to the
+ * tape's rate. The blocks are handed to TapeBuffer::importFrames, whose
+ * disk thread writes them straight to the tape file, so playing is not
+ * disturbed. The track's slices and peaks follow as it goes.
+ *
+ * Like Bounce, `start` returns right away, and the UI can poll `progress`
+ * and `cancel` it. A cancelled import keeps what it stored so far, start
+ * an undo step before to take it back.
+ */
+class Import {
+public:
+
+  /** Frames read from the file at once */
+  static constexpr uint BLOCK = 1 << 16;
+
+  /** Frames waiting for the disk thread at most, the import waits for it after that */
+  static constexpr std::size_t MAX_PENDING = 4 * BLOCK;
+
+  struct Settings {
+    /** The WAV to import */
+    std::string path;
+    Track track = Track::newName(1);
+    /** Where the file starts on the tape */
+    TapeTime at = 0;
+    /** Sample rate of the tape */
+    uint samplerate = 44100;
+    /** The channel of the file to import, or -1 to mix them all down */
+    int channel = -1;
+  };
+
+  Import(TapeBuffer &tape) : tape (tape) {}
+  ~Import();
+
+  Import(Import&) = delete;
+  Import(Import&&) = delete;
+
+  /**
+   * Start importing in the background.
+   * @return false if an import is running, or the file can't be read
+   */
+  bool start(Settings settings);
+
+  /** Stop importing */
+  void cancel();
+
+  /**
+   * Wait for the import to finish.
+   * @return whether all of the file was imported
+   */
+  bool wait();
+
+  bool running() const {
+    return active.load(std::memory_order_acquire);
+  }
+
+  /** Share of the file imported, from 0 to 1 */
+  float progress() const;
+
+  /** Where the file goes on the tape, once started */
+  Section<TapeTime> section() const {
+    return {settings.at, settings.at + TapeTime(length)};
+  }
+
+private:
+  TapeBuffer &tape;
+  Settings settings;
+  std::unique_ptr<SndFile<1>> file;
+  /** Length on the tape, after resampling */
+  std::size_t length = 0;
+
+  std::thread thread;
+  std::atomic_bool active = {false};
+  std::atomic_bool cancelled = {false};
+  std::atomic_bool failed = {false};
+  /** Frames handed to the tape */
+  std::atomic<std::size_t> done = {0};
+
+  void run();
+};
+
+}
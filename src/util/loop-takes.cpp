@@ -0,0 +1,192 @@
+#include "loop-takes.h"
+
+#include <algorithm>
+
+namespace top1 {
+
+/****************************************/
+/* LoopTakes Implementation             */
+/****************************************/
+
+constexpr uint LoopTakes::LAYERS;
+constexpr uint LoopTakes::MAX_LAYERS;
+
+namespace {
+
+/**
+ * Add `src` at `gain` to `dst`. Vectorized, this file is built with -O3
+ * like the write mode kernels.
+ */
+void addScaled(float *dst, const float *src, float gain, TapeTime n) {
+  for (TapeTime i = 0; i < n; i++) {
+    dst[i] += gain * src[i];
+  }
+}
+
+/** The smallest section holding both */
+Section<TapeTime> hull(Section<TapeTime> a, Section<TapeTime> b) {
+  if (!a) return b;
+  return {std::min(a.in, b.in), std::max(a.out, b.out)};
+}
+
+}
+
+LoopTakes::LoopTakes() {
+  for (auto &g : gains) g = 1;
+}
+
+bool LoopTakes::allocate(Section<TapeTime> loop, uint track, uint layers) {
+  std::lock_guard<std::mutex> lock (poolLock);
+  taken = 0;
+  mutedLayers = 0;
+  commitMask = 0;
+  current = -1;
+  previous = -1;
+  committed = 0;
+  recorded.fill({});
+  for (auto &g : gains) g = 1;
+  if (loop.in < 0 || loop.size() <= 0) {
+    pool.clear();
+    section = {};
+    return false;
+  }
+  section = loop;
+  trackIdx = track;
+  pool.resize(std::min(layers, MAX_LAYERS));
+  for (auto &layer : pool) {
+    layer.resize(loop.size());
+  }
+  return true;
+}
+
+void LoopTakes::release() {
+  allocate({}, 0, 0);
+}
+
+void LoopTakes::mute(uint layer, bool m) {
+  if (m) mutedLayers |= 1u << layer;
+  else mutedLayers &= ~(1u << layer);
+}
+
+bool LoopTakes::commit(uint mask) {
+  mask &= takes();
+  if (mask == 0) return false;
+  uint none = 0;
+  return commitMask.compare_exchange_strong(none, mask);
+}
+
+bool LoopTakes::startPass(uint track) {
+  std::unique_lock<std::mutex> lock (poolLock, std::try_to_lock);
+  if (!lock) {
+    // The pool is reallocated, which drops the takes and the last pass
+    current = -1;
+    return false;
+  }
+  // Late frames still go to the last pass
+  previous = current;
+  current = -1;
+  uint used = taken.load();
+  if (used != 0 && track != trackIdx) return false;
+  uint free = ~(used | commitMask.load());
+  for (uint l = 0; l < pool.size(); l++) {
+    if (!(free & (1u << l))) continue;
+    trackIdx = track;
+    current = l;
+    recorded[l] = {};
+    gains[l] = 1;
+    mute(l, false);
+    taken |= 1u << l;
+    return true;
+  }
+  return false;
+}
+
+void LoopTakes::stopPass() {
+  current = -1;
+  std::unique_lock<std::mutex> lock (poolLock, std::try_to_lock);
+  if (lock) previous = -1;
+}
+
+void LoopTakes::record(const float *src, uint nframes, TapeTime at, Direction dir) {
+  std::unique_lock<std::mutex> lock (poolLock, std::try_to_lock);
+  if (!lock) return;
+  int layer = current;
+  const TapeTime length = section.size();
+  const bool fw = dir == Direction::FW;
+  TapeTime rel = at - section.in;
+  // Frames of the previous pass
+  TapeTime behind = std::max<TapeTime>(0, fw ? -rel : rel - length + 1);
+  behind = std::min<TapeTime>(behind, nframes);
+  if (behind > 0 && previous >= 0) {
+    store(previous, fw ? rel + length : rel - length, src, behind, dir);
+  }
+  rel += fw ? behind : -behind;
+  TapeTime inLoop = std::max<TapeTime>(0, fw ? length - rel : rel + 1);
+  inLoop = std::min<TapeTime>(inLoop, nframes - behind);
+  if (layer >= 0) store(layer, rel, src + behind, inLoop, dir);
+}
+
+void LoopTakes::store(int layer, TapeTime rel, const float *src, uint nframes,
+  Direction dir) {
+  if (nframes == 0) return;
+  float *data = pool[layer].data();
+  if (dir == Direction::FW) {
+    std::copy(src, src + nframes, data + rel);
+    recorded[layer] = hull(recorded[layer], {rel, rel + nframes});
+  } else {
+    for (uint i = 0; i < nframes; i++) {
+      data[rel - i] = src[i];
+    }
+    recorded[layer] = hull(recorded[layer], {rel - nframes + 1, rel + 1});
+  }
+}
+
+uint LoopTakes::mix(float *dst, uint nframes, TapeTime at, Direction dir, uint mask) {
+  std::fill(dst, dst + nframes, 0.f);
+  std::unique_lock<std::mutex> lock (poolLock, std::try_to_lock);
+  if (!lock) return 0;
+  int layer = current;
+  if (layer >= 0) mask &= ~(1u << layer);
+  return mixLayers(dst, nframes, at, dir, mask & taken.load());
+}
+
+uint LoopTakes::commitInto(float *dst, uint nframes, TapeTime at, Direction dir) {
+  uint mask = commitMask.load();
+  if (mask == 0) return 0;
+  std::fill(dst, dst + nframes, 0.f);
+  std::unique_lock<std::mutex> lock (poolLock, std::try_to_lock);
+  if (!lock) return 0;
+  uint n = mixLayers(dst, nframes, at, dir, mask);
+  committed += n;
+  if (committed >= section.size()) {
+    taken &= ~mask;
+    commitMask = 0;
+    committed = 0;
+  }
+  return n > 0 ? nframes : 0;
+}
+
+uint LoopTakes::mixLayers(float *dst, uint nframes, TapeTime at,
+  Direction dir, uint mask) {
+  // The frames in tape order, mixed forwards and turned around after
+  Section<TapeTime> frames = dir == Direction::FW
+    ? Section<TapeTime>{at, at + nframes}
+    : Section<TapeTime>{at - nframes + 1, at + 1};
+  TapeTime in = std::max(frames.in, section.in);
+  TapeTime out = std::min(frames.out, section.out);
+  if (in >= out || pool.empty()) return 0;
+
+  for (uint l = 0; l < pool.size(); l++) {
+    if (!(mask & (1u << l))) continue;
+    auto &rec = recorded[l];
+    TapeTime from = std::max(in, section.in + rec.in);
+    TapeTime to = std::min(out, section.in + rec.out);
+    if (from >= to) continue;
+    addScaled(dst + (from - frames.in), pool[l].data() + (from - section.in),
+      gains[l].load(std::memory_order_relaxed), to - from);
+  }
+  if (dir == Direction::BW) std::reverse(dst, dst + nframes);
+  return out - in;
+}
+
+}
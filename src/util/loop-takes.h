@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "tapebuffer.h"
+
+namespace top1 {
+
+/**
+ * Each pass of a recorded loop, kept as its own take.
+ *
+ * Instead of summing every pass into the track, each one is captured into
+ * a layer the length of the loop. The layers are mixed into the track as
+ * it plays, each at its own gain or muted, and any of them can be
+ * committed to the tape later.
+ *
+ * The layers come from a pool, allocated up front by the UI thread. The
+ * audio thread only copies into and mixes out of it, and skips a cycle
+ * rather than wait while the pool is reallocated.
+ */
+class LoopTakes {
+public:
+
+  using Direction = TapeBuffer::Direction;
+
+  /** Layers in a pool by default */
+  static constexpr uint LAYERS = 8;
+  /** Layers are kept in bit masks */
+  static constexpr uint MAX_LAYERS = 32;
+
+  LoopTakes();
+
+  LoopTakes(LoopTakes&) = delete;
+  LoopTakes(LoopTakes&&) = delete;
+
+  // UI thread
+
+  /**
+   * Allocate `layers` layers the size of `loop`, for takes on `track`.
+   * Any takes already recorded are dropped.
+   * @return false if the loop is empty. The pool is freed.
+   */
+  bool allocate(Section<TapeTime> loop, uint track, uint layers = LAYERS);
+
+  /** Drop all takes and free the pool */
+  void release();
+
+  Section<TapeTime> loop() const { return section; }
+  uint track() const { return trackIdx; }
+  /** Size of the pool */
+  uint layers() const { return pool.size(); }
+
+  /** Layers holding a take, as a bit mask */
+  uint takes() const { return taken.load(std::memory_order_acquire); }
+  /** Takes that are not muted */
+  uint audible() const { return takes() & ~mutedLayers.load(); }
+  /** The layer being recorded, -1 if none */
+  int recording() const { return current.load(std::memory_order_relaxed); }
+
+  float gain(uint layer) const { return gains[layer].load(); }
+  void gain(uint layer, float g) { gains[layer] = g; }
+  bool muted(uint layer) const { return mutedLayers.load() & (1u << layer); }
+  void mute(uint layer, bool m);
+
+  /**
+   * Write the takes in `mask` to the tape, at their gains.
+   * They are written as the loop plays, see commitInto, and then leave
+   * the pool.
+   * @return false if a commit is already running, or no take is in `mask`
+   */
+  bool commit(uint mask);
+  bool committing() const { return commitMask.load() != 0; }
+
+  // Audio thread. Realtime safe, they never allocate or block.
+
+  /**
+   * Start recording the next pass into a free layer.
+   * @return false if the pool is full or empty, or holds takes of
+   *   another track. Nothing is recorded until the next pass then.
+   */
+  bool startPass(uint track);
+
+  /** Stop recording */
+  void stopPass();
+
+  /**
+   * Store recorded frames in the current layer.
+   * @param at the tape position of the first frame. The following ones
+   *   are at `at + 1` forwards, `at - 1` backwards.
+   *
+   * Frames recorded just after the loop jumped back belong to the end of
+   * the previous pass, the recording lags behind the playpoint. They are
+   * stored there, and frames outside of the loop are dropped.
+   */
+  void record(const float *src, uint nframes, TapeTime at, Direction dir);
+
+  /**
+   * Mix the layers in `mask` at the tape positions of `dst`, replacing
+   * what was there.
+   *
+   * The layer being recorded is left out, it is heard as it is played.
+   * @param at the tape position of the first frame, like `record`.
+   * @return the number of frames inside the loop, 0 if none
+   */
+  uint mix(float *dst, uint nframes, TapeTime at, Direction dir, uint mask);
+
+  /**
+   * While committing, mix the takes to commit like `mix`, for writing to
+   * the tape where they were just played. Once a whole pass of the loop
+   * has been written, the takes leave the pool.
+   * @return the number of frames to write, 0 if none
+   */
+  uint commitInto(float *dst, uint nframes, TapeTime at, Direction dir);
+
+private:
+  Section<TapeTime> section;
+  /** Read by the UI thread, set by the audio thread as it starts a pass */
+  std::atomic_uint trackIdx = {0};
+
+  /**
+   * Held by the UI thread while changing the pool, tried by the audio
+   * thread. It guards the fields of either thread below, the UI thread
+   * only resets them while holding it.
+   */
+  std::mutex poolLock;
+  std::vector<std::vector<float>> pool;
+
+  /**
+   * The part of each layer that was recorded, relative to the loop in.
+   * Audio thread, locked
+   */
+  std::array<Section<TapeTime>, MAX_LAYERS> recorded;
+
+  std::atomic_uint taken = {0};
+  std::atomic_uint mutedLayers = {0};
+  std::atomic_uint commitMask = {0};
+  std::array<std::atomic<float>, MAX_LAYERS> gains;
+
+  std::atomic_int current = {-1};
+  /** The layer recorded before the current one. Audio thread, locked */
+  int previous = -1;
+  /** Frames of the loop committed so far. Audio thread, locked */
+  TapeTime committed = 0;
+
+  void store(int layer, TapeTime rel, const float *src, uint nframes, Direction dir);
+  uint mixLayers(float *dst, uint nframes, TapeTime at, Direction dir, uint mask);
+};
+
+}
@@ -0,0 +1,133 @@
+#include "mapped-file.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <plog/Log.h>
+
+namespace top1 {
+
+/****************************************/
+/* MappedFile Implementation            */
+/****************************************/
+
+MappedFile::~MappedFile() {
+  if (isOpen()) close(std::max(openSize, length));
+}
+
+bool MappedFile::open(const std::string &path, bool readOnly) {
+  this->readOnly = readOnly;
+  fd = readOnly ? ::open(path.c_str(), O_RDONLY)
+    : ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    LOGE << "Couldn't open '" << path << "' for mapping: " << std::strerror(errno);
+    return false;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  openSize = st.st_size;
+  if (openSize > 0 && !map(openSize)) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void MappedFile::close(std::size_t finalSize) {
+  if (!isOpen()) return;
+  sync(true);
+  unmap();
+  if (!readOnly && ftruncate(fd, finalSize) != 0) {
+    LOGE << "Couldn't truncate mapped file: " << std::strerror(errno);
+  }
+  ::close(fd);
+  fd = -1;
+  openSize = 0;
+}
+
+bool MappedFile::reserve(std::size_t size) {
+  if (size <= length) return true;
+  if (readOnly) return false;
+  // Round up to whole extents
+  std::size_t newLength = (size + EXTENT - 1) / EXTENT * EXTENT;
+  sync();
+  unmap();
+  if (ftruncate(fd, newLength) != 0) {
+    LOGE << "Couldn't grow mapped file: " << std::strerror(errno);
+    map(std::max(openSize, length));
+    return false;
+  }
+  return map(newLength);
+}
+
+void MappedFile::markDirty(std::size_t from, std::size_t to) {
+  if (dirtyFrom == dirtyTo) {
+    dirtyFrom = from;
+    dirtyTo = to;
+  } else {
+    dirtyFrom = std::min(dirtyFrom, from);
+    dirtyTo = std::max(dirtyTo, to);
+  }
+}
+
+void MappedFile::prefetch(std::size_t from, std::size_t to) {
+  static const std::size_t page = sysconf(_SC_PAGESIZE);
+  from = from / page * page;
+  to = std::min(to, length);
+  if (mapping == nullptr || from >= to) return;
+  // Only advice, the kernel is free to ignore it
+  madvise(mapping + from, to - from, MADV_WILLNEED);
+}
+
+bool MappedFile::discard(std::size_t from, std::size_t to) {
+  static const std::size_t page = sysconf(_SC_PAGESIZE);
+  from = (from + page - 1) / page * page;
+  to = to / page * page;
+  if (!isOpen() || readOnly) return false;
+  if (from >= to) return true;
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) != 0) {
+    LOGW << "Couldn't free space in mapped file: " << std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void MappedFile::sync(bool wait) {
+  if (mapping == nullptr || dirtyFrom == dirtyTo) return;
+  static const std::size_t page = sysconf(_SC_PAGESIZE);
+  std::size_t from = dirtyFrom / page * page;
+  std::size_t to = std::min(dirtyTo, length);
+  if (msync(mapping + from, to - from, wait ? MS_SYNC : MS_ASYNC) != 0) {
+    LOGE << "msync failed: " << std::strerror(errno);
+  }
+  dirtyFrom = dirtyTo = 0;
+}
+
+bool MappedFile::map(std::size_t size) {
+  int prot = readOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+  void *ptr = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    LOGE << "mmap failed: " << std::strerror(errno);
+    mapping = nullptr;
+    length = 0;
+    return false;
+  }
+  mapping = static_cast<char *>(ptr);
+  length = size;
+  return true;
+}
+
+void MappedFile::unmap() {
+  if (mapping != nullptr) {
+    munmap(mapping, length);
+  }
+  mapping = nullptr;
+  length = 0;
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+
+namespace top1 {
+
+/**
+ * A file mapped into memory, grown in large extents.
+ *
+ * Only the mapping is managed here. Reads and writes are plain memcpys on
+ * `data()`, after which the written range should be passed to `markDirty`
+ * so `sync` knows what to flush.
+ *
+ * The file is grown with `ftruncate` past what is actually used, so it
+ * has to be closed with the size it should end up with.
+ */
+class MappedFile {
+public:
+
+  /** Files are grown in steps of this many bytes */
+  static constexpr std::size_t EXTENT = 64 << 20;
+
+  MappedFile() {}
+  ~MappedFile();
+
+  MappedFile(MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+
+  /**
+   * Open and map the whole file.
+   * @param readOnly never write to the file, nor change its size
+   * @return false if it could not be mapped.
+   */
+  bool open(const std::string &path, bool readOnly = false);
+
+  /**
+   * Flush, unmap and truncate the file to `finalSize` bytes.
+   * Read only files are left as they are.
+   */
+  void close(std::size_t finalSize);
+
+  bool isOpen() const { return fd >= 0; }
+  bool isReadOnly() const { return readOnly; }
+
+  /**
+   * Make sure `[0, size)` is mapped, growing the file if needed.
+   * Invalidates pointers returned by `data()`.
+   */
+  bool reserve(std::size_t size);
+
+  char *data() const { return mapping; }
+
+  /** Size of the file when it was opened */
+  std::size_t initialSize() const { return openSize; }
+
+  /** Bytes that can be accessed without growing */
+  std::size_t capacity() const { return length; }
+
+  void markDirty(std::size_t from, std::size_t to);
+
+  /**
+   * Start reading `[from, to)` from disk in the background, so accessing
+   * it later doesn't wait for it. Returns right away.
+   */
+  void prefetch(std::size_t from, std::size_t to);
+
+  /**
+   * Free the disk space of the whole pages in `[from, to)`, which read
+   * as zeros afterwards. The size of the file stays the same.
+   * @return false if the file system can't
+   */
+  bool discard(std::size_t from, std::size_t to);
+
+  /**
+   * Write the dirty range back to the file.
+   * @param wait block until it is on disk, otherwise it is only scheduled.
+   */
+  void sync(bool wait = false);
+
+private:
+  int fd = -1;
+  char *mapping = nullptr;
+  std::size_t length = 0;
+  std::size_t openSize = 0;
+  bool readOnly = false;
+
+  std::size_t dirtyFrom = 0;
+  std::size_t dirtyTo = 0;
+
+  bool map(std::size_t size);
+  void unmap();
+};
+
+}
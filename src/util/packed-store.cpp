@@ -0,0 +1,117 @@
+#include "packed-store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <plog/Log.h>
+
+#include "audio-codec.h"
+
+namespace top1 {
+
+/****************************************/
+/* PackedStore Implementation           */
+/****************************************/
+
+void PackedStore::open(const std::string &path, uint channels) {
+  close();
+  this->path = path;
+  this->channels = channels;
+  std::ifstream in (path, std::ios::binary);
+  RecordHeader header;
+  std::size_t pos = 0;
+  while (in.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+    if (std::memcmp(header.id, RecordHeader().id, 4) != 0) {
+      LOGW << "Ignoring the rest of the packed audio in '" << path << "'";
+      break;
+    }
+    pos += sizeof(header);
+    if (header.bytes > 0 && !in.seekg(header.bytes, std::ios::cur)) break;
+    set(header.block, {pos, header.bytes});
+    pos += header.bytes;
+  }
+}
+
+void PackedStore::close() {
+  if (file.is_open()) file.close();
+  index.clear();
+  count = 0;
+  bytes = 0;
+  cached = -1;
+}
+
+bool PackedStore::read(uint block, float *dst) {
+  if (!isPacked(block)) return false;
+  if (cached != int(block)) {
+    auto entry = index[block];
+    buffer.resize(entry.bytes);
+    if (!file.is_open()) file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekg(entry.offset);
+    cache.resize(BLOCK * channels);
+    if (!file.read(buffer.data(), entry.bytes)
+      || !codec::decode(buffer.data(), entry.bytes, cache.data(), BLOCK, channels)) {
+      LOGE << "Couldn't read packed block " << block << " of '" << path << "'";
+      file.clear();
+      cached = -1;
+      return false;
+    }
+    cached = block;
+  }
+  std::copy(cache.begin(), cache.end(), dst);
+  return true;
+}
+
+bool PackedStore::pack(uint block, const float *src) {
+  buffer.clear();
+  codec::encode(src, BLOCK, channels, buffer);
+  if (!append(block, buffer)) return false;
+  if (cached == int(block)) cached = -1;
+  return true;
+}
+
+void PackedStore::unpack(uint block) {
+  if (!isPacked(block)) return;
+  append(block, {});
+  if (cached == int(block)) cached = -1;
+}
+
+bool PackedStore::append(uint block, const std::vector<char> &data) {
+  if (!file.is_open()) {
+    auto mode = std::ios::binary | std::ios::in | std::ios::out;
+    file.open(path, mode);
+    if (!file.is_open()) {
+      file.clear();
+      file.open(path, mode | std::ios::trunc);
+    }
+  }
+  RecordHeader header;
+  header.block = block;
+  header.bytes = data.size();
+  file.seekp(0, std::ios::end);
+  std::size_t pos = std::size_t(file.tellp()) + sizeof(header);
+  file.write(reinterpret_cast<char *>(&header), sizeof(header));
+  file.write(data.data(), data.size());
+  file.flush();
+  if (!file) {
+    LOGE << "Couldn't write packed audio to '" << path << "'";
+    file.clear();
+    return false;
+  }
+  set(block, {pos, header.bytes});
+  return true;
+}
+
+void PackedStore::set(uint block, Entry entry) {
+  if (block >= index.size()) index.resize(block + 1);
+  auto &old = index[block];
+  if (old.bytes > 0) {
+    count--;
+    bytes -= old.bytes;
+  }
+  old = entry;
+  if (entry.bytes > 0) {
+    count++;
+    bytes += entry.bytes;
+  }
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "typedefs.h"
+
+namespace top1 {
+
+/**
+ * Blocks of a sound file kept compressed, see `codec`, in a sidecar file.
+ *
+ * The sidecar is a log of records, each a `RecordHeader` followed by the
+ * compressed block. Packing a block again appends a new record, and a
+ * record without bytes unpacks it, its frames being back in the sound
+ * file. The index is rebuilt from the log when opening. The log is never
+ * compacted, blocks are only unpacked when written to, which is rare for
+ * cold ones.
+ */
+class PackedStore {
+public:
+
+  /** Frames per block */
+  static constexpr uint BLOCK = 4096;
+
+  struct RecordHeader {
+    char id[4] = {'P', 'A', 'C', 'K'};
+    uint32_t block = 0;
+    /** Compressed size, 0 to unpack */
+    uint32_t bytes = 0;
+  };
+
+  PackedStore() {}
+  PackedStore(PackedStore&) = delete;
+
+  /** Open the sidecar at `path`, if there is one. It is made when needed */
+  void open(const std::string &path, uint channels);
+  void close();
+
+  bool isPacked(uint block) const {
+    return block < index.size() && index[block].bytes > 0;
+  }
+
+  /** Whether any block is packed */
+  bool empty() const { return count == 0; }
+
+  /**
+   * Decode a block, `BLOCK` frames.
+   * @return false if it is not packed, or its record is broken
+   */
+  bool read(uint block, float *dst);
+
+  /**
+   * Compress and store `BLOCK` frames. They can be dropped from the
+   * sound file afterwards.
+   * @return false if the sidecar couldn't be written
+   */
+  bool pack(uint block, const float *src);
+
+  /** Drop a block, after its frames were written back to the sound file */
+  void unpack(uint block);
+
+  /** Number of packed blocks */
+  uint packedBlocks() const { return count; }
+  /** Size of the packed blocks */
+  std::size_t packedBytes() const { return bytes; }
+
+private:
+  struct Entry {
+    std::size_t offset = 0;
+    uint32_t bytes = 0;
+  };
+
+  std::string path;
+  uint channels = 1;
+  std::fstream file;
+  std::vector<Entry> index;
+  uint count = 0;
+  std::size_t bytes = 0;
+
+  std::vector<char> buffer;
+  /** The last block read, decoded, as reads are mostly sequential */
+  std::vector<float> cache;
+  int cached = -1;
+
+  bool append(uint block, const std::vector<char> &data);
+  void set(uint block, Entry entry);
+};
+
+}
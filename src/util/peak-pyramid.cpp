@@ -0,0 +1,221 @@
+#include "peak-pyramid.h"
+
+#include <cstring>
+
+namespace top1 {
+
+/****************************************/
+/* PeakPyramid Implementation           */
+/****************************************/
+
+constexpr uint64_t PeakPyramid::MAX_BLOCKS;
+
+PeakPyramid::PeakPyramid() {
+  tables.emplace_back(new Table());
+  table.store(tables.back().get());
+}
+
+/** The floats go through integers, a Peak is copied member by member */
+uint64_t PeakPyramid::pack(Peak peak) {
+  uint32_t min, max;
+  std::memcpy(&min, &peak.min, sizeof(min));
+  std::memcpy(&max, &peak.max, sizeof(max));
+  return uint64_t(max) << 32 | min;
+}
+
+PeakPyramid::Peak PeakPyramid::unpack(uint64_t bits) {
+  uint32_t min = bits, max = bits >> 32;
+  Peak peak;
+  std::memcpy(&peak.min, &min, sizeof(min));
+  std::memcpy(&peak.max, &max, sizeof(max));
+  return peak;
+}
+
+/** Pages of `level` covering `pages` pages of level 0 */
+static uint levelPages(uint level, uint pages) {
+  for (uint l = 0; l < level; l++) {
+    pages = (pages + PeakPyramid::FANOUT - 1) / PeakPyramid::FANOUT;
+  }
+  return pages;
+}
+
+/**
+ * A full table is replaced by one twice as large, so the tables kept for
+ * readers take about as much as the last one.
+ */
+void PeakPyramid::reserve(TapeTime frames) {
+  const TapeTime pageFrames = TapeTime(PAGE) * BLOCK;
+  uint needed = std::min<TapeTime>(MAX_BLOCKS / PAGE,
+    (std::max<TapeTime>(frames, 0) + pageFrames - 1) / pageFrames);
+  std::lock_guard<std::mutex> lock (reserving);
+  uint reserved = reservedPages.load(std::memory_order_relaxed);
+  if (needed <= reserved) return;
+
+  Table *current = table.load(std::memory_order_relaxed);
+  if (needed > current->levels[0].size()) {
+    uint capacity = std::min<uint64_t>(MAX_BLOCKS / PAGE,
+      std::max<uint64_t>(needed, 2 * current->levels[0].size()));
+    std::unique_ptr<Table> grown (new Table());
+    for (uint l = 0; l < LEVELS; l++) {
+      grown->levels[l] = current->levels[l];
+      grown->levels[l].resize(levelPages(l, capacity), nullptr);
+    }
+    current = grown.get();
+    tables.push_back(std::move(grown));
+    table.store(current, std::memory_order_release);
+  }
+
+  for (uint l = 0; l < LEVELS; l++) {
+    for (uint p = levelPages(l, reserved); p < levelPages(l, needed); p++) {
+      if (current->levels[l][p]) continue;
+      pages.emplace_back(new Slot[PAGE]);
+      for (uint i = 0; i < PAGE; i++) pages.back()[i].store(pack({}));
+      current->levels[l][p] = pages.back().get();
+    }
+  }
+  // Publishes the pages
+  reservedPages.store(needed, std::memory_order_release);
+}
+
+PeakPyramid::Slot *PeakPyramid::find(uint level, uint64_t idx) const {
+  uint pagesIn = levelPages(level, reservedPages.load(std::memory_order_acquire));
+  uint64_t page = idx / PAGE;
+  if (page >= pagesIn) return nullptr;
+  return &table.load(std::memory_order_acquire)->levels[level][page][idx % PAGE];
+}
+
+PeakPyramid::Peak PeakPyramid::block(uint64_t idx) const {
+  auto *slot = find(0, idx);
+  return slot ? unpack(slot->load()) : Peak();
+}
+
+void PeakPyramid::setBlock(uint64_t idx, Peak peak) {
+  if (auto *slot = find(0, idx)) slot->store(pack(peak));
+}
+
+void PeakPyramid::update(TapeTime from, const float *data, uint n) {
+  if (from < 0 || n == 0) return;
+  TapeTime to = from + n;
+  for (TapeTime b = from / BLOCK * BLOCK; b < to; b += BLOCK) {
+    auto *slot = find(0, b / BLOCK);
+    if (slot == nullptr) break;
+    TapeTime in = std::max(b, from), out = std::min<TapeTime>(b + BLOCK, to);
+    Peak peak = {data[in - from], data[in - from]};
+    for (TapeTime t = in; t < out; t++) {
+      peak.add(data[t - from]);
+    }
+    if (in == b && out == b + BLOCK) {
+      slot->store(pack(peak));
+    } else {
+      uint64_t old = slot->load();
+      Peak grown;
+      do {
+        grown = unpack(old);
+        grown.add(peak);
+      } while (!slot->compare_exchange_weak(old, pack(grown)));
+    }
+  }
+  propagate({from, to});
+}
+
+std::vector<PeakPyramid::Peak> PeakPyramid::snapshot(TapeTime from, uint n) const {
+  std::vector<Peak> res;
+  for (uint64_t b = from / BLOCK; b < uint64_t(from + n + BLOCK - 1) / BLOCK; b++) {
+    res.push_back(block(b));
+  }
+  return res;
+}
+
+void PeakPyramid::rebuild(TapeTime from, const float *data, uint n,
+  const std::vector<Peak> &before) {
+  for (uint i = 0; i < before.size() && (i + 1) * BLOCK <= n; i++) {
+    auto *slot = find(0, from / BLOCK + i);
+    if (slot == nullptr) break;
+    const float *block = data + i * BLOCK;
+    Peak peak = {block[0], block[0]};
+    for (uint f = 1; f < BLOCK; f++) peak.add(block[f]);
+    uint64_t expected = pack(before[i]);
+    slot->compare_exchange_strong(expected, pack(peak));
+  }
+  propagate({from, from + TapeTime(n)});
+}
+
+/**
+ * Each parent is recomputed until no other thread changed it meanwhile,
+ * so the last one to write it has seen all of its children.
+ */
+void PeakPyramid::propagate(Section<TapeTime> section) {
+  if (section.size() <= 0) return;
+  uint64_t first = std::max<TapeTime>(section.in, 0) / BLOCK;
+  uint64_t last = (section.out - 1) / BLOCK;
+  for (uint level = 1; level < LEVELS; level++) {
+    first /= FANOUT;
+    last /= FANOUT;
+    for (uint64_t i = first; i <= last; i++) {
+      auto *slot = find(level, i);
+      if (slot == nullptr) break;
+      uint64_t old = slot->load();
+      Peak peak;
+      do {
+        peak = Peak();
+        for (uint c = 0; c < FANOUT; c++) {
+          auto *child = find(level - 1, i * FANOUT + c);
+          if (child == nullptr) break;
+          if (c == 0) peak = unpack(child->load());
+          else peak.add(unpack(child->load()));
+        }
+      } while (!slot->compare_exchange_strong(old, pack(peak)));
+    }
+  }
+  markChanged(section);
+}
+
+void PeakPyramid::clear(Section<TapeTime> section) {
+  if (section.size() <= 0) return;
+  uint64_t first = std::max<TapeTime>(section.in, 0) / BLOCK;
+  uint64_t last = (section.out - 1) / BLOCK;
+  for (uint64_t i = first; i <= last; i++) {
+    setBlock(i, {});
+  }
+  propagate(section);
+}
+
+PeakPyramid::Peak PeakPyramid::peak(Section<TapeTime> section) const {
+  Peak res;
+  if (section.size() <= 0 || section.out <= 0) return res;
+  // The coarsest level with at least one peak per section
+  uint level = 0;
+  while (level + 1 < LEVELS && span(level + 1) <= section.size()) level++;
+  TapeTime s = span(level);
+  uint64_t first = std::max<TapeTime>(section.in, 0) / s;
+  uint64_t last = (section.out - 1) / s;
+  for (uint64_t i = first; i <= last; i++) {
+    auto *slot = find(level, i);
+    if (slot == nullptr) break;
+    Peak p = unpack(slot->load());
+    if (i == first) res = p;
+    else res.add(p);
+  }
+  return res;
+}
+
+void PeakPyramid::markChanged(Section<TapeTime> section) {
+  // Nothing is stored past MAX_BLOCKS, so both fit in 32 bits
+  uint64_t in = std::min<uint64_t>(std::max<TapeTime>(section.in, 0) / BLOCK,
+    MAX_BLOCKS);
+  uint64_t out = std::min<uint64_t>((section.out + BLOCK - 1) / BLOCK,
+    MAX_BLOCKS);
+  uint64_t old = changed.load();
+  uint64_t next;
+  do {
+    next = old == 0 ? (in << 32 | out)
+      : (std::min(in, old >> 32) << 32 | std::max(out, old & 0xFFFFFFFF));
+  } while (next != old && !changed.compare_exchange_weak(old, next));
+}
+
+Section<TapeTime> PeakPyramid::takeChanged() {
+  uint64_t c = changed.exchange(0);
+  return {TapeTime(c >> 32) * TapeTime(BLOCK), TapeTime(c & 0xFFFFFFFF) * TapeTime(BLOCK)};
+}
+
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../utils.h"
+#include "edit-list.h"
+
+namespace top1 {
+
+/**
+ * Min/max overview of one track, at several resolutions.
+ *
+ * Level 0 holds one peak per `BLOCK` frames, each level above holds one
+ * peak per `FANOUT` peaks of the level below. Any section can then be
+ * summed up from a handful of peaks, so drawing a waveform takes time
+ * proportional to the pixels, whatever the zoom.
+ *
+ * The peaks are stored in pages that never move once allocated, so the
+ * UI can read while the other threads update. Pages are only allocated by
+ * `reserve`, which is not realtime safe. Updates past the reserved frames
+ * are dropped. The table of pages grows with them, up to `MAX_BLOCKS`.
+ *
+ * The audio thread `update`s the peaks of what it records, the disk thread
+ * `rebuild`s them from the file. Each peak is a single atomic, so a
+ * rebuild can tell when the audio thread got there first.
+ */
+class PeakPyramid {
+public:
+
+  struct Peak {
+    float min = 0;
+    float max = 0;
+
+    void add(float f) {
+      min = std::min(min, f);
+      max = std::max(max, f);
+    }
+
+    void add(Peak p) {
+      min = std::min(min, p.min);
+      max = std::max(max, p.max);
+    }
+  };
+
+  /** Frames per level 0 peak */
+  static constexpr uint BLOCK = 256;
+  /** Peaks per peak of the level above */
+  static constexpr uint FANOUT = 4;
+  static constexpr uint LEVELS = 8;
+  /** Peaks per page */
+  static constexpr uint PAGE = 4096;
+  /**
+   * Level 0 peaks, `2^40` frames. Blocks are counted in 32 bits, like
+   * in the peaks file, whole pages of them.
+   */
+  static constexpr uint64_t MAX_BLOCKS = (uint64_t(1) << 32) - PAGE;
+
+  PeakPyramid();
+
+  /** Frames covered by `n` peaks of `level` */
+  static TapeTime span(uint level) {
+    TapeTime s = BLOCK;
+    for (uint l = 0; l < level; l++) s *= FANOUT;
+    return s;
+  }
+
+  /** Allocate the pages for the frames before `frames` */
+  void reserve(TapeTime frames);
+
+  /** Frames the peaks are allocated for */
+  TapeTime reserved() const {
+    return TapeTime(reservedPages.load(std::memory_order_acquire)) * PAGE * BLOCK;
+  }
+
+  /**
+   * Update the peaks from `n` frames starting at `from`.
+   *
+   * Blocks completely inside are recomputed, the others can only grow, as
+   * the rest of their frames is not known. Realtime safe.
+   */
+  void update(TapeTime from, const float *data, uint n);
+
+  /** The level 0 peaks of `[from, from + n)`, to `rebuild` them later */
+  std::vector<Peak> snapshot(TapeTime from, uint n) const;
+
+  /**
+   * Like `update`, for whole blocks, but blocks that changed since
+   * `before` was taken are left alone. They were updated from newer data
+   * than `data`.
+   */
+  void rebuild(TapeTime from, const float *data, uint n,
+    const std::vector<Peak> &before);
+
+  /** Set `section` to silence */
+  void clear(Section<TapeTime> section);
+
+  /** The peak of `section`, possibly including a little around it */
+  Peak peak(Section<TapeTime> section) const;
+
+  /** The level 0 peak at `idx`, silence if not reserved */
+  Peak block(uint64_t idx) const;
+
+  /**
+   * Set a level 0 peak, e.g. when loading them. The levels above are
+   * updated by `propagate`.
+   */
+  void setBlock(uint64_t idx, Peak peak);
+
+  /** Recompute the levels above 0 for `section` */
+  void propagate(Section<TapeTime> section);
+
+  /**
+   * The frames updated since the last call, block aligned.
+   * Empty if there are none.
+   */
+  Section<TapeTime> takeChanged();
+
+private:
+  using Slot = std::atomic<uint64_t>;
+  using Page = std::unique_ptr<Slot[]>;
+
+  /**
+   * The pages of each level, null past the reserved ones. Reserving
+   * fills them in, or publishes a larger table when they are full.
+   */
+  struct Table {
+    std::vector<Slot *> levels[LEVELS];
+  };
+
+  std::atomic<Table *> table;
+  /** Level 0 pages reserved, the others follow */
+  std::atomic_uint reservedPages = {0};
+
+  /** Each table published, as readers may still use the older ones */
+  std::vector<std::unique_ptr<Table>> tables;
+  std::vector<Page> pages;
+  std::mutex reserving;
+
+  /** Block indices `[in, out)` changed, packed to be updated at once */
+  std::atomic<uint64_t> changed = {0};
+
+  Slot *find(uint level, uint64_t idx) const;
+  void markChanged(Section<TapeTime> section);
+
+  static uint64_t pack(Peak peak);
+  static Peak unpack(uint64_t bits);
+};
+
+}
@@ -0,0 +1,60 @@
+#include "prefetch-policy.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace top1 {
+
+/****************************************/
+/* PrefetchPolicy Implementation        */
+/****************************************/
+
+constexpr float PrefetchPolicy::SPOOL_SPEED;
+
+const char *PrefetchPolicy::modeName(Mode mode) {
+  switch (mode) {
+  case STOPPED: return "stopped";
+  case PLAYING: return "playing";
+  case SPOOLING: return "spooling";
+  default: return "";
+  }
+}
+
+PrefetchPolicy::Mode PrefetchPolicy::mode(float speed, float next) {
+  // Speeding up or slowing down, the faster one counts
+  float rate = std::max(std::abs(speed), std::abs(next));
+  if (rate == 0) return STOPPED;
+  if (rate > SPOOL_SPEED) return SPOOLING;
+  return PLAYING;
+}
+
+PrefetchPolicy::Plan PrefetchPolicy::plan(float speed, float next, int size,
+  int minRead) {
+  Plan plan;
+  plan.mode = mode(speed, next);
+  int ahead, behind;
+  switch (plan.mode) {
+  case STOPPED:
+    ahead = size / 4;
+    behind = size / 8;
+    plan.minRead = minRead;
+    break;
+  case PLAYING:
+    ahead = size * 5 / 8;
+    behind = size / 4;
+    plan.minRead = minRead * 2;
+    break;
+  default: {
+    float rate = std::max(std::abs(speed), std::abs(next));
+    plan.minRead = std::min(size / 8, minRead * 4 * int(std::ceil(rate)));
+    behind = size / 16;
+    ahead = size - behind - plan.minRead;
+  }
+  }
+  plan.bwFirst = backwards(speed, next);
+  plan.fw = plan.bwFirst ? behind : ahead;
+  plan.bw = plan.bwFirst ? ahead : behind;
+  return plan;
+}
+
+}
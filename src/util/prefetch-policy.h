@@ -0,0 +1,65 @@
+#pragma once
+
+#include "typedefs.h"
+
+namespace top1 {
+
+/**
+ * How much of the tape the disk thread keeps loaded around the playpoint,
+ * from how fast and which way the tape moves.
+ *
+ * Stopped, a little each way is enough to start playing. Playing, most of
+ * the ring is loaded ahead, with some left behind for short rewinds.
+ * Spooling, frames go several times as fast, so nearly all of the ring is
+ * loaded ahead, in reads that grow with the speed.
+ *
+ * Either side always keeps at least a sixteenth of the ring, so frames are
+ * only evicted that far from the playpoint.
+ */
+struct PrefetchPolicy {
+
+  enum Mode {
+    STOPPED,
+    PLAYING,
+    SPOOLING,
+    MODES
+  };
+
+  /** Faster than this, the tape is spooling */
+  static constexpr float SPOOL_SPEED = 1.5;
+
+  static const char *modeName(Mode mode);
+
+  struct Plan {
+    Mode mode = STOPPED;
+    /** Frames to keep loaded forwards and backwards of the playpoint */
+    int fw = 0;
+    int bw = 0;
+    /**
+     * A side is extended once this many frames are missing from it, so
+     * reads are at least this large
+     */
+    int minRead = 0;
+    /** Load the backwards side first, as the tape is moving that way */
+    bool bwFirst = false;
+  };
+
+  /**
+   * @param speed the speed the tape moves at, negative backwards
+   * @param next the speed it is heading for
+   */
+  static Mode mode(float speed, float next);
+
+  /** Whether the tape is heading backwards, or was while it slows down */
+  static bool backwards(float speed, float next) {
+    return next < 0 || (next == 0 && speed < 0);
+  }
+
+  /**
+   * @param size the frames of a ring
+   * @param minRead the smallest read, when stopped
+   */
+  static Plan plan(float speed, float next, int size, int minRead);
+};
+
+}
@@ -0,0 +1,69 @@
+#include "resampler.h"
+
+namespace top1 {
+namespace resampling {
+
+/** Modified Bessel function of the first kind, order 0 */
+static double besselI0(double x) {
+  double sum = 1, term = 1;
+  for (int k = 1; k < 50 && term > 1e-12 * sum; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+static Kernel makeKernel(uint zeroCrossings, double beta) {
+  Kernel kernel;
+  kernel.zeroCrossings = zeroCrossings;
+  uint length = zeroCrossings * Kernel::RESOLUTION;
+  // Padded with zeros, for interpolating at the very end
+  kernel.table.assign(length + 2, 0.f);
+  for (uint i = 0; i < length; i++) {
+    double t = double(i) / Kernel::RESOLUTION;
+    double x = t / zeroCrossings;
+    double window = besselI0(beta * std::sqrt(1 - x * x)) / besselI0(beta);
+    double sinc = i == 0 ? 1 : std::sin(M_PI * t) / (M_PI * t);
+    kernel.table[i] = sinc * window;
+  }
+  return kernel;
+}
+
+const Kernel &kernel(Quality quality) {
+  static const Kernel low = makeKernel(4, 5);
+  static const Kernel medium = makeKernel(8, 7);
+  static const Kernel high = makeKernel(MAX_ZERO_CROSSINGS, 9);
+  switch (quality) {
+  case Quality::LOW: return low;
+  case Quality::HIGH: return high;
+  default: return medium;
+  }
+}
+
+template<uint Channels>
+void filter(const Kernel &kernel, const float *history, double time, float cutoff,
+  float *out) {
+  float width = kernel.zeroCrossings / cutoff;
+  long from = std::ceil(time - width);
+  long to = std::floor(time + width);
+  float acc[Channels] = {0};
+  float sum = 0;
+  for (long k = from; k <= to; k++) {
+    float w = kernel((time - k) * cutoff);
+    const float *in = history + k * Channels;
+    for (uint ch = 0; ch < Channels; ch++) {
+      acc[ch] += w * in[ch];
+    }
+    sum += w;
+  }
+  // Normalized, so DC passes unchanged whatever the phase
+  for (uint ch = 0; ch < Channels; ch++) {
+    out[ch] = acc[ch] / sum;
+  }
+}
+
+template void filter<1>(const Kernel &, const float *, double, float, float *);
+template void filter<4>(const Kernel &, const float *, double, float, float *);
+
+}
+}
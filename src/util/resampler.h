@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+namespace top1 {
+
+namespace resampling {
+
+enum class Quality {
+  /** 4 point Hermite, no anti-aliasing. Cheap, for spooling */
+  CUBIC,
+  /** Windowed sinc, 4 zero crossings each side */
+  LOW,
+  /** Windowed sinc, 8 zero crossings each side */
+  MEDIUM,
+  /** Windowed sinc, 16 zero crossings each side */
+  HIGH
+};
+
+/**
+ * One side of a Kaiser windowed sinc, sampled `RESOLUTION` times per zero
+ * crossing. Intermediate points are interpolated linearly.
+ */
+struct Kernel {
+  static constexpr uint RESOLUTION = 512;
+
+  uint zeroCrossings = 0;
+  std::vector<float> table;
+
+  /** @param t distance in zero crossings, `|t| <= zeroCrossings` */
+  float operator()(float t) const {
+    float pos = std::abs(t) * RESOLUTION;
+    uint idx = pos;
+    float frac = pos - idx;
+    return table[idx] + frac * (table[idx + 1] - table[idx]);
+  }
+};
+
+/**
+ * The kernel for `quality`, which has to be a sinc quality.
+ * Built on first use, so call it once outside of the audio thread.
+ */
+const Kernel &kernel(Quality quality);
+
+/** Highest zero crossing count of the sinc qualities */
+constexpr uint MAX_ZERO_CROSSINGS = 16;
+
+/** The cutoff is this far below the Nyquist frequency of the slower side */
+constexpr float ROLLOFF = 0.95f;
+
+/**
+ * One output frame of `Channels` interleaved floats, filtered from the
+ * frames of `history` around `time` with `kernel` scaled by `cutoff`.
+ *
+ * The inner loop of the sinc qualities, run for every frame the tape
+ * plays. Instantiated for 1 and 4 channels in resampler.cpp, which is
+ * built with -O3 whatever the build type.
+ */
+template<uint Channels>
+void filter(const Kernel &kernel, const float *history, double time, float cutoff,
+  float *out);
+
+}
+
+/**
+ * Streaming sample rate converter for varispeed.
+ *
+ * Input is pushed in, and output pulled out at `step` input frames per
+ * output frame, which may change between pulls. The fractional position
+ * is kept between pulls, so blocks join seamlessly. Frames are
+ * `Channels` interleaved floats, and all channels are filtered together.
+ *
+ * When downsampling (`step > 1`), the sinc kernel is widened to cut off
+ * below the new Nyquist frequency. At `step == 1` on a whole frame, the
+ * input is copied as is.
+ *
+ * The stream has no direction, to play backwards push the frames in the
+ * order they are played, and `reset` when turning around.
+ *
+ * Realtime safe once constructed, as long as less than `maxInput` frames
+ * are pushed between pulls.
+ */
+template<uint Channels>
+class Resampler {
+public:
+  using Quality = resampling::Quality;
+
+  Quality quality;
+
+  /**
+   * @param maxStep the widest step the filter is widened for. Higher
+   *   steps work, but alias.
+   * @param maxInput frames pushed between two pulls at most
+   */
+  Resampler(Quality quality = Quality::MEDIUM, float maxStep = 8,
+    uint maxInput = 65536) :
+    quality (quality),
+    maxStep (maxStep),
+    past (resampling::MAX_ZERO_CROSSINGS * maxStep / resampling::ROLLOFF + 2) {
+    if (quality != Quality::CUBIC) resampling::kernel(quality);
+    history.reserve((2 * past + maxInput) * Channels);
+    reset();
+  }
+
+  /** Forget the input, and start over on the next pushed frame */
+  void reset() {
+    history.assign(past * Channels, 0.f);
+    time = past;
+  }
+
+  /** Frames to push before `nframes` can be pulled at `step` */
+  uint needed(uint nframes, float step) const {
+    double last = time + (nframes - 1) * double(step);
+    long required = long(last) + reach(step) + 1;
+    return std::max(0l, required - long(size()));
+  }
+
+  void push(const float *in, uint nframes) {
+    history.insert(history.end(), in, in + nframes * Channels);
+  }
+
+  /**
+   * Produce up to `nframes` frames, as many as the pushed input allows.
+   * @return the number of frames produced
+   */
+  uint pull(float *out, uint nframes, float step) {
+    const uint reach = this->reach(step);
+    uint n = 0;
+    if (step == 1 && time == std::floor(time)) {
+      // Nothing to interpolate
+      long from = time;
+      n = std::max<long>(0, std::min<long>(nframes, long(size()) - from));
+      std::copy(frame(from), frame(from + n), out);
+      time += n;
+    } else if (quality == Quality::CUBIC) {
+      for (; n < nframes && long(time) + reach < long(size()); n++) {
+        cubic(out + n * Channels);
+        time += step;
+      }
+    } else {
+      auto &kernel = resampling::kernel(quality);
+      float cutoff = resampling::ROLLOFF / std::min(std::max(step, 1.f), maxStep);
+      for (; n < nframes && long(time) + reach < long(size()); n++) {
+        sinc(out + n * Channels, kernel, cutoff);
+        time += step;
+      }
+    }
+    // Keep what the widest kernel may still look back at
+    long drop = long(time) - long(past);
+    if (drop > 0) {
+      history.erase(history.begin(), history.begin() + drop * Channels);
+      time -= drop;
+    }
+    return n;
+  }
+
+  /**
+   * Input frames pushed ahead of the next output frame. That much of the
+   * input has not been heard yet.
+   */
+  double latency() const {
+    return size() - time;
+  }
+
+private:
+  float maxStep;
+  /** Frames kept before the current position */
+  uint past;
+  std::vector<float> history;
+  /** Position of the next output frame in `history`, in frames */
+  double time = 0;
+
+  std::size_t size() const {
+    return history.size() / Channels;
+  }
+
+  const float *frame(long idx) const {
+    return history.data() + idx * Channels;
+  }
+
+  /** Frames needed after the current position */
+  uint reach(float step) const {
+    if (quality == Quality::CUBIC) return 2;
+    float cutoff = resampling::ROLLOFF / std::min(std::max(step, 1.f), maxStep);
+    return std::ceil(resampling::kernel(quality).zeroCrossings / cutoff) + 1;
+  }
+
+  void cubic(float *out) const {
+    long i = time;
+    float t = time - i;
+    const float *a = frame(i - 1), *b = frame(i), *c = frame(i + 1), *d = frame(i + 2);
+    for (uint ch = 0; ch < Channels; ch++) {
+      float c1 = 0.5f * (c[ch] - a[ch]);
+      float c2 = a[ch] - 2.5f * b[ch] + 2 * c[ch] - 0.5f * d[ch];
+      float c3 = 0.5f * (d[ch] - a[ch]) + 1.5f * (b[ch] - c[ch]);
+      out[ch] = ((c3 * t + c2) * t + c1) * t + b[ch];
+    }
+  }
+
+  void sinc(float *out, const resampling::Kernel &kernel, float cutoff) const {
+    resampling::filter<Channels>(kernel, history.data(), time, cutoff, out);
+  }
+};
+
+}
@@ -0,0 +1,164 @@
+#include "sample-conversion.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include <fmt/format.h>
+#include <plog/Log.h>
+
+#include "resampler.h"
+#include "sndfile.h"
+
+namespace top1 {
+
+/****************************************/
+/* SampleConversion Implementation      */
+/****************************************/
+
+constexpr uint SampleConversion::BLOCK;
+
+SampleConversion::~SampleConversion() {
+  cancel();
+  wait();
+}
+
+bool SampleConversion::start(const std::string &newPath, uint newSamplerate,
+  Callback newDone) {
+  cancel();
+  wait();
+  SndFile<1> file;
+  file.readOnly = true;
+  file.open(newPath);
+  if (file.error.log()) return false;
+  if (file.samplerate == 0 || newSamplerate == 0) return false;
+  if (file.samplerate == newSamplerate) return false;
+
+  path = newPath;
+  samplerate = newSamplerate;
+  done = std::move(newDone);
+  copyPath.clear();
+  cancelled = false;
+  ready = false;
+  active = true;
+  thread = std::thread([this] {
+      run();
+      active.store(false, std::memory_order_release);
+    });
+  return true;
+}
+
+void SampleConversion::cancel() {
+  cancelled = true;
+}
+
+bool SampleConversion::wait() {
+  if (thread.joinable()) thread.join();
+  return ready;
+}
+
+std::string SampleConversion::cachePath(const std::string &path, uint64_t hash,
+  uint samplerate) {
+  return fmt::format("{}.{:016x}.{}.resampled", path, hash, samplerate);
+}
+
+uint64_t SampleConversion::hash(const std::string &path,
+  const std::atomic_bool *cancelled) {
+  std::ifstream in (path, std::ios::binary);
+  if (!in) return 0;
+  uint64_t h = 14695981039346656037ull;
+  std::vector<char> block (1 << 16);
+  while (in.read(block.data(), block.size()) || in.gcount() > 0) {
+    if (cancelled && *cancelled) return 0;
+    for (std::streamsize i = 0; i < in.gcount(); i++) {
+      h ^= uint8_t(block[i]);
+      h *= 1099511628211ull;
+    }
+  }
+  return h;
+}
+
+void SampleConversion::run() {
+  uint64_t h = hash(path, &cancelled);
+  if (h == 0 || cancelled) return;
+  std::string to = cachePath(path, h, samplerate);
+  {
+    SndFile<1> cached;
+    cached.readOnly = true;
+    cached.open(to);
+    if (!cached.error && cached.samplerate == samplerate
+      && cached.size() > 0) {
+      LOGD << "Found '" << to << "'";
+      copyPath = to;
+    }
+  }
+  if (copyPath.empty()) {
+    if (!convert(to)) return;
+    copyPath = to;
+  }
+  ready = true;
+  if (done && !cancelled) done(copyPath);
+}
+
+bool SampleConversion::convert(const std::string &to) {
+  SndFile<1> in;
+  in.readOnly = true;
+  in.open(path);
+  if (in.error.log()) return false;
+  const std::size_t size = in.size();
+  const std::size_t length = std::ceil(size * double(samplerate) / in.samplerate);
+  const float step = float(in.samplerate) / samplerate;
+
+  const std::string part = to + ".part";
+  std::remove(part.c_str());
+  bool ok = true;
+  {
+    SndFile<1> out;
+    out.open(part);
+    out.samplerate = samplerate;
+
+    Resampler<1> resampler {Resampler<1>::Quality::HIGH, std::max(8.f, step), BLOCK};
+    std::vector<float> block (BLOCK);
+    std::vector<float> converted (std::ceil(BLOCK / step) + 1);
+    std::size_t written = 0;
+    auto store = [&] () {
+      while (uint n = resampler.pull(converted.data(), converted.size(), step)) {
+        n = std::min<std::size_t>(n, length - written);
+        if (n == 0) return;
+        if (out.write(converted.data(), n) != n) {
+          ok = false;
+          return;
+        }
+        written += n;
+      }
+    };
+    in.seek(0);
+    while (ok && !cancelled) {
+      uint n = in.read(block.data(), BLOCK);
+      if (n == 0) break;
+      resampler.push(block.data(), n);
+      store();
+    }
+    // The end of the sample is still in the filter
+    std::fill(block.begin(), block.end(), 0.f);
+    while (ok && !cancelled && written < length) {
+      resampler.push(block.data(), BLOCK);
+      store();
+    }
+    if (!cancelled) ok = ok && written == length;
+  }
+  if (!ok || cancelled) {
+    if (!ok) LOGE << "Couldn't convert '" << path << "' to " << samplerate << " Hz";
+    std::remove(part.c_str());
+    return false;
+  }
+  if (std::rename(part.c_str(), to.c_str()) != 0) {
+    LOGE << "Couldn't write '" << to << "'";
+    std::remove(part.c_str());
+    return false;
+  }
+  LOGI << "Converted '" << path << "' to " << samplerate << " Hz";
+  return true;
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "typedefs.h"
+
+namespace top1 {
+
+/**
+ * Converts a sample to another sample rate, in the background.
+ *
+ * The sample is mixed down to mono and resampled at the highest quality,
+ * once. The copy is cached next to it, at `cachePath`, named after a hash
+ * of the sample's contents and the rate. Converting the same sample to
+ * the same rate again finds the copy, even if the sample was moved or
+ * touched. The copy is written under a temporary name and renamed when
+ * complete, so a cached copy is always whole.
+ *
+ * The copies are never removed, one per sample and rate it was played
+ * at. Deleting the `.resampled` files next to the samples is safe, they
+ * are made again when needed.
+ *
+ * Like Import, `start` returns right away, and `done` is called from the
+ * background thread with the path of the copy.
+ */
+class SampleConversion {
+public:
+
+  /** Frames read from the sample at once */
+  static constexpr uint BLOCK = 1 << 16;
+
+  using Callback = std::function<void(const std::string &copy)>;
+
+  SampleConversion() {}
+  ~SampleConversion();
+
+  SampleConversion(SampleConversion&) = delete;
+  SampleConversion(SampleConversion&&) = delete;
+
+  /**
+   * Start converting `path` to `samplerate`.
+   * Any conversion running is cancelled first.
+   * @param done called when the copy is ready, not if it failed or was cancelled
+   * @return false if the sample can't be read, or is at `samplerate` already
+   */
+  bool start(const std::string &path, uint samplerate, Callback done = nullptr);
+
+  void cancel();
+
+  /**
+   * Wait for the conversion to finish.
+   * @return whether the copy is ready
+   */
+  bool wait();
+
+  bool running() const {
+    return active.load(std::memory_order_acquire);
+  }
+
+  /** The copy, once ready */
+  const std::string &copy() const { return copyPath; }
+
+  /** Where the copy of a sample hashed `hash` at `samplerate` goes */
+  static std::string cachePath(const std::string &path, uint64_t hash, uint samplerate);
+
+  /**
+   * FNV-1a hash of the bytes of `path`, 0 if it can't be read.
+   * @param cancelled checked between blocks, 0 is returned once it is set
+   */
+  static uint64_t hash(const std::string &path,
+    const std::atomic_bool *cancelled = nullptr);
+
+private:
+  std::string path;
+  uint samplerate = 0;
+  Callback done;
+  std::string copyPath;
+
+  std::thread thread;
+  std::atomic_bool active = {false};
+  std::atomic_bool cancelled = {false};
+  std::atomic_bool ready = {false};
+
+  void run();
+  bool convert(const std::string &to);
+};
+
+}
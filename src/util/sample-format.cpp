@@ -0,0 +1,200 @@
+#include "sample-format.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace top1 {
+namespace sampleformat {
+
+SampleFormat fromWav(uint16_t audioFormat, uint16_t bitsPerSample) {
+  const uint16_t PCM = 1, FLOAT = 3;
+  if (audioFormat == PCM) {
+    switch (bitsPerSample) {
+    case 16: return SampleFormat::PCM16;
+    case 24: return SampleFormat::PCM24;
+    case 32: return SampleFormat::PCM32;
+    }
+  } else if (audioFormat == FLOAT) {
+    switch (bitsPerSample) {
+    case 32: return SampleFormat::FLOAT32;
+    case 64: return SampleFormat::FLOAT64;
+    }
+  }
+  return SampleFormat::UNKNOWN;
+}
+
+uint bytes(SampleFormat format) {
+  switch (format) {
+  case SampleFormat::PCM16: return 2;
+  case SampleFormat::PCM24: return 3;
+  case SampleFormat::PCM32: return 4;
+  case SampleFormat::FLOAT32: return 4;
+  case SampleFormat::FLOAT64: return 8;
+  default: return 0;
+  }
+}
+
+const char *name(SampleFormat format) {
+  switch (format) {
+  case SampleFormat::PCM16: return "16 bit";
+  case SampleFormat::PCM24: return "24 bit";
+  case SampleFormat::PCM32: return "32 bit";
+  case SampleFormat::FLOAT32: return "32 bit float";
+  case SampleFormat::FLOAT64: return "64 bit float";
+  default: return "unknown";
+  }
+}
+
+namespace {
+
+/** Samples of type `T`, scaled by `scale`. The copy keeps it unaligned safe */
+template<typename T>
+void convert(const char *src, float *dst, std::size_t n, float scale) {
+  for (std::size_t i = 0; i < n; i++) {
+    T sample;
+    std::memcpy(&sample, src + i * sizeof(T), sizeof(T));
+    dst[i] = sample * scale;
+  }
+}
+
+}
+
+void toFloat(SampleFormat format, const char *src, float *dst, std::size_t nsamples) {
+  switch (format) {
+  case SampleFormat::PCM16:
+    convert<int16_t>(src, dst, nsamples, 1.f / 32768);
+    break;
+  case SampleFormat::PCM24: {
+    auto bytes = reinterpret_cast<const uint8_t *>(src);
+    for (std::size_t i = 0; i < nsamples; i++) {
+      // In the top three bytes of an int32
+      int32_t sample = uint32_t(bytes[3 * i]) << 8
+        | uint32_t(bytes[3 * i + 1]) << 16
+        | uint32_t(bytes[3 * i + 2]) << 24;
+      dst[i] = sample * (1.f / 2147483648.f);
+    }
+    break;
+  }
+  case SampleFormat::PCM32:
+    convert<int32_t>(src, dst, nsamples, 1.f / 2147483648.f);
+    break;
+  case SampleFormat::FLOAT32:
+    std::memcpy(dst, src, nsamples * sizeof(float));
+    break;
+  case SampleFormat::FLOAT64:
+    convert<double>(src, dst, nsamples, 1.f);
+    break;
+  default:
+    std::fill(dst, dst + nsamples, 0.f);
+  }
+}
+
+namespace {
+
+/**
+ * `x`, already clipped, rounded half away from zero. Unlike std::lrint
+ * this isn't a call per sample, so the loops using it are vectorized.
+ */
+inline int32_t roundClipped(float x) {
+  return int32_t(x + std::copysign(0.5f, x));
+}
+
+/** Floats as integers of type `T`, at `scale` */
+template<typename T>
+void convertBack(const float *src, char *dst, std::size_t n, float scale) {
+  for (std::size_t i = 0; i < n; i++) {
+    float clipped = std::min(std::max(src[i] * scale, -scale), scale - 1);
+    T sample = roundClipped(clipped);
+    std::memcpy(dst + i * sizeof(T), &sample, sizeof(T));
+  }
+}
+
+}
+
+void fromFloat(SampleFormat format, const float *src, char *dst, std::size_t nsamples) {
+  switch (format) {
+  case SampleFormat::PCM16:
+    convertBack<int16_t>(src, dst, nsamples, 32768.f);
+    break;
+  case SampleFormat::PCM24: {
+    auto bytes = reinterpret_cast<uint8_t *>(dst);
+    const float scale = 8388608.f;
+    for (std::size_t i = 0; i < nsamples; i++) {
+      float clipped = std::min(std::max(src[i] * scale, -scale), scale - 1);
+      int32_t sample = roundClipped(clipped);
+      bytes[3 * i] = sample;
+      bytes[3 * i + 1] = sample >> 8;
+      bytes[3 * i + 2] = sample >> 16;
+    }
+    break;
+  }
+  case SampleFormat::PCM32:
+    // Floats can't hold 2^31 - 1, stay clear of it
+    convertBack<int32_t>(src, dst, nsamples, 2147483520.f);
+    break;
+  case SampleFormat::FLOAT32:
+    std::memcpy(dst, src, nsamples * sizeof(float));
+    break;
+  case SampleFormat::FLOAT64:
+    for (std::size_t i = 0; i < nsamples; i++) {
+      double sample = src[i];
+      std::memcpy(dst + i * sizeof(double), &sample, sizeof(double));
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void toMono(const float *src, uint channels, int channel, float *dst,
+  std::size_t nframes) {
+  if (channel >= 0) {
+    for (std::size_t i = 0; i < nframes; i++) {
+      dst[i] = src[i * channels + channel];
+    }
+    return;
+  }
+  switch (channels) {
+  case 1:
+    std::copy(src, src + nframes, dst);
+    break;
+  case 2:
+    for (std::size_t i = 0; i < nframes; i++) {
+      dst[i] = 0.5f * (src[2 * i] + src[2 * i + 1]);
+    }
+    break;
+  default: {
+    const float gain = 1.f / channels;
+    for (std::size_t i = 0; i < nframes; i++) {
+      float sum = 0;
+      for (uint c = 0; c < channels; c++) sum += src[i * channels + c];
+      dst[i] = sum * gain;
+    }
+  }
+  }
+}
+
+void remap(const float *src, uint srcChannels, float *dst, uint dstChannels,
+  int channel, std::size_t nframes) {
+  if (dstChannels == 1) {
+    toMono(src, srcChannels, channel, dst, nframes);
+    return;
+  }
+  if (srcChannels == 1 || channel >= 0) {
+    uint from = channel >= 0 ? channel : 0;
+    for (std::size_t i = 0; i < nframes; i++) {
+      float sample = src[i * srcChannels + from];
+      for (uint c = 0; c < dstChannels; c++) dst[i * dstChannels + c] = sample;
+    }
+    return;
+  }
+  for (std::size_t i = 0; i < nframes; i++) {
+    for (uint c = 0; c < dstChannels; c++) {
+      dst[i * dstChannels + c] = src[i * srcChannels + c % srcChannels];
+    }
+  }
+}
+
+}
+}
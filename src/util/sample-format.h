@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+
+#include "typedefs.h"
+
+namespace top1 {
+
+/** How the samples of a sound file are stored */
+enum class SampleFormat {
+  UNKNOWN,
+  PCM16,
+  PCM24,
+  PCM32,
+  FLOAT32,
+  FLOAT64
+};
+
+/**
+ * Converting samples as stored in files to floats and back.
+ *
+ * The kernels are plain loops over whole blocks, with no calls or
+ * branches per sample. sample-format.cpp is built optimized whatever the
+ * build type, and all but the 24 bit loops are vectorized, see the
+ * benchmark in tests/util/sample-format.cpp.
+ */
+namespace sampleformat {
+
+/** The format of a WAV's `fmt ` chunk, UNKNOWN if it isn't supported */
+SampleFormat fromWav(uint16_t audioFormat, uint16_t bitsPerSample);
+
+/** Bytes per sample */
+uint bytes(SampleFormat format);
+
+const char *name(SampleFormat format);
+
+/**
+ * Convert `nsamples` samples from `src` to floats in `dst`.
+ * Integers are scaled to `[-1, 1)`. Little endian, like WAVs.
+ */
+void toFloat(SampleFormat format, const char *src, float *dst, std::size_t nsamples);
+
+/**
+ * Convert `nsamples` floats to samples in `format`, clipped to `[-1, 1]`
+ * for the integer formats.
+ */
+void fromFloat(SampleFormat format, const float *src, char *dst, std::size_t nsamples);
+
+/**
+ * Turn `nframes` interleaved frames of `channels` samples into mono.
+ * @param channel the channel to take, or -1 to mix them all down
+ *   at equal gain
+ */
+void toMono(const float *src, uint channels, int channel, float *dst,
+  std::size_t nframes);
+
+/**
+ * Turn `nframes` frames of `srcChannels` samples into `dstChannels`.
+ *
+ * To mono, see toMono. From mono, the sample goes to every channel. From
+ * more channels, the first ones are taken. From fewer, they repeat.
+ * @param channel if 0 or more, every channel is this one of the source
+ */
+void remap(const float *src, uint srcChannels, float *dst, uint dstChannels,
+  int channel, std::size_t nframes);
+
+}
+}
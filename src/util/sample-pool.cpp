@@ -0,0 +1,124 @@
+#include "sample-pool.h"
+
+#include <algorithm>
+#include <sys/stat.h>
+#include <plog/Log.h>
+
+#include "sndfile.h"
+
+namespace top1 {
+
+/****************************************/
+/* SamplePool Implementation            */
+/****************************************/
+
+constexpr std::size_t SamplePool::BUDGET;
+
+SamplePool::Buffer SamplePool::get(const std::string &path, std::size_t maxFrames) {
+  int64_t time = mtime(path);
+  if (time < 0) {
+    LOGE << "Couldn't find sample '" << path << "'";
+    return nullptr;
+  }
+  Key key {path, time, maxFrames};
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    auto found = index.find(key);
+    if (found != index.end()) {
+      entries.splice(entries.begin(), entries, found->second);
+      return found->second->buffer;
+    }
+  }
+
+  // Decoded outside the lock, others may use the pool meanwhile
+  Buffer buffer = load(path, time, maxFrames);
+  if (!buffer) return nullptr;
+
+  std::vector<Buffer> evicted;
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    auto found = index.find(key);
+    // Someone else was quicker
+    if (found != index.end()) {
+      entries.splice(entries.begin(), entries, found->second);
+      return found->second->buffer;
+    }
+    std::size_t bytes = buffer->frames.size() * sizeof(float);
+    entries.push_front({key, buffer, bytes});
+    index[key] = entries.begin();
+    usedBytes += bytes;
+    evicted = evict(budgetBytes);
+  }
+  return buffer;
+}
+
+bool SamplePool::current(const Buffer &buffer) {
+  return buffer && mtime(buffer->path) == buffer->mtime;
+}
+
+int64_t SamplePool::mtime(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return -1;
+  return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+void SamplePool::budget(std::size_t bytes) {
+  std::vector<Buffer> evicted;
+  std::lock_guard<std::mutex> guard (lock);
+  budgetBytes = bytes;
+  evicted = evict(budgetBytes);
+}
+
+std::size_t SamplePool::used() const {
+  std::lock_guard<std::mutex> guard (lock);
+  return usedBytes;
+}
+
+std::size_t SamplePool::size() const {
+  std::lock_guard<std::mutex> guard (lock);
+  return entries.size();
+}
+
+void SamplePool::purge() {
+  std::vector<Buffer> evicted;
+  std::lock_guard<std::mutex> guard (lock);
+  evicted = evict(0);
+}
+
+SamplePool::Buffer SamplePool::load(const std::string &path, int64_t time,
+  std::size_t maxFrames) {
+  SndFile<1> file;
+  file.readOnly = true;
+  file.open(path);
+  if (file.error.log()) return nullptr;
+  if (file.fileFormat() == SampleFormat::UNKNOWN || file.fileChannels() == 0) {
+    LOGE << "Can't load '" << path << "', its format isn't supported";
+    return nullptr;
+  }
+  auto sample = std::make_shared<Sample>();
+  sample->path = path;
+  sample->mtime = time;
+  sample->samplerate = file.samplerate;
+  sample->fileSize = file.size();
+  sample->frames.resize(std::min(maxFrames, sample->fileSize));
+  file.seek(0);
+  sample->frames.resize(file.read(sample->frames.data(), sample->frames.size()));
+  LOGD << "Pooled " << sample->frames.size() << " frames of '" << path << "'";
+  return sample;
+}
+
+std::vector<SamplePool::Buffer> SamplePool::evict(std::size_t limit) {
+  std::vector<Buffer> evicted;
+  for (auto it = entries.end(); it != entries.begin() && usedBytes > limit;) {
+    --it;
+    // Held by someone
+    if (it->buffer.use_count() > 1) continue;
+    evicted.push_back(std::move(it->buffer));
+    usedBytes -= it->bytes;
+    index.erase(it->key);
+    it = entries.erase(it);
+  }
+  return evicted;
+}
+
+}
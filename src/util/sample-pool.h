@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "typedefs.h"
+
+namespace top1 {
+
+/**
+ * Decoded samples, shared by everything playing them.
+ *
+ * A sample is decoded once, mixed down to mono, and handed out as an
+ * immutable buffer to everyone asking for the same file. It is keyed by
+ * its path and modification time, so a changed file is decoded again.
+ *
+ * Buffers no one holds stay pooled, so switching back to a module or
+ * reloading a project finds them ready. Once the pool is over its memory
+ * budget, the least recently used of those are freed.
+ *
+ * Buffers are only ever freed by the thread asking for or dropping them,
+ * never the audio thread, which only reads through raw pointers handed to
+ * it by their holders, see SampleStream.
+ */
+class SamplePool {
+public:
+
+  /** Bytes of unused buffers kept by default */
+  static constexpr std::size_t BUDGET = std::size_t(256) << 20;
+
+  struct Sample {
+    std::string path;
+    int64_t mtime = 0;
+    uint samplerate = 44100;
+    /** Frames in the file, which may be more than were decoded */
+    std::size_t fileSize = 0;
+    /** The decoded frames, from the start of the file */
+    std::vector<float> frames;
+  };
+
+  using Buffer = std::shared_ptr<const Sample>;
+
+  SamplePool(std::size_t budget = BUDGET) : budgetBytes (budget) {}
+
+  SamplePool(SamplePool&) = delete;
+  SamplePool(SamplePool&&) = delete;
+
+  /**
+   * The first `maxFrames` frames of `path`, decoded if they aren't pooled.
+   * @return nullptr if the file can't be read
+   */
+  Buffer get(const std::string &path, std::size_t maxFrames);
+
+  /** Whether `buffer` is still what its file holds */
+  static bool current(const Buffer &buffer);
+
+  /** The modification time of `path` in nanoseconds, -1 if there is none */
+  static int64_t mtime(const std::string &path);
+
+  std::size_t budget() const { return budgetBytes; }
+  /** Change the budget, freeing what is over it */
+  void budget(std::size_t bytes);
+
+  /** Bytes of all pooled buffers, used or not */
+  std::size_t used() const;
+  /** Number of pooled buffers */
+  std::size_t size() const;
+
+  /** Free every unused buffer */
+  void purge();
+
+private:
+  using Key = std::tuple<std::string, int64_t, std::size_t>;
+
+  struct Entry {
+    Key key;
+    Buffer buffer;
+    std::size_t bytes;
+  };
+
+  mutable std::mutex lock;
+  std::size_t budgetBytes;
+  std::size_t usedBytes = 0;
+  /** Most recently used first */
+  std::list<Entry> entries;
+  std::map<Key, std::list<Entry>::iterator> index;
+
+  static Buffer load(const std::string &path, int64_t mtime, std::size_t maxFrames);
+
+  /**
+   * Take unused buffers out of the pool, least recently used first, until
+   * it holds `limit` bytes. They are freed by the caller, outside the lock.
+   */
+  std::vector<Buffer> evict(std::size_t limit);
+};
+
+}
@@ -0,0 +1,368 @@
+#include "sample-stream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <plog/Log.h>
+
+namespace top1 {
+
+/****************************************/
+/* SampleStream Implementation          */
+/****************************************/
+
+constexpr uint SampleStream::RING;
+constexpr uint SampleStream::CHUNK;
+constexpr uint SampleStream::HEAD_MS;
+constexpr std::size_t SampleStream::NO_END;
+
+SampleStream::SampleStream(SamplePool &pool, uint nvoices) : pool (pool) {
+  for (uint v = 0; v < nvoices; v++) {
+    voices.push_back(std::make_unique<Voice>());
+    voices.back()->ring.resize(RING);
+  }
+}
+
+SampleStream::~SampleStream() {
+  close();
+}
+
+bool SampleStream::open(const std::string &path, uint newHeadMs) {
+  close();
+  headMs = newHeadMs;
+  if (!load(path, true)) return false;
+  convert(outputRate);
+  return true;
+}
+
+bool SampleStream::current(const std::string &path) const {
+  return !sourcePath.empty() && sourcePath == path
+    && SamplePool::mtime(path) == sourceMtime;
+}
+
+void SampleStream::close() {
+  conversion.cancel();
+  conversion.wait();
+  {
+    std::lock_guard<std::mutex> lock (convertedLock);
+    convertedPath.clear();
+  }
+  stopReader();
+  SamplePool::Buffer old;
+  {
+    std::lock_guard<std::mutex> lock (sampleLock);
+    for (auto &voice : voices) voice->active = false;
+    old = std::move(buffer);
+    head = nullptr;
+    headFrames = 0;
+    length = 0;
+  }
+  file = nullptr;
+  sourcePath.clear();
+  sourceLength = 0;
+}
+
+void SampleStream::output(uint samplerate) {
+  outputRate = samplerate;
+}
+
+void SampleStream::update() {
+  uint samplerate = outputRate;
+  if (samplerate != convertRate) convert(samplerate);
+  std::string copy;
+  {
+    std::lock_guard<std::mutex> lock (convertedLock);
+    copy = std::move(convertedPath);
+    convertedPath.clear();
+  }
+  if (!copy.empty()) swap(copy);
+}
+
+void SampleStream::convert(uint samplerate) {
+  convertRate = samplerate;
+  conversion.cancel();
+  conversion.wait();
+  {
+    std::lock_guard<std::mutex> lock (convertedLock);
+    convertedPath.clear();
+  }
+  if (sourcePath.empty() || samplerate == 0 || samplerate == rate) return;
+  if (samplerate == sourceRate) {
+    swap(sourcePath);
+    return;
+  }
+  // Called on the conversion's thread, `update` swaps the copy in
+  conversion.start(sourcePath, samplerate, [this] (const std::string &copy) {
+      std::lock_guard<std::mutex> lock (convertedLock);
+      convertedPath = copy;
+    });
+}
+
+void SampleStream::swap(const std::string &path) {
+  if (load(path, false)) {
+    LOGD << "Playing '" << path << "' at " << rate.load() << " Hz";
+  }
+}
+
+bool SampleStream::load(const std::string &path, bool source) {
+  auto newFile = std::make_unique<SndFile<1>>();
+  newFile->readOnly = true;
+  newFile->open(path);
+  if (newFile->error.log()) return false;
+  if (newFile->fileFormat() == SampleFormat::UNKNOWN || newFile->fileChannels() == 0) {
+    LOGE << "Can't play '" << path << "', its format isn't supported";
+    return false;
+  }
+  auto newBuffer = pool.get(path, std::size_t(newFile->samplerate) * headMs / 1000);
+  if (!newBuffer) return false;
+  if (source) {
+    sourcePath = path;
+    sourceMtime = newBuffer->mtime;
+    sourceLength = newBuffer->fileSize;
+    sourceRate = newBuffer->samplerate;
+  }
+
+  stopReader();
+  SamplePool::Buffer old;
+  {
+    std::lock_guard<std::mutex> lock (sampleLock);
+    old = std::move(buffer);
+    buffer = newBuffer;
+    head = buffer->frames.data();
+    headFrames = buffer->frames.size();
+    length = buffer->fileSize;
+    rate = buffer->samplerate;
+    scale = double(rate) / sourceRate;
+  }
+  file = std::move(newFile);
+  if (length > headFrames) startReader();
+  return true;
+}
+
+void SampleStream::start(uint v, Region region) {
+  if (v >= voices.size()) return;
+  Voice &voice = *voices[v];
+  if (region.length <= 0) {
+    voice.active = false;
+    return;
+  }
+  // In frames of the file played
+  const double s = scale.load(std::memory_order_relaxed);
+  const int length = std::max(1l, std::lround(region.length * s));
+  voice.scale = s;
+  voice.in.store(std::lround(region.in * s), std::memory_order_relaxed);
+  voice.length.store(length, std::memory_order_relaxed);
+  voice.fwd.store(region.fwd, std::memory_order_relaxed);
+  voice.end.store(region.loop ? NO_END : length, std::memory_order_relaxed);
+  voice.position = 0;
+  voice.played.store(0, std::memory_order_relaxed);
+  voice.generation.fetch_add(1, std::memory_order_release);
+  voice.active.store(true, std::memory_order_release);
+  wake.post();
+}
+
+void SampleStream::stop(uint v) {
+  if (v < voices.size()) voices[v]->active = false;
+}
+
+void SampleStream::release(uint v) {
+  if (v >= voices.size()) return;
+  Voice &voice = *voices[v];
+  std::size_t len = voice.length.load(std::memory_order_relaxed);
+  if (len == 0) return;
+  std::size_t lapEnd = (std::size_t(voice.position) / len + 1) * len;
+  voice.end.store(std::min(voice.end.load(), lapEnd));
+}
+
+bool SampleStream::play(uint v, float *dst, uint nframes, float speed) {
+  if (v >= voices.size()) return false;
+  Voice &voice = *voices[v];
+  if (!voice.active.load(std::memory_order_acquire)) return false;
+  const uint out = outputRate.load(std::memory_order_relaxed);
+  std::unique_lock<std::mutex> lock (sampleLock, std::try_to_lock);
+  if (!lock) {
+    // A copy is being swapped in. Keep time, in silence
+    const double step = out > 0 ? speed * double(rate) / out : speed;
+    voice.position += nframes * step;
+    underrunFrames.fetch_add(nframes, std::memory_order_relaxed);
+    voice.played.store(std::size_t(voice.position), std::memory_order_release);
+    if (std::size_t(voice.position) >= voice.end.load(std::memory_order_relaxed)) {
+      voice.active = false;
+      return false;
+    }
+    return true;
+  }
+
+  // Swapped for a copy at another rate
+  const double s = scale.load(std::memory_order_relaxed);
+  if (s != voice.scale) rescale(voice, s);
+  const double step = out > 0 ? speed * double(rate) / out : speed;
+
+  const int in = voice.in.load(std::memory_order_relaxed);
+  const int len = voice.length.load(std::memory_order_relaxed);
+  const bool fwd = voice.fwd.load(std::memory_order_relaxed);
+  const std::size_t end = voice.end.load(std::memory_order_relaxed);
+  const bool ready = voice.readyGen.load(std::memory_order_acquire)
+    == voice.generation.load(std::memory_order_relaxed);
+  const std::size_t lo = voice.lo.load(std::memory_order_acquire);
+  const std::size_t hi = voice.hi.load(std::memory_order_acquire);
+  const float *ring = voice.ring.data();
+
+  std::size_t missed = 0;
+  for (uint i = 0; i < nframes; i++) {
+    std::size_t k = voice.position;
+    if (k >= end) break;
+    std::size_t f = frame(in, len, fwd, k);
+    if (f < headFrames) {
+      dst[i] += head[f];
+    } else if (f >= length) {
+      // Past the end of the sample
+    } else if (ready && k >= lo && k < hi) {
+      dst[i] += ring[k & (RING - 1)];
+    } else {
+      missed++;
+    }
+    voice.position += step;
+  }
+  if (missed > 0) underrunFrames.fetch_add(missed, std::memory_order_relaxed);
+  // The reader may overwrite what is behind this
+  const std::size_t played = voice.position;
+  voice.played.store(played, std::memory_order_release);
+  // Wake the reader once a chunk of the ring can be refilled
+  if (std::size_t(in + len) > headFrames && hi < end && hi + CHUNK <= played + RING) {
+    wake.post();
+  }
+  if (std::size_t(voice.position) >= end) {
+    voice.active = false;
+    return false;
+  }
+  return true;
+}
+
+void SampleStream::rescale(Voice &voice, double newScale) {
+  const double ratio = newScale / voice.scale;
+  voice.scale = newScale;
+  voice.in.store(std::lround(voice.in.load() * ratio), std::memory_order_relaxed);
+  voice.length.store(std::max(1l, std::lround(voice.length.load() * ratio)),
+    std::memory_order_relaxed);
+  std::size_t end = voice.end.load();
+  if (end != NO_END) voice.end.store(std::llround(end * ratio), std::memory_order_relaxed);
+  voice.position *= ratio;
+  voice.played.store(std::size_t(voice.position), std::memory_order_relaxed);
+  // The reader starts over
+  voice.generation.fetch_add(1, std::memory_order_release);
+  wake.post();
+}
+
+float SampleStream::offset(uint v) const {
+  if (v >= voices.size()) return 0;
+  const Voice &voice = *voices[v];
+  int len = voice.length.load(std::memory_order_relaxed);
+  if (len <= 0) return 0;
+  double off = std::fmod(voice.position, len);
+  if (!voice.fwd.load(std::memory_order_relaxed)) off = len - 1 - off;
+  return off / voice.scale;
+}
+
+std::size_t SampleStream::buffered(uint v) const {
+  if (v >= voices.size()) return 0;
+  const Voice &voice = *voices[v];
+  if (voice.readyGen.load(std::memory_order_acquire) != voice.generation.load()) return 0;
+  std::size_t played = voice.played.load(std::memory_order_acquire);
+  std::size_t hi = voice.hi.load(std::memory_order_acquire);
+  return hi > played ? hi - played : 0;
+}
+
+void SampleStream::startReader() {
+  running = true;
+  reader = std::thread([this] { read(); });
+}
+
+void SampleStream::stopReader() {
+  running = false;
+  wake.post();
+  if (reader.joinable()) reader.join();
+}
+
+void SampleStream::read() {
+  while (running) {
+    bool busy = false;
+    for (auto &v : voices) {
+      Voice &voice = *v;
+      if (!voice.active.load(std::memory_order_acquire)) continue;
+      uint gen = voice.generation.load(std::memory_order_acquire);
+      const int in = voice.in.load(std::memory_order_relaxed);
+      const int len = voice.length.load(std::memory_order_relaxed);
+      const bool fwd = voice.fwd.load(std::memory_order_relaxed);
+      // Restarted while reading the region
+      if (voice.generation.load(std::memory_order_acquire) != gen) continue;
+      // All of it is in memory
+      if (in < 0 || len <= 0 || std::size_t(in + len) <= headFrames) continue;
+
+      if (voice.readyGen.load(std::memory_order_relaxed) != gen) {
+        // Frames in memory needn't be streamed
+        std::size_t from = 0;
+        if (fwd && std::size_t(in) < headFrames) {
+          from = std::min<std::size_t>(headFrames - in, len);
+        }
+        voice.lo.store(from, std::memory_order_relaxed);
+        voice.hi.store(from, std::memory_order_relaxed);
+        voice.readyGen.store(gen, std::memory_order_release);
+      }
+
+      std::size_t played = voice.played.load(std::memory_order_acquire);
+      std::size_t hi = voice.hi.load(std::memory_order_relaxed);
+      // Fallen behind, catch up with the voice
+      if (hi < played) {
+        voice.lo.store(played, std::memory_order_release);
+        voice.hi.store(played, std::memory_order_release);
+        hi = played;
+      }
+      std::size_t target = std::min(voice.end.load(std::memory_order_relaxed),
+        played + RING);
+      if (hi >= target) continue;
+      uint n = std::min<std::size_t>(CHUNK, target - hi);
+      fill(voice, hi, n);
+      voice.hi.store(hi + n, std::memory_order_release);
+      busy = true;
+    }
+    // Until a voice starts, or has played a chunk
+    if (!busy) wake.wait();
+  }
+}
+
+void SampleStream::fill(Voice &voice, std::size_t from, uint nframes) {
+  const int in = voice.in.load(std::memory_order_relaxed);
+  const int len = voice.length.load(std::memory_order_relaxed);
+  const bool fwd = voice.fwd.load(std::memory_order_relaxed);
+  float *ring = voice.ring.data();
+  // In runs that neither wrap around the ring nor the region
+  while (nframes > 0) {
+    std::size_t off = from % len;
+    uint run = std::min<std::size_t>(nframes, len - off);
+    run = std::min<std::size_t>(run, RING - (from & (RING - 1)));
+    float *dst = ring + (from & (RING - 1));
+    if (fwd) {
+      readFrames(in + off, run, dst);
+    } else {
+      readFrames(in + len - off - run, run, dst);
+      std::reverse(dst, dst + run);
+    }
+    from += run;
+    nframes -= run;
+  }
+}
+
+void SampleStream::readFrames(std::size_t from, uint nframes, float *dst) {
+  uint done = 0;
+  if (from < headFrames) {
+    done = std::min<std::size_t>(nframes, headFrames - from);
+    std::copy(head + from, head + from + done, dst);
+  }
+  if (done < nframes && from + done < length) {
+    file->seek(from + done);
+    done += file->read(dst + done, nframes - done);
+  }
+  std::fill(dst + done, dst + nframes, 0.f);
+}
+
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sample-conversion.h"
+#include "sample-pool.h"
+#include "semaphore.h"
+#include "sndfile.h"
+
+namespace top1 {
+
+/**
+ * A sample played straight from the disk.
+ *
+ * The first `headMs` milliseconds of the sample stay in memory, so a voice
+ * starting there sounds at once. They come from a SamplePool, shared with
+ * everything else playing the same file. The rest is streamed into a ring per
+ * voice by a background reader, which keeps each ring filled ahead of its
+ * voice. Memory stays bounded by the head and the rings, however long the
+ * sample is.
+ *
+ * A voice plays a region of the sample, forwards or backwards, and maybe
+ * looped. The rings hold the region in the order it is played, laps of a
+ * loop one after the other, so the reader never has to guess where a voice
+ * jumps to. The region of a voice is fixed when it is started.
+ *
+ * Frames the reader hasn't caught up with yet play as silence, and are
+ * counted in `underruns`. This only happens for voices starting outside
+ * the head, or a reader starved of disk time. So do the frames played
+ * while a copy at another rate is swapped in. The reader sleeps until a
+ * voice starts, or has played a chunk of its ring.
+ *
+ * Given the rate it plays at, see `output`, a sample at another rate is
+ * converted to it by a SampleConversion, and the copy swapped in by
+ * `update` when ready. Voices playing carry on from the same place in the
+ * copy. Until then, the sample is sped up or down. Regions and offsets
+ * are in frames of the sample either way.
+ */
+class SampleStream {
+public:
+
+  /** Frames in each voice's ring. A power of two */
+  static constexpr uint RING = 1 << 16;
+  /** Frames read at once */
+  static constexpr uint CHUNK = 1 << 12;
+  /** Milliseconds kept in memory by default */
+  static constexpr uint HEAD_MS = 500;
+
+  /** What a voice plays, in frames of the sample */
+  struct Region {
+    int in = 0;
+    int length = 0;
+    bool fwd = true;
+    bool loop = false;
+  };
+
+  SampleStream(SamplePool &pool, uint voices);
+  ~SampleStream();
+
+  SampleStream(SampleStream&) = delete;
+  SampleStream(SampleStream&&) = delete;
+
+  // UI thread
+
+  /**
+   * Open `path`, in any format SndFile reads, mixed down to mono.
+   * The voices are stopped, and the previous sample closed.
+   * @return false if it can't be read. The stream is empty then.
+   */
+  bool open(const std::string &path, uint headMs = HEAD_MS);
+
+  /** Whether `path` is open, as it is now on the disk */
+  bool current(const std::string &path) const;
+
+  void close();
+
+  /**
+   * Start converting to the output rate, or swap in the copy once it is
+   * converted. Call it regularly, e.g. before drawing each frame.
+   */
+  void update();
+
+  /**
+   * Play at `samplerate` from now on. The sample is converted to it in the
+   * background if it is at another rate, from the next `update`.
+   * Any thread, it only stores the rate.
+   */
+  void output(uint samplerate);
+
+  /** Whether a copy converted to the output rate is played */
+  bool converted() const { return rate != sourceRate; }
+
+  /** Frames in the sample, at its own rate */
+  std::size_t size() const { return sourceLength; }
+  uint samplerate() const { return sourceRate; }
+  /** Frames kept in memory */
+  std::size_t headSize() const { return headFrames; }
+
+  /** Frames played as silence, waiting for the reader or a swap */
+  std::size_t underruns() const { return underrunFrames.load(); }
+
+  // Audio thread. Realtime safe, they never allocate or block.
+
+  /** Start `voice` at the beginning of `region` */
+  void start(uint voice, Region region);
+
+  void stop(uint voice);
+
+  /**
+   * End the loop of `voice` after its current lap, the voice then plays to
+   * the end of its region.
+   */
+  void release(uint voice);
+
+  /**
+   * Add `nframes` frames of `voice` to `dst`, at `speed` times the pitch
+   * of the sample. At 1, a converted sample is read frame by frame.
+   * @return false once the voice has played to its end, or is stopped
+   */
+  bool play(uint voice, float *dst, uint nframes, float speed);
+
+  /** Frame of the sample `voice` is at, relative to its region's in */
+  float offset(uint voice) const;
+
+  /** Frames streamed ahead of `voice`, ready to play */
+  std::size_t buffered(uint voice) const;
+
+private:
+
+  struct Voice {
+    // Written by the audio thread, a start bumps the generation last
+    std::atomic_int in = {0};
+    std::atomic_int length = {0};
+    std::atomic_bool fwd = {true};
+    std::atomic<std::size_t> end = {0};
+    std::atomic_uint generation = {0};
+    std::atomic_bool active = {false};
+    /** The frame of the region played last, counting laps */
+    std::atomic<std::size_t> played = {0};
+    /** Exact position of `played`. Audio thread */
+    double position = 0;
+    /** The `scale` the region is in. Audio thread */
+    double scale = 1;
+
+    // Written by the reader
+    /** The generation `ring` holds, and which frames of it */
+    std::atomic_uint readyGen = {0};
+    std::atomic<std::size_t> lo = {0};
+    std::atomic<std::size_t> hi = {0};
+    std::vector<float> ring;
+  };
+
+  static constexpr std::size_t NO_END = std::numeric_limits<std::size_t>::max();
+
+  std::vector<std::unique_ptr<Voice>> voices;
+
+  SamplePool &pool;
+  /** Held by the UI thread while opening, tried by the audio thread */
+  std::mutex sampleLock;
+  SamplePool::Buffer buffer;
+  const float *head = nullptr;
+  std::size_t headFrames = 0;
+  /** Frames in the file played, and its rate */
+  std::size_t length = 0;
+  std::atomic_uint rate = {44100};
+  /** Frames of the file played per frame of the sample */
+  std::atomic<double> scale = {1};
+  std::atomic_uint outputRate = {0};
+
+  std::string sourcePath;
+  int64_t sourceMtime = 0;
+  std::size_t sourceLength = 0;
+  uint sourceRate = 44100;
+  uint headMs = HEAD_MS;
+  SampleConversion conversion;
+  /** The rate converted to, or being converted to */
+  uint convertRate = 0;
+  /** A copy converted to `convertRate`, waiting for `update` */
+  std::string convertedPath;
+  std::mutex convertedLock;
+  std::atomic<std::size_t> underrunFrames = {0};
+
+  /** Reader thread */
+  std::unique_ptr<SndFile<1>> file;
+  std::thread reader;
+  std::atomic_bool running = {false};
+  Semaphore wake;
+
+  void read();
+  void fill(Voice &voice, std::size_t from, uint nframes);
+  void readFrames(std::size_t from, uint nframes, float *dst);
+  void startReader();
+  void stopReader();
+
+  /**
+   * Play `path` from now on, the sample itself if `source`, otherwise a
+   * copy of it at another rate.
+   */
+  bool load(const std::string &path, bool source);
+
+  /** Play `path`, a copy of the sample at another rate, from now on */
+  void swap(const std::string &path);
+
+  /** Cancel any conversion, and start the one to `samplerate` */
+  void convert(uint samplerate);
+
+  /** Move the region and position of `voice` to `newScale`. Audio thread */
+  void rescale(Voice &voice, double newScale);
+
+  /** The frame of the sample at `k` in a region, counting laps */
+  static std::size_t frame(int in, int length, bool fwd, std::size_t k) {
+    std::size_t off = k % length;
+    return fwd ? in + off : in + length - 1 - off;
+  }
+};
+
+}
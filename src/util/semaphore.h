@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <semaphore.h>
+
+namespace top1 {
+
+/**
+ * Thin wrapper around a POSIX semaphore.
+ *
+ * Unlike a condition variable, posting needs no mutex and only enters the
+ * kernel (futex wake) when the other side is actually waiting, so it is
+ * safe to post from the audio thread.
+ */
+class Semaphore {
+  sem_t sem;
+public:
+
+  Semaphore(unsigned int init = 0) {
+    sem_init(&sem, 0, init);
+  }
+
+  ~Semaphore() {
+    sem_destroy(&sem);
+  }
+
+  Semaphore(Semaphore&) = delete;
+  Semaphore(Semaphore&&) = delete;
+
+  void post() {
+    sem_post(&sem);
+  }
+
+  void wait() {
+    while (sem_wait(&sem) == -1 && errno == EINTR);
+  }
+
+  /**
+   * @return true if the semaphore was decremented
+   */
+  bool tryWait() {
+    return sem_trywait(&sem) == 0;
+  }
+
+  /**
+   * Wait at most `timeout`.
+   * @return true if the semaphore was decremented
+   */
+  template<typename Rep, typename Period>
+  bool waitFor(std::chrono::duration<Rep, Period> timeout) {
+    // sem_timedwait takes an absolute CLOCK_REALTIME time
+    auto deadline = std::chrono::system_clock::now() + timeout;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      deadline.time_since_epoch()).count();
+    timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (sem_timedwait(&sem, &ts) == -1) {
+      if (errno != EINTR) return false;
+    }
+    return true;
+  }
+};
+
+}
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <type_traits>
+#include <vector>
 
 #include "top1file.h"
+#include "mapped-file.h"
+#include "sample-format.h"
 
 namespace top1 {
 
@@ -16,6 +21,45 @@ protected:
     WavHeader() : Chunk("RIFF") {
       addField(format);
     }
+
+    /** Past 4 GB, the file is an RF64 */
+    bool matches(const Chunk &chunk) const override {
+      return chunk.id == ChunkFCC("RIFF") || chunk.id == ChunkFCC("RF64");
+    }
+  };
+
+  /**
+   * The sizes of an RF64 file, which don't fit the chunks' 32 bits.
+   *
+   * Files start out as plain WAVs, with this chunk as `JUNK` in its place.
+   * Once they grow past 4 GB it is renamed `ds64`, the file `RF64`, and
+   * the 32 bit sizes are all set to `0xFFFFFFFF`. See EBU Tech 3306.
+   */
+  struct Ds64Chunk : public Chunk {
+    uint64_t riffSize = 0;
+    uint64_t dataSize = 0;
+    uint64_t sampleCount = 0;
+    u4b tableLength = 0;
+
+    /** Set for files made without it, it is then never written */
+    bool absent = false;
+
+    Ds64Chunk() : Chunk("JUNK") {
+      addField(riffSize);
+      addField(dataSize);
+      addField(sampleCount);
+      addField(tableLength);
+    }
+
+    bool matches(const Chunk &chunk) const override {
+      if (chunk.id == ChunkFCC("ds64")) return true;
+      // Only our own JUNK, there may be others
+      return chunk.id == ChunkFCC("JUNK") && chunk.size == size;
+    }
+
+    void write(File *file) override {
+      if (!absent) Chunk::write(file);
+    }
   };
 
   struct WavFmt : public Chunk {
@@ -35,6 +79,21 @@ protected:
       addField(bitsPerSample);
       addField(cbSize);
     };
+
+    /** Files written by others often leave out `cbSize` */
+    u4b minSize() const override {
+      return 16;
+    }
+
+    void read(File *file) override {
+      Chunk::read(file);
+      // WAVE_FORMAT_EXTENSIBLE, the format is in the sub format GUID
+      if (audioFormat == 0xFFFE && size >= 40) {
+        file->fseek(offset + 8 + 24);
+        audioFormat = file->readBytes<u2b>();
+        file->fseek(offset + 8 + size);
+      }
+    }
   };
 
   struct AudioChunk : public Chunk {
@@ -42,9 +101,13 @@ protected:
   };
 
   WavHeader wavHeader;
+  Ds64Chunk ds64;
   WavFmt wavFmt;
   AudioChunk audioChunk;
 
+  /** Largest size in a chunk header, larger ones go in `ds64` */
+  static constexpr uint64_t MAX_CHUNK_SIZE = 0xFFFFFFFF;
+
 public:
 
   struct AudioFrame {
@@ -68,32 +131,168 @@ public:
 
   const static uint channels = _channels;
 
-  BasicSndFile() : File() {
-    setupChunks();
-    wavHeader.subChunk(wavFmt);
-    wavHeader.subChunk(audioChunk);
-    addChunk(wavHeader);
-  }
+  BasicSndFile() : File() {}
 
   BasicSndFile(std::string path) : BasicSndFile() {
     open(path);
   }
 
-  virtual ~BasicSndFile() {}
+  virtual ~BasicSndFile() {
+    // The chunks are gone by the time ~File runs
+    close();
+  }
 
   BasicSndFile(BasicSndFile&) = delete;
   BasicSndFile(BasicSndFile&&) = delete;
 
-  void seek(uint pos) {
-    fseek(audioChunk.offset + 8 + pos * AudioFrame::size);
+  /**
+   * Access the audio data through a memory mapping instead of the stream.
+   * Set before opening. If the file can't be mapped, the stream is used.
+   */
+  bool useMmap = true;
+
+  bool mapped() const {
+    return mappedAudio.isOpen();
+  }
+
+  /**
+   * When reading a file with more channels than `channels` into mono,
+   * take this one, or -1 to mix them all down. See sampleformat::remap
+   */
+  int readChannel = -1;
+
+  /** Frames read and converted at once, for files in another format */
+  static constexpr uint BLOCK = 1 << 14;
+
+  void seek(std::size_t pos) {
+    if (mapped()) {
+      cursor = pos;
+      return;
+    }
+    fseek(dataOffset() + pos * frameSize());
   }
 
   std::size_t position() {
-    return (rpos() - audioChunk.offset - 8) / AudioFrame::size;
+    if (mapped()) return cursor;
+    return (rpos() - dataOffset()) / frameSize();
   }
 
+  /** Frames in the file */
   std::size_t size() const {
-    return audioChunk.size / AudioFrame::size;
+    return ds64.dataSize / frameSize();
+  }
+
+  /** How the file stores its samples, which may not be `sample_type` */
+  SampleFormat fileFormat() const {
+    return sampleformat::fromWav(wavFmt.audioFormat, wavFmt.bitsPerSample);
+  }
+
+  /** Channels in the file, which may not be `channels` */
+  uint fileChannels() const {
+    return wavFmt.numChannels;
+  }
+
+  /** Bytes per frame in the file */
+  uint frameSize() const {
+    return wavFmt.blockAlign ? wavFmt.blockAlign : AudioFrame::size;
+  }
+
+  /**
+   * Whether the file stores frames exactly like `AudioFrame`, so they are
+   * read and written as they are. Otherwise they are converted.
+   */
+  bool native() const {
+    return fileChannels() == channels && frameSize() == AudioFrame::size
+      && fileFormat() == SampleFormat::FLOAT32 && std::is_same<sample_type, float>::value;
+  }
+
+  /**
+   * Read `[pos, pos + nframes)` as stored in the file, in one go.
+   * Frames are `fileChannels()` samples of `fileFormat()`.
+   * @return the number of frames read
+   */
+  uint readRaw(char *dst, std::size_t pos, uint nframes) {
+    uint n = pos < size() ? std::min<std::size_t>(nframes, size() - pos) : 0;
+    if (n == 0) return 0;
+    std::size_t from = dataOffset() + pos * frameSize();
+    if (mapped()) {
+      std::memcpy(dst, mappedAudio.data() + from, std::size_t(n) * frameSize());
+      return n;
+    }
+    fseek(from);
+    fileStream.read(dst, std::size_t(n) * frameSize());
+    n = fileStream.gcount() / frameSize();
+    fileStream.clear();
+    return n;
+  }
+
+  /**
+   * Write `[pos, pos + nframes)` as stored in the file, in one go.
+   * @return the number of frames written
+   */
+  uint writeRaw(const char *src, std::size_t pos, uint nframes) {
+    if (!canGrow(pos + nframes)) return 0;
+    std::size_t from = dataOffset() + pos * frameSize();
+    std::size_t bytes = std::size_t(nframes) * frameSize();
+    if (mapped()) {
+      if (!mappedAudio.reserve(from + bytes)) return 0;
+      std::memcpy(mappedAudio.data() + from, src, bytes);
+      mappedAudio.markDirty(from, from + bytes);
+    } else {
+      fseek(from);
+      fileStream.write(src, bytes);
+      if (!fileStream) {
+        LOGE << "Couldn't write to '" << path << "'";
+        fileStream.clear();
+        return 0;
+      }
+    }
+    growAudio((pos + nframes) * frameSize());
+    return nframes;
+  }
+
+  /** Whether the file is an RF64, having grown past 4 GB */
+  bool isRF64() const {
+    return wavHeader.id == ChunkFCC("RF64");
+  }
+
+  /**
+   * Make room for the `ds64` chunk in a file made without it, moving
+   * everything after the RIFF header.
+   * @return false if it couldn't
+   */
+  bool insertDs64() {
+    if (!ds64.absent || wavHeader.offset < 0) return true;
+    if (readOnly) return false;
+    std::size_t from = wavHeader.offset + 12;
+    std::size_t length = wavHeader.offset + 8 + ds64.riffSize - from;
+    std::size_t shift = 8 + ds64.size;
+    LOGI << "Making room for RF64 sizes in '" << path << "'";
+    if (mapped()) {
+      if (!mappedAudio.reserve(from + shift + length)) return false;
+      char *data = mappedAudio.data();
+      std::memmove(data + from + shift, data + from, length);
+      mappedAudio.markDirty(from, from + shift + length);
+    } else {
+      // Back to front, the ranges overlap
+      std::vector<char> block (1 << 20);
+      for (std::size_t done = 0; done < length;) {
+        std::size_t n = std::min(block.size(), length - done);
+        std::size_t pos = from + length - done - n;
+        fseek(pos);
+        readBytes(block.data(), n);
+        fseek(pos + shift);
+        writeBytes(block.data(), n);
+        done += n;
+      }
+    }
+    wavHeader.move(shift);
+    wavHeader.offset -= shift;
+    ds64.offset = from;
+    ds64.absent = false;
+    ds64.riffSize += shift;
+    writeFile();
+    return true;
   }
 
   uint read(AudioFrame* data, uint nframes) {
@@ -104,53 +303,259 @@ public:
     return write(reinterpret_cast<float *>(data), nframes);
   }
 
+  /**
+   * Read `nframes` frames of `channels` floats from the position on.
+   *
+   * Files in other formats are converted in `BLOCK` frame blocks, and
+   * their channels mapped to `channels`, see sampleformat::remap.
+   * @return the number of frames read
+   */
   uint read(float* data, uint nframes) {
-    uint framesRead = 0;
-    try {
-      for (uint i = 0; i < nframes; ++i) {
-        readBytes(data + i * channels, channels);
-        ++framesRead;
+    std::size_t pos = position();
+    if (native()) {
+      uint n = readRaw(reinterpret_cast<char *>(data), pos, nframes);
+      seek(pos + n);
+      return n;
+    }
+    SampleFormat format = fileFormat();
+    if (format == SampleFormat::UNKNOWN || fileChannels() == 0) {
+      LOGE << "Can't read '" << path << "', its format isn't supported";
+      return 0;
+    }
+    const uint fileCh = fileChannels();
+    rawBlock.resize(std::size_t(BLOCK) * frameSize());
+    if (fileCh != channels) convertedBlock.resize(std::size_t(BLOCK) * fileCh);
+    uint done = 0;
+    while (done < nframes) {
+      uint n = readRaw(rawBlock.data(), pos + done, std::min(BLOCK, nframes - done));
+      if (n == 0) break;
+      float *out = data + std::size_t(done) * channels;
+      if (fileCh == channels) {
+        sampleformat::toFloat(format, rawBlock.data(), out, n * channels);
+      } else {
+        sampleformat::toFloat(format, rawBlock.data(), convertedBlock.data(), n * fileCh);
+        sampleformat::remap(convertedBlock.data(), fileCh, out, channels, readChannel, n);
       }
-    } catch (ReadException e) {
-      if (e.type != e.END_OF_FILE) LOGE << e.message;
+      done += n;
     }
-    fseek(rpos());
-    return framesRead;
+    seek(pos + done);
+    return done;
   }
 
+  /**
+   * Write `nframes` frames of `channels` floats from the position on.
+   * Files in other formats are converted, if they have `channels` channels.
+   * @return the number of frames written
+   */
   uint write(float* data, uint nframes) {
-    uint framesWritten = 0;
-    try {
-      for (uint i = 0; i < nframes; ++i) {
-        writeBytes(data + i * channels, channels);
-        ++framesWritten;
-      }
-    } catch (ReadException e) {
-      if (e.type != e.END_OF_FILE) LOGE << e.message;
+    std::size_t pos = position();
+    if (native()) {
+      uint n = writeRaw(reinterpret_cast<const char *>(data), pos, nframes);
+      seek(pos + n);
+      return n;
+    }
+    SampleFormat format = fileFormat();
+    if (format == SampleFormat::UNKNOWN || fileChannels() != channels) {
+      LOGE << "Can't write to '" << path << "', its format isn't supported";
+      return 0;
     }
-    uint newSize = wpos() - audioChunk.offset - 8;
-    if (newSize > audioChunk.size) {
-      wavHeader.size += newSize - audioChunk.size;
-      audioChunk.size = newSize;
+    rawBlock.resize(std::size_t(BLOCK) * frameSize());
+    uint done = 0;
+    while (done < nframes) {
+      uint n = std::min(BLOCK, nframes - done);
+      sampleformat::fromFloat(format, data + std::size_t(done) * channels,
+        rawBlock.data(), n * channels);
+      n = writeRaw(rawBlock.data(), pos + done, n);
+      if (n == 0) break;
+      done += n;
     }
-    fseek(wpos());
-    return framesWritten;
+    seek(pos + done);
+    return done;
+  }
+
+  /**
+   * Start reading `[pos, pos + nframes)` in the background.
+   * Only does anything when mapped.
+   */
+  void prefetch(std::size_t pos, uint nframes) {
+    if (!mapped() || pos >= size()) return;
+    std::size_t n = std::min<std::size_t>(nframes, size() - pos);
+    std::size_t from = dataOffset() + pos * frameSize();
+    mappedAudio.prefetch(from, from + n * frameSize());
+  }
+
+  /**
+   * Free the disk space of `[pos, pos + nframes)`, which reads as silence
+   * afterwards. Only possible when mapped.
+   * @return false if the space couldn't be freed
+   */
+  bool discard(std::size_t pos, uint nframes) {
+    if (!mapped()) return false;
+    std::size_t from = dataOffset() + pos * frameSize();
+    return mappedAudio.discard(from, from + nframes * frameSize());
+  }
 
+  /**
+   * Schedule written audio to be written to disk.
+   * Only does anything when mapped, the stream is flushed with `flush()`.
+   */
+  void sync() {
+    mappedAudio.sync();
+  }
+
+  /** Whether the audio grew since the chunk sizes were written */
+  bool sizesChanged() const {
+    return ds64.dataSize != writtenSize;
+  }
+
+  /**
+   * Write the chunk sizes after the audio grew,
+   * without rewriting the rest of the header.
+   */
+  void writeSizes() {
+    updateSizes();
+    fseek(wavHeader.offset);
+    writeBytes(wavHeader.id);
+    writeBytes(wavHeader.size);
+    ds64.write(this);
+    fseek(audioChunk.offset + 4);
+    writeBytes(audioChunk.size);
+    fileStream.flush();
+    writtenSize = ds64.dataSize;
+  }
+
+  void writeFile() override {
+    updateSizes();
+    File::writeFile();
+    writtenSize = ds64.dataSize;
   }
 
   uint &samplerate = wavFmt.sampleRate;
 
   void open(std::string path) override {
+    if (chunks.empty()) {
+      // Not in the constructor, where setupChunks can't be overridden
+      wavHeader.subChunk(ds64);
+      wavHeader.subChunk(wavFmt);
+      setupChunks();
+      wavHeader.subChunk(audioChunk);
+      addChunk(wavHeader);
+    }
+    // The sizes of a new file
+    ds64.riffSize = wavHeader.size;
+    ds64.dataSize = audioChunk.size;
+    ds64.absent = false;
     File::open(path);
+    if (!fileStream.is_open()) return;
+    if (ds64.offset < 0) {
+      ds64.absent = true;
+    }
+    if (!isRF64()) {
+      ds64.riffSize = wavHeader.size;
+      ds64.dataSize = audioChunk.size;
+    }
+    writtenSize = ds64.dataSize;
+    if (useMmap) mappedAudio.open(path, readOnly);
+    // A file cut short claims more audio than it holds
+    std::size_t fileSize = mapped() ? mappedAudio.initialSize() : streamSize();
+    std::size_t held = fileSize > dataOffset() ? fileSize - dataOffset() : 0;
+    held -= held % frameSize();
+    if (ds64.dataSize > held) {
+      LOGW << "'" << path << "' is truncated, reading the " << held / frameSize()
+           << " frames it holds";
+      ds64.riffSize -= ds64.dataSize - held;
+      ds64.dataSize = held;
+    }
     seek(0);
   }
 
+  void close() override {
+    if (mapped()) {
+      // The mapping grows the file in large steps, trim it
+      mappedAudio.close(std::max<std::size_t>(
+          mappedAudio.initialSize(), dataOffset() + ds64.dataSize));
+    }
+    File::close();
+  }
+
+  void flush() override {
+    mappedAudio.sync();
+    File::flush();
+  }
+
 protected:
 
+  MappedFile mappedAudio;
+  /** The read/write position in frames, when mapped */
+  std::size_t cursor = 0;
+  /** Scratch space for converting, see read and write */
+  std::vector<char> rawBlock;
+  std::vector<float> convertedBlock;
+  /** The audio size last written to the header */
+  uint64_t writtenSize = 0;
+
+  std::size_t dataOffset() const {
+    return audioChunk.offset + 8;
+  }
+
+  /** Bytes in the file, through the stream */
+  std::size_t streamSize() {
+    fileStream.clear();
+    fileStream.seekg(0, std::ios::end);
+    std::size_t end = rpos();
+    fileStream.clear();
+    return end;
+  }
+
+  /** Update the sizes, if the audio has grown to `newSize` bytes */
+  void growAudio(std::size_t newSize) {
+    if (newSize > ds64.dataSize) {
+      ds64.riffSize += newSize - ds64.dataSize;
+      ds64.dataSize = newSize;
+      updateSizes();
+    }
+  }
+
+  /**
+   * Whether the audio can grow to `nframes`. Past 4 GB, only if there is
+   * room for the `ds64` chunk.
+   */
+  bool canGrow(std::size_t nframes) {
+    uint64_t newSize = nframes * frameSize();
+    if (newSize <= ds64.dataSize || !ds64.absent) return true;
+    if (ds64.riffSize + (newSize - ds64.dataSize) <= MAX_CHUNK_SIZE) return true;
+    LOGE << "'" << path << "' can't grow past 4 GB, it has no room for the RF64 sizes";
+    return false;
+  }
+
+  /** Derive the sizes in the chunk headers from the 64 bit ones */
+  void updateSizes() {
+    ds64.sampleCount = ds64.dataSize / frameSize();
+    if (ds64.riffSize > MAX_CHUNK_SIZE && !ds64.absent) {
+      wavHeader.id = "RF64";
+      ds64.id = "ds64";
+    }
+    if (isRF64()) {
+      wavHeader.size = MAX_CHUNK_SIZE;
+      audioChunk.size = MAX_CHUNK_SIZE;
+    } else {
+      wavHeader.size = ds64.riffSize;
+      audioChunk.size = ds64.dataSize;
+    }
+  }
+
+  /**
+   * Register chunks of derived formats.
+   * They are placed between the format and the audio, so the audio can
+   * keep growing at the end of the file.
+   */
   virtual void setupChunks() {}
 
 };
 
+template<typename sample_type, uint _channels>
+constexpr uint BasicSndFile<sample_type, _channels>::BLOCK;
+
 template<uint channels>
 using SndFile = BasicSndFile<float, channels>;
 
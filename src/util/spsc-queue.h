@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdlib>
+
+namespace top1 {
+
+/**
+ * Bounded, wait-free single producer / single consumer queue.
+ *
+ * One thread may push, one (other) thread may pop. Neither side ever blocks,
+ * which makes it usable from the audio thread.
+ *
+ * @tparam Capacity Must be a power of two
+ */
+template<typename T, std::size_t Capacity>
+class SPSCQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+    "SPSCQueue capacity must be a power of two");
+
+  std::array<T, Capacity> slots;
+
+  // Written by the consumer only
+  alignas(64) std::atomic<std::size_t> head = {0};
+  // Written by the producer only
+  alignas(64) std::atomic<std::size_t> tail = {0};
+
+public:
+
+  /**
+   * Producer side.
+   * @return false if the queue was full, in which case nothing was pushed.
+   */
+  bool push(const T &el) {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    slots[t & (Capacity - 1)] = el;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Consumer side.
+   * @return false if the queue was empty.
+   */
+  bool pop(T &el) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    el = slots[h & (Capacity - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire)
+      == tail.load(std::memory_order_acquire);
+  }
+};
+
+}
@@ -0,0 +1,60 @@
+#include "tape-stats.h"
+
+#include <fmt/format.h>
+
+namespace top1 {
+
+const char *TapeStats::opName(Op op) {
+  switch (op) {
+  case READ: return "Read";
+  case WRITE_BACK: return "Write back";
+  case METADATA: return "Metadata";
+  case EDIT: return "Edit";
+  default: return "";
+  }
+}
+
+void TapeStats::reset() {
+  for (uint d = 0; d < 2; d++) {
+    underruns[d] = 0;
+    underrunFrames[d] = 0;
+    overruns[d] = 0;
+    overrunFrames[d] = 0;
+  }
+  for (uint m = 0; m < PrefetchPolicy::MODES; m++) {
+    reads[m] = 0;
+    starvedReads[m] = 0;
+  }
+  fillFW.reset();
+  fillBW.reset();
+  for (auto &l : latency) l.reset();
+}
+
+std::string TapeStats::summary() const {
+  fmt::MemoryWriter w;
+  w.write("Underruns: FW {} ({} frames), BW {} ({} frames)\n",
+    underruns[0].load(), underrunFrames[0].load(),
+    underruns[1].load(), underrunFrames[1].load());
+  w.write("Overruns: FW {} ({} frames), BW {} ({} frames)\n",
+    overruns[0].load(), overrunFrames[0].load(),
+    overruns[1].load(), overrunFrames[1].load());
+  w.write("Starved reads:");
+  for (uint m = 0; m < PrefetchPolicy::MODES; m++) {
+    w.write(" {} {:.1f}%{}", PrefetchPolicy::modeName(PrefetchPolicy::Mode(m)),
+      starvedShare(m) * 100, m + 1 < PrefetchPolicy::MODES ? "," : "\n");
+  }
+  // The few cycles with the least loaded are the ones that matter
+  w.write("Loaded FW: 1% < {}, 50% < {} frames\n",
+    fillFW.percentile(0.01), fillFW.percentile(0.5));
+  w.write("Loaded BW: 1% < {}, 50% < {} frames\n",
+    fillBW.percentile(0.01), fillBW.percentile(0.5));
+  for (uint op = 0; op < OPS; op++) {
+    auto &l = latency[op];
+    w.write("{}: {} times, 50% < {}us, 99% < {}us, max {}us\n",
+      opName(Op(op)), l.count(), l.percentile(0.5), l.percentile(0.99),
+      l.largest());
+  }
+  return w.str();
+}
+
+}
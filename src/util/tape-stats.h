@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "prefetch-policy.h"
+#include "typedefs.h"
+
+namespace top1 {
+
+/**
+ * Counts of values in power of two buckets.
+ *
+ * Bucket 0 counts zeros, bucket `b` the values in `[2^(b-1), 2^b)`, the
+ * last one everything above. Each value is a single relaxed increment, so
+ * the audio thread can add to it, and any thread can read it, without
+ * locks. A reader may see a value counted in one bucket and not yet in
+ * another, which doesn't matter for statistics.
+ */
+template<uint N>
+class Histogram {
+public:
+  static constexpr uint BUCKETS = N;
+
+  void add(uint64_t value) {
+    uint b = value == 0 ? 0 : std::min<uint>(N - 1, 64 - __builtin_clzll(value));
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+    if (value > max.load(std::memory_order_relaxed)) {
+      max.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t count(uint bucket) const {
+    return buckets[bucket].load(std::memory_order_relaxed);
+  }
+
+  uint64_t count() const {
+    uint64_t sum = 0;
+    for (uint b = 0; b < N; b++) sum += count(b);
+    return sum;
+  }
+
+  /** The largest value added. Only exact with a single writer */
+  uint64_t largest() const {
+    return max.load(std::memory_order_relaxed);
+  }
+
+  /** The values of `bucket` are below this */
+  static uint64_t bound(uint bucket) {
+    return uint64_t(1) << bucket;
+  }
+
+  /**
+   * The bound of the first buckets holding at least the share `p` (0 to 1)
+   * of the values. 0 if there are none.
+   */
+  uint64_t percentile(double p) const {
+    uint64_t total = count();
+    if (total == 0) return 0;
+    uint64_t seen = 0;
+    for (uint b = 0; b < N; b++) {
+      seen += count(b);
+      if (seen >= p * total) return bound(b);
+    }
+    return bound(N - 1);
+  }
+
+  void reset() {
+    for (auto &b : buckets) b.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, N> buckets {};
+  std::atomic<uint64_t> max = {0};
+};
+
+/**
+ * How well the tape keeps up, to size the rings and reads from.
+ *
+ * Written by the audio and disk threads of a TapeBuffer, read by anyone,
+ * e.g. the tape's stats screen. Nothing here ever locks.
+ */
+struct TapeStats {
+
+  /** Disk thread operations that are timed */
+  enum Op {
+    READ,       ///< Loading frames into a ring
+    WRITE_BACK, ///< Saving recorded frames, and syncing the file
+    METADATA,   ///< Saving slices, edit lists and peaks
+    EDIT,       ///< Lifts, drops, undo and redo
+    OPS
+  };
+
+  static const char *opName(Op op);
+
+  /** Reads that came short, by TapeBuffer::Direction. Audio thread */
+  std::array<std::atomic<uint64_t>, 2> underruns {};
+  /** Frames missing from them */
+  std::array<std::atomic<uint64_t>, 2> underrunFrames {};
+
+  /** Writes that didn't fit in the ring, by direction. Audio thread */
+  std::array<std::atomic<uint64_t>, 2> overruns {};
+  /** Frames skipped from them */
+  std::array<std::atomic<uint64_t>, 2> overrunFrames {};
+
+  /** Reads from the ring, by PrefetchPolicy::Mode. Audio thread */
+  std::array<std::atomic<uint64_t>, PrefetchPolicy::MODES> reads {};
+  /** Those of them that came short */
+  std::array<std::atomic<uint64_t>, PrefetchPolicy::MODES> starvedReads {};
+
+  /**
+   * Frames loaded ahead of the playpoint, forwards and backwards, at the
+   * start of each cycle. Audio thread
+   */
+  Histogram<20> fillFW;
+  Histogram<20> fillBW;
+
+  /** Time taken by each `Op`, in microseconds. Disk thread */
+  std::array<Histogram<24>, OPS> latency;
+
+  /** Times an operation into `latency` */
+  struct Timer {
+    using clock = std::chrono::steady_clock;
+    clock::time_point start = clock::now();
+
+    void stop(TapeStats &stats, Op op) {
+      auto time = clock::now() - start;
+      stats.latency[op].add(
+        std::chrono::duration_cast<std::chrono::microseconds>(time).count());
+    }
+  };
+
+  void underrun(uint dir, uint missing) {
+    underruns[dir].fetch_add(1, std::memory_order_relaxed);
+    underrunFrames[dir].fetch_add(missing, std::memory_order_relaxed);
+  }
+
+  void read(uint mode, bool starved) {
+    reads[mode].fetch_add(1, std::memory_order_relaxed);
+    if (starved) starvedReads[mode].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /** The share of the reads in `mode` that came short, 0 without reads */
+  double starvedShare(uint mode) const {
+    uint64_t total = reads[mode].load(std::memory_order_relaxed);
+    if (total == 0) return 0;
+    return double(starvedReads[mode].load(std::memory_order_relaxed)) / total;
+  }
+
+  void overrun(uint dir, uint skipped) {
+    overruns[dir].fetch_add(1, std::memory_order_relaxed);
+    overrunFrames[dir].fetch_add(skipped, std::memory_order_relaxed);
+  }
+
+  /** Start counting anew. Counts made meanwhile may be lost */
+  void reset();
+
+  /** A few lines of text, for the log */
+  std::string summary() const;
+};
+
+}
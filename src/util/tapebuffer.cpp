@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <limits>
 #include "../globals.h"
 #include "tapefile.h"
 
@@ -11,250 +12,1072 @@ namespace top1 {
 /*  TapeBuffer Implementation              */
 /*******************************************/
 
-TapeBuffer::TapeBuffer() : playPoint (0), newCuts (false) {}
+constexpr std::chrono::milliseconds TapeBuffer::METADATA_INTERVAL;
+constexpr std::chrono::milliseconds TapeBuffer::FILL_RETRY;
+constexpr TapeTime TapeBuffer::PEAKS_REBUILD_SIZE;
+constexpr uint TapeBuffer::PACK_SCAN;
+
+TapeBuffer::TapeBuffer() {
+  rings[0].state = RingBuffer::ACTIVE;
+  for (auto &cue : cues) cue = -1;
+}
 
 void TapeBuffer::init() {
+  running = true;
   diskThread = std::thread([this]{threadRoutine();});
 }
 
 void TapeBuffer::exit() {
-  readData.notify_all();
+  if (!diskThread.joinable()) return;
+  running = false;
+  diskSignal.post();
   diskThread.join();
+  LOGI << "Tape stats:\n" << stats.summary();
+}
+
+void TapeBuffer::save() {
+  if (!running) return;
+  std::unique_lock<std::recursive_mutex> lock (file.mutex);
+  applyEdits();
+  writeBack();
+  saveMetadata(true);
+  file.flush();
 }
 
 // Disk handling:
 
 void TapeBuffer::threadRoutine() {
-  movePlaypointAbs(0);
-
   file.open(GLOB.project->path);
   file.samplerate = GLOB.samplerate;
-  const static uint FRAMEBUF_SIZE = RingBuffer::SIZE / 2;
-  top1::DynArray<AudioFrame> framebuf (FRAMEBUF_SIZE);
+  if (GLOB.project->planarTape) file.makePlanar();
+  if (GLOB.project->sparseTape) file.makeSparse();
 
   if (file.error.log()) GLOB.exit();
 
   Track::foreach([&](Track t) {
-     auto &slices = file.slices.tracks[t.idx];
-     for (uint i = 0; i < slices.count; i++) {
-       auto &slice = slices.slices[i];
-       trackSlices[t.idx].addSlice({(int)slice.inPos, (int)slice.outPos});
+     std::vector<TapeSlice> slices;
+     for (auto &slice : file.sliceList(t.idx)) {
+       slices.push_back({TapeTime(slice.inPos), TapeTime(slice.outPos)});
      }
+     trackSlices[t.idx].assign(slices);
      trackSlices[t.idx].changed = false;
+     edits[t.idx] = file.editList(t.idx);
    });
+  loadPeaks();
 
   bool runAgain = false;
+  // Times in a row the active ring couldn't be filled
+  uint fillFailures = 0;
 
-
-waitData:
-  while(GLOB.running()) {
+  while(running) {
     std::unique_lock<std::recursive_mutex> lock (file.mutex);
 
-    // Keep some space in the middle to avoid overlap fights
-    int desLength = buffer.SIZE / 2 - sizeof(AudioFrame);
-
-    if (buffer.notWritten) {
-      int startIdx = buffer.notWritten.in;
-      int startTime = buffer.posAt0 + startIdx;
-      if (startTime < 0) {
-        startIdx = buffer.notWritten.in -= startTime;
-        startTime = buffer.posAt0 + buffer.notWritten.in;
+    auto plan = PrefetchPolicy::plan(speed.load(std::memory_order_relaxed),
+      nextSpeed.load(std::memory_order_relaxed), RingBuffer::SIZE, MIN_READ_SIZE);
+    if (!fillWindow(active.load(std::memory_order_acquire), plan)) {
+      // Switching rings or seeking. Once is usual, more means the audio
+      // thread hasn't caught up yet: wait for it rather than spin
+      lock.unlock();
+      if (++fillFailures == 2) {
+        LOGW << "Waiting for the audio thread to settle on a ring";
       }
-      file.seek(startTime);
-      file.write(
-        buffer.data.data() + buffer.wrapIdx(startIdx),
-        buffer.notWritten.size());
-      file.error.log();
-      buffer.notWritten.in = buffer.notWritten.out = buffer.playIdx;
-    }
-
-    if (buffer.lengthFW < desLength - MIN_READ_SIZE) {
-      uint startIdx = buffer.playIdx + buffer.lengthFW; 
-      file.seek(buffer.posAt0 + startIdx);
-      uint nframes = desLength - buffer.lengthFW;
-      framebuf.clear();
-      file.read(framebuf.data(), nframes);
-      file.error.log();
-      for (uint i = 0; i < nframes; i++) {
-        // TODO: Read directly into buffer
-        buffer[startIdx + i] = framebuf[i];
+      if (fillFailures >= 2) diskSignal.waitFor(FILL_RETRY);
+      continue;
+    }
+    fillFailures = 0;
+    // Keep some space in the middle to avoid overlap fights
+    loadCues(RingBuffer::SIZE / 2 - MIN_READ_SIZE);
+
+    if (applyEdits()) {
+      runAgain = true;
+    }
+
+    if (rebuildPeaks()) {
+      runAgain = true;
+    }
+
+    saveMetadata();
+
+    // Only when there is nothing else to do
+    if (!runAgain && packColdBlock()) {
+      runAgain = true;
+    }
+
+    lock.unlock();
+    if (runAgain) {
+      runAgain = false;
+    } else {
+      // Wake up anyway to save metadata changed in the meantime
+      diskSignal.waitFor(METADATA_INTERVAL);
+      // Several posts may have piled up while we were busy
+      while (diskSignal.tryWait());
+    }
+  }
+
+  // Edits requested on the way out
+  applyEdits();
+  writeBack();
+  saveMetadata(true);
+  file.close();
+}
+
+/**
+ * Save the slices, edit lists, audio sizes and peaks that changed.
+ *
+ * Changes are written at most every METADATA_INTERVAL, so a burst of
+ * edits is saved once. When nothing changed, nothing is written.
+ * The slices recorded meanwhile are added first, whenever it is called.
+ * @param now don't wait for the interval
+ */
+void TapeBuffer::saveMetadata(bool now) {
+  for (auto &slices : trackSlices) slices.applyRecorded();
+  auto time = std::chrono::steady_clock::now();
+  if (!now && time - metadataSaved < METADATA_INTERVAL) return;
+  TapeStats::Timer timer;
+  bool saved = false;
+  Track::foreach([&](Track t) {
+     if (trackSlices[t.idx].changed.exchange(false)) {
+       std::vector<TapeFile::SliceData> slices;
+       uint dropped = 0;
+       for (auto slice : *trackSlices[t.idx].snapshot()) {
+         if (slice.in < 0 || slice.out > std::numeric_limits<u4b>::max()) {
+           dropped++;
+           continue;
+         }
+         slices.push_back({u4b(slice.in), u4b(slice.out)});
+       }
+       if (dropped > 0) {
+         LOGE << "Track " << t.str() << " has " << dropped
+              << " slices past 32 bits, they are not saved";
+       }
+       file.setSliceList(t.idx, std::move(slices));
+       file.writeSlices(t.idx);
+       saved = true;
+     }
+     if (editsChanged[t.idx]) {
+       file.setEditList(t.idx, edits[t.idx]);
+       file.writeEdits(t.idx);
+       editsChanged[t.idx] = false;
+       saved = true;
+     }
+   });
+  if (file.sizesChanged()) {
+    file.writeSizes();
+    saved = true;
+  }
+  Section<TapeTime> changed;
+  for (auto &p : peaks) {
+    auto c = p.takeChanged();
+    if (!c) continue;
+    changed = changed ? Section<TapeTime>(std::min(changed.in, c.in),
+      std::max(changed.out, c.out)) : c;
+  }
+  if (changed) {
+    file.writePeaks(peaks, changed);
+    saved = true;
+  }
+  if (saved) {
+    metadataSaved = time;
+    timer.stop(stats, TapeStats::METADATA);
+  }
+}
+
+/**
+ * Keep the active ring loaded around the playpoint, as far as `plan` says.
+ * @return false if the loop should start over
+ */
+bool TapeBuffer::fillWindow(uint ringIdx, const PrefetchPolicy::Plan &plan) {
+  auto &buffer = rings[ringIdx];
+  // Everything queued before the epoch was bumped is visible after this
+  uint epoch = buffer.seekEpoch.load(std::memory_order_acquire);
+  writeBack();
+
+  if (buffer.state.load(std::memory_order_acquire) != RingBuffer::ACTIVE) {
+    // Switched to another ring since we looked
+    return false;
+  }
+
+  if (epoch != buffer.windowEpoch.load(std::memory_order_relaxed)) {
+    // The audio thread is not using the window until windowEpoch matches
+    TapeTime pos = playPoint.load(std::memory_order_acquire);
+    buffer.loadedIn.store(pos, std::memory_order_relaxed);
+    buffer.loadedOut.store(pos, std::memory_order_relaxed);
+    buffer.windowEpoch.store(epoch, std::memory_order_release);
+  }
+
+  TapeTime pos = playPoint.load(std::memory_order_acquire);
+  TapeTime in = buffer.loadedIn.load(std::memory_order_relaxed);
+  TapeTime out = buffer.loadedOut.load(std::memory_order_relaxed);
+
+  if (pos < in || pos > out) {
+    if (active.load(std::memory_order_acquire) == ringIdx) {
+      // Should not happen, the audio thread only moves within the window
+      LOGW << "Playpoint outside of the loaded window, reloading";
+      buffer.seekEpoch.fetch_add(1);
+    }
+    return false;
+  }
+
+  auto extendFW = [&] {
+    if (out - pos >= plan.fw - plan.minRead) return;
+    TapeTime newOut = pos + plan.fw;
+    // The slots we are about to fill still hold the oldest frames.
+    // Evict them first.
+    if (newOut - (int) buffer.SIZE > in) {
+      in = newOut - buffer.SIZE;
+      buffer.loadedIn.store(in, std::memory_order_release);
+    }
+    readToBuffer(buffer, {out, newOut});
+    prefetch({out + PREFETCH_SIZE, newOut + PREFETCH_SIZE});
+    out = newOut;
+    buffer.loadedOut.store(out, std::memory_order_release);
+  };
+
+  auto extendBW = [&] {
+    if (pos - in >= plan.bw - plan.minRead) return;
+    TapeTime newIn = std::max<TapeTime>(0, pos - plan.bw);
+    if (newIn >= in) return;
+    if (newIn + (int) buffer.SIZE < out) {
+      out = newIn + buffer.SIZE;
+      buffer.loadedOut.store(out, std::memory_order_release);
+    }
+    readToBuffer(buffer, {newIn, in});
+    prefetch({std::max<TapeTime>(0, newIn - PREFETCH_SIZE),
+          std::max<TapeTime>(0, in - PREFETCH_SIZE)});
+    in = newIn;
+    buffer.loadedIn.store(in, std::memory_order_release);
+  };
+
+  // The side the tape is moving towards first
+  if (plan.bwFirst) {
+    extendBW();
+    extendFW();
+  } else {
+    extendFW();
+    extendBW();
+  }
+  return true;
+}
+
+/**
+ * Keep a `READY` ring loaded around each cue point.
+ *
+ * A stale one stays `READY` until its replacement is, so the audio thread
+ * always finds a ring to jump to.
+ */
+void TapeBuffer::loadCues(int desLength) {
+  std::array<TapeTime, CUES> wanted;
+  for (uint i = 0; i < wanted.size(); i++) {
+    wanted[i] = cues[i].load(std::memory_order_relaxed);
+  }
+  auto isWanted = [&] (TapeTime cue) {
+    return std::find(wanted.begin(), wanted.end(), cue) != wanted.end();
+  };
+
+  for (TapeTime cue : wanted) {
+    if (cue < 0) continue;
+    bool loaded = std::any_of(rings.begin(), rings.end(), [&] (auto &r) {
+        return r.cue == cue && !r.stale && r.state.load() == RingBuffer::READY;
+      });
+    if (loaded) continue;
+
+    // Find a ring to load it into
+    RingBuffer *target = nullptr;
+    for (auto &r : rings) {
+      int state = r.state.load(std::memory_order_acquire);
+      if (state == RingBuffer::IDLE) {
+        target = &r;
+        break;
       }
-      buffer.lengthFW += nframes;
-      int overflow = buffer.lengthFW + buffer.lengthBW - buffer.SIZE;
-      if (overflow > 0) {
-        buffer.lengthBW -= overflow;
+      if (state == RingBuffer::READY && !isWanted(r.cue)
+        && r.state.compare_exchange_strong(state, RingBuffer::IDLE)) {
+        target = &r;
+        break;
       }
     }
+    if (target == nullptr) continue;
 
-    if (buffer.lengthBW < desLength - MIN_READ_SIZE) {
-      uint nframes = desLength - buffer.lengthBW;
-      int startIdx = buffer.playIdx - buffer.lengthBW - nframes; 
-      file.seek(buffer.posAt0 + startIdx);
-      framebuf.clear();
-      file.read(framebuf.data(), nframes);
-      file.error.log();
-      for (uint i = 0; i < nframes; i++) {
-        buffer[startIdx + i] = framebuf[i];
-      }
-      buffer.lengthBW += nframes;
-      int overflow = buffer.lengthFW + buffer.lengthBW - buffer.SIZE;
-      if (overflow > 0) {
-        buffer.lengthFW -= overflow;
+    auto &buffer = *target;
+    writeBack(buffer);
+    TapeTime in = std::max<TapeTime>(0, cue - desLength);
+    TapeTime out = cue + desLength;
+    buffer.cue = cue;
+    buffer.loadedIn.store(in, std::memory_order_relaxed);
+    buffer.loadedOut.store(in, std::memory_order_relaxed);
+    readToBuffer(buffer, {in, out});
+    buffer.loadedOut.store(out, std::memory_order_relaxed);
+    buffer.windowEpoch.store(buffer.seekEpoch.load());
+    buffer.stale = false;
+    buffer.state.store(RingBuffer::READY, std::memory_order_release);
+
+    // Let go of the stale one, unless the audio thread jumped to it
+    for (auto &r : rings) {
+      if (&r == &buffer || r.cue != cue || !r.stale) continue;
+      int state = RingBuffer::READY;
+      if (r.state.compare_exchange_strong(state, RingBuffer::IDLE)) {
+        r.seekEpoch.fetch_add(1);
       }
     }
+  }
+}
+
+/**
+ * Drop everything loaded, after the file was changed behind the rings' back
+ */
+void TapeBuffer::invalidate() {
+  for (auto &r : rings) {
+    int state = RingBuffer::READY;
+    r.state.compare_exchange_strong(state, RingBuffer::IDLE);
+    r.seekEpoch.fetch_add(1);
+  }
+}
+
+/**
+ * Reload the rings holding any of `section`, leaving the others be
+ */
+void TapeBuffer::invalidate(Section<TapeTime> section) {
+  for (auto &r : rings) {
+    auto w = r.window();
+    if (w.valid && (w.out <= section.in || w.in >= section.out)) continue;
+    int state = RingBuffer::READY;
+    r.state.compare_exchange_strong(state, RingBuffer::IDLE);
+    r.seekEpoch.fetch_add(1);
+  }
+}
+
+/**
+ * Pointers to the tracks of `time` in the ring.
+ * Contiguous up to where the ring wraps.
+ */
+static TapeFile::Lanes ringLanes(TapeBuffer::RingBuffer &buffer, TapeTime time) {
+  TapeFile::Lanes lanes;
+  uint idx = buffer.wrapIdx(time);
+  for (uint l = 0; l < lanes.size(); l++) {
+    lanes[l] = buffer.lane(l) + idx;
+  }
+  return lanes;
+}
+
+/**
+ * Whether every track of `section` is stored in its own lane at the same
+ * time, so all of them can be streamed at once
+ */
+static bool unedited(const std::array<EditList, 4> &edits,
+  Section<TapeTime> section) {
+  for (uint l = 0; l < edits.size(); l++) {
+    if (!edits[l].isIdentity(section, l)) return false;
+  }
+  return true;
+}
+
+void TapeBuffer::readToBuffer(RingBuffer &buffer, Section<TapeTime> section) {
+  TapeStats::Timer timer;
+  if (unedited(edits, section)) {
+    // At most two reads, split where the ring wraps
+    while (section.size() > 0) {
+      uint idx = buffer.wrapIdx(section.in);
+      uint n = std::min<uint>(section.size(), buffer.SIZE - idx);
+      file.readLanes(section.in, ringLanes(buffer, section.in), n);
+      section.in += n;
+    }
+  } else {
+    for (uint track = 0; track < edits.size(); track++) {
+      buffer.forSpans(section.in, section.size(), [&] (uint idx, uint off, uint n) {
+          TapeTime at = section.in + off;
+          readTrack(track, {at, at + (TapeTime)n}, buffer.lane(track) + idx);
+        });
+    }
+  }
+  file.error.log();
+  // Frames can only be written where they are loaded
+  for (auto &p : peaks) p.reserve(section.out);
+  timer.stop(stats, TapeStats::READ);
+}
+
+/** Read one track of `section` from where its edit list stores it */
+void TapeBuffer::readTrack(uint track, Section<TapeTime> section, float *dst) {
+  file.readTrack(edits[track], section, dst);
+}
+
+/**
+ * Have the storage of `section` read in the background.
+ *
+ * The tape is memory mapped, so this only asks the kernel to read ahead.
+ * Reads for both ends of the window are then in flight while the disk
+ * thread goes on, and the next readToBuffer finds them in memory.
+ */
+void TapeBuffer::prefetch(Section<TapeTime> section) {
+  if (section.size() <= 0) return;
+  if (unedited(edits, section)) {
+    file.prefetchLanes(section.in, section.size());
+    return;
+  }
+  for (uint track = 0; track < edits.size(); track++) {
+    edits[track].resolve(section, [&] (auto part, auto *region) {
+        if (region == nullptr) return;
+        file.prefetchLane(region->lane, region->sourceOf(part.in), part.size());
+      });
+  }
+}
+
+void TapeBuffer::writeFromBuffer(RingBuffer &buffer, Section<TapeTime> section) {
+  if (section.in < 0) section.in = 0;
+  if (unedited(edits, section) && !isShared(section)) {
+    while (section.size() > 0) {
+      uint idx = buffer.wrapIdx(section.in);
+      uint n = std::min<uint>(section.size(), buffer.SIZE - idx);
+      auto lanes = ringLanes(buffer, section.in);
+      file.writeLanes(section.in, {{lanes[0], lanes[1], lanes[2], lanes[3]}}, n);
+      section.in += n;
+    }
+  } else {
+    for (uint track = 0; track < edits.size(); track++) {
+      writeTrack(buffer, track, section);
+    }
+  }
+  file.error.log();
+}
 
-    {
-      // Lift frames
-      if (clipboard.fromSlice.size() > 0) {
-        LOGD << "Lifting " << clipboard.fromSlice.size() << " frames from "
-             << clipboard.fromSlice.in;
-        std::unique_lock<std::mutex> clipboardLock (clipboard.lock);
-        TapeSlice readSlice = {
-          clipboard.fromSlice.in,
-          clipboard.fromSlice.in
-        };
-        clipboard.data.clear();
-        framebuf.clear();
-        while(readSlice.out < clipboard.fromSlice.out) {
-          readSlice.out = std::min<int>(
-            readSlice.in + FRAMEBUF_SIZE,
-            clipboard.fromSlice.out);
-          file.seek(readSlice.in);
-          file.read(framebuf.data(), readSlice.size());
-          for (int i = 0; i < readSlice.size(); i++) {
-            clipboard.data.push_back(framebuf[i][clipboard.fromTrack.idx]);
-            framebuf[i][clipboard.fromTrack.idx] = 0;
-          }
-          file.seek(readSlice.in);
-          file.write(framebuf.data(), readSlice.size());
-          readSlice.in = readSlice.out;
+/**
+ * Write one track of `section` to where its edit list stores it.
+ *
+ * Storage is never overwritten while anything else refers to it, e.g.
+ * after dropping the clipboard twice. The frames are stored anew instead,
+ * at the end of the lane. So are frames recorded into gaps, except for
+ * the silence before and after them, which the gaps already are. On
+ * sparse tapes, that is all that is recorded.
+ */
+void TapeBuffer::writeTrack(RingBuffer &buffer, uint track,
+  Section<TapeTime> section) {
+  buffer.forSpans(section.in, section.size(), [&] (uint idx, uint off, uint n) {
+      TapeTime at = section.in + off;
+      storeTrack(track, {at, at + (TapeTime)n}, buffer.lane(track) + idx);
+    });
+}
+
+/**
+ * Store `section` of a track from `data`, see writeTrack
+ */
+void TapeBuffer::storeTrack(uint track, Section<TapeTime> section,
+  const float *data) {
+  auto &list = edits[track];
+  list.resolve(section, [&] (auto part, auto *region) {
+      const float *src = data + (part.in - section.in);
+      if (region != nullptr) {
+        const uint size = part.size();
+        TapeTime source = region->sourceOf(part.in);
+        if (!isShared(*region, {source, source + part.size()})) {
+          file.writeLane(region->lane, source, src, size);
+          return;
         }
-        buffer.lengthFW = buffer.lengthBW = 0;
-        runAgain = true;
-        clipboard.fromSlice = {0,0};
+        trackBuffer.resize(size);
+        file.readLane(region->lane, source, trackBuffer.data(), size);
+        if (std::equal(src, src + size, trackBuffer.begin())) return;
+      } else {
+        // Only the sound is stored, the silence around it stays a gap
+        auto sound = [] (float f) {return f != 0;};
+        const float *end = src + part.size();
+        const float *first = std::find_if(src, end, sound);
+        if (first == end) return;
+        while (!sound(end[-1])) end--;
+        part = {part.in + TapeTime(first - src), part.in + TapeTime(end - src)};
+        src = first;
       }
+      const uint size = part.size();
+      if (auto *open = list.openEnd()) {
+        list.close(file.laneSize(open->lane));
+      }
+      TapeTime source = storageEnd(track);
+      list.map(part, track, source);
+      editsChanged[track] = true;
+      file.writeLane(track, source, src, size);
+    });
+}
 
-      // Drop frames
-      if (clipboard.toTime >= 0 && !clipboard.data.empty()) {
-        std::unique_lock<std::mutex> clipboardLock (clipboard.lock);
-        LOGD << "Dropping " << clipboard.data.size() << " frames at " << clipboard.toTime;
-        TapeSlice writeSlice = {
-          clipboard.toTime,
-          clipboard.toTime
-        };
-        while(true) {
-          uint startIdx = writeSlice.in - clipboard.toTime;
-          writeSlice.out = writeSlice.in + std::min<int>(
-            FRAMEBUF_SIZE,
-            clipboard.data.size() - startIdx);
-
-          if ((ulong)writeSlice.size() > clipboard.data.size()) break;
-          if (writeSlice.size() == 0) break;
-
-          framebuf.clear();
-          file.seek(writeSlice.in);
-          file.read(framebuf.data(), writeSlice.size());
-          int i;
-          for (i = 0; i < writeSlice.size(); i++) {
-            framebuf[i][clipboard.toTrack.idx] = clipboard.data[startIdx + i];
-          }
-          LOGD << i;
-          file.seek(writeSlice.in);
-          file.write(framebuf.data(), writeSlice.size());
-          writeSlice.in = writeSlice.out;
-        }
-        file.flush();
-        buffer.lengthFW = buffer.lengthBW = 0;
-        runAgain = true;
-        clipboard.toTime = -1;
+/**
+ * Whether any region but `region`, the clipboard or an undo step refers
+ * to `storage` in its lane
+ */
+bool TapeBuffer::isShared(const EditList::Region &region,
+  Section<TapeTime> storage) {
+  auto overlaps = [&] (const EditList::Region &r) {
+    return &r != &region && r.lane == region.lane
+      && r.source < storage.out && r.sourceEnd() > storage.in;
+  };
+  auto anyOf = [&] (const std::array<EditList, 4> &lists) {
+    for (auto &list : lists) {
+      if (std::any_of(list.regions().begin(), list.regions().end(), overlaps)) {
+        return true;
       }
-      clipboard.done.notify_all();
-    }
-    // Write metadata
-    Track::foreach([&](Track t) {
-       auto &tsc = file.slices.tracks[t.idx];
-       auto &ts  = trackSlices[t.idx];
-       tsc.count = 0;
-       for (auto slice : ts) {
-         tsc.slices[tsc.count] = {
-           (u4b)slice.in,
-           (u4b)slice.out
-         };
-         tsc.count++;
-       }
-       ts.changed = false;
-     });
-    file.writeFile();
+    }
+    return false;
+  };
+  if (anyOf(edits)) return true;
+  if (std::any_of(clipboard.clip.begin(), clipboard.clip.end(), overlaps)) {
+    return true;
+  }
+  for (auto &weak : journaled) {
+    auto entry = weak.lock();
+    if (entry && anyOf(entry->edits)) return true;
+  }
+  return false;
+}
 
-    if (runAgain) runAgain = false;
-    else readData.wait(lock);
+/**
+ * Whether the storage of an unedited `section` is referred to by anything
+ * but the tracks themselves, so it can't be written in place
+ */
+bool TapeBuffer::isShared(Section<TapeTime> section) {
+  for (auto &list : edits) {
+    const EditList::Region *region;
+    list.first(section, region);
+    if (region && isShared(*region, section)) return true;
   }
+  return false;
+}
 
-  if (GLOB.running()) goto waitData;
-  file.close();
+/**
+ * The end of the storage used in `lane`. Frames after it are free.
+ * Lanes are only ever appended to, so this is past anything that was
+ * stored there, even if nothing refers to it anymore.
+ */
+TapeTime TapeBuffer::storageEnd(uint lane) {
+  TapeTime end = file.laneSize(lane);
+  auto grow = [&] (const EditList::Region &r) {
+    if (r.lane == lane && r.out != EditList::END) {
+      end = std::max(end, r.sourceEnd());
+    }
+  };
+  for (auto &list : edits) {
+    for (auto &r : list.regions()) grow(r);
+  }
+  for (auto &r : clipboard.clip) grow(r);
+  for (auto &weak : journaled) {
+    auto entry = weak.lock();
+    if (!entry) continue;
+    for (auto &list : entry->edits) {
+      for (auto &r : list.regions()) grow(r);
+    }
+  }
+  return end;
+}
+
+/**
+ * The hull of where `a` and `b` differ, empty if they are the same.
+ * Edits are local, so only the regions between the common head and tail
+ * are compared.
+ */
+static Section<TapeTime> difference(const EditList &a, const EditList &b) {
+  auto &x = a.regions();
+  auto &y = b.regions();
+  std::size_t head = 0;
+  while (head < x.size() && head < y.size() && x[head] == y[head]) head++;
+  if (head == x.size() && head == y.size()) return {};
+  std::size_t tail = 0;
+  while (head + tail < x.size() && head + tail < y.size()
+    && x[x.size() - 1 - tail] == y[y.size() - 1 - tail]) {
+    tail++;
+  }
+  Section<TapeTime> hull = {EditList::END, 0};
+  for (auto *list : {&x, &y}) {
+    for (std::size_t i = head; i + tail < list->size(); i++) {
+      hull.in = std::min(hull.in, (*list)[i].in);
+      hull.out = std::max(hull.out, (*list)[i].out);
+    }
+  }
+  return hull;
 }
 
-void TapeBuffer::movePlaypointRel(int time) {
-  movePlaypointAbs(playPoint + time);
+/**
+ * Store the edit lists in a journal entry. Open ends are closed where
+ * their storage ends now, so frames recorded later are not part of it.
+ */
+void TapeBuffer::storeCheckpoint(const std::shared_ptr<JournalEntry> &entry) {
+  entry->edits = edits;
+  for (auto &list : entry->edits) {
+    if (auto *open = list.openEnd()) list.close(file.laneSize(open->lane));
+  }
+  journaled.erase(std::remove_if(journaled.begin(), journaled.end(),
+      [] (auto &weak) { return weak.expired(); }), journaled.end());
+  journaled.push_back(entry);
 }
 
-void TapeBuffer::movePlaypointAbs(int newPos) {
-  std::unique_lock<std::recursive_mutex> lock (file.mutex);
+/** Swap the edit lists with the ones in a journal entry */
+void TapeBuffer::swapEdits(JournalEntry &entry) {
+  for (uint t = 0; t < edits.size(); t++) {
+    auto changed = difference(edits[t], entry.edits[t]);
+    if (!changed) continue;
+    TapeTime end = trackEnd(t);
+    std::swap(edits[t], entry.edits[t]);
+    changed.out = std::min(changed.out, std::max(end, trackEnd(t)));
+    if (changed.size() > 0) stalePeaks[t].push_back(changed);
+    editsChanged[t] = true;
+  }
+}
+
+/**
+ * Apply the checkpoints at the front of the queue.
+ *
+ * Called before writing back recorded frames, which may be the take a
+ * checkpoint was requested for. They would overwrite the storage the
+ * checkpoint is about to keep.
+ */
+void TapeBuffer::applyCheckpoints() {
+  std::lock_guard<std::mutex> lock (clipboard.lock);
+  auto &pending = clipboard.pending;
+  auto it = pending.begin();
+  for (; it != pending.end() && it->type == Edit::CHECKPOINT; it++) {
+    storeCheckpoint(it->entry);
+  }
+  pending.erase(pending.begin(), it);
+}
+
+/**
+ * Apply the edits requested since the last time.
+ * @return whether anything changed
+ */
+bool TapeBuffer::applyEdits() {
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    if (clipboard.pending.empty()) return false;
+  }
+  TapeStats::Timer timer;
+  // Recorded frames go with the lift
+  writeBack();
+  std::vector<Edit> todo;
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    todo.swap(clipboard.pending);
+  }
+  if (todo.empty()) return false;
+  // Whether the tape moved around, and every ring has to be reloaded
+  bool moved = false;
+  for (auto &edit : todo) {
+    if (edit.type == Edit::CHECKPOINT) {
+      storeCheckpoint(edit.entry);
+      continue;
+    }
+    if (edit.type == Edit::SWAP) {
+      swapEdits(*edit.entry);
+      moved = true;
+      continue;
+    }
+    if (edit.type == Edit::IMPORT) {
+      uint track = edit.track.idx;
+      importing -= edit.frames.size();
+      // Storing can't be undone, so check first: each gap may become a
+      // region, and the regions across the ends are split
+      std::size_t regions = edits[track].size() + 2;
+      edits[track].resolve(edit.section, [&] (auto, auto *region) {
+          if (region == nullptr) regions++;
+        });
+      if (regions > TapeFile::MAX_REGIONS) {
+        LOGW << "Track " << edit.track.str() << " has too many edits, not importing";
+        continue;
+      }
+      storeTrack(track, edit.section, edit.frames.data());
+      stalePeaks[track].push_back(edit.section);
+      invalidate(edit.section);
+      continue;
+    }
+    moved = true;
+    auto &list = edits[edit.track.idx];
+    EditList before = list;
+    EditList::Clip clip;
+    if (edit.type == Edit::LIFT) {
+      LOGD << "Lifting " << edit.section.size() << " frames from "
+           << edit.section.in;
+      clip = list.cut(edit.section);
+    } else {
+      LOGD << "Dropping " << edit.section.size() << " frames at "
+           << edit.section.in;
+      list.paste(edit.section.in, clipboard.clip, edit.section.size());
+    }
+    if (list.size() > TapeFile::MAX_REGIONS) {
+      LOGW << "Track " << edit.track.str() << " has too many edits, skipping";
+      list = before;
+      continue;
+    }
+    auto &trackPeaks = peaks[edit.track.idx];
+    if (edit.type == Edit::LIFT) {
+      clipboard.clip = std::move(clip);
+      trackPeaks.clear(edit.section);
+    } else {
+      stalePeaks[edit.track.idx].push_back(edit.section);
+    }
+    editsChanged[edit.track.idx] = true;
+  }
+  if (moved) invalidate();
+  timer.stop(stats, TapeStats::EDIT);
+  return true;
+}
+
+/**
+ * Where the audio of `track` ends, after that it is silent
+ */
+TapeTime TapeBuffer::trackEnd(uint track) {
+  return file.trackEnd(edits[track]);
+}
+
+/**
+ * Load the saved peaks, and schedule the rest of the tape to be rebuilt,
+ * e.g. for tapes recorded before there were peaks.
+ */
+void TapeBuffer::loadPeaks() {
+  TapeTime loaded = file.readPeaks(peaks);
+  for (uint t = 0; t < peaks.size(); t++) {
+    TapeTime end = trackEnd(t);
+    if (end > loaded) stalePeaks[t].push_back({loaded, end});
+  }
+}
+
+/**
+ * Rebuild the peaks of a part of a stale section from the file.
+ * @return whether there is more to do
+ */
+bool TapeBuffer::rebuildPeaks() {
+  for (uint t = 0; t < stalePeaks.size(); t++) {
+    auto &stale = stalePeaks[t];
+    if (stale.empty()) continue;
+    auto &section = stale.back();
+    const TapeTime block = PeakPyramid::BLOCK;
+    TapeTime in = section.in / block * block;
+    TapeTime out = std::min(section.out, in + PEAKS_REBUILD_SIZE);
+    out = (out + block - 1) / block * block;
+    peaks[t].reserve(out);
+    // Blocks recorded from here on keep the peaks the audio thread gave them
+    auto before = peaks[t].snapshot(in, out - in);
+    for (auto &r : rings) writeBack(r);
+    trackBuffer.resize(out - in);
+    readTrack(t, {in, out}, trackBuffer.data());
+    file.error.log();
+    peaks[t].rebuild(in, trackBuffer.data(), out - in, before);
+    section.in = out;
+    if (section.size() <= 0) stale.pop_back();
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Compress a block of storage no loaded window is near, see
+ * TapeFile::packBlock. One block at a time, so the thread is soon back to
+ * the windows.
+ * @return whether there may be more to pack
+ */
+bool TapeBuffer::packColdBlock() {
+  if (!GLOB.project->packTape || !file.canPack()) return false;
+  const uint lanes = file.planar() ? edits.size() : 1;
+  const TapeTime size = PackedStore::BLOCK;
+
+  // The storage of the windows, and of what is read next
+  std::vector<std::pair<uint, Section<TapeTime>>> hot;
+  for (auto &r : rings) {
+    if (r.state.load(std::memory_order_acquire) == RingBuffer::IDLE) continue;
+    Section<TapeTime> window = {
+      std::max<TapeTime>(0, r.loadedIn.load() - PREFETCH_SIZE),
+      r.loadedOut.load() + PREFETCH_SIZE
+    };
+    for (auto &list : edits) {
+      list.resolve(window, [&] (auto part, auto *region) {
+          if (region == nullptr) return;
+          hot.push_back({lanes == 1 ? 0 : region->lane,
+              {region->sourceOf(part.in), region->sourceOf(part.out)}});
+        });
+    }
+  }
+  auto isHot = [&] (uint lane, TapeTime block) {
+    return std::any_of(hot.begin(), hot.end(), [&] (auto &h) {
+        return h.first == lane
+          && h.second.in < (block + 1) * size && h.second.out > block * size;
+      });
+  };
+
+  auto &cursor = packCursor;
+  for (uint scanned = 0; scanned < PACK_SCAN; scanned++) {
+    if (cursor.lane >= lanes) cursor.lane = 0;
+    if (cursor.block >= file.packableBlocks(cursor.lane)) {
+      cursor.block = 0;
+      cursor.lane++;
+      // Once around, until the next time there is nothing to do
+      if (cursor.lane >= lanes) return false;
+      continue;
+    }
+    uint block = cursor.block++;
+    if (file.isPacked(cursor.lane, block) || isHot(cursor.lane, block)) continue;
+    return file.packBlock(cursor.lane, block);
+  }
+  return true;
+}
+
+void TapeBuffer::writeBack() {
+  TapeStats::Timer timer;
+  bool written = false;
+  for (auto &r : rings) {
+    if (writeBack(r)) written = true;
+  }
+  file.sync();
+  if (written) timer.stop(stats, TapeStats::WRITE_BACK);
+}
+
+/**
+ * @return whether there was anything to write
+ */
+bool TapeBuffer::writeBack(RingBuffer &buffer) {
+  Section<TapeTime> section;
+  bool written = false;
+  while (buffer.dirty.pop(section)) {
+    applyCheckpoints();
+    writeFromBuffer(buffer, section);
+    syncCopies(buffer, section);
+    written = true;
+  }
+  return written;
+}
+
+/**
+ * Copy frames written in one ring to the other rings that hold them.
+ *
+ * Only rings the audio thread doesn't touch are copied to: `IDLE` ones,
+ * and `RETIRED` ones, which it only empties the dirty queue of. The
+ * active ring is left alone, it may hold newer frames than `from`. A
+ * `READY` ring may be claimed by the audio thread at any time, so it is
+ * marked stale instead, and replaced by `loadCues` with one read anew.
+ */
+void TapeBuffer::syncCopies(const RingBuffer &from, Section<TapeTime> section) {
+  for (auto &r : rings) {
+    if (&r == &from) continue;
+    auto w = r.window();
+    if (!w.valid || w.out <= section.in || w.in >= section.out) continue;
+    int state = r.state.load(std::memory_order_acquire);
+    if (state == RingBuffer::READY) {
+      r.stale = true;
+      continue;
+    }
+    if (state != RingBuffer::IDLE && state != RingBuffer::RETIRED) continue;
+    for (TapeTime t = std::max(section.in, w.in); t < std::min(section.out, w.out); t++) {
+      r.setFrame(t, from.frame(t));
+    }
+  }
+}
+
+// Audio thread:
+
+void TapeBuffer::preProcess() {
+  applyJump();
+  stats.fillFW.add(lengthFW());
+  stats.fillBW.add(lengthBW());
+  // Hand rings we switched away from back to the disk thread
+  for (auto &r : rings) {
+    if (r.state.load(std::memory_order_relaxed) != RingBuffer::RETIRED) continue;
+    markDirty(r, {0, 0});
+    if (!r.unqueuedDirty) {
+      r.state.store(RingBuffer::IDLE, std::memory_order_release);
+      diskSignal.post();
+    }
+  }
+}
+
+void TapeBuffer::setSpeed(float speed, float next) {
+  this->speed.store(speed, std::memory_order_relaxed);
+  nextSpeed.store(next, std::memory_order_relaxed);
+  // The disk thread plans anew right away when the tape changes course
+  int newMode = PrefetchPolicy::mode(speed, next);
+  bool bw = PrefetchPolicy::backwards(speed, next);
+  bool changed = mode.exchange(newMode, std::memory_order_relaxed) != newMode;
+  if (backwards.exchange(bw, std::memory_order_relaxed) != bw || changed) {
+    diskSignal.post();
+  }
+}
+
+void TapeBuffer::applyJump() {
+  TapeTime jump = pendingJump.exchange(-1);
+  if (jump >= 0) {
+    movePlaypointAbs(jump);
+  }
+}
+
+void TapeBuffer::movePlaypointRel(TapeTime time) {
+  movePlaypointAbs(position() + time);
+}
+
+void TapeBuffer::movePlaypointAbs(TapeTime newPos) {
   if (newPos < 0) {
     newPos = 0;
   }
-  uint oldPos = playPoint;
-  int diff = newPos - oldPos;
-  if (diff <= buffer.lengthFW && diff >= -buffer.lengthBW) {
+  auto &buffer = ring();
+  if (buffer.window().contains(newPos)) {
     // The new position is within the loaded section, so keep that data
-    // TODO: This should probably also happen if the new position is just
-    //   slightly outside the section.
-    //   That could be fixed with setting negative FW/BW lenghts
-    // NOTE: Section::overlaps has the correct algorithm for this
-    buffer.playIdx = buffer.wrapIdx(newPos - buffer.posAt0);
-    buffer.lengthBW += diff;
-    buffer.lengthFW -= diff;
-  } else {
-    // just discard the data
-    buffer.lengthBW = 0;
-    buffer.lengthFW = 0;
+    playPoint.store(newPos, std::memory_order_release);
+  } else if (!switchRing(newPos)) {
+    // Make sure the dirty frames get saved before the window is dropped
+    markDirty(buffer, {0, 0});
+    playPoint.store(newPos, std::memory_order_release);
+    buffer.seekEpoch.fetch_add(1);
   }
-  uint newTime = newPos - buffer.playIdx;
-  if (newTime != buffer.posAt0) {
-    buffer.notWritten.in += buffer.posAt0 - newTime;
-    buffer.notWritten.out += buffer.posAt0 - newTime;
-    buffer.posAt0 = newTime;
+  diskSignal.post();
+}
+
+/**
+ * Continue playing from a `READY` ring that has `pos` loaded.
+ * @return false if there is none
+ */
+bool TapeBuffer::switchRing(TapeTime pos) {
+  uint current = active.load(std::memory_order_relaxed);
+  for (uint i = 0; i < RINGS; i++) {
+    if (i == current) continue;
+    auto &r = rings[i];
+    int state = RingBuffer::READY;
+    if (!r.window().contains(pos)) continue;
+    if (!r.state.compare_exchange_strong(state, RingBuffer::ACTIVE)) continue;
+    // The disk thread may have reloaded it in between
+    if (!r.window().contains(pos)) {
+      r.state.store(RingBuffer::READY, std::memory_order_release);
+      continue;
+    }
+    auto &old = rings[current];
+    markDirty(old, {0, 0});
+    old.state.store(RingBuffer::RETIRED, std::memory_order_release);
+    playPoint.store(pos, std::memory_order_release);
+    active.store(i, std::memory_order_release);
+    return true;
   }
-  playPoint = newPos;
-  readData.notify_all();
+  return false;
 }
 
-// Fancy wrapper methods!
-std::vector<AudioFrame> TapeBuffer::readFW(uint nframes) {
-  uint n = std::min<int>(nframes, buffer.lengthFW);
+void TapeBuffer::markDirty(RingBuffer &buffer, Section<TapeTime> section) {
+  auto &unqueuedDirty = buffer.unqueuedDirty;
+  if (unqueuedDirty) {
+    if (buffer.dirty.push(unqueuedDirty)) {
+      unqueuedDirty = {0, 0};
+    }
+  }
+  if (!section) return;
+  if (unqueuedDirty || !buffer.dirty.push(section)) {
+    // The disk thread is way behind. Both sections are within the loaded
+    // window, so so is everything between them, and it is safe to write
+    // back the hull.
+    if (unqueuedDirty) {
+      unqueuedDirty.in = std::min(unqueuedDirty.in, section.in);
+      unqueuedDirty.out = std::max(unqueuedDirty.out, section.out);
+    } else {
+      unqueuedDirty = section;
+    }
+  }
+}
 
-  std::vector<AudioFrame> ret;
+void TapeBuffer::setCues(TapeTime in, TapeTime out) {
+  bool changed = cues[0].exchange(in) != in;
+  changed = cues[1].exchange(out) != out || changed;
+  if (changed) diskSignal.post();
+}
 
-  for (uint i = 0; i < n; i++) {
-    ret.push_back(buffer[buffer.playIdx + i]);
+uint TapeBuffer::readInto(AudioFrame *dst, uint nframes, Direction dir) {
+  applyJump();
+  TapeTime pos = position();
+  auto &buffer = ring();
+  uint n;
+  if (dir == Direction::FW) {
+    n = std::min<int>(nframes, lengthFW());
+    buffer.copyOut(pos, dst, n);
+    movePlaypointRel(n);
+  } else {
+    n = std::min<int>(nframes, lengthBW());
+    buffer.copyOut(pos - n, dst, n);
+    std::reverse(dst, dst + n);
+    movePlaypointRel(-TapeTime(n));
   }
+  // Backwards, the tape may just have ended
+  uint wanted = dir == Direction::FW ? nframes : std::min<TapeTime>(nframes, pos);
+  if (n < wanted) stats.underrun(uint(dir), wanted - n);
+  stats.read(mode.load(std::memory_order_relaxed), n < wanted);
+  return n;
+}
 
-  movePlaypointRel(n);
+Section<TapeTime> TapeBuffer::prepareWrite(
+  uint nframes, Direction dir, uint offset, uint &skip) {
+  applyJump();
+  auto window = ring().window();
+  skip = nframes;
+  if (!window.valid) {
+    if (nframes > 0) stats.overrun(uint(dir), nframes);
+    return {0, 0};
+  }
 
-  return ret;
+  Section<TapeTime> section;
+  if (dir == Direction::FW) {
+    section.out = position() - offset;
+    section.in = std::max<TapeTime>(section.out - nframes, window.in);
+  } else {
+    section.in = position() + offset;
+    section.out = std::min<TapeTime>(section.in + nframes, window.out);
+  }
+  if (section.size() <= 0) section = {0, 0};
+  // Frames outside of the loaded window are skipped
+  skip = nframes - section.size();
+  if (skip > 0) stats.overrun(uint(dir), skip);
+  return section;
 }
 
-std::vector<AudioFrame> TapeBuffer::readBW(uint nframes) {
-  uint n = std::min<int>(nframes, buffer.lengthBW);
+/**
+ * @param lane the track written, -1 for all of them
+ */
+void TapeBuffer::finishWrite(Section<TapeTime> section, int lane) {
+  if (!section) return;
+  // Queued first: a rebuild that sees the new peaks also sees the frames
+  markDirty(ring(), section);
+  updatePeaks(ring(), section, lane);
+  diskSignal.post();
+}
 
-  std::vector<AudioFrame> ret;
+/**
+ * Update the peaks of frames written to the ring. The blocks around them
+ * are recomputed from the ring, as far as it holds them.
+ */
+void TapeBuffer::updatePeaks(const RingBuffer &buffer,
+  Section<TapeTime> section, int lane) {
+  const TapeTime block = PeakPyramid::BLOCK;
+  auto w = buffer.window();
+  Section<TapeTime> blocks = {
+    std::max(section.in / block * block, w.in),
+    std::min((section.out + block - 1) / block * block, w.out)
+  };
+  for (uint l = 0; l < RingBuffer::LANES; l++) {
+    if (lane >= 0 && (uint) lane != l) continue;
+    static_assert(RingBuffer::SIZE % PeakPyramid::BLOCK == 0,
+      "Spans of whole blocks split into whole blocks");
+    buffer.forSpans(blocks.in, blocks.size(), [&] (uint idx, uint off, uint n) {
+        peaks[l].update(blocks.in + off, buffer.lane(l) + idx, n);
+      });
+  }
+}
 
-  for (uint i = 0; i < n; i++) {
-    ret.push_back(buffer[buffer.playIdx - i]);
+uint TapeBuffer::writeFrom(const AudioFrame *src, uint nframes,
+  Direction dir, uint offset) {
+  uint skip;
+  auto section = prepareWrite(nframes, dir, offset, skip);
+  auto &buffer = ring();
+  if (dir == Direction::FW) {
+    buffer.copyIn(section.in, src + skip, section.size());
+  } else {
+    for (int i = 0; i < section.size(); i++) {
+      buffer.setFrame(section.out - 1 - i, src[skip + i]);
+    }
   }
+  finishWrite(section);
+  return section.size();
+}
 
-  movePlaypointRel(-n);
+// Fancy wrapper methods!
+std::vector<AudioFrame> TapeBuffer::readFW(uint nframes) {
+  std::vector<AudioFrame> ret (nframes);
+  ret.resize(readInto(ret.data(), nframes, Direction::FW));
+  return ret;
+}
 
+std::vector<AudioFrame> TapeBuffer::readBW(uint nframes) {
+  std::vector<AudioFrame> ret (nframes);
+  ret.resize(readInto(ret.data(), nframes, Direction::BW));
   return ret;
 }
 
@@ -263,31 +1086,8 @@ uint TapeBuffer::writeFW(
   uint offset,
   std::function<AudioFrame(AudioFrame, AudioFrame)> writeFunc)
 {
-  std::unique_lock<std::recursive_mutex> lock (file.mutex);
-  int n = std::min<int>(data.size(), buffer.SIZE - buffer.lengthFW);
-
-  int beginPos = buffer.playIdx - n - offset;
-
-  for (int i = 0; i < n; i++) {
-    buffer[beginPos + i] = writeFunc(buffer[beginPos + i], data[i]);
-  }
-
-  if (buffer.notWritten) {
-    buffer.notWritten.in =
-      std::min<int>(buffer.notWritten.in, beginPos);
-    buffer.notWritten.out =
-      std::max<int>(buffer.notWritten.out, buffer.playIdx);
-  } else {
-    buffer.notWritten.in = beginPos;
-    buffer.notWritten.out = buffer.playIdx;
-  }
-
-  buffer.lengthBW =
-    std::max<int>(data.size(), buffer.lengthBW);
-  buffer.lengthFW =
-    std::min<int>(buffer.lengthFW, buffer.SIZE - buffer.lengthBW);
-
-  return data.size() - n;
+  return data.size() - writeFrom(
+    data.data(), data.size(), Direction::FW, offset, writeFunc);
 }
 
 uint TapeBuffer::writeBW(
@@ -295,127 +1095,142 @@ uint TapeBuffer::writeBW(
   uint offset,
   std::function<AudioFrame(AudioFrame, AudioFrame)> writeFunc)
 {
-  std::unique_lock<std::recursive_mutex> lock (file.mutex);
-  int n = std::min<int>(data.size(), buffer.SIZE - buffer.lengthBW);
+  return data.size() - writeFrom(
+    data.data(), data.size(), Direction::BW, offset, writeFunc);
+}
 
-  int endPos = buffer.playIdx + n + offset;
+void TapeBuffer::goTo(TapeTime pos) {
+  pendingJump.store(std::max<TapeTime>(pos, 0));
+  diskSignal.post();
+}
 
-  for (int i = 0; i < n; i++) {
-    buffer[endPos - i]= writeFunc(buffer[endPos - i], data[i]);
-  }
+// Cuts & Slices
+std::vector<TapeBuffer::TapeSlice> TapeBuffer::TapeSliceSet::list() const {
+  return *snapshot();
+}
 
-  if (buffer.notWritten) {
-    buffer.notWritten.in =
-      std::min<int>(buffer.notWritten.in, buffer.playIdx);
-    buffer.notWritten.out =
-      std::max<int>(buffer.notWritten.out, endPos);
-  } else {
-    buffer.notWritten.in = buffer.playIdx;
-    buffer.notWritten.out = endPos;
+template<typename F>
+void TapeBuffer::TapeSliceSet::change(F &&f) {
+  auto copy = std::make_shared<Slices>(*snapshot());
+  popRecorded(*copy);
+  f(*copy);
+  std::atomic_store(&slices, Snapshot(std::move(copy)));
+  changed = true;
+}
+
+bool TapeBuffer::TapeSliceSet::popRecorded(Slices &slices) {
+  bool any = false;
+  TapeSlice slice;
+  while (recorded.pop(slice)) {
+    punch(slices, slice, &slice);
+    any = true;
   }
+  return any;
+}
 
-  buffer.lengthFW =
-    std::max<int>(data.size(), buffer.lengthFW);
-  buffer.lengthBW =
-    std::min<int>(buffer.lengthBW, buffer.SIZE - buffer.lengthFW);
+void TapeBuffer::TapeSliceSet::assign(const std::vector<TapeSlice> &list) {
+  std::lock_guard<std::mutex> guard (lock);
+  change([&] (Slices &slices) {
+      slices.assign(list.begin(), list.end());
+      std::sort(slices.begin(), slices.end(), [] (auto &a, auto &b) {
+          return a.in < b.in;
+        });
+    });
+}
 
-  return data.size() - n;
+/**
+ * The slices are disjoint, so sorted by their ends too
+ */
+std::pair<std::size_t, std::size_t>
+TapeBuffer::TapeSliceSet::overlapping(const Slices &slices, TapeSlice area) {
+  auto first = std::partition_point(slices.begin(), slices.end(),
+    [&] (auto &s) {return s.out < area.in;});
+  auto last = std::partition_point(first, slices.end(),
+    [&] (auto &s) {return s.in <= area.out;});
+  return {first - slices.begin(), last - slices.begin()};
 }
 
-void TapeBuffer::goTo(TapeTime pos) {
-  movePlaypointAbs(pos);
+void TapeBuffer::TapeSliceSet::punch(Slices &slices, TapeSlice area,
+  const TapeSlice *middle) {
+  auto range = overlapping(slices, area);
+  std::array<TapeSlice, 3> pieces;
+  std::size_t n = 0;
+  if (range.first < range.second && slices[range.first].in < area.in) {
+    pieces[n++] = {slices[range.first].in, area.in - 1};
+  }
+  if (middle) pieces[n++] = *middle;
+  if (range.first < range.second && slices[range.second - 1].out > area.out) {
+    pieces[n++] = {area.out + 1, slices[range.second - 1].out};
+  }
+  std::size_t old = range.second - range.first;
+  auto at = slices.begin() + range.first;
+  std::copy(pieces.begin(), pieces.begin() + std::min(old, n), at);
+  if (n > old) {
+    slices.insert(at + old, pieces.begin() + old, pieces.begin() + n);
+  } else {
+    slices.erase(at + n, at + old);
+  }
 }
 
-// Cuts & Slices
 std::vector<TapeBuffer::TapeSlice>
 TapeBuffer::TapeSliceSet::slicesIn(Section<TapeTime> area) const {
   std::vector<TapeBuffer::TapeSlice> xs;
-  if (slices.size() == 0) {
-    return xs;
-  }
-  auto it = slices.upper_bound(area);
-  if (it != slices.begin()) --it;
-  if (it == slices.end()) it = slices.begin();
-  if (!it->overlaps(area)) it++;
-  for (; it != slices.end(); it++) {
-    if (area.overlaps(*it)) {
-      xs.push_back(*it);
-    } else {
-      break;
-    }
-  }
+  forEachIn(area, [&] (auto &s) {xs.push_back(s);});
   return xs;
 }
 
 bool TapeBuffer::TapeSliceSet::inSlice(TapeTime time) const {
-  if (slices.size() == 0) return false;
-  auto it = slices.upper_bound({time, time});
-  if (it != slices.begin()) {
-    it--;
-  }
-  if (it->contains(time)) {
-    return true;
-  } else {
-    it++;
-    return it->contains(time);
-  }
+  auto s = snapshot();
+  auto range = overlapping(*s, {time, time});
+  return range.first < range.second;
 }
 
 TapeBuffer::TapeSlice TapeBuffer::TapeSliceSet::current(TapeTime time) const {
-  auto it = slices.upper_bound({time, time});
-  if (it != slices.begin()) {
-    it--;
-  }
-  if (it->contains(time)) {
-    return *it;
-  } else {
-    it++;
-    if (it->contains(time))
-      return *it;
-    return {0, 0};
-  }
+  auto s = snapshot();
+  auto range = overlapping(*s, {time, time});
+  if (range.first < range.second) return (*s)[range.first];
+  return {0, 0};
 }
 
 void TapeBuffer::TapeSliceSet::erase(TapeBuffer::TapeSlice slice) {
   if (slice.size() < 1) return;
-  for (auto &s : slicesIn(slice)) {
-    switch (slice.overlaps(s)) {
-    case Section<>::NONE:
-      break;
-    case Section<>::CONTAINS:
-      slices.erase(s);
-      break;
-    case Section<>::CONTAINED:
-      slices.erase(s);
-      if (s.in != slice.in)
-        slices.emplace(s.in, slice.in - 1);
-      if (s.out != slice.out)
-        slices.emplace(slice.out + 1, s.out);
-      break;
-    case Section<>::CONTAINS_IN:
-      slices.erase(s);
-      slices.emplace(slice.out + 1, s.out);
-      break;
-    case Section<>::CONTAINS_OUT:
-      slices.erase(s);
-      slices.emplace(s.in, slice.in - 1);
-      break;
-    }
-  }
-  changed = true;
+  std::lock_guard<std::mutex> guard (lock);
+  change([&] (Slices &slices) {punch(slices, slice, nullptr);});
 }
 
 void TapeBuffer::TapeSliceSet::addSlice(TapeBuffer::TapeSlice slice) {
-  erase(slice);
-  slices.emplace(slice.in, slice.out);
-  changed = true;
+  std::lock_guard<std::mutex> guard (lock);
+  change([&] (Slices &slices) {punch(slices, slice, &slice);});
+}
+
+void TapeBuffer::TapeSliceSet::record(TapeSlice slice) {
+  if (unqueued && recorded.push(unqueued)) unqueued = {0, 0};
+  if (!unqueued && recorded.push(slice)) return;
+  // Nothing applies them. A take grows in place, the rest are merged
+  if (unqueued && unqueued.in != slice.in) {
+    slice = {std::min(unqueued.in, slice.in), std::max(unqueued.out, slice.out)};
+  }
+  unqueued = slice;
+}
+
+bool TapeBuffer::TapeSliceSet::applyRecorded() {
+  if (recorded.empty()) return false;
+  std::lock_guard<std::mutex> guard (lock);
+  change([] (Slices &) {});
+  return true;
 }
 
 void TapeBuffer::TapeSliceSet::cut(TapeTime time) {
-  if (!inSlice(time)) return;
-  TapeSlice slice = current(time);
-  addSlice({slice.in, time - 1});
-  addSlice({time, slice.out});
+  std::lock_guard<std::mutex> guard (lock);
+  change([&] (Slices &slices) {
+      auto range = overlapping(slices, {time, time});
+      if (range.first == range.second) return;
+      TapeSlice slice = slices[range.first];
+      TapeSlice left = {slice.in, time - 1};
+      TapeSlice right = {time, slice.out};
+      punch(slices, left, &left);
+      punch(slices, right, &right);
+    });
 }
 
 void TapeBuffer::TapeSliceSet::glue(TapeSlice s1, TapeSlice s2) {
@@ -429,29 +1244,100 @@ void TapeBuffer::lift(Track track) {
     return;
   }
   TapeSlice slice = tss.current(position());
-  std::unique_lock<std::mutex> lock(clipboard.lock);
-  clipboard.fromTrack = track;
-  clipboard.fromSlice = slice;
-  readData.notify_all();
-  clipboard.done.wait(lock);
+  checkpoint();
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    clipboard.pending.push_back(Edit::lift(track, slice));
+    clipboard.length = slice.size();
+  }
+  diskSignal.post();
   tss.erase(slice);
 }
 
 void TapeBuffer::drop(Track track) {
-  std::unique_lock<std::mutex> lock(clipboard.lock);
-  clipboard.toTrack = track;
-  clipboard.toTime = position();
-  TapeSlice slice = {
-    clipboard.toTime,
-    clipboard.toTime + (int)clipboard.data.size()
-  };
-  readData.notify_all();
-  clipboard.done.wait(lock);
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    if (clipboard.length <= 0) {
+      LOGD << "Nothing to drop";
+      return;
+    }
+  }
+  checkpoint();
+  TapeSlice slice;
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    slice = {position(), position() + clipboard.length};
+    clipboard.pending.push_back(Edit::drop(track, slice));
+  }
+  diskSignal.post();
   trackSlices[track.idx].addSlice(slice);
 }
 
+void TapeBuffer::importFrames(Track track, TapeTime at, std::vector<float> frames) {
+  if (frames.empty()) return;
+  importing += frames.size();
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    clipboard.pending.push_back(Edit::import(track, at, std::move(frames)));
+  }
+  diskSignal.post();
+}
+
+// Undo
+
+void TapeBuffer::checkpoint() {
+  auto entry = std::make_shared<JournalEntry>();
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    for (uint t = 0; t < entry->slices.size(); t++) {
+      entry->slices[t] = trackSlices[t].list();
+    }
+    journal.undo.push_back(entry);
+    if (journal.undo.size() > UNDO_LEVELS) journal.undo.pop_front();
+    journal.redo.clear();
+    clipboard.pending.push_back(Edit::checkpoint(entry));
+  }
+  diskSignal.post();
+}
+
+void TapeBuffer::swapSlices(JournalEntry &entry) {
+  for (uint t = 0; t < entry.slices.size(); t++) {
+    auto current = trackSlices[t].list();
+    trackSlices[t].assign(entry.slices[t]);
+    entry.slices[t] = std::move(current);
+  }
+}
+
+bool TapeBuffer::undo() {
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    if (journal.undo.empty()) return false;
+    auto entry = journal.undo.back();
+    journal.undo.pop_back();
+    swapSlices(*entry);
+    journal.redo.push_back(entry);
+    clipboard.pending.push_back(Edit::swap(entry));
+  }
+  diskSignal.post();
+  return true;
+}
+
+bool TapeBuffer::redo() {
+  {
+    std::lock_guard<std::mutex> lock (clipboard.lock);
+    if (journal.redo.empty()) return false;
+    auto entry = journal.redo.back();
+    journal.redo.pop_back();
+    swapSlices(*entry);
+    journal.undo.push_back(entry);
+    clipboard.pending.push_back(Edit::swap(entry));
+  }
+  diskSignal.post();
+  return true;
+}
+
 std::string TapeBuffer::timeStr() {
-  double seconds = playPoint/(1.0 * GLOB.samplerate);
+  double seconds = position()/(1.0 * GLOB.samplerate);
   double minutes = seconds / 60.0;
   return fmt::format("{:0>2}:{:0>5.2f}", (int) minutes, fmod(seconds, 60.0));
 }
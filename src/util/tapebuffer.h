@@ -1,23 +1,31 @@
 #pragma once
 
 #include <cstdlib>
+#include <cstring>
 #include <atomic>
+#include <chrono>
 #include <vector>
 #include <array>
-#include <set>
+#include <deque>
+#include <memory>
 #include <iterator>
 #include <thread>
-#include <condition_variable>
+#include <mutex>
 #include <functional>
 #include <fmt/format.h>
 #include <plog/Log.h>
 
 #include "../utils.h"
 #include "dyn-array.h"
+#include "edit-list.h"
+#include "peak-pyramid.h"
+#include "semaphore.h"
+#include "spsc-queue.h"
+#include "tape-stats.h"
 #include "tapefile.h"
+#include "write-modes.h"
 
 namespace top1 {
-using TapeTime = int;
 
 /**
  * A Wrapper for ringbuffers, used for the tapemodule.
@@ -25,89 +33,578 @@ using TapeTime = int;
 class TapeBuffer {
 public:
   using TapeSlice = Section<TapeTime>;
-  class CompareTapeSlice {
-  public:
-    bool operator()(const TapeSlice &e1, const TapeSlice &e2) const {return e1.in < e2.in;}
-  };
 
+  enum class Direction {
+    FW, BW
+  };
+  /**
+   * The slices of a track, disjoint and sorted.
+   *
+   * Readers get an immutable snapshot, searched with binary searches, that
+   * stays valid however the set changes meanwhile. A change copies the
+   * slices under a lock, and publishes the copy with an atomic swap.
+   *
+   * The audio thread neither locks nor allocates: it queues the slices it
+   * records with `record`, and `applyRecorded` adds them on another thread.
+   * Recording adds the same slice again and again as it grows, so only the
+   * latest of those matters.
+   */
   class TapeSliceSet {
-    std::set<TapeSlice, CompareTapeSlice> slices;
   public:
-    bool changed = false;
-    TapeSliceSet() {}
+    using Slices = std::vector<TapeSlice>;
+    using Snapshot = std::shared_ptr<const Slices>;
+
+  private:
+    /** Only accessed through std::atomic_load and std::atomic_store */
+    Snapshot slices;
+    /** Held while changing the slices */
+    std::mutex lock;
+    /** Slices recorded by the audio thread, see `record` */
+    SPSCQueue<TapeSlice, 1024> recorded;
+    /** A slice that could not be queued yet. Audio thread only */
+    TapeSlice unqueued;
+
+    /** Indices `[first, second)` of the slices overlapping `area` */
+    static std::pair<std::size_t, std::size_t> overlapping(
+      const Slices &slices, TapeSlice area);
+    /** Replace the slices overlapping `area` with what is left of them
+     *  around it, and `middle` if given */
+    static void punch(Slices &slices, TapeSlice area, const TapeSlice *middle);
+    /** Publish a copy of the slices changed by `f(slices)`, after the
+     *  recorded ones. Holding `lock` */
+    template<typename F>
+    void change(F &&f);
+    /** Add the recorded slices to `slices`. Holding `lock` */
+    bool popRecorded(Slices &slices);
+  public:
+
+    /** Set on changes, until the disk thread saved them */
+    std::atomic_bool changed = {false};
+    TapeSliceSet() : slices (std::make_shared<const Slices>()) {}
+
+    /** The slices as they are now, left alone by later changes */
+    Snapshot snapshot() const {
+      return std::atomic_load(&slices);
+    }
+
     std::vector<TapeSlice> slicesIn(Section<TapeTime> area) const;
 
+    /** Call `f(slice)` for each slice overlapping `area`, in order.
+     *  Doesn't allocate */
+    template<typename F>
+    void forEachIn(Section<TapeTime> area, F &&f) const {
+      auto s = snapshot();
+      auto range = overlapping(*s, area);
+      for (auto i = range.first; i < range.second; i++) f((*s)[i]);
+    }
+
     bool inSlice(TapeTime time) const;
     TapeSlice current(TapeTime time) const;
 
     void addSlice(TapeSlice slice);
     void erase(TapeSlice slice);
 
+    /** Add `slice` later, see `applyRecorded`. Audio thread */
+    void record(TapeSlice slice);
+    /**
+     * Add the slices queued by `record`. Not on the audio thread.
+     * @return whether there were any
+     */
+    bool applyRecorded();
+
     void cut(TapeTime time);
     void glue(TapeSlice s1, TapeSlice s2);
 
-    // Iteration
-    auto begin() { return slices.begin(); }
-    auto end() { return slices.end(); }
-    auto size() { return slices.size(); }
+    std::vector<TapeSlice> list() const;
+    /** Replace all slices with `list` */
+    void assign(const std::vector<TapeSlice> &list);
+
+    std::size_t size() const { return snapshot()->size(); }
   };
+
+  struct RingBuffer;
 protected:
   const static int MIN_READ_SIZE = 2048;
+  /**
+   * Frames past each end of the window that are read ahead in the
+   * background, so extending the window rarely waits for the disk.
+   */
+  const static int PREFETCH_SIZE = 65536;
 
-  /** The current position on the tape, counted in frames from the beginning*/
-  std::atomic_uint playPoint;
+  std::thread diskThread;
+  std::atomic_bool running = {false};
 
+  /** Posted whenever the disk thread has something to do */
+  Semaphore diskSignal;
 
-  std::thread diskThread;
-  std::condition_variable_any readData;
+  /**
+   * A jump requested by goTo, applied by the audio thread.
+   * -1 if there is none.
+   */
+  std::atomic<TapeTime> pendingJump = {-1};
 
-  std::atomic_bool newCuts;
+  /** See setSpeed. Written by the audio thread */
+  std::atomic<float> speed = {0};
+  std::atomic<float> nextSpeed = {0};
+  std::atomic<int> mode = {PrefetchPolicy::STOPPED};
+  std::atomic_bool backwards = {false};
 
   void threadRoutine();
 
-  void movePlaypointRel(int time);
+  // Audio thread
+
+  void applyJump();
+
+  void movePlaypointRel(TapeTime time);
+
+  void movePlaypointAbs(TapeTime pos);
+
+  void markDirty(RingBuffer &ring, Section<TapeTime> section);
+
+  bool switchRing(TapeTime pos);
+
+  Section<TapeTime> prepareWrite(
+    uint nframes, Direction dir, uint offset, uint &skip);
+  void finishWrite(Section<TapeTime> section, int lane = -1);
+  void updatePeaks(const RingBuffer &ring, Section<TapeTime> section, int lane);
+
+  // Disk thread
+
+  void readToBuffer(RingBuffer &ring, Section<TapeTime> section);
+  void readTrack(uint track, Section<TapeTime> section, float *dst);
+  void prefetch(Section<TapeTime> section);
+
+  void writeFromBuffer(RingBuffer &ring, Section<TapeTime> section);
+
+  void writeTrack(RingBuffer &ring, uint track, Section<TapeTime> section);
+  void storeTrack(uint track, Section<TapeTime> section, const float *src);
+  bool isShared(const EditList::Region &region, Section<TapeTime> storage);
+  bool isShared(Section<TapeTime> section);
+  TapeTime storageEnd(uint lane);
+  bool applyEdits();
+  void applyCheckpoints();
+  void saveMetadata(bool now = false);
+
+  TapeTime trackEnd(uint track);
+  void loadPeaks();
+  bool rebuildPeaks();
+
+  void writeBack();
+  bool writeBack(RingBuffer &ring);
+  void syncCopies(const RingBuffer &from, Section<TapeTime> section);
+
+  bool fillWindow(uint ringIdx, const PrefetchPolicy::Plan &plan);
+  void loadCues(int desLength);
+  void invalidate();
+  void invalidate(Section<TapeTime> section);
+
+  /**
+   * Where each track is stored. Disk thread only, the other threads
+   * change it through `Edit`s.
+   */
+  std::array<EditList, 4> edits;
 
-  void movePlaypointAbs(int pos);
+  /** Edit lists changed since they were saved. Disk thread */
+  std::array<bool, 4> editsChanged = {{false, false, false, false}};
+
+  /** Metadata is saved at most this often */
+  static constexpr std::chrono::milliseconds METADATA_INTERVAL {500};
+  std::chrono::steady_clock::time_point metadataSaved;
+
+  /**
+   * How long to wait for the audio thread when the active ring can't be
+   * filled, at most. It posts `diskSignal` as it moves on.
+   */
+  static constexpr std::chrono::milliseconds FILL_RETRY {2};
+
+  /**
+   * The tracks as they were before an edit, to go back to.
+   *
+   * The storage the edit lists refer to is never overwritten. Recording
+   * over it stores the frames anew, see writeTrack. Going back is then
+   * only a matter of swapping lists, and the frames that did not change
+   * are shared by all the steps.
+   */
+  struct JournalEntry {
+    /** Disk thread */
+    std::array<EditList, 4> edits;
+    /** Guarded by `clipboard.lock` */
+    std::array<std::vector<TapeSlice>, 4> slices;
+  };
+
+  /**
+   * A change to `edits`, applied by the disk thread.
+   *  - `LIFT` and `DROP` use `track` and `section`.
+   *  - `CHECKPOINT` stores the edit lists in `entry`.
+   *  - `SWAP` swaps them with the ones in `entry`, to undo or redo.
+   *  - `IMPORT` stores `frames` on `track` at `section`.
+   */
+  struct Edit {
+    enum Type {
+      LIFT, DROP, CHECKPOINT, SWAP, IMPORT
+    } type;
+    Track track;
+    TapeSlice section;
+    std::shared_ptr<JournalEntry> entry;
+    std::vector<float> frames;
+
+    static Edit lift(Track track, TapeSlice section) {
+      return {LIFT, track, section, nullptr, {}};
+    }
+    static Edit drop(Track track, TapeSlice section) {
+      return {DROP, track, section, nullptr, {}};
+    }
+    static Edit checkpoint(std::shared_ptr<JournalEntry> entry) {
+      return {CHECKPOINT, Track(), {}, std::move(entry), {}};
+    }
+    static Edit swap(std::shared_ptr<JournalEntry> entry) {
+      return {SWAP, Track(), {}, std::move(entry), {}};
+    }
+    static Edit import(Track track, TapeTime at, std::vector<float> frames) {
+      TapeSlice section = {at, at + TapeTime(frames.size())};
+      return {IMPORT, track, section, nullptr, std::move(frames)};
+    }
+
+  private:
+    Edit(Type type, Track track, TapeSlice section,
+      std::shared_ptr<JournalEntry> entry, std::vector<float> frames)
+      : type (type), track (track), section (section),
+        entry (std::move(entry)), frames (std::move(frames)) {}
+  };
+
+  /** Frames of `IMPORT` edits not stored yet */
+  std::atomic<std::size_t> importing = {0};
 
   struct {
-    std::vector<float> data;
-    Track fromTrack;
-    TapeSlice fromSlice = {-1, -2};
-    Track toTrack;
-    TapeTime toTime = -1;
+    /** The regions of the last lift. Disk thread */
+    EditList::Clip clip;
+    /** Length of the last lift */
+    TapeTime length = 0;
+    /** Edits waiting for the disk thread */
+    std::vector<Edit> pending;
     std::mutex lock;
-    std::condition_variable done;
   } clipboard;
 
+  /** Guarded by `clipboard.lock` */
+  struct {
+    std::deque<std::shared_ptr<JournalEntry>> undo;
+    std::deque<std::shared_ptr<JournalEntry>> redo;
+  } journal;
+
+  /** The entries whose storage has to be kept. Disk thread */
+  std::vector<std::weak_ptr<JournalEntry>> journaled;
+
+  void swapSlices(JournalEntry &entry);
+  void storeCheckpoint(const std::shared_ptr<JournalEntry> &entry);
+  void swapEdits(JournalEntry &entry);
+
+  /** Disk thread scratch space */
+  std::vector<float> trackBuffer;
+
+  /** Frames rebuilt from the file at once */
+  static constexpr TapeTime PEAKS_REBUILD_SIZE = 65536;
+
+  /** Blocks looked at for packing at once */
+  static constexpr uint PACK_SCAN = 4096;
+
+  /** The next block to look at for packing */
+  struct {
+    uint lane = 0;
+    uint block = 0;
+  } packCursor;
+
+  bool packColdBlock();
+
+  /**
+   * Sections of each track whose peaks have to be rebuilt from the file,
+   * e.g. after a drop. Disk thread.
+   */
+  std::array<std::vector<Section<TapeTime>>, 4> stalePeaks;
+
 public:
   TapeFile file;
 
+  /**
+   * A window of frames loaded from the tape.
+   *
+   * Shared between the audio thread and the disk thread without locks.
+   * Every cursor has exactly one writer, and they are kept on separate
+   * cache lines so the two threads don't fight over them:
+   *  - `loadedIn` and `loadedOut` are only moved by the disk thread.
+   *    The frames `[loadedIn, loadedOut)` are valid.
+   *  - `seekEpoch` is incremented (never set) by whoever needs the window
+   *    thrown away, i.e. on jumps out of the window. The disk thread then
+   *    reloads around the playpoint and publishes `windowEpoch`. Until the
+   *    two match, the window is considered empty.
+   *  - `state` tells who owns the ring, see `State`.
+   *
+   * Within an epoch, the disk thread only grows the active window towards
+   * the playpoint's surroundings, and only evicts frames at least
+   * `SIZE / 16` frames away from it, see PrefetchPolicy, which is more
+   * than the audio thread ever reads in one cycle.
+   *
+   * Frames written by the audio thread are published in `dirty`, and
+   * written to disk before the disk thread reuses the slots.
+   */
   struct RingBuffer {
     const static uint SIZE = 262144; // 2^18
-    DynArray<AudioFrame> data = DynArray<AudioFrame>(SIZE);
-    Section<int> notWritten;
-    std::atomic_int lengthFW = {0};
-    std::atomic_int lengthBW = {0};
-    std::atomic_uint playIdx = {0};
-    std::atomic_uint posAt0 = {0};
 
-    AudioFrame& operator[](int i) {
-      return data[wrapIdx(i)];
+    /**
+     * Ownership of a ring.
+     *
+     * The audio thread plays from the `ACTIVE` ring, and claims a `READY`
+     * one (compare and swap) when jumping to a position it has loaded.
+     * The ring it leaves is `RETIRED` until its dirty frames are queued,
+     * after which the disk thread may reuse it (`IDLE`). The disk thread
+     * takes a `READY` ring back to `IDLE` with a compare and swap before
+     * changing it.
+     */
+    enum State {
+      IDLE, READY, ACTIVE, RETIRED
+    };
+
+    const static uint LANES = AudioFrame::size / sizeof(float);
+    static_assert(LANES == 4, "copyIn and copyOut expect four tracks");
+
+    /**
+     * The tracks are stored planar, track `l` in `[l * SIZE, (l + 1) * SIZE)`,
+     * so single track writes touch contiguous memory.
+     */
+    DynArray<float> data = DynArray<float>(SIZE * LANES);
+
+    struct Window {
+      bool valid = false;
+      TapeTime in = 0;
+      TapeTime out = 0;
+
+      bool contains(TapeTime time) const {
+        return valid && time >= in && time <= out;
+      }
+    };
+
+    alignas(64) std::atomic_int state = {IDLE};
+
+    // Disk thread
+    alignas(64) std::atomic<TapeTime> loadedIn = {0};
+    std::atomic<TapeTime> loadedOut = {0};
+    std::atomic_uint windowEpoch = {0};
+    /** The cue point a `READY` ring is loaded around */
+    TapeTime cue = -1;
+    /** Whether the file changed under a `READY` ring, see syncCopies */
+    bool stale = false;
+
+    // Any thread
+    alignas(64) std::atomic_uint seekEpoch = {1};
+
+    /** Sections written by the audio thread, waiting to be saved */
+    SPSCQueue<Section<TapeTime>, 1024> dirty;
+
+    /** Dirty frames that could not be queued yet. Audio thread only. */
+    Section<TapeTime> unqueuedDirty;
+
+    float *lane(uint l) {
+      return data.data() + l * SIZE;
+    }
+
+    const float *lane(uint l) const {
+      return data.data() + l * SIZE;
+    }
+
+    AudioFrame frame(TapeTime time) const {
+      AudioFrame f;
+      uint idx = wrapIdx(time);
+      for (uint l = 0; l < LANES; l++) f[l] = lane(l)[idx];
+      return f;
     }
 
-    uint wrapIdx(int index) {
-      return ((index %= SIZE) < 0) ? SIZE + index : index;
+    void setFrame(TapeTime time, AudioFrame f) {
+      uint idx = wrapIdx(time);
+      for (uint l = 0; l < LANES; l++) lane(l)[idx] = f[l];
     }
 
-  } buffer;
+    /**
+     * Call `f(idx, offset, count)` for the contiguous parts of
+     * `[from, from + n)`, split where the ring wraps.
+     * `idx` is the index in the lanes, `offset` the index in `[0, n)`.
+     */
+    template<typename F>
+    void forSpans(TapeTime from, uint n, F &&f) const {
+      uint idx = wrapIdx(from);
+      uint first = std::min(n, SIZE - idx);
+      f(idx, 0u, first);
+      if (first < n) f(0u, first, n - first);
+    }
+
+    /**
+     * Copy `[from, from + n)` out of the ring, interleaving the tracks.
+     */
+    void copyOut(TapeTime from, AudioFrame *dst, uint n) const {
+      forSpans(from, n, [&] (uint idx, uint offset, uint count) {
+          // Spelled out, it is a lot easier on the optimizer than a loop
+          const float *a = lane(0) + idx, *b = lane(1) + idx;
+          const float *c = lane(2) + idx, *d = lane(3) + idx;
+          AudioFrame *out = dst + offset;
+          for (uint i = 0; i < count; i++) {
+            out[i][0] = a[i];
+            out[i][1] = b[i];
+            out[i][2] = c[i];
+            out[i][3] = d[i];
+          }
+        });
+    }
+
+    /**
+     * Copy into `[to, to + n)` of the ring, deinterleaving the tracks.
+     */
+    void copyIn(TapeTime to, const AudioFrame *src, uint n) {
+      forSpans(to, n, [&] (uint idx, uint offset, uint count) {
+          float *a = lane(0) + idx, *b = lane(1) + idx;
+          float *c = lane(2) + idx, *d = lane(3) + idx;
+          const AudioFrame *in = src + offset;
+          for (uint i = 0; i < count; i++) {
+            a[i] = in[i][0];
+            b[i] = in[i][1];
+            c[i] = in[i][2];
+            d[i] = in[i][3];
+          }
+        });
+    }
+
+    uint wrapIdx(TapeTime index) const {
+      return ((index %= (int) SIZE) < 0) ? SIZE + index : index;
+    }
+
+    /**
+     * A snapshot of the loaded window.
+     * Wait free, if the window is being reloaded it is reported invalid.
+     */
+    Window window() const {
+      Window w;
+      uint epoch = seekEpoch.load();
+      w.valid = windowEpoch.load(std::memory_order_acquire) == epoch;
+      w.in = loadedIn.load(std::memory_order_acquire);
+      w.out = loadedOut.load(std::memory_order_acquire);
+      w.valid = w.valid && seekEpoch.load() == epoch;
+      return w;
+    }
+
+  };
+
+  /** Positions kept loaded, see setCues */
+  static constexpr uint CUES = 2;
+
+  /**
+   * One ring follows the playpoint, the others are kept loaded around the
+   * cue points, so jumping there does not have to wait for the disk.
+   * The spare one replaces a cue ring gone stale, see syncCopies.
+   */
+  static constexpr uint RINGS = CUES + 2;
+  std::array<RingBuffer, RINGS> rings;
+
+  /** Only moved by the audio thread */
+  alignas(64) std::atomic<TapeTime> playPoint = {0};
+
+  /** Index of the `ACTIVE` ring. Only changed by the audio thread */
+  std::atomic_uint active = {0};
+
+  /** Positions to keep loaded, -1 for none. See setCues */
+  std::array<std::atomic<TapeTime>, CUES> cues;
+
+  /** The ring being played. Audio thread */
+  RingBuffer &ring() {
+    return rings[active.load(std::memory_order_relaxed)];
+  }
+
+  const RingBuffer &ring() const {
+    return rings[active.load(std::memory_order_relaxed)];
+  }
+
+  /** Frames available forwards from the playpoint */
+  int lengthFW() const {
+    auto w = ring().window();
+    TapeTime pos = position();
+    return w.contains(pos) ? w.out - pos : 0;
+  }
+
+  /** Frames available backwards from the playpoint */
+  int lengthBW() const {
+    auto w = ring().window();
+    TapeTime pos = position();
+    return w.contains(pos) ? pos - w.in : 0;
+  }
 
   TapeSliceSet trackSlices[4] = {{}, {}, {}, {}};
 
+  /** Underruns, fill levels and disk latencies. Safe to read from any thread */
+  TapeStats stats;
+
+  /**
+   * Overview of each track, for drawing. Updated by the audio thread as it
+   * writes, and by the disk thread after edits. Safe to read from any thread.
+   */
+  std::array<PeakPyramid, 4> peaks;
+
   TapeBuffer();
 
   void init();
   void exit();
 
+  /**
+   * Write everything recorded and edited to the tape file right away,
+   * e.g. before something else reads it. Waits for the disk thread.
+   */
+  void save();
+
+  /**
+   * Reads along the tape, moving the playPoint.
+   *
+   * Realtime safe, copies straight out of the ring without allocating.
+   * Forwards reads `[playPoint, playPoint + nframes)`, backwards reads
+   * `[playPoint - nframes, playPoint)`.
+   * @param dst where to put the frames. They are stored in read order,
+   *   meaning reverse when reading backwards.
+   * @return the number of frames read. Less than nframes if the disk
+   *   thread has not loaded them yet.
+   */
+  uint readInto(AudioFrame *dst, uint nframes, Direction dir);
+
+  /**
+   * Writes frames to the tape, replacing what was there.
+   *
+   * Realtime safe.
+   * @param src the frames, in write order.
+   * @param offset forwards the end of the data will be at
+   *   `playPoint - offset`, backwards at `playPoint + offset`.
+   * @return the number of frames written. Frames that would land outside
+   *   of the loaded section are skipped from the start of `src`.
+   */
+  uint writeFrom(const AudioFrame *src, uint nframes,
+    Direction dir, uint offset = 0);
+
+  /**
+   * Writes frames to the tape, combining them with what was there.
+   *
+   * Like writeFrom above, but `writeFunc` is called for each frame with
+   * the original and the new frame, and returns the frame to store.
+   */
+  template<typename WriteFunc>
+  uint writeFrom(const AudioFrame *src, uint nframes,
+    Direction dir, uint offset, WriteFunc &&writeFunc);
+
+  /**
+   * Writes a single track to the tape.
+   *
+   * Like writeFrom, but only the track `lane` is touched, and the write is
+   * done by one of the kernels in `writemode`, once for each contiguous
+   * part of the ring.
+   * @param src the mono samples, in write order.
+   * @param mode e.g. `writemode::Overdub()`. Taken by reference, so
+   *   stateful modes like `writemode::Punch` keep their state between calls.
+   */
+  template<typename Mode>
+  uint writeLane(const float *src, uint nframes, uint lane,
+    Direction dir, uint offset, Mode &&mode);
+
   /**
    * Reads forwards along the tape, moving the playPoint.
    * @param nframes number of frames to read.
@@ -117,6 +614,7 @@ public:
 
   /**
    * Reads backwards along the tape, moving the playPoint.
+   * Reads the frames before the playPoint, i.e. `[playPoint - nframes, playPoint)`
    * @param nframes number of frames to read.
    * @return a vector of length nframes with the data. The data will be in the
    *        read order, meaning reverse.
@@ -152,19 +650,134 @@ public:
     = [](AudioFrame, AudioFrame n) { return n; });
 
   /**
-   * Jumps to another position in the tape
+   * Jumps to another position in the tape.
+   * Safe to call from any thread, the jump is performed by the audio thread
+   * the next time it accesses the buffer.
    * @param tapePos position to jump to
    */
   void goTo(TapeTime tapePos);
 
-  TapeTime position() {
-    return playPoint;
+  /**
+   * Keep the frames around these positions loaded, e.g. the ends of a loop.
+   * Jumping to a cue point does not have to wait for the disk.
+   * Safe to call from any thread.
+   * @param in, out the cue points, -1 for none
+   */
+  void setCues(TapeTime in, TapeTime out);
+
+  /**
+   * Called by the audio thread at the start of every cycle.
+   * Performs jumps requested with goTo.
+   */
+  void preProcess();
+
+  /**
+   * How fast the tape moves, negative backwards, and the speed it is
+   * heading for. The disk thread loads ahead accordingly, see
+   * PrefetchPolicy. Called by the audio thread, every cycle.
+   */
+  void setSpeed(float speed, float next);
+
+  TapeTime position() const {
+    return playPoint.load(std::memory_order_relaxed);
   }
 
+  /** Undo steps kept */
+  static constexpr uint UNDO_LEVELS = 10;
+
+  /**
+   * Start a new undo step, e.g. before recording a take.
+   * Lifts and drops start their own.
+   */
+  void checkpoint();
+
+  /**
+   * Go back to before the last step, without copying any audio.
+   * @return false if there is nothing to undo
+   */
+  bool undo();
+  /** Undo the last undo */
+  bool redo();
+
+  /**
+   * Lift the slice at the playpoint off the track onto the clipboard.
+   * Only the edit list changes, the audio stays where it is on disk.
+   * Returns right away, the disk thread applies the edit.
+   */
   void lift(Track track);
+
+  /**
+   * Drop the clipboard onto the track at the playpoint, replacing what
+   * was there. Like lift, only the edit list changes.
+   */
   void drop(Track track);
 
+  /**
+   * Store `frames` on `track` from `at` on, replacing what was there, e.g.
+   * audio imported from a file. Safe to call from any thread.
+   *
+   * The disk thread writes them straight to the file, and only reloads
+   * the rings holding that part of the tape. Playing elsewhere is not
+   * disturbed.
+   */
+  void importFrames(Track track, TapeTime at, std::vector<float> frames);
+
+  /** Frames passed to importFrames that are not stored yet */
+  std::size_t pendingImports() const {
+    return importing.load(std::memory_order_acquire);
+  }
+
   std::string timeStr();
 
 };
+
+template<typename WriteFunc>
+uint TapeBuffer::writeFrom(const AudioFrame *src, uint nframes,
+  Direction dir, uint offset, WriteFunc &&writeFunc) {
+  uint skip;
+  auto section = prepareWrite(nframes, dir, offset, skip);
+  auto &buffer = ring();
+  const int size = section.size();
+  src += skip;
+  buffer.forSpans(section.in, size, [&] (uint idx, uint off, uint count) {
+      float *lanes[RingBuffer::LANES];
+      for (uint l = 0; l < RingBuffer::LANES; l++) {
+        lanes[l] = buffer.lane(l) + idx;
+      }
+      for (uint i = 0; i < count; i++) {
+        // Backwards, src is in reverse
+        int j = dir == Direction::FW ? off + i : size - 1 - (off + i);
+        AudioFrame frame;
+        for (uint l = 0; l < RingBuffer::LANES; l++) frame[l] = lanes[l][i];
+        frame = writeFunc(frame, src[j]);
+        for (uint l = 0; l < RingBuffer::LANES; l++) lanes[l][i] = frame[l];
+      }
+    });
+  finishWrite(section);
+  return size;
+}
+
+template<typename Mode>
+uint TapeBuffer::writeLane(const float *src, uint nframes, uint lane,
+  Direction dir, uint offset, Mode &&mode) {
+  uint skip;
+  auto section = prepareWrite(nframes, dir, offset, skip);
+  uint size = section.size();
+  float *data = ring().lane(lane);
+  src += skip;
+  if (dir == Direction::FW) {
+    uint idx = ring().wrapIdx(section.in);
+    uint first = std::min(size, RingBuffer::SIZE - idx);
+    mode.template write<1>(data + idx, src, first);
+    mode.template write<1>(data, src + first, size - first);
+  } else {
+    uint idx = ring().wrapIdx(section.out - 1);
+    uint first = std::min(size, idx + 1);
+    mode.template write<-1>(data + idx, src, first);
+    mode.template write<-1>(data + RingBuffer::SIZE - 1, src + first, size - first);
+  }
+  finishWrite(section, lane);
+  return size;
+}
+
 }
@@ -1,17 +1,670 @@
 #include "tapefile.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <fmt/format.h>
+
 namespace top1 {
 
 /****************************************/
 /* TapeFile Implementation              */
 /****************************************/
 
+const uint TapeFile::MAX_SLICES;
+const u4b TapeFile::RegionData::END;
+const u4b TapeFile::RegionData::OLD_END;
+
 void TapeFile::readSlices() {
   slices.read(this);
 }
 
 void TapeFile::writeSlices() {
   slices.write(this);
+  writeLongSlices();
+}
+
+void TapeFile::writeSlices(uint track) {
+  slices.tracks[track].write(this);
+  fileStream.flush();
+  writeLongSlices();
+}
+
+std::vector<TapeFile::SliceData> TapeFile::sliceList(uint track) const {
+  if (!longSlices[track].empty()) return longSlices[track];
+  auto &chunk = slices.tracks[track];
+  return {chunk.slices.begin(), chunk.slices.begin() + chunk.count};
+}
+
+void TapeFile::setSliceList(uint track, std::vector<SliceData> list) {
+  auto &chunk = slices.tracks[track];
+  chunk.count = std::min<std::size_t>(list.size(), MAX_SLICES);
+  std::copy(list.begin(), list.begin() + chunk.count, chunk.slices.begin());
+  if (list.size() > MAX_SLICES) longSlices[track] = std::move(list);
+  else longSlices[track].clear();
+}
+
+std::string TapeFile::slicesPath(std::string path) {
+  return path + ".slices";
+}
+
+/**
+ * A track's list is only taken if it starts with the slices in the tape,
+ * in case the tape was saved without it since.
+ */
+void TapeFile::readLongSlices() {
+  for (auto &list : longSlices) list.clear();
+  std::ifstream in (slicesPath(path), std::ios::binary);
+  SlicesHeader header;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) return;
+  if (std::memcmp(header.id, SlicesHeader().id, 4) != 0 || header.version != 1) {
+    LOGW << "Ignoring slices of '" << path << "' in an unknown format";
+    return;
+  }
+  struct {
+    ChunkFCC id;
+    u4b size;
+    u4b track;
+    u4b count;
+  } chunk;
+  while (in.read(reinterpret_cast<char *>(&chunk), sizeof(chunk))) {
+    if (chunk.id != ChunkFCC("trak") || chunk.track >= longSlices.size()
+      || chunk.size != 8 + chunk.count * sizeof(SliceData)) break;
+    std::vector<SliceData> list (chunk.count);
+    if (!in.read(reinterpret_cast<char *>(list.data()),
+        chunk.count * sizeof(SliceData))) break;
+    auto &saved = slices.tracks[chunk.track];
+    bool current = saved.count == MAX_SLICES && list.size() > MAX_SLICES
+      && std::equal(saved.slices.begin(), saved.slices.end(), list.begin(),
+        [] (auto &a, auto &b) {return a.inPos == b.inPos && a.outPos == b.outPos;});
+    if (current) longSlices[chunk.track] = std::move(list);
+  }
+}
+
+/** Rewritten whole, it is only there for heavily edited tracks */
+void TapeFile::writeLongSlices() {
+  bool any = std::any_of(longSlices.begin(), longSlices.end(),
+    [] (auto &list) {return !list.empty();});
+  std::string file = slicesPath(path);
+  if (!any) {
+    std::remove(file.c_str());
+    return;
+  }
+  std::ofstream out (file, std::ios::binary | std::ios::trunc);
+  SlicesHeader header;
+  out.write(reinterpret_cast<char *>(&header), sizeof(header));
+  for (u4b t = 0; t < longSlices.size(); t++) {
+    auto &list = longSlices[t];
+    if (list.empty()) continue;
+    ChunkFCC id = "trak";
+    u4b count = list.size();
+    u4b size = 8 + count * sizeof(SliceData);
+    out.write(reinterpret_cast<char *>(&id), sizeof(id));
+    out.write(reinterpret_cast<char *>(&size), sizeof(size));
+    out.write(reinterpret_cast<char *>(&t), sizeof(t));
+    out.write(reinterpret_cast<char *>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char *>(list.data()), size - 8);
+  }
+  if (!out) LOGE << "Couldn't write the slices of '" << path << "'";
+}
+
+void TapeFile::writeEdits(uint track) {
+  edits.tracks[track].write(this);
+  fileStream.flush();
+}
+
+std::string TapeFile::trackPath(std::string path, uint lane) {
+  return fmt::format("{}.track{}.wav", path, lane + 1);
+}
+
+std::string TapeFile::peaksPath(std::string path) {
+  return path + ".peaks";
+}
+
+std::string TapeFile::packedPath(std::string path) {
+  return path + ".packed";
+}
+
+void TapeFile::open(std::string path) {
+  // Sidecars left over from a deleted tape
+  if (!readOnly && !std::ifstream(path)) {
+    std::remove(peaksPath(path).c_str());
+    std::remove(slicesPath(path).c_str());
+    std::remove(packedPath(path).c_str());
+    for (uint l = 0; l < channels; l++) {
+      std::remove(packedPath(trackPath(path, l)).c_str());
+    }
+  }
+  SndFile<4>::open(path);
+  if (readOnly) {
+    if (!fileStream.is_open()) return;
+  } else {
+    if (top1Chunk.offset < 0 && audioChunk.offset >= 0) {
+      insertMetadata();
+    }
+    if (top1Chunk.version < 2) upgradeEdits();
+    // Tapes from before RF64, so they can still grow past 4 GB
+    insertDs64();
+  }
+  readLongSlices();
+  if (std::ifstream(trackPath(path, 0))) {
+    openTracks();
+  } else {
+    packed[0].open(packedPath(path), channels);
+  }
+}
+
+void TapeFile::close() {
+  for (auto &track : trackFiles) {
+    if (track) track->close();
+    track = nullptr;
+  }
+  if (peaksFile.is_open()) peaksFile.close();
+  peaksHeader = PeaksHeader();
+  for (auto &list : longSlices) list.clear();
+  for (auto &store : packed) store.close();
+  packingFailed = false;
+  SndFile<4>::close();
+}
+
+void TapeFile::flush() {
+  for (auto &track : trackFiles) {
+    if (track) track->flush();
+  }
+  SndFile<4>::flush();
+}
+
+void TapeFile::sync() {
+  for (auto &track : trackFiles) {
+    if (track) track->sync();
+  }
+  SndFile<4>::sync();
+}
+
+/**
+ * Tapes saved without the TOP1 chunk have the audio right after the
+ * format. Move it back to fit the chunk in between.
+ */
+void TapeFile::insertMetadata() {
+  std::size_t from = audioChunk.offset;
+  std::size_t length = 8 + ds64.dataSize;
+  std::size_t shift = 8 + top1Chunk.size;
+  LOGI << "Adding tape metadata to '" << path << "'";
+  if (mapped()) {
+    if (!mappedAudio.reserve(from + shift + length)) return;
+    char *data = mappedAudio.data();
+    std::memmove(data + from + shift, data + from, length);
+    mappedAudio.markDirty(from, from + shift + length);
+  } else {
+    // Back to front, the ranges overlap
+    std::vector<char> block (1 << 20);
+    for (std::size_t done = 0; done < length;) {
+      std::size_t n = std::min(block.size(), length - done);
+      std::size_t pos = from + length - done - n;
+      fseek(pos);
+      readBytes(block.data(), n);
+      fseek(pos + shift);
+      writeBytes(block.data(), n);
+      done += n;
+    }
+  }
+  top1Chunk.offset = from;
+  audioChunk.offset = from + shift;
+  ds64.riffSize += shift;
+  writeFile();
+}
+
+/**
+ * Tapes of version 1 stored open regions as OLD_END, a position that
+ * tapes past 2^31 frames can reach. Store them as END.
+ */
+void TapeFile::upgradeEdits() {
+  for (auto &chunk : edits.tracks) {
+    for (uint i = 0; i < chunk.count; i++) {
+      auto &r = chunk.regions[i];
+      if (r.outPos == RegionData::OLD_END) r.outPos = RegionData::END;
+    }
+  }
+  top1Chunk.version = 2;
+  writeFile();
+}
+
+TapeTime TapeFile::readPeaks(std::array<PeakPyramid, 4> &peaks) {
+  std::ifstream in (peaksPath(path), std::ios::binary);
+  PeaksHeader header;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) return 0;
+  if (std::memcmp(header.id, PeaksHeader().id, 4) != 0 || header.version != 1
+    || header.block != PeakPyramid::BLOCK) {
+    LOGW << "Ignoring peaks of '" << path << "' in an unknown format";
+    return 0;
+  }
+  TapeTime frames = TapeTime(header.blocks) * PeakPyramid::BLOCK;
+  for (auto &p : peaks) p.reserve(frames);
+  std::array<PeakPyramid::Peak, 4> block;
+  u4b b = 0;
+  for (; b < header.blocks; b++) {
+    if (!in.read(reinterpret_cast<char *>(block.data()), sizeof(block))) break;
+    for (uint t = 0; t < peaks.size(); t++) peaks[t].setBlock(b, block[t]);
+  }
+  frames = TapeTime(b) * PeakPyramid::BLOCK;
+  for (auto &p : peaks) {
+    p.propagate({0, frames});
+    p.takeChanged();
+  }
+  peaksHeader.blocks = b;
+  return frames;
+}
+
+void TapeFile::writePeaks(std::array<PeakPyramid, 4> &peaks,
+  Section<TapeTime> section) {
+  if (section.size() <= 0) return;
+  if (!peaksFile.is_open()) {
+    auto mode = std::ios::binary | std::ios::in | std::ios::out;
+    peaksFile.open(peaksPath(path), mode);
+    if (!peaksFile.is_open()) {
+      peaksFile.clear();
+      peaksFile.open(peaksPath(path), mode | std::ios::trunc);
+      peaksHeader = PeaksHeader();
+    }
+  }
+  u4b first = section.in / PeakPyramid::BLOCK;
+  u4b last = (section.out + PeakPyramid::BLOCK - 1) / PeakPyramid::BLOCK;
+  // Blocks between the old end and `first` are silent
+  first = std::min(first, peaksHeader.blocks);
+  std::vector<std::array<PeakPyramid::Peak, 4>> blocks (last - first);
+  for (u4b b = first; b < last; b++) {
+    for (uint t = 0; t < peaks.size(); t++) {
+      blocks[b - first][t] = peaks[t].block(b);
+    }
+  }
+  peaksHeader.blocks = std::max(peaksHeader.blocks, last);
+  peaksFile.seekp(0);
+  peaksFile.write(reinterpret_cast<char *>(&peaksHeader), sizeof(peaksHeader));
+  peaksFile.seekp(sizeof(peaksHeader) + first * sizeof(blocks[0]));
+  peaksFile.write(reinterpret_cast<char *>(blocks.data()),
+    blocks.size() * sizeof(blocks[0]));
+  peaksFile.flush();
+  if (!peaksFile) {
+    LOGE << "Couldn't save the peaks of '" << path << "'";
+    peaksFile.clear();
+  }
+}
+
+bool TapeFile::sizesChanged() const {
+  for (auto &track : trackFiles) {
+    if (track && track->sizesChanged()) return true;
+  }
+  return SndFile<4>::sizesChanged();
+}
+
+void TapeFile::writeSizes() {
+  for (auto &track : trackFiles) {
+    if (track && track->sizesChanged()) track->writeSizes();
+  }
+  if (SndFile<4>::sizesChanged()) SndFile<4>::writeSizes();
+}
+
+void TapeFile::openTracks() {
+  for (uint i = 0; i < trackFiles.size(); i++) {
+    trackFiles[i] = std::make_unique<SndFile<1>>();
+    trackFiles[i]->readOnly = readOnly;
+    trackFiles[i]->open(trackPath(path, i));
+    trackFiles[i]->samplerate = samplerate;
+    trackFiles[i]->insertDs64();
+    packed[i].open(packedPath(trackPath(path, i)), 1);
+  }
+}
+
+bool TapeFile::makePlanar() {
+  if (planar()) return true;
+  if (size() > 0) {
+    LOGW << "Tape '" << path << "' holds interleaved audio, keeping it that way";
+    return false;
+  }
+  openTracks();
+  return true;
+}
+
+bool TapeFile::makeSparse() {
+  bool empty = true;
+  for (uint l = 0; l < channels; l++) empty = empty && laneSize(l) == 0;
+  if (!empty) return false;
+  for (uint t = 0; t < channels; t++) {
+    edits.tracks[t].count = 0;
+    writeEdits(t);
+  }
+  return true;
+}
+
+EditList TapeFile::editList(uint track) const {
+  auto &chunk = edits.tracks[track];
+  std::vector<EditList::Region> regions;
+  for (uint i = 0; i < chunk.count; i++) {
+    auto &r = chunk.regions[i];
+    bool open = r.outPos == RegionData::END
+      || (top1Chunk.version < 2 && r.outPos == RegionData::OLD_END);
+    regions.push_back({TapeTime(r.inPos), open ? EditList::END : TapeTime(r.outPos),
+      r.lane, TapeTime(r.source)});
+  }
+  return EditList(regions);
+}
+
+void TapeFile::setEditList(uint track, const EditList &list) {
+  // An `outPos` of END is open, so positions must stay below it
+  const TapeTime max = RegionData::END - 1;
+  for (auto &r : list.regions()) {
+    bool open = r.out == EditList::END;
+    if (r.in > max || r.source > max || (!open && r.out > max)) {
+      LOGE << "Track " << track + 1 << " has edits past 32 bits, not saving them";
+      return;
+    }
+  }
+  auto &chunk = edits.tracks[track];
+  chunk.count = 0;
+  if (list.size() > MAX_REGIONS) {
+    LOGE << "Track " << track + 1 << " has " << list.size()
+         << " regions, only the first " << MAX_REGIONS << " are saved";
+  }
+  for (auto &r : list.regions()) {
+    if (chunk.count == MAX_REGIONS) break;
+    u4b out = r.out == EditList::END ? RegionData::END : u4b(r.out);
+    chunk.regions[chunk.count++] = {u4b(r.in), out, r.lane, u4b(r.source)};
+  }
+}
+
+TapeTime TapeFile::trackEnd(const EditList &list) const {
+  auto &regions = list.regions();
+  if (regions.empty()) return 0;
+  auto &last = regions.back();
+  if (last.out != EditList::END) return last.out;
+  return last.in + std::max<TapeTime>(0, laneSize(last.lane) - last.source);
+}
+
+void TapeFile::readTrack(const EditList &list, Section<TapeTime> section,
+  float *dst) {
+  list.resolve(section, [&] (auto part, auto *region) {
+      float *out = dst + (part.in - section.in);
+      if (region == nullptr) {
+        std::fill(out, out + part.size(), 0.f);
+      } else {
+        readLane(region->lane, region->sourceOf(part.in), out, part.size());
+      }
+    });
+}
+
+/**
+ * The tracks are read as they sound, so edits are flattened on the way.
+ * When sparse, each track is packed from the start of its lane, even
+ * interleaved, as nothing else is stored there.
+ */
+bool TapeFile::convert(const std::string &from, const std::string &to,
+  bool sparse) {
+  if (!std::ifstream(from)) {
+    LOGE << "No tape at '" << from << "' to convert";
+    return false;
+  }
+  TapeFile src (from);
+  if (src.error.log()) return false;
+  std::remove(to.c_str());
+  std::remove(peaksPath(to).c_str());
+  std::remove(slicesPath(to).c_str());
+  for (uint l = 0; l < channels; l++) std::remove(trackPath(to, l).c_str());
+  TapeFile dst (to);
+  if (src.planar()) dst.makePlanar();
+  if (sparse) dst.makeSparse();
+  LOGI << "Converting '" << from << "' to a " << (sparse ? "sparse" : "dense")
+       << " tape at '" << to << "'";
+
+  std::vector<float> block (CONVERT_BLOCK);
+  for (uint t = 0; t < channels; t++) {
+    auto list = src.editList(t);
+    TapeTime end = src.trackEnd(list);
+    EditList stored;
+    TapeTime storageEnd = 0;
+    for (TapeTime pos = 0; pos < end; pos += CONVERT_BLOCK) {
+      uint n = std::min<TapeTime>(CONVERT_BLOCK, end - pos);
+      src.readTrack(list, {pos, pos + TapeTime(n)}, block.data());
+      if (!sparse) {
+        dst.writeLane(t, pos, block.data(), n);
+        continue;
+      }
+      bool silent = std::all_of(block.begin(), block.begin() + n,
+        [] (float f) {return f == 0;});
+      // Past the limit, silence is stored to keep the regions together
+      if (silent && stored.size() + 1 < MAX_REGIONS) continue;
+      dst.writeLane(t, storageEnd, block.data(), n);
+      stored.map({pos, pos + TapeTime(n)}, t, storageEnd);
+      storageEnd += n;
+    }
+    if (sparse) dst.setEditList(t, stored);
+    dst.setSliceList(t, src.sliceList(t));
+  }
+  dst.writeLongSlices();
+  dst.close();
+  src.close();
+  return true;
+}
+
+/**
+ * Read `[pos, pos + nframes)` of `file`, decoding the blocks that are
+ * packed in `store`.
+ * @return the number of frames read, like SndFile::read
+ */
+template<uint N>
+static uint readStored(SndFile<N> &file, PackedStore &store, std::size_t pos,
+  float *dst, uint nframes, std::vector<float> &buffer) {
+  if (store.empty()) {
+    file.seek(pos);
+    return file.read(dst, nframes);
+  }
+  const uint size = PackedStore::BLOCK;
+  uint read = 0;
+  for (uint done = 0; done < nframes;) {
+    std::size_t at = pos + done;
+    uint block = at / size;
+    uint n = std::min<std::size_t>(nframes - done, std::size_t(block + 1) * size - at);
+    float *out = dst + done * N;
+    if (store.isPacked(block)) {
+      buffer.resize(size * N);
+      if (!store.read(block, buffer.data())) {
+        std::fill(buffer.begin(), buffer.end(), 0.f);
+      }
+      auto from = buffer.begin() + (at - std::size_t(block) * size) * N;
+      std::copy(from, from + n * N, out);
+      read = done + n;
+    } else {
+      // Up to the next packed block
+      while (done + n < nframes && !store.isPacked((at + n) / size)) {
+        n = std::min(nframes - done, n + size);
+      }
+      file.seek(at);
+      uint r = file.read(out, n);
+      if (r > 0) read = done + r;
+    }
+    done += n;
+  }
+  return read;
+}
+
+/**
+ * Write `[pos, pos + nframes)` of `file`. Blocks packed in `store` are
+ * written back whole first, and unpacked.
+ */
+template<uint N>
+static uint writeStored(SndFile<N> &file, PackedStore &store, std::size_t pos,
+  const float *src, uint nframes, std::vector<float> &buffer) {
+  const uint size = PackedStore::BLOCK;
+  for (uint block = pos / size;
+       !store.empty() && std::size_t(block) * size < pos + nframes; block++) {
+    if (!store.isPacked(block)) continue;
+    buffer.resize(size * N);
+    if (!store.read(block, buffer.data())) {
+      std::fill(buffer.begin(), buffer.end(), 0.f);
+    }
+    std::size_t in = std::max(pos, std::size_t(block) * size);
+    std::size_t out = std::min(pos + nframes, std::size_t(block + 1) * size);
+    std::copy(src + (in - pos) * N, src + (out - pos) * N,
+      buffer.begin() + (in - std::size_t(block) * size) * N);
+    file.seek(std::size_t(block) * size);
+    file.write(buffer.data(), size);
+    store.unpack(block);
+  }
+  file.seek(pos);
+  return file.write(const_cast<float *>(src), nframes);
+}
+
+/**
+ * The block is stored packed before its space is freed, and stays in the
+ * file if that fails.
+ */
+template<uint N>
+static bool pack(SndFile<N> &file, PackedStore &store, uint block,
+  std::vector<float> &buffer) {
+  const uint size = PackedStore::BLOCK;
+  buffer.resize(size * N);
+  file.seek(std::size_t(block) * size);
+  if (file.read(buffer.data(), size) != size) return false;
+  if (!store.pack(block, buffer.data())) return false;
+  if (!file.discard(std::size_t(block) * size, size)) {
+    store.unpack(block);
+    return false;
+  }
+  return true;
+}
+
+bool TapeFile::canPack() const {
+  if (packingFailed) return false;
+  return planar() ? trackFiles[0]->mapped() : mapped();
+}
+
+bool TapeFile::packBlock(uint lane, uint block) {
+  if (!canPack() || block >= packableBlocks(lane)) return false;
+  auto &store = packedFor(lane);
+  if (store.isPacked(block)) return true;
+  bool done = planar()
+    ? pack(*trackFiles[lane], store, block, packBuffer)
+    : pack<4>(*this, store, block, packBuffer);
+  if (!done) {
+    LOGW << "Couldn't pack audio of '" << path << "', keeping it as it is";
+    packingFailed = true;
+  }
+  return done;
+}
+
+std::size_t TapeFile::packedBytes() const {
+  std::size_t bytes = 0;
+  for (auto &store : packed) bytes += store.packedBytes();
+  return bytes;
+}
+
+uint TapeFile::readLanes(std::size_t pos, Lanes dst, uint nframes) {
+  if (planar()) {
+    uint read = 0;
+    for (uint l = 0; l < channels; l++) {
+      read = std::max(read, readLane(l, pos, dst[l], nframes));
+    }
+    return read;
+  }
+  uint read = 0;
+  for (uint done = 0; done < nframes;) {
+    uint n = std::min<uint>(nframes - done, scratch.size());
+    uint r = readStored<4>(*this, packed[0], pos + done,
+      reinterpret_cast<float *>(scratch.data()), n, packBuffer);
+    std::fill(scratch.begin() + r, scratch.begin() + n, AudioFrame());
+    for (uint l = 0; l < channels; l++) {
+      for (uint i = 0; i < n; i++) {
+        dst[l][done + i] = scratch[i][l];
+      }
+    }
+    read += r;
+    done += n;
+  }
+  return read;
+}
+
+uint TapeFile::writeLanes(std::size_t pos, ConstLanes src, uint nframes) {
+  if (planar()) {
+    for (uint l = 0; l < channels; l++) {
+      writeLane(l, pos, src[l], nframes);
+    }
+    return nframes;
+  }
+  uint written = 0;
+  for (uint done = 0; done < nframes;) {
+    uint n = std::min<uint>(nframes - done, scratch.size());
+    for (uint l = 0; l < channels; l++) {
+      for (uint i = 0; i < n; i++) {
+        scratch[i][l] = src[l][done + i];
+      }
+    }
+    written += writeStored<4>(*this, packed[0], pos + done,
+      reinterpret_cast<float *>(scratch.data()), n, packBuffer);
+    done += n;
+  }
+  return written;
+}
+
+void TapeFile::prefetchLanes(std::size_t pos, uint nframes) {
+  if (planar()) {
+    for (auto &track : trackFiles) track->prefetch(pos, nframes);
+  } else {
+    SndFile<4>::prefetch(pos, nframes);
+  }
+}
+
+void TapeFile::prefetchLane(uint lane, std::size_t pos, uint nframes) {
+  if (planar()) {
+    trackFiles[lane]->prefetch(pos, nframes);
+  } else {
+    SndFile<4>::prefetch(pos, nframes);
+  }
+}
+
+uint TapeFile::readLane(uint lane, std::size_t pos, float *dst, uint nframes) {
+  if (planar()) {
+    auto &track = *trackFiles[lane];
+    uint read = 0;
+    if (pos < track.size()) {
+      read = readStored(track, packed[lane], pos, dst, nframes, packBuffer);
+    }
+    std::fill(dst + read, dst + nframes, 0.f);
+    return read;
+  }
+  uint read = 0;
+  for (uint done = 0; done < nframes;) {
+    uint n = std::min<uint>(nframes - done, scratch.size());
+    uint r = readStored<4>(*this, packed[0], pos + done,
+      reinterpret_cast<float *>(scratch.data()), n, packBuffer);
+    std::fill(scratch.begin() + r, scratch.begin() + n, AudioFrame());
+    for (uint i = 0; i < n; i++) {
+      dst[done + i] = scratch[i][lane];
+    }
+    read += r;
+    done += n;
+  }
+  return read;
+}
+
+uint TapeFile::writeLane(uint lane, std::size_t pos, const float *src, uint nframes) {
+  if (planar()) {
+    return writeStored(*trackFiles[lane], packed[lane], pos, src, nframes, packBuffer);
+  }
+  // The other tracks have to be read and written back
+  uint written = 0;
+  for (uint done = 0; done < nframes;) {
+    uint n = std::min<uint>(nframes - done, scratch.size());
+    uint r = readStored<4>(*this, packed[0], pos + done,
+      reinterpret_cast<float *>(scratch.data()), n, packBuffer);
+    std::fill(scratch.begin() + r, scratch.begin() + n, AudioFrame());
+    for (uint i = 0; i < n; i++) {
+      scratch[i][lane] = src[done + i];
+    }
+    written += writeStored<4>(*this, packed[0], pos + done,
+      reinterpret_cast<float *>(scratch.data()), n, packBuffer);
+    done += n;
+  }
+  return written;
 }
 
 }
@@ -1,4 +1,14 @@
 #pragma once
+
+#include <array>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "packed-store.h"
+#include "peak-pyramid.h"
 #include "sndfile.h"
 
 namespace top1 {
@@ -7,7 +17,8 @@ class TapeFile : public SndFile<4> {
 public:
   struct TOP1Chunk : public Chunk {
     ChunkFCC type = "TAPE";
-    u4b version = 1;
+    /** 1 for tapes that stored open regions as RegionData::OLD_END */
+    u4b version = 2;
 
     TOP1Chunk() : Chunk("TOP1") {
       addField(version);
@@ -19,16 +30,31 @@ public:
     u4b  outPos;
   };
 
+  /** Slices kept in the tape, see `sliceList` for more */
+  static const uint MAX_SLICES = 2048;
+
   struct TrackSlicesChunk : public Chunk {
     u4b  trackNum;
     u4b  count = 0;
-    std::array<SliceData, 2048> slices;
+    std::array<SliceData, MAX_SLICES> slices;
 
     TrackSlicesChunk(u4b track) : Chunk("trak"), trackNum (track) {
       addField(trackNum);
       addField(count);
       addField(slices);
     };
+
+    /**
+     * Once the chunk is in the file, only the used slices are written.
+     * The rest is past `count`, and never read.
+     */
+    void write(File *file) override {
+      if (offset < 0) return Chunk::write(file);
+      file->fseek(offset + 8);
+      file->writeBytes(trackNum);
+      file->writeBytes(count);
+      file->writeBytes(slices.data(), count);
+    }
   };
 
   struct SlicesChunk : public Chunk {
@@ -42,22 +68,284 @@ public:
     };
   };
 
+  static const uint MAX_REGIONS = 2048;
+
+  /**
+   * A region of a track's edit list, see EditList. Positions are stored
+   * unsigned, an open `outPos` as `END`.
+   */
+  struct RegionData {
+    static constexpr u4b END = 0xFFFFFFFF;
+    /** What tapes of version 1 stored for an open `outPos` */
+    static constexpr u4b OLD_END = 0x7FFFFFFF;
+
+    u4b inPos;
+    u4b outPos;
+    u4b lane;
+    u4b source;
+  };
+
+  struct TrackEditsChunk : public Chunk {
+    u4b trackNum;
+    u4b count = 1;
+    std::array<RegionData, MAX_REGIONS> regions;
+
+    TrackEditsChunk(u4b track) : Chunk("regs"), trackNum (track) {
+      // Until edited, the track is stored in its own lane
+      regions[0] = {0, RegionData::END, track, 0};
+      addField(trackNum);
+      addField(count);
+      addField(regions);
+    };
+
+    /** Like TrackSlicesChunk, only the used regions are written */
+    void write(File *file) override {
+      if (offset < 0) return Chunk::write(file);
+      file->fseek(offset + 8);
+      file->writeBytes(trackNum);
+      file->writeBytes(count);
+      file->writeBytes(regions.data(), count);
+    }
+  };
+
+  struct EditsChunk : public Chunk {
+    TrackEditsChunk tracks[4] {{0}, {1}, {2}, {3}};
+
+    EditsChunk() : Chunk("edit") {
+      subChunk(tracks[0]);
+      subChunk(tracks[1]);
+      subChunk(tracks[2]);
+      subChunk(tracks[3]);
+    };
+  };
+
   TOP1Chunk top1Chunk;
   SlicesChunk slices;
+  EditsChunk edits;
+
+  using Lanes = std::array<float*, 4>;
+  using ConstLanes = std::array<const float*, 4>;
 
   void readSlices();
   void writeSlices();
 
+  /** Write the slices of one track, leaving the rest of the file alone */
+  void writeSlices(uint track);
+  /** Write the edit list of one track, leaving the rest of the file alone */
+  void writeEdits(uint track);
+
   TapeFile() : SndFile<4>() {};
-  TapeFile(std::string path) : SndFile<4>(path) {};
+  TapeFile(std::string path) : TapeFile() {
+    open(path);
+  };
+
+  ~TapeFile() {
+    close();
+  }
 
   TapeFile(TapeFile&) = delete;
   TapeFile(TapeFile&&) = delete;
 
+  void open(std::string path) override;
+  void close() override;
+  void flush() override;
+
+  /** Schedule written audio to be written to disk, see BasicSndFile::sync */
+  void sync();
+
+  /** See BasicSndFile::sizesChanged, includes the track files */
+  bool sizesChanged() const;
+  void writeSizes();
+
+  /**
+   * Planar tapes store each track in a mono sidecar file,
+   * `<path>.track<n>.wav`, and keep only the metadata in the tape file.
+   * Single track reads and writes then only touch that track's data.
+   * Interleaved tapes store all tracks in the tape file.
+   */
+  bool planar() const {
+    return trackFiles[0] != nullptr;
+  }
+
+  /**
+   * Switch to the planar layout.
+   * Only possible while the tape holds no interleaved audio.
+   * @return whether the tape is planar
+   */
+  bool makePlanar();
+
+  /**
+   * Start the tracks of a new tape as a gap instead of their own lane.
+   * Recorded frames are then stored one after another as they come, and
+   * silence not at all, see TapeBuffer::writeTrack. The tape only takes
+   * the space of what was recorded, wherever it is on the tape.
+   * Only possible while the tape holds no audio.
+   * @return whether the tracks start as a gap
+   */
+  bool makeSparse();
+
+  /** Number of frames stored in `lane` */
+  std::size_t laneSize(uint lane) const {
+    return planar() ? trackFiles[lane]->size() : size();
+  }
+
+  /**
+   * The slices of `track`, as saved.
+   *
+   * The first MAX_SLICES are in the tape. Tracks with more are saved
+   * whole in `<path>.slices`, as `trak` chunks of any length after a
+   * `SlicesHeader`. Without it, the tape still reads, with the first
+   * slices only.
+   */
+  std::vector<SliceData> sliceList(uint track) const;
+  /** Set the slices of `track`, to be saved by writeSlices */
+  void setSliceList(uint track, std::vector<SliceData> list);
+
+  struct SlicesHeader {
+    char id[4] = {'S', 'L', 'I', 'C'};
+    u4b version = 1;
+  };
+
+  static std::string slicesPath(std::string path);
+
+  /** The edit list of `track`, as saved */
+  EditList editList(uint track) const;
+  /**
+   * Set the edit list of `track`, to be saved. At most MAX_REGIONS.
+   * A list with positions past 32 bits is not saved.
+   */
+  void setEditList(uint track, const EditList &list);
+
+  /** Where the audio of a track stored as `list` ends */
+  TapeTime trackEnd(const EditList &list) const;
+
+  /**
+   * Read `section` of a track stored as `list`.
+   * Gaps are silent, and not read at all.
+   */
+  void readTrack(const EditList &list, Section<TapeTime> section, float *dst);
+
+  /**
+   * Read all tracks of `[pos, pos + nframes)`.
+   * Frames past the end of the tape are read as silence.
+   * @return the number of frames actually read from the file
+   */
+  uint readLanes(std::size_t pos, Lanes dst, uint nframes);
+  uint writeLanes(std::size_t pos, ConstLanes src, uint nframes);
+
+  /**
+   * Read a single track of `[pos, pos + nframes)`.
+   * Frames past the end of the tape are read as silence.
+   * @return the number of frames actually read from the file
+   */
+  uint readLane(uint lane, std::size_t pos, float *dst, uint nframes);
+  uint writeLane(uint lane, std::size_t pos, const float *src, uint nframes);
+
+  /** Start reading `[pos, pos + nframes)` of all lanes in the background */
+  void prefetchLanes(std::size_t pos, uint nframes);
+  /** Start reading `[pos, pos + nframes)` of `lane` in the background */
+  void prefetchLane(uint lane, std::size_t pos, uint nframes);
+
+  static std::string trackPath(std::string path, uint lane);
+
+  /** Frames looked at at once for silence, when converting */
+  static const uint CONVERT_BLOCK = 4096;
+
+  /**
+   * Store the tape at `from` anew at `to`, keeping its layout.
+   * Storage nothing refers to anymore is left behind.
+   * @param sparse store the tracks like a tape made sparse, with silent
+   *   blocks left out. Otherwise, each track is stored in its own lane at
+   *   the same time, which any WAV player can play.
+   * @return false if `from` couldn't be read
+   */
+  static bool convert(const std::string &from, const std::string &to, bool sparse);
+
+  /** Compressed blocks of a sound file are kept in `<path>.packed` */
+  static std::string packedPath(std::string path);
+
+  /**
+   * Compress a block of `lane`, and free its space in the file.
+   * Meant for audio that isn't played, reading it decodes the block, and
+   * writing to it unpacks it again. On interleaved tapes, a block holds
+   * all the lanes.
+   * @return false if it couldn't, see `canPack`
+   */
+  bool packBlock(uint lane, uint block);
+
+  /** Whether the audio is mapped, and the file system can free space */
+  bool canPack() const;
+
+  /** Full blocks of `lane`, the ones that can be packed */
+  uint packableBlocks(uint lane) const {
+    return laneSize(lane) / PackedStore::BLOCK;
+  }
+
+  bool isPacked(uint lane, uint block) const {
+    return packed[planar() ? lane : 0].isPacked(block);
+  }
+
+  /** Size of the packed audio, all lanes together */
+  std::size_t packedBytes() const;
+
+  /**
+   * The peaks of the tracks are kept in `<path>.peaks`: a `PeaksHeader`,
+   * then the level 0 peaks, the four tracks of each block next to each
+   * other. Not part of the tape, it can be rebuilt from the audio.
+   */
+  struct PeaksHeader {
+    char id[4] = {'P', 'E', 'A', 'K'};
+    u4b version = 1;
+    u4b block = PeakPyramid::BLOCK;
+    u4b blocks = 0;
+  };
+
+  static std::string peaksPath(std::string path);
+
+  /**
+   * Load the peaks saved with the tape.
+   * @return the frames loaded, 0 if there are none
+   */
+  TapeTime readPeaks(std::array<PeakPyramid, 4> &peaks);
+
+  /** Save the peaks of `section`, block aligned */
+  void writePeaks(std::array<PeakPyramid, 4> &peaks, Section<TapeTime> section);
+
 protected:
 
+  std::array<std::unique_ptr<SndFile<1>>, 4> trackFiles;
+
+  /** The slices of the tracks with more than MAX_SLICES, empty otherwise */
+  std::array<std::vector<SliceData>, 4> longSlices;
+
+  void readLongSlices();
+  void writeLongSlices();
+
+  /** Opened on the first write */
+  std::fstream peaksFile;
+  PeaksHeader peaksHeader;
+
+  /** Frames are (de)interleaved through this, in blocks of its size */
+  std::vector<AudioFrame> scratch = std::vector<AudioFrame>(4096);
+
+  /** Packed blocks of the tape, or of each track file when planar */
+  std::array<PackedStore, 4> packed;
+  /** Set when the file system couldn't free space */
+  bool packingFailed = false;
+  /** Blocks are unpacked through this */
+  std::vector<float> packBuffer;
+
+  PackedStore &packedFor(uint lane) {
+    return packed[planar() ? lane : 0];
+  }
+
+  void openTracks();
+  void insertMetadata();
+  void upgradeEdits();
+
   void setupChunks() override {
     top1Chunk.subChunk(slices);
+    top1Chunk.subChunk(edits);
     wavHeader.subChunk(top1Chunk);
   }
 
@@ -65,6 +353,14 @@ protected:
 
 // Custom readers/writers
 
+static_assert(sizeof(TapeFile::SliceData) == 8,
+  "Slices are written as they are in memory");
+static_assert(sizeof(TapeFile::RegionData) == 16,
+  "Regions are written as they are in memory");
+static_assert(sizeof(TapeFile::PeaksHeader) == 16
+  && sizeof(PeakPyramid::Peak) == 8,
+  "Peaks are written as they are in memory");
+
 template<>
 inline void File::writeBytes<std::array<TapeFile::SliceData, 2048>>(
   std::array<TapeFile::SliceData, 2048> &data) {
@@ -81,4 +377,25 @@ inline void File::readBytes<std::array<TapeFile::SliceData, 2048>>(
     readBytes<u4b>(slice.outPos);
   }
 }
+
+template<>
+inline void File::writeBytes<std::array<TapeFile::RegionData, TapeFile::MAX_REGIONS>>(
+  std::array<TapeFile::RegionData, TapeFile::MAX_REGIONS> &data) {
+  for (auto &region : data) {
+    writeBytes(region.inPos);
+    writeBytes(region.outPos);
+    writeBytes(region.lane);
+    writeBytes(region.source);
+  }
+}
+template<>
+inline void File::readBytes<std::array<TapeFile::RegionData, TapeFile::MAX_REGIONS>>(
+  std::array<TapeFile::RegionData, TapeFile::MAX_REGIONS> &data) {
+  for (auto &region : data) {
+    readBytes<u4b>(region.inPos);
+    readBytes<u4b>(region.outPos);
+    readBytes<u4b>(region.lane);
+    readBytes<u4b>(region.source);
+  }
+}
 }
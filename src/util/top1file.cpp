@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <exception>
 #include <fmt/format.h>
 #include "top1file.h"
@@ -9,33 +10,47 @@ void File::Chunk::read(File *file) {
     offset = file->rpos();
   }
   file->fseek(offset);
-  ChunkFCC rName = file->readBytes<u4b>();
-  if (id.name != rName.name) {
+  Chunk found (file->readBytes<u4b>());
+  found.size = file->readBytes<u4b>();
+  found.offset = offset;
+  if (!matches(found)) {
     throw ReadException(
       ReadException::UNEXPECTED_CHUNK,
       fmt::format("Unexpected chunk name at {:#x}: Got {:#x} expected {:#x}",
-       offset, rName.name, id.name));
+       offset, found.id.name, id.name));
   }
-  uint fsize;
-  if ((fsize = file->readBytes<u4b>()) < size) {
+  id = found.id;
+  uint fsize = found.size;
+  // Subchunks are looked up by id, and may be missing
+  if (fsize < minSize()) {
     throw ReadException(
       ReadException::INVALID_SIZE, "INVALID_CHUNK_SIZE");
   }
   this->size = fsize;
-  uint end = file->rpos() + fsize;
+  std::size_t end = file->rpos() + fsize;
+  std::size_t fieldsRead = 0;
   for (auto field : fields) {
+    fieldsRead += field->size();
+    if (fieldsRead > fsize) break;
     field->read(file);
   }
-  uint chunksStart = file->rpos();
+  std::size_t chunksStart = file->rpos();
+  // Subchunks with the same id are matched in order
+  auto claimed = [&] (const Chunk &c) {
+    return std::any_of(chunks.begin(), chunks.end(), [&] (Chunk *other) {
+        return other->offset == c.offset;
+      });
+  };
   for (auto chunk : chunks) {
     if (chunk->offset < 0) {
       file->fseek(chunksStart);
-      uint lastPos = file->rpos();
+      std::size_t lastPos = file->rpos();
       while (file->rpos() < end) {
         try {
           Chunk c = file->getChunk();
-          if (c.id == chunk->id) {
+          if (chunk->matches(c) && !claimed(c)) {
             chunk->read(file);
+            break;
           } else if (c.id.name == 0) {
             break;
           } else {
@@ -63,7 +78,7 @@ void File::Chunk::write(File *file) {
   file->writeBytes(id);
   file->writeBytes(size);
 
-  uint end = file->wpos() + size;
+  std::size_t end = file->wpos() + size;
   for (auto &&field : fields) {
     field->write(file);
   }
@@ -81,7 +96,16 @@ void File::Chunk::write(File *file) {
 
 // File handling
 void File::open(std::string path) {
-  fileStream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+  if (readOnly) {
+    fileStream.open(path, std::ios::in | std::ios::binary);
+    if (!fileStream) {
+      error.status = Error::ERROR;
+      error.message = "Couldn't open '" + path + "' for reading";
+      return;
+    }
+  } else {
+    fileStream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+  }
   if (!fileStream) {
     LOGI << "Empty file, creating";
     fileStream.open(path, std::ios::trunc | std::ios::out | std::ios::binary);
@@ -98,13 +122,13 @@ void File::open(std::string path) {
 void File::close() {
   if (fileStream.is_open()) {
     LOGI << "Closing TOP1File '" << path << "'";
-    writeFile();
+    if (!readOnly) writeFile();
     fileStream.close();
   }
 }
 
 void File::flush() {
-  if (fileStream.is_open()) {
+  if (fileStream.is_open() && !readOnly) {
     writeFile();
     fileStream.flush();
   }
@@ -112,7 +136,7 @@ void File::flush() {
 
 // Read/Write
 
-void File::fseek(uint pos) {
+void File::fseek(std::size_t pos) {
   fileStream.seekg(pos);
   fileStream.peek();
   if (fileStream.eof() || fileStream.fail()) {
@@ -130,8 +154,8 @@ void File::fseek(uint pos) {
 // Chunk handling
 
 bool File::skipChunkR(Chunk &chunk) {
-  uint newPos = chunk.offset + 4 + 4 + chunk.size;
-  if (fileStream.tellg() != newPos) {
+  std::size_t newPos = chunk.offset + 4 + 4 + chunk.size;
+  if (fileStream.tellg() != std::streampos(newPos)) {
     fseek(newPos);
     if (fileStream.eof()) throw ReadException(ReadException::END_OF_FILE, "skipChunk: EOF");
     return true;
@@ -140,8 +164,8 @@ bool File::skipChunkR(Chunk &chunk) {
 }
 
 bool File::skipChunkW(Chunk &chunk) {
-  uint newPos = chunk.offset + 4 + 4 + chunk.size;
-  if (fileStream.tellp() != newPos) {
+  std::size_t newPos = chunk.offset + 4 + 4 + chunk.size;
+  if (fileStream.tellp() != std::streampos(newPos)) {
     fseek(newPos);
     if (fileStream.eof()) throw ReadException(ReadException::END_OF_FILE, "skipChunk: EOF");
     return true;
@@ -167,12 +191,13 @@ void File::readChunks() {
   for (auto chunk : chunks) {
     if (chunk->offset < 0) {
       fseek(0);
-      uint lastPos = rpos();
+      std::size_t lastPos = rpos();
       while (!fileStream.eof()) {
         try {
           Chunk c = getChunk();
-          if (c.id == chunk->id) {
+          if (chunk->matches(c)) {
             chunk->read(this);
+            break;
           } else if (c.id.name == 0) {
             break;
           } else {
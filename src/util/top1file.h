@@ -48,6 +48,12 @@ public:
 
   std::string path;
 
+  /**
+   * Never write to the file, e.g. to read one something else is writing.
+   * Set before opening. A file that doesn't exist is then an error.
+   */
+  bool readOnly = false;
+
   struct Field {
     virtual size_t size() const = 0;
     virtual void read(File *file) = 0;
@@ -80,9 +86,11 @@ public:
     std::vector<Field*> fields;
     std::vector<Chunk*> chunks;
   public:
-    const ChunkFCC id;
+    /** Only changed by chunks that go by several names, see `matches` */
+    ChunkFCC id;
     u4b size = 0;
-    int offset = -1;
+    /** Position in the file, -1 until read or written */
+    int64_t offset = -1;
 
     Chunk() {};
     Chunk(ChunkFCC id) : id ( id) {};
@@ -92,6 +100,25 @@ public:
 
     void subChunk(Chunk &subChunk);
 
+    /** Size of the fields, without the subchunks */
+    u4b fieldsSize() const;
+
+    /**
+     * The smallest size the chunk can have in a file. Fields past it are
+     * optional, and keep their value when the chunk is too short for them.
+     */
+    virtual u4b minSize() const {
+      return fieldsSize();
+    }
+
+    /** Whether `chunk`, as found in the file, is this one */
+    virtual bool matches(const Chunk &chunk) const {
+      return chunk.id == id;
+    }
+
+    /** Move the chunk and its subchunks by `delta` bytes in the file */
+    void move(int64_t delta);
+
     virtual void read(File *file);
     virtual void write(File *file);
   };
@@ -116,9 +143,9 @@ public:
   template<class T>
   void writeBytes(T &bytes);
 
-  void fseek(uint pos);
-  uint rpos() {return fileStream.tellg(); }
-  uint wpos() {return fileStream.tellp(); }
+  void fseek(std::size_t pos);
+  std::size_t rpos() {return fileStream.tellg(); }
+  std::size_t wpos() {return fileStream.tellp(); }
 
   bool skipChunkR(Chunk &chunk);
   bool skipChunkW(Chunk &chunk);
@@ -133,11 +160,11 @@ public:
     enum {
       NONE,
       ERROR
-    } status;
+    } status = NONE;
 
     std::string message;
 
-    operator bool() {
+    operator bool() const {
       return status != NONE;
     }
 
@@ -184,7 +211,18 @@ struct TypedField : public File::Field {
 
 inline void File::Chunk::subChunk(File::Chunk &chunk) {
   chunks.push_back(&chunk);
-  size += chunk.size;
+  size += 8 + chunk.size;
+}
+
+inline void File::Chunk::move(int64_t delta) {
+  if (offset >= 0) offset += delta;
+  for (auto chunk : chunks) chunk->move(delta);
+}
+
+inline u4b File::Chunk::fieldsSize() const {
+  u4b sum = 0;
+  for (auto field : fields) sum += field->size();
+  return sum;
 }
 
 template<class T>
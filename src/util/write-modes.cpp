@@ -0,0 +1,64 @@
+#include "write-modes.h"
+
+#include <cstddef>
+
+namespace top1 {
+namespace writemode {
+
+/****************************************/
+/* Write mode kernels                   */
+/****************************************/
+
+namespace kernel {
+
+// The index is a std::ptrdiff_t: GCC doesn't vectorize the loops with an
+// index converted from the unsigned counter to int.
+
+template<int Stride>
+void replace(float *tape, const float *in, uint n) {
+  for (std::size_t i = 0; i < n; i++) {
+    tape[std::ptrdiff_t(i) * Stride] = in[i];
+  }
+}
+
+template<int Stride>
+void overdub(float *tape, const float *in, uint n) {
+  for (std::size_t i = 0; i < n; i++) {
+    tape[std::ptrdiff_t(i) * Stride] += in[i];
+  }
+}
+
+template<int Stride>
+void overdubDecay(float *tape, const float *in, uint n, float feedback) {
+  for (std::size_t i = 0; i < n; i++) {
+    float &t = tape[std::ptrdiff_t(i) * Stride];
+    t = t * feedback + in[i];
+  }
+}
+
+// The frame is converted to float from an int, which SSE2 does for
+// vectors, unlike from a 64 bit std::size_t.
+template<int Stride>
+void crossfade(float *tape, const float *in, uint n, uint from, int dir,
+  uint length) {
+  const float start = float(from) / length, step = float(dir) / length;
+  for (std::size_t i = 0; i < n; i++) {
+    float &t = tape[std::ptrdiff_t(i) * Stride];
+    float gain = start + step * float(int(i) + 1);
+    t += gain * (in[i] - t);
+  }
+}
+
+template void replace<1>(float *, const float *, uint);
+template void replace<-1>(float *, const float *, uint);
+template void overdub<1>(float *, const float *, uint);
+template void overdub<-1>(float *, const float *, uint);
+template void overdubDecay<1>(float *, const float *, uint, float);
+template void overdubDecay<-1>(float *, const float *, uint, float);
+template void crossfade<1>(float *, const float *, uint, uint, int, uint);
+template void crossfade<-1>(float *, const float *, uint, uint, int, uint);
+
+} // kernel
+
+} // writemode
+} // top1
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <sys/types.h>
+
+namespace top1 {
+
+/**
+ * Ways of writing a recorded track into the tape.
+ *
+ * Each mode writes `n` frames of a single track: `tape` points at the
+ * first frame, and successive frames are `Stride` floats apart, 1 when
+ * writing forwards and -1 backwards. `in` is the mono input, in write
+ * order. Pass them to TapeBuffer::writeLane.
+ */
+namespace writemode {
+
+/**
+ * The loops of the modes, instantiated for both strides in
+ * write-modes.cpp. That file is built with -O3 whatever the build type,
+ * so they are vectorized, see the benchmark in tests/util/write-modes.cpp.
+ */
+namespace kernel {
+
+template<int Stride>
+void replace(float *tape, const float *in, uint n);
+
+template<int Stride>
+void overdub(float *tape, const float *in, uint n);
+
+template<int Stride>
+void overdubDecay(float *tape, const float *in, uint n, float feedback);
+
+/**
+ * Fade from what was on the track to `in`, frame `i` at a gain of
+ * `(from + dir * (i + 1)) / length`.
+ */
+template<int Stride>
+void crossfade(float *tape, const float *in, uint n, uint from, int dir,
+  uint length);
+
+} // kernel
+
+/** Replace what was on the track */
+struct Replace {
+  template<int Stride>
+  void write(float *tape, const float *in, uint n) const {
+    kernel::replace<Stride>(tape, in, n);
+  }
+};
+
+/** Add to what was on the track */
+struct Overdub {
+  template<int Stride>
+  void write(float *tape, const float *in, uint n) const {
+    kernel::overdub<Stride>(tape, in, n);
+  }
+};
+
+/**
+ * Add to what was on the track, after scaling it by `feedback`.
+ * Used when overdubbing a loop, so older passes slowly fade out.
+ */
+struct OverdubDecay {
+  float feedback = 1;
+
+  template<int Stride>
+  void write(float *tape, const float *in, uint n) const {
+    kernel::overdubDecay<Stride>(tape, in, n, feedback);
+  }
+};
+
+/**
+ * Replace what was on the track, crossfading over `fadeLength` frames
+ * when punching in and out.
+ *
+ * Keeps its state between calls, so one instance should be used for the
+ * whole take. After `punchOut()`, keep writing until `done()` to fade
+ * back to the original.
+ */
+struct Punch {
+  uint fadeLength;
+  /// Position in the fade, from 0 (original) to fadeLength (new)
+  uint fade = 0;
+  bool punchedIn = true;
+
+  Punch(uint fadeLength = 256) : fadeLength (std::max(1u, fadeLength)) {}
+
+  void punchIn() { punchedIn = true; }
+  void punchOut() { punchedIn = false; }
+
+  /** Faded all the way out */
+  bool done() const { return !punchedIn && fade == 0; }
+
+  template<int Stride>
+  void write(float *tape, const float *in, uint n) {
+    const uint target = punchedIn ? fadeLength : 0;
+    const int dir = punchedIn ? 1 : -1;
+    uint fading = std::min(n, punchedIn ? target - fade : fade);
+    kernel::crossfade<Stride>(tape, in, fading, fade, dir, fadeLength);
+    fade += dir * int(fading);
+    // Steady state
+    if (fade == fadeLength) {
+      kernel::replace<Stride>(tape + std::ptrdiff_t(fading) * Stride,
+        in + fading, n - fading);
+    }
+  }
+};
+
+} // writemode
+} // top1
@@ -0,0 +1,67 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "globals.h"
+#include "modules/tape.h"
+
+using namespace top1;
+
+namespace {
+
+const std::string tapePath = "test-tape-module.tape";
+
+/// Frame `i` of the test tape holds `i` on track 1
+void writeTestTape(uint nframes) {
+  std::remove(tapePath.c_str());
+  TapeFile file (tapePath);
+  std::vector<float> up (nframes), silence (nframes);
+  for (uint i = 0; i < nframes; i++) up[i] = i;
+  file.writeLanes(0, {{up.data(), silence.data(), silence.data(), silence.data()}},
+    nframes);
+  file.close();
+}
+
+}
+
+TEST_CASE("TapeModule plays from anywhere on the tape", "[TapeModule]") {
+  const uint nframes = 256;
+  const TapeTime at = 20000;
+  writeTestTape(TapeBuffer::RingBuffer::SIZE * 2);
+
+  static Project project;
+  project.path = tapePath;
+  GLOB.project = &project;
+  auto &tape = GLOB.tapedeck;
+  tape.trackBuffer.resize(nframes);
+  tape.tapeIOBuffer.resize(nframes * 8);
+  tape.takeBuffer.resize(nframes * 8);
+  tape.tapeBuffer.init();
+
+  tape.tapeBuffer.goTo(at);
+  tape.state.play(1);
+  tape.state.playSpeed = 1;
+  bool loaded = false;
+  for (int i = 0; i < 500 && !loaded; i++) {
+    tape.tapeBuffer.preProcess();
+    loaded = tape.tapeBuffer.lengthFW() >= int(4 * nframes);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  REQUIRE(loaded);
+
+  // Two cycles, the first played frame is the one the tape was at
+  for (uint cycle = 0; cycle < 2; cycle++) {
+    tape.preProcess(nframes);
+    for (uint i = 0; i < nframes; i++) {
+      REQUIRE(tape.trackBuffer[i][0] == at + cycle * nframes + i);
+    }
+  }
+
+  tape.state.stop();
+  tape.state.playSpeed = 0;
+  tape.tapeBuffer.exit();
+  std::remove(tapePath.c_str());
+  std::remove((tapePath + ".peaks").c_str());
+}
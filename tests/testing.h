@@ -5,6 +5,12 @@
 #include <plog/Log.h>
 #include <fmt/format.h>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
 
 namespace test {
 
@@ -16,4 +22,19 @@ inline int rand(int min, int max) {
 inline double fRand(double min, double max) {
   return (std::rand() / double(RAND_MAX)) * (max - min) + min;
 }
+
+/// Make the WAV at `path` like the ones written before the RF64 support,
+/// without the room for the 64 bit sizes
+inline void stripDs64(const std::string &path) {
+  std::ifstream in (path, std::ios::binary);
+  std::vector<char> bytes ((std::istreambuf_iterator<char>(in)),
+    std::istreambuf_iterator<char>());
+  in.close();
+  REQUIRE(std::string(bytes.data() + 12, 4) == "JUNK");
+  bytes.erase(bytes.begin() + 12, bytes.begin() + 48);
+  uint32_t riffSize = bytes.size() - 8;
+  std::memcpy(bytes.data() + 4, &riffSize, 4);
+  std::ofstream out (path, std::ios::binary | std::ios::trunc);
+  out.write(bytes.data(), bytes.size());
+}
 }
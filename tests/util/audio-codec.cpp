@@ -0,0 +1,133 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <fmt/format.h>
+
+#include "util/audio-codec.h"
+#include "util/sndfile.h"
+
+using namespace top1;
+
+namespace {
+
+/// Whether `a` and `b` hold the same bits
+bool sameBits(const std::vector<float> &a, const std::vector<float> &b) {
+  return a.size() == b.size()
+    && std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+}
+
+std::vector<float> roundTrip(const std::vector<float> &in, uint channels,
+  std::size_t *size = nullptr) {
+  std::vector<char> packed;
+  uint nframes = in.size() / channels;
+  codec::encode(in.data(), nframes, channels, packed);
+  if (size) *size = packed.size();
+  std::vector<float> out (in.size());
+  REQUIRE(codec::decode(packed.data(), packed.size(), out.data(), nframes, channels));
+  return out;
+}
+
+/// Four tracks of something like a recording: tones, and a little noise
+std::vector<float> music(uint nframes) {
+  std::vector<float> res (nframes * 4);
+  for (uint i = 0; i < nframes; i++) {
+    for (uint c = 0; c < 4; c++) {
+      res[i * 4 + c] = 0.3 * std::sin(2 * M_PI * (c + 1) * 110 * i / 44100.)
+        + test::fRand(-0.001, 0.001);
+    }
+  }
+  return res;
+}
+
+}
+
+TEST_CASE("AudioCodec is lossless", "[AudioCodec]") {
+  std::vector<float> noise (4096 * 4);
+  for (auto &s : noise) s = test::fRand(-1, 1);
+  REQUIRE(sameBits(roundTrip(noise, 4), noise));
+
+  auto tones = music(4096);
+  REQUIRE(sameBits(roundTrip(tones, 4), tones));
+
+  // Any bits at all, and blocks of any length
+  std::vector<float> odd = {0.f, -0.f, 1e-40f, -1e-40f,
+    std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::max(),
+    std::numeric_limits<float>::quiet_NaN(), 1.f, -1.f};
+  for (uint i = 0; i < 300; i++) {
+    uint32_t bits = uint32_t(test::rand(0, 0xFFFF)) << 16 | test::rand(0, 0xFFFF);
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    odd.push_back(f);
+  }
+  for (uint n = 0; n <= odd.size(); n += 37) {
+    std::vector<float> part (odd.begin(), odd.begin() + n);
+    REQUIRE(sameBits(roundTrip(part, 1), part));
+  }
+}
+
+TEST_CASE("AudioCodec compresses", "[AudioCodec]") {
+  std::size_t size;
+  std::vector<float> silence (4096 * 4, 0.f);
+  REQUIRE(sameBits(roundTrip(silence, 4, &size), silence));
+  REQUIRE(size < 64);
+
+  auto tones = music(4096);
+  roundTrip(tones, 4, &size);
+  REQUIRE(size < tones.size() * sizeof(float) * 0.9);
+}
+
+TEST_CASE("AudioCodec rejects what it didn't encode", "[AudioCodec]") {
+  auto tones = music(1024);
+  std::vector<char> packed;
+  codec::encode(tones.data(), 1024, 4, packed);
+  std::vector<float> out (tones.size());
+  REQUIRE_FALSE(codec::decode(packed.data(), packed.size() / 2, out.data(), 1024, 4));
+}
+
+/*
+ * Compression ratio, and encode and decode speed in multiples of realtime
+ * for a 4 track tape at 48 kHz. Hidden, run with `tests "[.bench]"`.
+ * A real recording can be used with TOP1_BENCH_WAV, a 4 channel float WAV.
+ */
+TEST_CASE("AudioCodec benchmark", "[.bench]") {
+  using clock = std::chrono::steady_clock;
+  const uint block = 4096;
+  std::vector<float> audio;
+  if (const char *path = std::getenv("TOP1_BENCH_WAV")) {
+    SndFile<4> file (path);
+    audio.resize(file.size() * 4);
+    file.read(audio.data(), file.size());
+    file.close();
+  } else {
+    audio = music(48000 * 60);
+  }
+  uint blocks = audio.size() / 4 / block;
+  REQUIRE(blocks > 0);
+
+  std::vector<char> packed;
+  std::vector<std::size_t> ends;
+  auto start = clock::now();
+  for (uint b = 0; b < blocks; b++) {
+    codec::encode(audio.data() + b * block * 4, block, 4, packed);
+    ends.push_back(packed.size());
+  }
+  double encoded = std::chrono::duration<double>(clock::now() - start).count();
+
+  std::vector<float> out (block * 4);
+  start = clock::now();
+  for (uint b = 0; b < blocks; b++) {
+    std::size_t from = b == 0 ? 0 : ends[b - 1];
+    codec::decode(packed.data() + from, ends[b] - from, out.data(), block, 4);
+  }
+  double decoded = std::chrono::duration<double>(clock::now() - start).count();
+
+  double seconds = double(blocks) * block / 48000;
+  fmt::print("ratio {:.3f}, encode {:.0f}x realtime, decode {:.0f}x realtime\n",
+    double(packed.size()) / (blocks * block * 4 * sizeof(float)),
+    seconds / encoded, seconds / decoded);
+}
@@ -0,0 +1,175 @@
+#include "../testing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include "util/bounce.h"
+
+using namespace top1;
+
+namespace {
+
+void removeBounce(std::string tape, std::string out) {
+  std::remove(tape.c_str());
+  std::remove(TapeFile::peaksPath(tape).c_str());
+  std::remove(TapeFile::packedPath(tape).c_str());
+  std::remove((out + ".wav").c_str());
+  for (uint t = 0; t < 4; t++) std::remove(Bounce::stemPath(out, t).c_str());
+}
+
+/// A sample of `lane` at `i` that can be told apart from the others
+float sample(uint lane, std::size_t i) {
+  return (lane + 1) * 0.1f + (i % 1000) * 0.0001f;
+}
+
+/// A tape of `nframes` of these samples
+void makeTape(std::string path, std::size_t nframes) {
+  TapeFile file (path);
+  std::array<std::vector<float>, 4> lanes;
+  const uint block = 1 << 16;
+  for (auto &l : lanes) l.resize(block);
+  for (std::size_t pos = 0; pos < nframes; pos += block) {
+    uint n = std::min<std::size_t>(block, nframes - pos);
+    for (uint l = 0; l < 4; l++) {
+      for (uint i = 0; i < n; i++) lanes[l][i] = sample(l, pos + i);
+    }
+    file.writeLanes(pos, {{
+          lanes[0].data(), lanes[1].data(), lanes[2].data(), lanes[3].data()
+        }}, n);
+  }
+}
+
+}
+
+TEST_CASE("Bounce renders the mix and stems", "[Bounce]") {
+  const std::string tape = "test-bounce.tape";
+  const std::string out = "test-bounce";
+  removeBounce(tape, out);
+  const std::size_t length = 3 * Bounce::BLOCK + 1234;
+  makeTape(tape, length);
+
+  Bounce::Settings settings;
+  settings.tape = tape;
+  settings.mixPath = out + ".wav";
+  settings.stemsPath = out;
+  settings.tracks = {{{0.5, 0}, {0.8, -0.5}, {0.3, 0.9, true}, {1, 0.2}}};
+  settings.threads = 3;
+
+  SECTION("As recorded") {}
+  SECTION("Edited") {
+    // Track 1 starts with what was recorded on lane 2
+    const TapeTime cut = Bounce::BLOCK + 100;
+    {
+      TapeFile file (tape);
+      file.setEditList(0, EditList({{0, cut, 1, 0}, {cut, EditList::END, 0, cut}}));
+      file.writeEdits(0);
+    }
+    settings.tracks[1].muted = true;
+  }
+
+  Bounce bounce;
+  REQUIRE(bounce.start(settings));
+  REQUIRE(bounce.wait());
+  REQUIRE_FALSE(bounce.running());
+  REQUIRE(bounce.progress() == 1);
+
+  TapeFile file (tape);
+  auto edits = file.editList(0);
+  auto lane0 = [&] (std::size_t i) {
+    auto region = std::find_if(edits.regions().begin(), edits.regions().end(),
+      [&] (auto &r) {return TapeTime(i) >= r.in && TapeTime(i) < r.out;});
+    return sample(region->lane, region->sourceOf(i));
+  };
+  file.close();
+
+  SndFile<2> mix (out + ".wav");
+  REQUIRE(mix.size() == length);
+  std::vector<float> frames (length * 2);
+  REQUIRE(mix.read(frames.data(), length) == length);
+  for (std::size_t i = 0; i < length; i++) {
+    float left = 0, right = 0;
+    for (uint t = 0; t < 4; t++) {
+      float s = t == 0 ? lane0(i) : sample(t, i);
+      left += s * settings.tracks[t].left();
+      right += s * settings.tracks[t].right();
+    }
+    REQUIRE(frames[i * 2] == Approx(left));
+    REQUIRE(frames[i * 2 + 1] == Approx(right));
+  }
+
+  for (uint t = 0; t < 4; t++) {
+    auto path = Bounce::stemPath(out, t);
+    if (settings.tracks[t].muted) {
+      REQUIRE_FALSE(std::ifstream(path));
+      continue;
+    }
+    SndFile<1> stem (path);
+    REQUIRE(stem.size() == length);
+    std::vector<float> samples (length);
+    stem.read(samples.data(), length);
+    for (std::size_t i = 0; i < length; i += 97) {
+      float s = t == 0 ? lane0(i) : sample(t, i);
+      REQUIRE(samples[i] == Approx(s * settings.tracks[t].level));
+    }
+  }
+  removeBounce(tape, out);
+}
+
+TEST_CASE("Bounce can be cancelled", "[Bounce]") {
+  const std::string tape = "test-bounce-cancel.tape";
+  const std::string out = "test-bounce-cancel";
+  removeBounce(tape, out);
+  makeTape(tape, 1000);
+
+  Bounce bounce;
+  Bounce::Settings settings;
+  settings.tape = "test-bounce-none.tape";
+  settings.mixPath = out + ".wav";
+  REQUIRE_FALSE(bounce.start(settings));
+  REQUIRE_FALSE(std::ifstream("test-bounce-none.tape"));
+
+  // Far past the end of the tape, a single thread takes a while
+  settings.tape = tape;
+  settings.section = {0, 256 * Bounce::BLOCK};
+  settings.threads = 1;
+  REQUIRE(bounce.start(settings));
+  bounce.cancel();
+  REQUIRE_FALSE(bounce.wait());
+  REQUIRE_FALSE(std::ifstream(out + ".wav"));
+  removeBounce(tape, out);
+}
+
+/*
+ * Bounce speed in multiples of realtime at 48 kHz, with one thread and
+ * one per core. Hidden, run with `tests "[.bench]"`. The tape size in MB
+ * can be set with TOP1_BENCH_MB.
+ */
+TEST_CASE("Bounce benchmark", "[.bench]") {
+  using clock = std::chrono::steady_clock;
+  const std::string tape = "test-bounce-bench.tape";
+  const std::string out = "test-bounce-bench";
+  removeBounce(tape, out);
+
+  std::size_t mb = 256;
+  if (const char *env = std::getenv("TOP1_BENCH_MB")) mb = std::atoi(env);
+  const std::size_t length = (mb << 20) / TapeFile::AudioFrame::size;
+  makeTape(tape, length);
+
+  for (uint threads : {1u, std::thread::hardware_concurrency()}) {
+    Bounce::Settings settings;
+    settings.tape = tape;
+    settings.mixPath = out + ".wav";
+    settings.stemsPath = out;
+    settings.threads = threads;
+    Bounce bounce;
+    auto start = clock::now();
+    REQUIRE(bounce.start(settings));
+    REQUIRE(bounce.wait());
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    fmt::print("{} threads: {:.0f}x realtime\n", threads, length / 48000. / seconds);
+  }
+  removeBounce(tape, out);
+}
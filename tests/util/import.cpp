@@ -0,0 +1,146 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include "globals.h"
+#include "util/import.h"
+
+using namespace top1;
+
+namespace {
+
+const std::string tapePath = "test-import.tape";
+const std::string wavPath = "test-import.wav";
+
+void removeTape() {
+  std::remove(tapePath.c_str());
+  std::remove(TapeFile::peaksPath(tapePath).c_str());
+  std::remove(TapeFile::packedPath(tapePath).c_str());
+  std::remove(TapeFile::slicesPath(tapePath).c_str());
+}
+
+template<typename T>
+void put(std::ofstream &out, T value) {
+  out.write(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+/**
+ * A 16 bit stereo WAV as most programs write it, with a 16 byte `fmt `.
+ * Left is `left`, right is `right`, for `nframes` frames.
+ */
+void writeWav(uint samplerate, std::size_t nframes, int16_t left, int16_t right) {
+  std::ofstream out (wavPath, std::ios::binary | std::ios::trunc);
+  u4b dataSize = nframes * 4;
+  out.write("RIFF", 4);
+  put<u4b>(out, 4 + 8 + 16 + 8 + dataSize);
+  out.write("WAVEfmt ", 8);
+  put<u4b>(out, 16);
+  put<u2b>(out, 1);
+  put<u2b>(out, 2);
+  put<u4b>(out, samplerate);
+  put<u4b>(out, samplerate * 4);
+  put<u2b>(out, 4);
+  put<u2b>(out, 16);
+  out.write("data", 4);
+  put<u4b>(out, dataSize);
+  for (std::size_t i = 0; i < nframes; i++) {
+    put(out, left);
+    put(out, right);
+  }
+}
+
+struct ImportFixture {
+  TapeBuffer tb;
+  ImportFixture() {
+    static Project project;
+    project.path = tapePath;
+    project.planarTape = false;
+    project.sparseTape = false;
+    project.packTape = false;
+    GLOB.project = &project;
+    removeTape();
+  }
+  ~ImportFixture() {
+    tb.exit();
+    removeTape();
+    std::remove(wavPath.c_str());
+  }
+};
+
+}
+
+TEST_CASE_METHOD(ImportFixture, "Import puts a WAV on a track", "[Import]") {
+  const std::size_t nframes = 3 * Import::BLOCK + 100;
+  writeWav(22050, nframes, 16384, 8192);
+  const TapeTime at = 1000;
+
+  tb.init();
+  tb.checkpoint();
+  Import import (tb);
+  Import::Settings settings;
+  settings.path = wavPath;
+  settings.track = Track::newIdx(2);
+  settings.at = at;
+  settings.samplerate = 44100;
+  SECTION("Mixed down") {}
+  SECTION("One channel") {
+    settings.channel = 1;
+  }
+  const float level = settings.channel < 0 ? 0.375 : 0.25;
+  REQUIRE(import.start(settings));
+  REQUIRE(import.wait());
+  REQUIRE(import.progress() == 1);
+  REQUIRE(import.section().in == at);
+  REQUIRE(import.section().size() == TapeTime(nframes * 2));
+  REQUIRE(tb.trackSlices[2].current(at + 5000).in == at);
+  REQUIRE(tb.trackSlices[2].current(at + 5000).out == at + TapeTime(nframes * 2));
+  for (int i = 0; i < 500 && tb.pendingImports() > 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  REQUIRE(tb.pendingImports() == 0);
+  tb.save();
+
+  // The peaks follow
+  for (int i = 0; i < 500; i++) {
+    if (tb.peaks[2].peak({at, at + 4096}).max > 0) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  REQUIRE(tb.peaks[2].peak({at, at + 4096}).max == Approx(level).epsilon(0.05));
+  tb.exit();
+
+  TapeFile file (tapePath);
+  auto edits = file.editList(2);
+  std::vector<float> track (nframes * 2 + 2000);
+  file.readTrack(edits, {0, TapeTime(track.size())}, track.data());
+  REQUIRE(track[at - 1] == 0);
+  // Away from the edges, where the filter rings
+  for (std::size_t i = at + 100; i < at + nframes * 2 - 100; i += 37) {
+    REQUIRE(track[i] == Approx(level).epsilon(0.001));
+  }
+  REQUIRE(track[at + nframes * 2] == 0);
+  // The other tracks are untouched
+  std::vector<float> other (4096);
+  file.readTrack(file.editList(0), {at, at + 4096}, other.data());
+  REQUIRE(std::all_of(other.begin(), other.end(), [] (float f) {return f == 0;}));
+}
+
+TEST_CASE_METHOD(ImportFixture, "Import refuses what it can't read", "[Import]") {
+  tb.init();
+  Import import (tb);
+  Import::Settings settings;
+  settings.path = "test-import-none.wav";
+  REQUIRE_FALSE(import.start(settings));
+  REQUIRE_FALSE(std::ifstream(settings.path));
+
+  writeWav(48000, 100, 1, 1);
+  settings.path = wavPath;
+  settings.channel = 2;
+  REQUIRE_FALSE(import.start(settings));
+  settings.channel = 0;
+  REQUIRE(import.start(settings));
+  REQUIRE(import.wait());
+  REQUIRE(import.section().size() == 100 * 44100 / 48000 + 1);
+}
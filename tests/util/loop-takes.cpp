@@ -0,0 +1,145 @@
+#include "../testing.h"
+
+#include "util/loop-takes.h"
+
+using namespace top1;
+
+namespace {
+
+using Dir = LoopTakes::Direction;
+
+/** A pass of `length` frames, each one `value` */
+std::vector<float> pass(uint length, float value) {
+  return std::vector<float>(length, value);
+}
+
+}
+
+TEST_CASE("LoopTakes keeps each pass as a take", "[LoopTakes]") {
+  const Section<TapeTime> loop = {1000, 1400};
+  const uint length = loop.size();
+  LoopTakes takes;
+
+  REQUIRE_FALSE(takes.allocate({-1, -1}, 0));
+  REQUIRE_FALSE(takes.startPass(0));
+  REQUIRE(takes.allocate(loop, 2, 3));
+  REQUIRE(takes.layers() == 3);
+
+  // Three passes, the third one stopped half way
+  for (uint p = 0; p < 3; p++) {
+    REQUIRE(takes.startPass(2));
+    REQUIRE(takes.recording() == int(p));
+    auto frames = pass(p == 2 ? length / 2 : length, p + 1);
+    takes.record(frames.data(), frames.size(), loop.in, Dir::FW);
+  }
+  takes.stopPass();
+  REQUIRE(takes.takes() == 0b111);
+  // The pool is full
+  REQUIRE_FALSE(takes.startPass(2));
+  takes.stopPass();
+
+  std::vector<float> out (length + 200);
+  SECTION("Mixed at their gains") {
+    takes.gain(1, 0.5);
+    REQUIRE(takes.mix(out.data(), out.size(), loop.in - 100, Dir::FW,
+        takes.audible()) == length);
+    REQUIRE(out[0] == 0);
+    REQUIRE(out[100] == Approx(1 + 1 + 3));
+    REQUIRE(out[100 + length / 2] == Approx(1 + 1));
+    REQUIRE(out[99 + length] == Approx(2));
+    REQUIRE(out[100 + length] == 0);
+  }
+  SECTION("Muted") {
+    takes.mute(0, true);
+    REQUIRE(takes.muted(0));
+    REQUIRE(takes.audible() == 0b110);
+    takes.mix(out.data(), length, loop.in, Dir::FW, takes.audible());
+    REQUIRE(out[0] == Approx(2 + 3));
+    REQUIRE(out[length - 1] == Approx(2));
+  }
+  SECTION("Backwards") {
+    takes.mix(out.data(), length, loop.out - 1, Dir::BW, takes.audible());
+    REQUIRE(out[0] == Approx(1 + 2));
+    REQUIRE(out[length - 1] == Approx(1 + 2 + 3));
+  }
+  SECTION("Committed") {
+    REQUIRE_FALSE(takes.commit(0b1000));
+    REQUIRE(takes.commit(0b011));
+    REQUIRE(takes.committing());
+    REQUIRE_FALSE(takes.commit(0b100));
+    // A pass of the loop, starting half way
+    uint half = length / 2;
+    REQUIRE(takes.commitInto(out.data(), half, loop.in + half, Dir::FW) == half);
+    REQUIRE(out[0] == Approx(1 + 2));
+    REQUIRE(takes.committing());
+    REQUIRE(takes.commitInto(out.data(), length - half, loop.in, Dir::FW)
+      == length - half);
+    REQUIRE_FALSE(takes.committing());
+    REQUIRE(takes.takes() == 0b100);
+    REQUIRE(takes.commitInto(out.data(), length, loop.in, Dir::FW) == 0);
+    // Their layers can be recorded again
+    REQUIRE(takes.startPass(2));
+    REQUIRE(takes.recording() == 0);
+  }
+}
+
+TEST_CASE("LoopTakes stores late frames in the previous pass", "[LoopTakes]") {
+  const Section<TapeTime> loop = {0, 500};
+  const uint length = loop.size();
+  LoopTakes takes;
+  REQUIRE(takes.allocate(loop, 0));
+  std::vector<float> out (length);
+
+  SECTION("Forwards") {
+    REQUIRE(takes.startPass(0));
+    auto first = pass(length - 10, 1);
+    takes.record(first.data(), first.size(), 0, Dir::FW);
+    REQUIRE(takes.startPass(0));
+    // The recording lags 10 frames behind the jump
+    auto second = pass(length, 2);
+    std::fill(second.begin(), second.begin() + 10, 1);
+    takes.record(second.data(), second.size(), -10, Dir::FW);
+    takes.stopPass();
+
+    takes.mix(out.data(), length, 0, Dir::FW, 0b01);
+    REQUIRE(std::all_of(out.begin(), out.end(), [] (float f) {return f == 1;}));
+    takes.mix(out.data(), length, 0, Dir::FW, 0b10);
+    REQUIRE(out[length - 11] == 2);
+    // Not recorded yet
+    REQUIRE(out[length - 1] == 0);
+  }
+  SECTION("Backwards") {
+    REQUIRE(takes.startPass(0));
+    auto first = pass(length - 10, 1);
+    takes.record(first.data(), first.size(), length - 1, Dir::BW);
+    REQUIRE(takes.startPass(0));
+    auto second = pass(length, 2);
+    std::fill(second.begin(), second.begin() + 10, 1);
+    takes.record(second.data(), second.size(), length + 9, Dir::BW);
+    takes.stopPass();
+
+    takes.mix(out.data(), length, 0, Dir::FW, 0b01);
+    REQUIRE(std::all_of(out.begin(), out.end(), [] (float f) {return f == 1;}));
+    takes.mix(out.data(), length, 0, Dir::FW, 0b10);
+    REQUIRE(out[10] == 2);
+    REQUIRE(out[0] == 0);
+  }
+}
+
+TEST_CASE("LoopTakes leaves out the take being recorded", "[LoopTakes]") {
+  const Section<TapeTime> loop = {0, 100};
+  LoopTakes takes;
+  REQUIRE(takes.allocate(loop, 1));
+  REQUIRE(takes.startPass(1));
+  auto frames = pass(100, 1);
+  takes.record(frames.data(), frames.size(), 0, Dir::FW);
+  std::vector<float> out (100);
+  REQUIRE(takes.mix(out.data(), 100, 0, Dir::FW, takes.audible()) == 100);
+  REQUIRE(out[50] == 0);
+  takes.stopPass();
+  takes.mix(out.data(), 100, 0, Dir::FW, takes.audible());
+  REQUIRE(out[50] == 1);
+  // Takes of one track at a time
+  REQUIRE_FALSE(takes.startPass(3));
+  REQUIRE(takes.startPass(1));
+}
@@ -0,0 +1,86 @@
+#include "../testing.h"
+
+#include <vector>
+
+#include "util/peak-pyramid.h"
+
+using namespace top1;
+
+TEST_CASE("PeakPyramid sums up sections at any size", "[PeakPyramid]") {
+  PeakPyramid peaks;
+  const TapeTime size = 1 << 20;
+  peaks.reserve(size);
+  REQUIRE(peaks.reserved() >= size);
+
+  // A ramp from -1 to 1
+  std::vector<float> ramp (size);
+  for (TapeTime i = 0; i < size; i++) {
+    ramp[i] = 2 * float(i) / size - 1;
+  }
+  peaks.update(0, ramp.data(), size);
+
+  for (int i = 0; i < 200; i++) {
+    TapeTime in = test::rand(0, size - 2);
+    TapeTime out = test::rand(in + 1, size);
+    CAPTURE(in);
+    CAPTURE(out);
+    auto peak = peaks.peak({in, out});
+    // Whole peaks are used, so a little around the section may be included
+    REQUIRE(peak.min <= ramp[in]);
+    REQUIRE(peak.max >= ramp[out - 1]);
+    TapeTime slack = std::max<TapeTime>(PeakPyramid::BLOCK, out - in);
+    REQUIRE(peak.min >= ramp[std::max<TapeTime>(0, in - slack)]);
+    REQUIRE(peak.max <= ramp[std::min<TapeTime>(size - 1, out + slack)]);
+  }
+
+  SECTION("Partial updates keep the rest of the block") {
+    float loud = 2;
+    peaks.update(1000, &loud, 1);
+    REQUIRE(peaks.peak({768, 1024}).max == 2);
+    REQUIRE(peaks.peak({768, 1024}).min == ramp[768]);
+    REQUIRE(peaks.peak({0, size}).max == 2);
+  }
+
+  SECTION("Cleared sections are silent") {
+    peaks.clear({0, size / 2});
+    REQUIRE(peaks.peak({0, size / 2}).min == 0);
+    REQUIRE(peaks.peak({0, size / 2}).max == 0);
+    REQUIRE(peaks.peak({0, size}).max == ramp[size - 1]);
+  }
+
+  SECTION("Changes are reported once") {
+    peaks.takeChanged();
+    float f = 0.5;
+    peaks.update(5000, &f, 1);
+    peaks.update(300, &f, 1);
+    auto changed = peaks.takeChanged();
+    REQUIRE(changed.in == 256);
+    REQUIRE(changed.out == 5120);
+    REQUIRE(!peaks.takeChanged());
+  }
+
+  SECTION("Nothing is stored past the reserved frames") {
+    float f = 3;
+    peaks.update(peaks.reserved(), &f, 1);
+    REQUIRE(peaks.peak({0, peaks.reserved() + 256}).max < 3);
+    // Nor wrapped around to the start
+    peaks.update(TapeTime(PeakPyramid::BLOCK) << 32, &f, 1);
+    REQUIRE(peaks.block(0).max < 3);
+  }
+}
+
+TEST_CASE("PeakPyramid keeps its peaks as it grows", "[PeakPyramid]") {
+  PeakPyramid peaks;
+  const TapeTime page = PeakPyramid::PAGE * PeakPyramid::BLOCK;
+  float f = 0.5;
+  for (TapeTime size = page; size <= 20 * page; size += page) {
+    peaks.reserve(size);
+    REQUIRE(peaks.reserved() == size);
+    peaks.update(size - 1, &f, 1);
+    REQUIRE(peaks.peak({0, size}).max == 0.5);
+  }
+  for (TapeTime size = page; size <= 20 * page; size += page) {
+    REQUIRE(peaks.block((size - 1) / PeakPyramid::BLOCK).max == 0.5);
+    REQUIRE(peaks.peak({size - page, size}).max == 0.5);
+  }
+}
@@ -0,0 +1,42 @@
+#include "../testing.h"
+
+#include "util/prefetch-policy.h"
+
+using namespace top1;
+
+TEST_CASE("PrefetchPolicy follows the tape", "[PrefetchPolicy]") {
+  using P = PrefetchPolicy;
+  const int size = 1 << 18;
+  const int minRead = 2048;
+
+  REQUIRE(P::mode(0, 0) == P::STOPPED);
+  REQUIRE(P::mode(1, 1) == P::PLAYING);
+  // Starting and stopping count as playing
+  REQUIRE(P::mode(0, 1) == P::PLAYING);
+  REQUIRE(P::mode(0.5, 0) == P::PLAYING);
+  REQUIRE(P::mode(-5, -5) == P::SPOOLING);
+  REQUIRE(P::mode(1, 5) == P::SPOOLING);
+
+  for (float speed : {0.f, 1.f, -1.f, 2.f, 5.f, -5.f, 20.f, -0.3f}) {
+    auto plan = P::plan(speed, speed, size, minRead);
+    // Frames are never evicted near the playpoint
+    REQUIRE(plan.fw + plan.bw + plan.minRead <= size);
+    REQUIRE(plan.fw >= size / 16);
+    REQUIRE(plan.bw >= size / 16);
+    REQUIRE(plan.minRead >= minRead);
+    REQUIRE(plan.bwFirst == (speed < 0));
+    if (speed > 0) REQUIRE(plan.fw > plan.bw);
+    if (speed < 0) REQUIRE(plan.bw > plan.fw);
+  }
+
+  auto stopped = P::plan(0, 0, size, minRead);
+  auto playing = P::plan(1, 1, size, minRead);
+  auto spooling = P::plan(5, 5, size, minRead);
+  REQUIRE(stopped.fw + stopped.bw < playing.fw + playing.bw);
+  REQUIRE(playing.fw < spooling.fw);
+  REQUIRE(playing.minRead < spooling.minRead);
+  REQUIRE(P::plan(-5, -5, size, minRead).bw == spooling.fw);
+
+  // Slowing down from rewinding, it keeps loading behind
+  REQUIRE(P::plan(-2, 0, size, minRead).bwFirst);
+}
@@ -0,0 +1,139 @@
+#include "../testing.h"
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include <fmt/format.h>
+
+#include "util/resampler.h"
+
+using namespace top1;
+using Quality = resampling::Quality;
+
+namespace {
+
+/// `nframes` of a sine with `freq` cycles per frame, starting at frame `from`
+std::vector<float> sine(float freq, uint nframes, uint from = 0) {
+  std::vector<float> res (nframes);
+  for (uint i = 0; i < nframes; i++) {
+    res[i] = std::sin(2 * M_PI * freq * (from + i));
+  }
+  return res;
+}
+
+/// Run `input` through `rs` in blocks of varying size
+std::vector<float> resample(Resampler<1> &rs, const std::vector<float> &input,
+  float step) {
+  std::vector<float> out;
+  std::vector<float> block (512);
+  uint pushed = 0;
+  for (uint i = 0; pushed < input.size(); i++) {
+    uint nframes = 16 + (i * 37) % 300;
+    uint needed = std::min<uint>(rs.needed(nframes, step), input.size() - pushed);
+    rs.push(input.data() + pushed, needed);
+    pushed += needed;
+    uint n = rs.pull(block.data(), nframes, step);
+    out.insert(out.end(), block.begin(), block.begin() + n);
+  }
+  return out;
+}
+
+float rms(const float *data, uint nframes) {
+  double sum = 0;
+  for (uint i = 0; i < nframes; i++) sum += data[i] * data[i];
+  return std::sqrt(sum / nframes);
+}
+
+}
+
+TEST_CASE("Resampler copies the input at step 1", "[Resampler]") {
+  Resampler<4> rs;
+  std::vector<float> in (4 * 1000);
+  for (auto &s : in) s = test::fRand(-1, 1);
+  std::vector<float> out (in.size());
+  uint done = 0;
+  for (uint pushed = 0; pushed < 1000; pushed += 100) {
+    rs.push(in.data() + 4 * pushed, 100);
+    done += rs.pull(out.data() + 4 * done, 100, 1);
+  }
+  REQUIRE(done == 1000);
+  REQUIRE(out == in);
+}
+
+TEST_CASE("Resampler pulls what it needs", "[Resampler]") {
+  for (auto quality : {Quality::CUBIC, Quality::LOW, Quality::MEDIUM, Quality::HIGH}) {
+    Resampler<4> rs (quality);
+    std::vector<float> in (4 * 4096), out (4 * 256);
+    for (int i = 0; i < 200; i++) {
+      float step = test::fRand(0.1, 8);
+      uint nframes = test::rand(1, 256);
+      uint needed = rs.needed(nframes, step);
+      REQUIRE(needed <= 4096);
+      rs.push(in.data(), needed);
+      REQUIRE(rs.pull(out.data(), nframes, step) == nframes);
+    }
+  }
+}
+
+TEST_CASE("Resampler follows the signal across blocks", "[Resampler]") {
+  const float freq = 0.02;
+  for (auto quality : {Quality::CUBIC, Quality::LOW, Quality::MEDIUM, Quality::HIGH}) {
+    for (float step : {0.3f, 0.75f, 1.5f, 2.7f}) {
+      CAPTURE(int(quality));
+      CAPTURE(step);
+      Resampler<1> rs (quality);
+      auto out = resample(rs, sine(freq, 20000), step);
+      REQUIRE(out.size() > 20000 / step - 400);
+      // The first frames are filtered against the silence before the input
+      float maxError = 0;
+      for (uint i = 100; i < out.size() - 100; i++) {
+        float expected = std::sin(2 * M_PI * freq * i * step);
+        maxError = std::max(maxError, std::abs(out[i] - expected));
+      }
+      REQUIRE(maxError < (quality == Quality::CUBIC ? 0.01f : 0.005f));
+    }
+  }
+}
+
+TEST_CASE("Resampler filters out what the output can't hold", "[Resampler]") {
+  // Above the output Nyquist frequency, which is 0.125 at step 4
+  for (auto quality : {Quality::LOW, Quality::MEDIUM, Quality::HIGH}) {
+    CAPTURE(int(quality));
+    Resampler<1> rs (quality);
+    auto out = resample(rs, sine(0.3, 40000), 4);
+    REQUIRE(rms(out.data() + 100, out.size() - 200) < 0.01);
+
+    // While the passband is kept
+    rs.reset();
+    out = resample(rs, sine(0.05, 40000), 4);
+    REQUIRE(rms(out.data() + 100, out.size() - 200) == Approx(M_SQRT1_2).epsilon(0.02));
+  }
+}
+
+/*
+ * Cost of resampling one block of all four tracks, per quality and speed.
+ * Hidden, run with `tests "[.bench]"`
+ */
+TEST_CASE("Resampler benchmark", "[.bench]") {
+  using clock = std::chrono::steady_clock;
+  const int iterations = 5000;
+  const uint nframes = 256;
+  std::vector<float> in (4 * nframes * 9), out (4 * nframes);
+  for (auto &s : in) s = test::fRand(-1, 1);
+  for (auto quality : {Quality::CUBIC, Quality::LOW, Quality::MEDIUM, Quality::HIGH}) {
+    for (float step : {0.5f, 1.f, 1.01f, 2.f, 8.f}) {
+      Resampler<4> rs (quality);
+      auto start = clock::now();
+      for (int i = 0; i < iterations; i++) {
+        rs.push(in.data(), rs.needed(nframes, step));
+        rs.pull(out.data(), nframes, step);
+      }
+      auto time = clock::now() - start;
+      fmt::print("{:>6} step {:>4}: {:>8} ns/block\n",
+        std::array<const char *, 4>{{"cubic", "low", "medium", "high"}}[int(quality)],
+        step,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time).count() / iterations);
+    }
+  }
+}
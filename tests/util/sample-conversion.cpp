@@ -0,0 +1,117 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "util/sample-conversion.h"
+#include "util/sample-stream.h"
+
+using namespace top1;
+
+namespace {
+
+const std::string path = "test-convert.wav";
+
+/** A sine at `freq` Hz, sampled at `rate` */
+float sine(double freq, uint rate, double frame) {
+  return 0.5 * std::sin(2 * M_PI * freq * frame / rate);
+}
+
+void writeSine(std::size_t nframes, uint rate, double freq) {
+  std::remove(path.c_str());
+  SndFile<1> sf;
+  sf.open(path);
+  sf.samplerate = rate;
+  std::vector<float> frames (nframes);
+  for (std::size_t i = 0; i < nframes; i++) frames[i] = sine(freq, rate, i);
+  sf.write(frames.data(), frames.size());
+}
+
+}
+
+TEST_CASE("SampleConversion caches a copy at another rate", "[SampleConversion]") {
+  writeSine(30000, 22050, 1000);
+  const std::string cache = SampleConversion::cachePath(path,
+    SampleConversion::hash(path), 44100);
+  std::remove(cache.c_str());
+
+  SampleConversion conversion;
+  std::string copy;
+  REQUIRE(conversion.start(path, 44100, [&] (const std::string &c) { copy = c; }));
+  REQUIRE(conversion.wait());
+  REQUIRE(copy == cache);
+  REQUIRE(conversion.copy() == cache);
+
+  {
+    SndFile<1> sf;
+    sf.readOnly = true;
+    sf.open(cache);
+    REQUIRE(sf.samplerate == 44100);
+    REQUIRE(sf.size() == 60000);
+    std::vector<float> frames (60000);
+    REQUIRE(sf.read(frames.data(), frames.size()) == 60000);
+    // Away from the edges, where the filter saw silence
+    for (uint i = 1000; i < 59000; i += 97) {
+      REQUIRE(frames[i] == Approx(sine(1000, 44100, i)).margin(1e-3));
+    }
+  }
+
+  SECTION("Found again") {
+    copy.clear();
+    REQUIRE(conversion.start(path, 44100, [&] (const std::string &c) { copy = c; }));
+    REQUIRE(conversion.wait());
+    REQUIRE(copy == cache);
+  }
+
+  SECTION("Hashing stops when cancelled") {
+    std::atomic_bool cancelled = {true};
+    REQUIRE(SampleConversion::hash(path, &cancelled) == 0);
+    cancelled = false;
+    REQUIRE(SampleConversion::hash(path, &cancelled) == SampleConversion::hash(path));
+  }
+
+  SECTION("Not needed at the same rate") {
+    REQUIRE_FALSE(conversion.start(path, 22050));
+    REQUIRE_FALSE(conversion.start("test-convert-missing.wav", 44100));
+  }
+
+  SECTION("Played by a stream") {
+    SamplePool pool;
+    SampleStream stream {pool, 1};
+    stream.output(44100);
+    REQUIRE(stream.open(path));
+    // The copy is swapped in by the thread updating the stream
+    for (int i = 0; i < 2000 && !stream.converted(); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      stream.update();
+    }
+    REQUIRE(stream.converted());
+    // Still in frames of the sample
+    REQUIRE(stream.size() == 30000);
+    REQUIRE(stream.samplerate() == 22050);
+
+    stream.start(0, {2000, 4000, true, false});
+    std::vector<float> out (512);
+    REQUIRE(stream.play(0, out.data(), out.size(), 1));
+    REQUIRE(stream.offset(0) == Approx(256));
+    for (uint i = 0; i < out.size(); i++) {
+      REQUIRE(out[i] == Approx(sine(1000, 44100, 4000 + i)).margin(1e-3));
+    }
+
+    // Back to the sample's own rate
+    stream.output(22050);
+    REQUIRE(stream.converted());
+    stream.update();
+    REQUIRE_FALSE(stream.converted());
+    std::fill(out.begin(), out.end(), 0.f);
+    REQUIRE(stream.play(0, out.data(), 1, 1));
+    REQUIRE(stream.offset(0) == Approx(257));
+    REQUIRE(out[0] == Approx(sine(1000, 22050, 2256)).margin(1e-3));
+  }
+
+  std::remove(cache.c_str());
+  std::remove(path.c_str());
+}
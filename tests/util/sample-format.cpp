@@ -0,0 +1,147 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include "util/sample-format.h"
+
+using namespace top1;
+
+TEST_CASE("Samples in any format are converted to floats", "[SampleFormat]") {
+  namespace sf = sampleformat;
+  REQUIRE(sf::fromWav(1, 16) == SampleFormat::PCM16);
+  REQUIRE(sf::fromWav(1, 24) == SampleFormat::PCM24);
+  REQUIRE(sf::fromWav(3, 32) == SampleFormat::FLOAT32);
+  REQUIRE(sf::fromWav(3, 64) == SampleFormat::FLOAT64);
+  REQUIRE(sf::fromWav(1, 8) == SampleFormat::UNKNOWN);
+  REQUIRE(sf::fromWav(2, 16) == SampleFormat::UNKNOWN);
+
+  float out[4];
+  SECTION("16 bit") {
+    int16_t in[] = {0, 16384, -32768, 32767};
+    sf::toFloat(SampleFormat::PCM16, reinterpret_cast<char *>(in), out, 4);
+    REQUIRE(out[0] == 0);
+    REQUIRE(out[1] == 0.5);
+    REQUIRE(out[2] == -1);
+    REQUIRE(out[3] == Approx(1).epsilon(0.001));
+  }
+  SECTION("24 bit") {
+    // Little endian, three bytes each
+    unsigned char in[] = {
+      0, 0, 0,
+      0, 0, 0x40,
+      0, 0, 0x80,
+      0xFF, 0xFF, 0xFF,
+    };
+    sf::toFloat(SampleFormat::PCM24, reinterpret_cast<char *>(in), out, 4);
+    REQUIRE(out[0] == 0);
+    REQUIRE(out[1] == 0.5);
+    REQUIRE(out[2] == -1);
+    REQUIRE(out[3] == Approx(-1.f / (1 << 23)));
+  }
+  SECTION("32 bit") {
+    int32_t in[] = {0, 1 << 30, INT32_MIN, -(1 << 29)};
+    sf::toFloat(SampleFormat::PCM32, reinterpret_cast<char *>(in), out, 4);
+    REQUIRE(out[1] == 0.5);
+    REQUIRE(out[2] == -1);
+    REQUIRE(out[3] == -0.25);
+  }
+  SECTION("64 bit float, unaligned") {
+    double in[] = {0.25, -0.5, 1, 2};
+    char bytes[sizeof(in) + 1];
+    std::memcpy(bytes + 1, in, sizeof(in));
+    sf::toFloat(SampleFormat::FLOAT64, bytes + 1, out, 4);
+    REQUIRE(out[0] == 0.25);
+    REQUIRE(out[1] == -0.5);
+    REQUIRE(out[3] == 2);
+  }
+}
+
+TEST_CASE("Floats are converted back, rounded and clipped", "[SampleFormat]") {
+  namespace sf = sampleformat;
+  const float in[] = {0, 0.5, -1, 2, -2, 0.3 / 32768, -0.7 / 32768};
+  SECTION("16 bit") {
+    int16_t out[7];
+    sf::fromFloat(SampleFormat::PCM16, in, reinterpret_cast<char *>(out), 7);
+    REQUIRE(out[0] == 0);
+    REQUIRE(out[1] == 16384);
+    REQUIRE(out[2] == -32768);
+    REQUIRE(out[3] == 32767);
+    REQUIRE(out[4] == -32768);
+    REQUIRE(out[5] == 0);
+    REQUIRE(out[6] == -1);
+  }
+  SECTION("24 bit") {
+    unsigned char out[3 * 7];
+    sf::fromFloat(SampleFormat::PCM24, in, reinterpret_cast<char *>(out), 7);
+    auto sample = [&] (int i) {
+      return int32_t(out[3 * i] << 8 | out[3 * i + 1] << 16
+        | uint32_t(out[3 * i + 2]) << 24) >> 8;
+    };
+    REQUIRE(sample(1) == 1 << 22);
+    REQUIRE(sample(2) == -(1 << 23));
+    REQUIRE(sample(3) == (1 << 23) - 1);
+    REQUIRE(sample(4) == -(1 << 23));
+  }
+  SECTION("32 bit") {
+    int32_t out[7];
+    sf::fromFloat(SampleFormat::PCM32, in, reinterpret_cast<char *>(out), 7);
+    // Scaled a little below 2^31, see fromFloat
+    REQUIRE(out[1] == 2147483520 / 2);
+    REQUIRE(out[3] > 2147483000);
+    REQUIRE(out[4] < -2147483000);
+  }
+}
+
+TEST_CASE("Frames are turned into mono", "[SampleFormat]") {
+  namespace sf = sampleformat;
+  const float stereo[] = {1, 0, 0.5, 0.5, -1, 1};
+  float out[3];
+  sf::toMono(stereo, 2, -1, out, 3);
+  REQUIRE(out[0] == 0.5);
+  REQUIRE(out[1] == 0.5);
+  REQUIRE(out[2] == 0);
+  sf::toMono(stereo, 2, 1, out, 3);
+  REQUIRE(out[0] == 0);
+  REQUIRE(out[2] == 1);
+  const float three[] = {3, 0, 0, 0, 3, 3};
+  sf::toMono(three, 3, -1, out, 2);
+  REQUIRE(out[0] == 1);
+  REQUIRE(out[1] == 2);
+}
+
+/*
+ * Converting a block of samples each way, as BasicSndFile does. Hidden,
+ * run with `tests "[.bench]"`.
+ */
+TEST_CASE("Sample format benchmark", "[.bench]") {
+  namespace sf = sampleformat;
+  using clock = std::chrono::steady_clock;
+  using ns = std::chrono::nanoseconds;
+  const int iterations = 2000;
+  const std::size_t n = 16384;
+  std::vector<float> floats (n, 0.25);
+  std::vector<char> raw (n * 8);
+
+  for (auto format : {SampleFormat::PCM16, SampleFormat::PCM24,
+      SampleFormat::PCM32, SampleFormat::FLOAT64}) {
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      sf::fromFloat(format, floats.data(), raw.data(), n);
+    }
+    auto from = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      sf::toFloat(format, raw.data(), floats.data(), n);
+    }
+    auto to = clock::now() - start;
+
+    fmt::print("{:>12}: from float {:>6} ns, to float {:>6} ns\n",
+      sf::name(format),
+      std::chrono::duration_cast<ns>(from).count() / iterations,
+      std::chrono::duration_cast<ns>(to).count() / iterations);
+  }
+  REQUIRE(floats[0] == Approx(0.25));
+}
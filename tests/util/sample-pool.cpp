@@ -0,0 +1,82 @@
+#include "../testing.h"
+
+#include <cstdio>
+#include <vector>
+
+#include "util/sample-pool.h"
+#include "util/sndfile.h"
+
+using namespace top1;
+
+namespace {
+
+/** `nframes` frames of `value` */
+void writeSample(const std::string &path, std::size_t nframes, float value) {
+  std::remove(path.c_str());
+  SndFile<1> sf;
+  sf.open(path);
+  sf.samplerate = 48000;
+  std::vector<float> frames (nframes, value);
+  sf.write(frames.data(), frames.size());
+}
+
+}
+
+TEST_CASE("SamplePool shares decoded samples", "[SamplePool]") {
+  const std::string a = "test-pool-a.wav";
+  const std::string b = "test-pool-b.wav";
+  writeSample(a, 1000, 0.5);
+  writeSample(b, 1000, 0.25);
+
+  SamplePool pool (2 * 1000 * sizeof(float));
+
+  auto first = pool.get(a, 600);
+  REQUIRE(first);
+  REQUIRE(first->frames.size() == 600);
+  REQUIRE(first->fileSize == 1000);
+  REQUIRE(first->samplerate == 48000);
+  REQUIRE(first->frames[599] == 0.5);
+  REQUIRE(pool.get(a, 600) == first);
+  REQUIRE(SamplePool::current(first));
+  // More than there is
+  REQUIRE(pool.get(a, 5000)->frames.size() == 1000);
+  REQUIRE(pool.size() == 2);
+
+  SECTION("Unused ones are evicted, least recently used first") {
+    first = nullptr;
+    // Over the budget, the first one was used the longest ago
+    auto other = pool.get(b, 1000);
+    REQUIRE(pool.size() == 2);
+    REQUIRE(pool.used() == 2000 * sizeof(float));
+    // Decoded again, the whole of `a` goes instead
+    REQUIRE(pool.get(a, 600) != nullptr);
+    REQUIRE(pool.size() == 2);
+    REQUIRE(pool.used() == 1600 * sizeof(float));
+    // Used ones stay
+    pool.purge();
+    REQUIRE(pool.size() == 1);
+    REQUIRE(pool.used() == 1000 * sizeof(float));
+    other = nullptr;
+    pool.budget(0);
+    REQUIRE(pool.size() == 0);
+    REQUIRE(pool.used() == 0);
+  }
+
+  SECTION("Changed files are decoded again") {
+    writeSample(a, 800, 0.75);
+    REQUIRE_FALSE(SamplePool::current(first));
+    auto changed = pool.get(a, 600);
+    REQUIRE(changed != first);
+    REQUIRE(changed->fileSize == 800);
+    REQUIRE(changed->frames[0] == 0.75);
+    // The old one is still there for those holding it
+    REQUIRE(first->frames[0] == 0.5);
+  }
+
+  SECTION("Missing files") {
+    REQUIRE(pool.get("test-pool-missing.wav", 100) == nullptr);
+  }
+
+  std::remove(a.c_str());
+  std::remove(b.c_str());
+}
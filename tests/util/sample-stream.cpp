@@ -0,0 +1,140 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "util/sample-stream.h"
+
+using namespace top1;
+
+namespace {
+
+const std::string path = "test-stream.wav";
+
+/** A ramp, each frame its own index over `scale` */
+void writeRamp(std::size_t nframes, float scale) {
+  std::remove(path.c_str());
+  SndFile<1> sf;
+  sf.open(path);
+  sf.samplerate = 44100;
+  std::vector<float> ramp (nframes);
+  for (std::size_t i = 0; i < nframes; i++) ramp[i] = i / scale;
+  sf.write(ramp.data(), ramp.size());
+}
+
+/** Wait for the reader to get `n` frames ahead of `voice` */
+bool waitFor(SampleStream &stream, uint voice, std::size_t n) {
+  for (int i = 0; i < 2000; i++) {
+    if (stream.buffered(voice) >= n) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+}
+
+TEST_CASE("SampleStream plays samples longer than it holds", "[SampleStream]") {
+  // Several rings long
+  const std::size_t nframes = 5 * SampleStream::RING;
+  const float scale = nframes;
+  writeRamp(nframes, scale);
+
+  SamplePool pool;
+  SampleStream stream {pool, 4};
+  // A head of 441 frames
+  REQUIRE(stream.open(path, 10));
+  REQUIRE(stream.current(path));
+  REQUIRE(stream.size() == nframes);
+  REQUIRE(stream.headSize() == 441);
+  REQUIRE(stream.samplerate() == 44100);
+
+  const uint block = 256;
+  std::vector<float> out (block);
+
+  SECTION("Forwards, to the end") {
+    stream.start(1, {0, int(nframes), true, false});
+    // The head plays at once
+    REQUIRE(stream.play(1, out.data(), block, 1));
+    REQUIRE(stream.underruns() == 0);
+    REQUIRE(out[100] == Approx(100 / scale));
+    std::size_t played = block;
+    bool playing = true;
+    while (playing) {
+      REQUIRE(waitFor(stream, 1, std::min<std::size_t>(block, nframes - played)));
+      std::fill(out.begin(), out.end(), 0.f);
+      playing = stream.play(1, out.data(), block, 1);
+      uint n = std::min<std::size_t>(block, nframes - played);
+      REQUIRE(out[0] == Approx(played / scale));
+      REQUIRE(out[n - 1] == Approx((played + n - 1) / scale));
+      played += n;
+    }
+    REQUIRE(played == nframes);
+    REQUIRE(stream.underruns() == 0);
+  }
+
+  SECTION("Backwards, at double speed") {
+    const int in = 1000;
+    const int length = 3 * SampleStream::RING;
+    stream.start(0, {in, length, false, false});
+    REQUIRE(waitFor(stream, 0, 2 * block));
+    std::size_t played = 0;
+    while (stream.play(0, out.data(), block, 2)) {
+      played += 2 * block;
+      REQUIRE(stream.offset(0) == Approx(length - 1 - played));
+      REQUIRE(waitFor(stream, 0, std::min<std::size_t>(2 * block, length - played)));
+      std::fill(out.begin(), out.end(), 0.f);
+    }
+    REQUIRE(stream.underruns() == 0);
+    REQUIRE(out[0] == Approx((in + length - 1 - played) / scale));
+  }
+
+  SECTION("Looped, then released") {
+    const int in = SampleStream::RING;
+    const int length = 1000;
+    stream.start(2, {in, length, true, true});
+    std::size_t played = 0;
+    for (int i = 0; i < 20; i++) {
+      REQUIRE(waitFor(stream, 2, block));
+      std::fill(out.begin(), out.end(), 0.f);
+      REQUIRE(stream.play(2, out.data(), block, 1));
+      REQUIRE(out[0] == Approx((in + played % length) / scale));
+      played += block;
+    }
+    stream.release(2);
+    std::size_t left = length - played % length;
+    REQUIRE(waitFor(stream, 2, std::min<std::size_t>(block, left)));
+    while (stream.play(2, out.data(), block, 1)) {
+      left -= block;
+      REQUIRE(waitFor(stream, 2, std::min<std::size_t>(block, left)));
+    }
+    REQUIRE(stream.underruns() == 0);
+  }
+
+  SECTION("Starting outside the head") {
+    stream.start(3, {int(nframes) / 2, 100, true, false});
+    // Silence until the reader catches up
+    stream.play(3, out.data(), 50, 1);
+    REQUIRE(waitFor(stream, 3, 50));
+    std::fill(out.begin(), out.end(), 0.f);
+    REQUIRE(stream.play(3, out.data(), 40, 1));
+    REQUIRE(out[0] == Approx((nframes / 2 + 50) / scale));
+    stream.stop(3);
+    REQUIRE_FALSE(stream.play(3, out.data(), block, 1));
+  }
+
+  stream.close();
+  REQUIRE(stream.size() == 0);
+  std::remove(path.c_str());
+}
+
+TEST_CASE("SampleStream refuses what it can't read", "[SampleStream]") {
+  SamplePool pool;
+  SampleStream stream {pool, 1};
+  REQUIRE_FALSE(stream.open("test-stream-missing.wav"));
+  std::vector<float> out (64);
+  stream.start(0, {0, 64, true, false});
+  REQUIRE(stream.play(0, out.data(), 32, 1));
+  REQUIRE(out[0] == 0);
+}
@@ -1,5 +1,11 @@
 #include "../testing.h"
 
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include <unistd.h>
+
 #include "util/sndfile.h"
 #include "util/dyn-array.h"
 
@@ -107,3 +113,324 @@ TEST_CASE("Persistance of sound data", "[SndFile]") {
 
 
 }
+
+TEST_CASE("Mapped and streamed sound data match", "[SndFile]") {
+  const std::string path = "test3.wav";
+  std::remove(path.c_str());
+
+  using Sf = top1::BasicSndFile<float, 2>;
+  std::vector<Sf::AudioFrame> audio (5000);
+  for (auto &frm : audio) {
+    frm[0] = test::fRand(-1.0, 1.0);
+    frm[1] = test::fRand(-1.0, 1.0);
+  }
+
+  {
+    Sf sf;
+    sf.open(path);
+    REQUIRE(sf.mapped());
+    // Past the end, the gap is silent
+    sf.seek(1000);
+    REQUIRE(sf.write(audio.data() + 1000, 4000) == 4000);
+    REQUIRE(sf.size() == 5000);
+    sf.seek(0);
+    REQUIRE(sf.write(audio.data(), 1000) == 1000);
+    REQUIRE(sf.position() == 1000);
+  }
+
+  // The mapping does not leave anything behind the audio
+  std::ifstream raw (path, std::ios::binary | std::ios::ate);
+  // RIFF, room for the RF64 sizes, fmt and data chunk headers
+  const std::size_t header = 84;
+  REQUIRE(std::size_t(raw.tellg()) == header + 5000 * Sf::AudioFrame::size);
+
+  Sf sf;
+  sf.useMmap = false;
+  sf.open(path);
+  REQUIRE(!sf.mapped());
+  REQUIRE(sf.size() == 5000);
+  std::vector<Sf::AudioFrame> rAudio (5000);
+  REQUIRE(sf.read(rAudio.data(), 5000) == 5000);
+  for (uint i = 0; i < 5000; i++) {
+    REQUIRE(rAudio[i][0] == audio[i][0]);
+    REQUIRE(rAudio[i][1] == audio[i][1]);
+  }
+}
+
+TEST_CASE("SndFile grows past 4 GB as an RF64", "[SndFile]") {
+  const std::string path = "test-rf64.wav";
+  std::remove(path.c_str());
+
+  using Sf = top1::BasicSndFile<float, 1>;
+  // Sparse, only the last frames take space on disk
+  const std::size_t far = (std::size_t(5) << 30) / Sf::AudioFrame::size;
+  std::vector<float> audio (1000);
+  for (auto &s : audio) s = test::fRand(-1.0, 1.0);
+
+  {
+    Sf sf;
+    sf.open(path);
+    REQUIRE(sf.mapped());
+    REQUIRE_FALSE(sf.isRF64());
+    sf.seek(far);
+    REQUIRE(sf.write(audio.data(), 1000) == 1000);
+    REQUIRE(sf.size() == far + 1000);
+    REQUIRE(sf.isRF64());
+  }
+
+  for (bool mmap : {true, false}) {
+    Sf sf;
+    sf.useMmap = mmap;
+    sf.open(path);
+    REQUIRE(sf.isRF64());
+    REQUIRE(sf.size() == far + 1000);
+    std::vector<float> rAudio (1000);
+    sf.seek(far);
+    REQUIRE(sf.read(rAudio.data(), 1000) == 1000);
+    REQUIRE(rAudio == audio);
+    sf.seek(0);
+    REQUIRE(sf.read(rAudio.data(), 1) == 1);
+    REQUIRE(rAudio[0] == 0.f);
+  }
+  std::remove(path.c_str());
+}
+
+TEST_CASE("SndFile makes room for the RF64 sizes in old files", "[SndFile]") {
+  const std::string path = "test-old.wav";
+  std::remove(path.c_str());
+
+  using Sf = top1::BasicSndFile<float, 2>;
+  std::vector<Sf::AudioFrame> audio (3000);
+  for (auto &frm : audio) {
+    frm[0] = test::fRand(-1.0, 1.0);
+    frm[1] = test::fRand(-1.0, 1.0);
+  }
+  {
+    Sf sf;
+    sf.open(path);
+    sf.samplerate = 48000;
+    sf.write(audio.data(), audio.size());
+  }
+  test::stripDs64(path);
+
+  for (bool mmap : {true, false}) {
+    {
+      Sf sf;
+      sf.useMmap = mmap;
+      sf.open(path);
+      REQUIRE(sf.size() == 3000);
+      // Without the room, it can't grow past 4 GB
+      sf.seek((std::size_t(5) << 30) / Sf::AudioFrame::size);
+      REQUIRE(sf.write(audio.data(), 1) == 0);
+      REQUIRE(sf.insertDs64());
+    }
+
+    Sf sf;
+    sf.useMmap = mmap;
+    sf.open(path);
+    REQUIRE(sf.samplerate == 48000);
+    REQUIRE(sf.size() == 3000);
+    std::vector<Sf::AudioFrame> rAudio (3000);
+    REQUIRE(sf.read(rAudio.data(), 3000) == 3000);
+    for (uint i = 0; i < 3000; i++) {
+      REQUIRE(rAudio[i][0] == audio[i][0]);
+      REQUIRE(rAudio[i][1] == audio[i][1]);
+    }
+    sf.close();
+
+    std::ifstream raw (path, std::ios::binary | std::ios::ate);
+    REQUIRE(std::size_t(raw.tellg()) == 84 + 3000 * Sf::AudioFrame::size);
+    raw.close();
+    if (mmap) test::stripDs64(path);
+  }
+  std::remove(path.c_str());
+}
+
+namespace {
+
+template<typename T>
+void put(std::ofstream &out, T value) {
+  out.write(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+/**
+ * A PCM WAV as most programs write it, with a 16 byte `fmt `.
+ * `samples` are interleaved, and stored in `bits` bit.
+ */
+void writePcm(const std::string &path, uint channels, uint bits,
+  const std::vector<int32_t> &samples) {
+  std::ofstream out (path, std::ios::binary | std::ios::trunc);
+  const uint bytes = bits / 8;
+  top1::u4b dataSize = samples.size() * bytes;
+  out.write("RIFF", 4);
+  put<top1::u4b>(out, 4 + 8 + 16 + 8 + dataSize);
+  out.write("WAVEfmt ", 8);
+  put<top1::u4b>(out, 16);
+  put<top1::u2b>(out, 1);
+  put<top1::u2b>(out, channels);
+  put<top1::u4b>(out, 44100);
+  put<top1::u4b>(out, 44100 * channels * bytes);
+  put<top1::u2b>(out, channels * bytes);
+  put<top1::u2b>(out, bits);
+  out.write("data", 4);
+  put<top1::u4b>(out, dataSize);
+  for (int32_t sample : samples) {
+    out.write(reinterpret_cast<char *>(&sample), bytes);
+  }
+}
+
+}
+
+TEST_CASE("SndFile converts files in other formats", "[SndFile]") {
+  const std::string path = "test-pcm.wav";
+  // More than a block, so it is converted in pieces
+  const uint nframes = top1::SndFile<1>::BLOCK + 100;
+  std::vector<int32_t> samples;
+  for (uint i = 0; i < nframes; i++) {
+    samples.push_back(i % 2 ? 16384 : -16384);
+    samples.push_back(-8192);
+  }
+
+  for (bool mmap : {true, false}) {
+    writePcm(path, 2, 16, samples);
+
+    SECTION(mmap ? "Mapped, 16 bit stereo into mono" : "Streamed, 16 bit stereo into mono") {
+      top1::SndFile<1> sf;
+      sf.useMmap = mmap;
+      sf.open(path);
+      REQUIRE(sf.fileFormat() == top1::SampleFormat::PCM16);
+      REQUIRE_FALSE(sf.native());
+      REQUIRE(sf.size() == nframes);
+      std::vector<float> mono (nframes);
+      REQUIRE(sf.read(mono.data(), nframes) == nframes);
+      REQUIRE(sf.position() == nframes);
+      REQUIRE(mono[0] == Approx((-0.5 - 0.25) / 2));
+      REQUIRE(mono[nframes - 1] == Approx((0.5 - 0.25) / 2));
+
+      sf.readChannel = 1;
+      sf.seek(10);
+      REQUIRE(sf.read(mono.data(), 10) == 10);
+      REQUIRE(mono[0] == Approx(-0.25));
+      // Past the end
+      sf.seek(nframes - 5);
+      REQUIRE(sf.read(mono.data(), 10) == 5);
+    }
+
+    SECTION(mmap ? "Mapped, 16 bit stereo" : "Streamed, 16 bit stereo") {
+      top1::SndFile<2> sf;
+      sf.useMmap = mmap;
+      sf.open(path);
+      std::vector<float> stereo (2 * nframes);
+      REQUIRE(sf.read(stereo.data(), nframes) == nframes);
+      REQUIRE(stereo[0] == Approx(-0.5));
+      REQUIRE(stereo[1] == Approx(-0.25));
+
+      // Written back as 16 bit
+      std::fill(stereo.begin(), stereo.end(), 0.75);
+      stereo[0] = 2;
+      sf.seek(0);
+      REQUIRE(sf.write(stereo.data(), nframes) == nframes);
+      sf.close();
+      sf.open(path);
+      REQUIRE(sf.fileFormat() == top1::SampleFormat::PCM16);
+      REQUIRE(sf.size() == nframes);
+      REQUIRE(sf.read(stereo.data(), 2) == 2);
+      REQUIRE(stereo[0] == Approx(32767 / 32768.f));
+      REQUIRE(stereo[3] == Approx(0.75));
+    }
+  }
+
+  SECTION("24 bit mono into stereo") {
+    writePcm(path, 1, 24, {-8388608, 4194304, 8388607});
+    top1::SndFile<2> sf;
+    sf.open(path);
+    REQUIRE(sf.fileFormat() == top1::SampleFormat::PCM24);
+    std::vector<float> stereo (6);
+    REQUIRE(sf.read(stereo.data(), 3) == 3);
+    REQUIRE(stereo[0] == Approx(-1));
+    REQUIRE(stereo[1] == Approx(-1));
+    REQUIRE(stereo[2] == Approx(0.5));
+    REQUIRE(stereo[3] == Approx(0.5));
+  }
+  std::remove(path.c_str());
+}
+
+TEST_CASE("SndFile reads what is left of truncated files", "[SndFile]") {
+  const std::string path = "test-truncated.wav";
+  const uint nframes = 10000;
+  const uint left = 1000;
+  std::vector<int32_t> samples (nframes, 16384);
+
+  for (bool mmap : {true, false}) {
+    SECTION(mmap ? "Mapped" : "Streamed") {
+      writePcm(path, 1, 16, samples);
+      // Cut off in the middle of a frame
+      REQUIRE(truncate(path.c_str(), 44 + left * 2 + 1) == 0);
+
+      top1::SndFile<1> sf;
+      sf.readOnly = true;
+      sf.useMmap = mmap;
+      sf.open(path);
+      REQUIRE(sf.mapped() == mmap);
+      REQUIRE(sf.size() == left);
+      std::vector<float> mono (nframes);
+      REQUIRE(sf.read(mono.data(), nframes) == left);
+      REQUIRE(mono[left - 1] == Approx(0.5));
+      sf.seek(left - 10);
+      REQUIRE(sf.read(mono.data(), 100) == 10);
+    }
+  }
+  std::remove(path.c_str());
+}
+
+/*
+ * Sequential and random access through the mapping and the stream.
+ * Hidden, run with `tests "[.bench]"`. The tape size in MB can be set
+ * with TOP1_BENCH_MB, e.g. 4096 for a tape the size of a long session.
+ */
+TEST_CASE("SndFile access benchmark", "[.bench]") {
+  using clock = std::chrono::steady_clock;
+  using Sf = top1::BasicSndFile<float, 4>;
+  const std::string path = "test-bench.wav";
+
+  std::size_t mb = 256;
+  if (const char *env = std::getenv("TOP1_BENCH_MB")) mb = std::atoi(env);
+  const uint block = 4096;
+  const std::size_t blocks = (mb << 20) / (block * Sf::AudioFrame::size);
+  std::vector<Sf::AudioFrame> buf (block, Sf::AudioFrame(0.5));
+
+  for (bool mmap : {false, true}) {
+    std::remove(path.c_str());
+    Sf sf;
+    sf.useMmap = mmap;
+    sf.open(path);
+
+    auto time = [&] (auto &&f) {
+      auto start = clock::now();
+      f();
+      sf.flush();
+      return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    double write = time([&] {
+        sf.seek(0);
+        for (std::size_t b = 0; b < blocks; b++) sf.write(buf.data(), block);
+      });
+    double read = time([&] {
+        sf.seek(0);
+        for (std::size_t b = 0; b < blocks; b++) sf.read(buf.data(), block);
+      });
+    double random = time([&] {
+        for (std::size_t b = 0; b < blocks; b++) {
+          sf.seek((std::rand() % blocks) * block);
+          sf.read(buf.data(), block);
+        }
+      });
+
+    fmt::print("{}: {} MB, write {:.0f} MB/s, read {:.0f} MB/s, "
+      "random read {:.0f} MB/s\n", mmap ? "mmap  " : "stream", mb,
+      mb / write, mb / read, mb / random);
+    sf.close();
+  }
+  std::remove(path.c_str());
+}
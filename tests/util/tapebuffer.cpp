@@ -0,0 +1,852 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <sys/stat.h>
+
+#include "globals.h"
+#include "util/tapebuffer.h"
+
+using namespace top1;
+
+namespace {
+
+const std::string tapePath = "test-tape.tape";
+
+/// Frame `i` of the test tape holds `i` on track 1 and `-i` on track 2
+void writeTestTape(uint nframes, bool planar = false) {
+  std::remove(tapePath.c_str());
+  for (uint l = 0; l < 4; l++) {
+    std::remove(TapeFile::trackPath(tapePath, l).c_str());
+  }
+  TapeFile file (tapePath);
+  if (planar) file.makePlanar();
+  std::vector<float> up (nframes), down (nframes), silence (nframes);
+  for (uint i = 0; i < nframes; i++) {
+    up[i] = i;
+    down[i] = -float(i);
+  }
+  file.writeLanes(0, {{up.data(), down.data(), silence.data(), silence.data()}},
+    nframes);
+  file.close();
+}
+
+/// Wait until the disk thread has loaded `nframes` in the given direction
+template<typename F>
+bool waitFor(F available, std::result_of_t<F()> nframes) {
+  for (int i = 0; i < 500; i++) {
+    if (available() >= nframes) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  return false;
+}
+
+using Slices = std::vector<std::pair<TapeTime, TapeTime>>;
+
+/// Sections compare as bools, so as pairs
+Slices pairs(const std::vector<TapeBuffer::TapeSlice> &slices) {
+  Slices res;
+  for (auto &s : slices) res.push_back({s.in, s.out});
+  return res;
+}
+
+struct TapeBufferFixture {
+  TapeBuffer tb;
+  TapeBufferFixture() {
+    static Project project;
+    project.path = tapePath;
+    project.planarTape = false;
+    project.sparseTape = false;
+    project.packTape = false;
+    GLOB.project = &project;
+  }
+  ~TapeBufferFixture() {
+    tb.exit();
+  }
+};
+
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer streams the tape", "[TapeBuffer]") {
+  writeTestTape(TapeBuffer::RingBuffer::SIZE * 2);
+  tb.init();
+
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+
+  SECTION("Reading forwards") {
+    auto data = tb.readFW(512);
+    REQUIRE(data.size() == 512);
+    for (uint i = 0; i < data.size(); i++) {
+      REQUIRE(data[i][0] == i);
+      REQUIRE(data[i][1] == -float(i));
+    }
+    REQUIRE(tb.position() == 512);
+
+    auto back = tb.readBW(256);
+    REQUIRE(back.size() == 256);
+    for (uint i = 0; i < back.size(); i++) {
+      REQUIRE(back[i][0] == 511 - i);
+    }
+    REQUIRE(tb.position() == 256);
+  }
+
+  SECTION("Jumping outside of the loaded window") {
+    TapeTime target = TapeBuffer::RingBuffer::SIZE + 1000;
+    tb.goTo(target);
+    tb.preProcess();
+    REQUIRE(tb.position() == target);
+    REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+    REQUIRE(waitFor([&] {return tb.lengthBW();}, 1024));
+    auto data = tb.readFW(100);
+    REQUIRE(data.size() == 100);
+    for (uint i = 0; i < data.size(); i++) {
+      REQUIRE(data[i][0] == target + i);
+    }
+  }
+
+  SECTION("Written frames reach the disk") {
+    tb.readFW(1000);
+    std::vector<AudioFrame> rec (500, AudioFrame(0.5));
+    REQUIRE(tb.writeFW(rec, 0, [](AudioFrame o, AudioFrame n) {
+       o[2] = n[0];
+       return o;
+     }) == 0);
+    tb.exit();
+
+    TapeFile file (tapePath);
+    std::vector<AudioFrame> frames (1000);
+    file.seek(0);
+    REQUIRE(file.read(frames.data(), 1000) == 1000);
+    for (uint i = 0; i < 1000; i++) {
+      REQUIRE(frames[i][0] == i);
+      REQUIRE(frames[i][2] == (i >= 500 ? 0.5 : 0));
+    }
+    file.close();
+    return;
+  }
+
+  tb.exit();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer span reads and writes", "[TapeBuffer]") {
+  writeTestTape(TapeBuffer::RingBuffer::SIZE);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 4096));
+
+  // Cross the point where the ring wraps
+  tb.goTo(TapeBuffer::RingBuffer::SIZE - 100);
+  tb.preProcess();
+  REQUIRE(waitFor([&] {return tb.lengthBW();}, 1024));
+
+  std::vector<AudioFrame> frames (200);
+
+  SECTION("Backwards reads come out reversed") {
+    tb.goTo(1000);
+    tb.preProcess();
+    REQUIRE(waitFor([&] {return tb.lengthBW();}, 1000));
+    REQUIRE(tb.readInto(frames.data(), 200, TapeBuffer::Direction::BW) == 200);
+    for (uint i = 0; i < 200; i++) {
+      REQUIRE(frames[i][0] == 999 - i);
+    }
+    REQUIRE(tb.position() == 800);
+  }
+
+  SECTION("Writing backwards") {
+    tb.goTo(1000);
+    tb.preProcess();
+    REQUIRE(waitFor([&] {return tb.lengthFW();}, 1000));
+    for (uint i = 0; i < 200; i++) frames[i] = AudioFrame(i);
+    REQUIRE(tb.writeFrom(frames.data(), 200, TapeBuffer::Direction::BW) == 200);
+    REQUIRE(tb.readInto(frames.data(), 200, TapeBuffer::Direction::FW) == 200);
+    for (uint i = 0; i < 200; i++) {
+      REQUIRE(frames[i][0] == 199 - i);
+    }
+  }
+
+  tb.exit();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer write modes", "[TapeBuffer]") {
+  writeTestTape(TapeBuffer::RingBuffer::SIZE * 2);
+  tb.init();
+
+  // Around the point where the ring wraps
+  TapeTime pos = TapeBuffer::RingBuffer::SIZE - 100;
+  tb.goTo(pos);
+  tb.preProcess();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+  REQUIRE(waitFor([&] {return tb.lengthBW();}, 1024));
+
+  std::vector<float> rec (200, 1);
+  std::vector<AudioFrame> frames (200);
+
+  SECTION("Overdubbing only touches one track") {
+    tb.readInto(frames.data(), 200, TapeBuffer::Direction::FW);
+    REQUIRE(tb.writeLane(rec.data(), 200, 1, TapeBuffer::Direction::FW, 0,
+        writemode::Overdub()) == 200);
+    tb.readInto(frames.data(), 200, TapeBuffer::Direction::BW);
+    for (uint i = 0; i < 200; i++) {
+      TapeTime t = pos + 199 - i;
+      REQUIRE(frames[i][0] == t);
+      REQUIRE(frames[i][1] == 1 - float(t));
+      REQUIRE(frames[i][2] == 0);
+    }
+  }
+
+  SECTION("Overdubbing backwards with decay") {
+    tb.readInto(frames.data(), 200, TapeBuffer::Direction::BW);
+    REQUIRE(tb.writeLane(rec.data(), 200, 0, TapeBuffer::Direction::BW, 0,
+        writemode::OverdubDecay{0.5}) == 200);
+    tb.readInto(frames.data(), 200, TapeBuffer::Direction::FW);
+    for (uint i = 0; i < 200; i++) {
+      TapeTime t = pos - 200 + i;
+      REQUIRE(frames[i][0] == t * 0.5f + 1);
+      REQUIRE(frames[i][1] == -float(t));
+    }
+  }
+
+  SECTION("Punching in and out crossfades") {
+    writemode::Punch punch (100);
+    std::fill(rec.begin(), rec.end(), 0);
+    REQUIRE(tb.writeLane(rec.data(), 150, 0, TapeBuffer::Direction::FW,
+        50, punch) == 150);
+    punch.punchOut();
+    REQUIRE(tb.writeLane(rec.data(), 50, 0, TapeBuffer::Direction::FW,
+        0, punch) == 50);
+    REQUIRE(!punch.done());
+
+    tb.goTo(pos - 200);
+    tb.preProcess();
+    tb.readInto(frames.data(), 200, TapeBuffer::Direction::FW);
+    for (uint i = 0; i < 200; i++) {
+      TapeTime t = pos - 200 + i;
+      float gain = i < 100 ? (i + 1) / 100.f : i < 150 ? 1 : 1 - (i - 149) / 100.f;
+      REQUIRE(frames[i][0] == Approx(t * (1 - gain)));
+    }
+  }
+
+  tb.exit();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer keeps loop points loaded", "[TapeBuffer]") {
+  using Ring = TapeBuffer::RingBuffer;
+  writeTestTape(Ring::SIZE * 4);
+
+  // Longer than a ring
+  Section<TapeTime> loop = {1000, Ring::SIZE * 2 + 5000};
+  tb.setCues(loop.in, loop.out);
+  tb.init();
+
+  auto readyRings = [&] {
+    return std::count_if(tb.rings.begin(), tb.rings.end(), [] (auto &r) {
+        return r.state == Ring::READY;
+      });
+  };
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+  REQUIRE(waitFor(readyRings, 2));
+
+  std::vector<AudioFrame> frames (500);
+  std::vector<float> rec (500, 1);
+
+  // Record at the start of the loop
+  tb.goTo(loop.in);
+  tb.preProcess();
+  REQUIRE(tb.readInto(frames.data(), 500, TapeBuffer::Direction::FW) == 500);
+  tb.writeLane(rec.data(), 500, 2, TapeBuffer::Direction::FW, 0,
+    writemode::Replace());
+
+  // Wait for the recording to reach the ring loaded around loop.in
+  REQUIRE(waitFor([&] {
+        return std::count_if(tb.rings.begin(), tb.rings.end(), [&] (auto &r) {
+            return r.state == Ring::READY && r.cue == loop.in
+              && r.frame(loop.in + 499)[2] == 1;
+          });
+      }, 1));
+
+  // Play up to the end of the loop, which is not in the active ring
+  tb.goTo(loop.out - 100);
+  tb.preProcess();
+  REQUIRE(tb.lengthFW() >= 100);
+  REQUIRE(tb.readInto(frames.data(), 100, TapeBuffer::Direction::FW) == 100);
+  for (uint i = 0; i < 100; i++) {
+    REQUIRE(frames[i][0] == loop.out - 100 + i);
+  }
+
+  // And around
+  tb.goTo(loop.in);
+  tb.preProcess();
+  REQUIRE(tb.readInto(frames.data(), 500, TapeBuffer::Direction::FW) == 500);
+  for (uint i = 0; i < 500; i++) {
+    REQUIRE(frames[i][0] == loop.in + i);
+    REQUIRE(frames[i][2] == 1);
+  }
+
+  // Backwards
+  REQUIRE(waitFor(readyRings, 2));
+  tb.goTo(loop.out);
+  tb.preProcess();
+  REQUIRE(tb.readInto(frames.data(), 500, TapeBuffer::Direction::BW) == 500);
+  for (uint i = 0; i < 500; i++) {
+    REQUIRE(frames[i][0] == loop.out - 1 - i);
+  }
+
+  tb.exit();
+
+  TapeFile file (tapePath);
+  file.seek(loop.in);
+  REQUIRE(file.read(frames.data(), 500) == 500);
+  for (uint i = 0; i < 500; i++) {
+    REQUIRE(frames[i][2] == 1);
+  }
+  file.close();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer on a planar tape", "[TapeBuffer]") {
+  GLOB.project->planarTape = true;
+  writeTestTape(TapeBuffer::RingBuffer::SIZE, true);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+
+  std::vector<AudioFrame> frames (1000);
+  REQUIRE(tb.readInto(frames.data(), 1000, TapeBuffer::Direction::FW) == 1000);
+  for (uint i = 0; i < 1000; i++) {
+    REQUIRE(frames[i][0] == i);
+    REQUIRE(frames[i][1] == -float(i));
+  }
+
+  std::vector<float> rec (500, 0.5);
+  REQUIRE(tb.writeLane(rec.data(), 500, 3, TapeBuffer::Direction::FW, 0,
+      writemode::Replace()) == 500);
+  tb.exit();
+
+  TapeFile file (tapePath);
+  REQUIRE(file.planar());
+  std::vector<float> track (1000);
+  file.readLane(3, 0, track.data(), 1000);
+  for (uint i = 0; i < 1000; i++) {
+    REQUIRE(track[i] == (i >= 500 ? 0.5 : 0));
+  }
+  file.readLane(0, 0, track.data(), 1000);
+  for (uint i = 0; i < 1000; i++) {
+    REQUIRE(track[i] == i);
+  }
+  file.close();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer lifts and drops without moving audio", "[TapeBuffer]") {
+  writeTestTape(TapeBuffer::RingBuffer::SIZE);
+  auto track = Track::newIdx(0);
+
+  auto readAt = [] (TapeBuffer &buffer, TapeTime pos, uint nframes) {
+    buffer.goTo(pos);
+    buffer.preProcess();
+    REQUIRE(waitFor([&] {return buffer.lengthFW();}, nframes));
+    std::vector<AudioFrame> frames (nframes);
+    REQUIRE(buffer.readInto(frames.data(), nframes, TapeBuffer::Direction::FW) == nframes);
+    return frames;
+  };
+
+  // Lift a slice, and drop it twice
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+  tb.trackSlices[0].addSlice({1000, 2000});
+  tb.goTo(1500);
+  tb.preProcess();
+  tb.lift(track);
+  tb.goTo(10000);
+  tb.preProcess();
+  tb.drop(track);
+  tb.goTo(20000);
+  tb.preProcess();
+  tb.drop(track);
+  tb.exit();
+
+  {
+    TapeFile file (tapePath);
+    std::vector<float> lane (1000);
+    file.readLane(0, 1000, lane.data(), 1000);
+    for (uint i = 0; i < 1000; i++) {
+      REQUIRE(lane[i] == 1000 + i);
+    }
+    REQUIRE(file.edits.tracks[0].count == 6);
+    REQUIRE(file.edits.tracks[1].count == 1);
+    file.close();
+  }
+
+  // Record into the gap, and over one of the copies
+  {
+    auto buffer = std::make_unique<TapeBuffer>();
+    buffer->init();
+    std::vector<float> rec (500, 0.25);
+    readAt(*buffer, 1200, 100);
+    buffer->writeLane(rec.data(), 100, 0, TapeBuffer::Direction::FW, 0,
+      writemode::Replace());
+    std::fill(rec.begin(), rec.end(), 0.5);
+    readAt(*buffer, 20000, 500);
+    buffer->writeLane(rec.data(), 500, 0, TapeBuffer::Direction::FW, 0,
+      writemode::Replace());
+    buffer->exit();
+  }
+
+  auto buffer = std::make_unique<TapeBuffer>();
+  buffer->init();
+  auto frames = readAt(*buffer, 900, 1200);
+  for (uint i = 0; i < frames.size(); i++) {
+    TapeTime t = 900 + i;
+    float expected = t < 1000 || t >= 2000 ? t : 0;
+    if (t >= 1200 && t < 1300) expected = 0.25;
+    REQUIRE(frames[i][0] == expected);
+    REQUIRE(frames[i][1] == -t);
+  }
+  frames = readAt(*buffer, 10000, 1000);
+  for (uint i = 0; i < frames.size(); i++) {
+    REQUIRE(frames[i][0] == 1000 + i);
+  }
+  frames = readAt(*buffer, 20000, 1000);
+  for (uint i = 0; i < frames.size(); i++) {
+    REQUIRE(frames[i][0] == (i < 500 ? 0.5 : 1000 + i));
+    REQUIRE(frames[i][1] == -float(20000 + i));
+  }
+  buffer->exit();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer saves metadata only when it changed", "[TapeBuffer]") {
+  writeTestTape(TapeBuffer::RingBuffer::SIZE);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+
+  auto modified = [] {
+    struct stat st;
+    stat(tapePath.c_str(), &st);
+    return std::chrono::seconds(st.st_mtim.tv_sec)
+      + std::chrono::nanoseconds(st.st_mtim.tv_nsec);
+  };
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  auto before = modified();
+
+  // Playing writes nothing
+  std::vector<AudioFrame> frames (256);
+  for (int i = 0; i < 200; i++) {
+    tb.readInto(frames.data(), frames.size(), TapeBuffer::Direction::FW);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  REQUIRE(modified() == before);
+
+  // Changes are saved without waiting for the tape to close
+  tb.trackSlices[2].addSlice({100, 200});
+  REQUIRE(waitFor([&] {return modified() != before;}, 1));
+  tb.exit();
+
+  TapeFile file (tapePath);
+  REQUIRE(file.slices.tracks[2].count == 1);
+  REQUIRE(file.slices.tracks[2].slices[0].inPos == 100);
+  REQUIRE(file.slices.tracks[1].count == 0);
+  file.close();
+}
+
+TEST_CASE("TapeSliceSet keeps slices apart", "[TapeBuffer]") {
+  TapeBuffer::TapeSliceSet set;
+  set.addSlice({100, 200});
+  set.addSlice({300, 400});
+  set.addSlice({150, 350});
+  REQUIRE(pairs(set.list()) == Slices({{100, 149}, {150, 350}, {351, 400}}));
+
+  set.erase({160, 170});
+  REQUIRE(pairs(set.list()) == Slices({{100, 149}, {150, 159}, {171, 350}, {351, 400}}));
+  REQUIRE(set.inSlice(100));
+  REQUIRE_FALSE(set.inSlice(165));
+  REQUIRE(pairs({set.current(180)}) == Slices({{171, 350}}));
+  REQUIRE_FALSE(set.current(1000));
+  REQUIRE(set.slicesIn({155, 360}).size() == 3);
+
+  set.cut(200);
+  REQUIRE(pairs({set.current(199)}) == Slices({{171, 199}}));
+  REQUIRE(pairs({set.current(200)}) == Slices({{200, 350}}));
+  set.glue({100, 149}, {351, 400});
+  REQUIRE(pairs(set.list()) == Slices({{100, 400}}));
+
+  // What was read stays as it was
+  auto before = set.snapshot();
+  set.addSlice({900, 1000});
+  REQUIRE(before->size() == 1);
+  REQUIRE(set.size() == 2);
+}
+
+TEST_CASE("TapeSliceSet adds recorded slices later", "[TapeBuffer]") {
+  TapeBuffer::TapeSliceSet set;
+  set.addSlice({100, 200});
+  set.record({300, 400});
+  REQUIRE(set.size() == 1);
+  REQUIRE(set.applyRecorded());
+  REQUIRE_FALSE(set.applyRecorded());
+  REQUIRE(pairs(set.list()) == Slices({{100, 200}, {300, 400}}));
+
+  // A take growing block after block, with nothing applying it for a while
+  for (int out = 1000; out < 100000; out += 64) {
+    set.record({900, out});
+  }
+  REQUIRE(set.size() == 2);
+  // Other changes go after the recorded slices
+  set.erase({150, 160});
+  REQUIRE(set.size() == 4);
+  set.record({900, 100000});
+  REQUIRE(set.applyRecorded());
+  REQUIRE(pairs(set.list()) == Slices({{100, 149}, {161, 200}, {300, 400}, {900, 100000}}));
+}
+
+TEST_CASE("TapeSliceSet with lots of slices", "[TapeBuffer]") {
+  TapeBuffer::TapeSliceSet set;
+  const int count = 50000;
+  for (int i = 0; i < count; i++) set.addSlice({i * 10, i * 10 + 5});
+  REQUIRE(set.size() == count);
+  for (int i = 0; i < 1000; i++) {
+    int time = test::rand(0, count * 10 - 1);
+    REQUIRE(set.inSlice(time) == (time % 10 <= 5));
+  }
+  int seen = 0;
+  set.forEachIn({95, 125}, [&] (auto &s) {
+      REQUIRE(s.in == 90 + 10 * seen);
+      seen++;
+    });
+  REQUIRE(seen == 4);
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer saves any number of slices", "[TapeBuffer]") {
+  writeTestTape(1024);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+  const int count = TapeFile::MAX_SLICES + 100;
+  std::vector<TapeBuffer::TapeSlice> slices;
+  for (int i = 0; i < count; i++) slices.push_back({i * 10, i * 10 + 5});
+  tb.trackSlices[3].assign(slices);
+  tb.exit();
+
+  TapeBuffer tb2;
+  tb2.init();
+  REQUIRE(waitFor([&] {return tb2.trackSlices[3].size();}, count));
+  REQUIRE(pairs(tb2.trackSlices[3].list()) == pairs(slices));
+  tb2.exit();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer keeps peaks of the tape", "[TapeBuffer]") {
+  const int size = TapeBuffer::RingBuffer::SIZE;
+  writeTestTape(size);
+  tb.init();
+
+  // Tapes without peaks are scanned in the background
+  REQUIRE(waitFor([&] {return tb.peaks[0].peak({0, size}).max;}, size - 1));
+  REQUIRE(waitFor([&] {return -tb.peaks[1].peak({0, size}).min;}, size - 1));
+  auto peak = tb.peaks[1].peak({1000, 2000});
+  REQUIRE(peak.max <= -768);
+  REQUIRE(peak.min <= -1999);
+  REQUIRE(peak.min > -2048 - 256);
+  REQUIRE(tb.peaks[2].peak({0, size}).max == 0);
+
+  // Recording updates them right away
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 4096));
+  std::vector<AudioFrame> frames (4096);
+  tb.readInto(frames.data(), frames.size(), TapeBuffer::Direction::FW);
+  std::vector<float> loud (512, 5.f);
+  tb.writeLane(loud.data(), loud.size(), 2, TapeBuffer::Direction::FW, 0,
+    writemode::Replace());
+  REQUIRE(tb.peaks[2].peak({3584, 4096}).max == 5);
+  REQUIRE(tb.peaks[2].peak({0, 3072}).max == 0);
+  REQUIRE(tb.peaks[2].peak({0, size}).max == 5);
+  tb.exit();
+
+  // And they are saved with the tape
+  auto tb2 = std::make_unique<TapeBuffer>();
+  tb2->init();
+  REQUIRE(waitFor([&] {return tb2->lengthFW();}, 1024));
+  REQUIRE(tb2->peaks[2].peak({3584, 4096}).max == 5);
+  REQUIRE(tb2->peaks[0].peak({0, size}).max == size - 1);
+
+  // Dropping rebuilds the peaks where it dropped
+  tb2->trackSlices[0].addSlice({0, 1024});
+  tb2->goTo(512);
+  tb2->preProcess();
+  tb2->lift(Track::newIdx(0));
+  REQUIRE(waitFor([&] {return tb2->peaks[0].peak({0, 1024}).max == 0;}, 1));
+  tb2->goTo(size - 1024);
+  tb2->preProcess();
+  tb2->drop(Track::newIdx(2));
+  REQUIRE(waitFor([&] {return tb2->peaks[2].peak({size - 1024, size}).max;}, 1023));
+  REQUIRE(tb2->peaks[2].peak({size - 1024, size}).max == 1023);
+  tb2->exit();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer undoes takes and edits", "[TapeBuffer]") {
+  const int size = TapeBuffer::RingBuffer::SIZE;
+  writeTestTape(size);
+  auto track = Track::newIdx(0);
+
+  auto readAt = [&] (TapeTime pos, uint nframes) {
+    tb.goTo(pos);
+    tb.preProcess();
+    REQUIRE(waitFor([&] {return tb.lengthFW();}, nframes));
+    std::vector<AudioFrame> frames (nframes);
+    REQUIRE(tb.readInto(frames.data(), nframes, TapeBuffer::Direction::FW) == nframes);
+    return frames;
+  };
+  auto peakOf = [&] (Section<TapeTime> section) {
+    return tb.peaks[0].peak(section).max;
+  };
+
+  tb.init();
+  REQUIRE_FALSE(tb.undo());
+  REQUIRE(waitFor([&] {return peakOf({0, size});}, size - 1));
+
+  // A take over the tape
+  tb.checkpoint();
+  readAt(1000, 500);
+  std::vector<float> rec (500, 0.5);
+  tb.writeLane(rec.data(), 500, 0, TapeBuffer::Direction::FW, 0,
+    writemode::Replace());
+
+  REQUIRE(tb.undo());
+  REQUIRE(waitFor([&] {return peakOf({1024, 1280});}, 1279));
+  auto frames = readAt(900, 1000);
+  for (uint i = 0; i < frames.size(); i++) {
+    REQUIRE(frames[i][0] == 900 + i);
+  }
+
+  REQUIRE(tb.redo());
+  REQUIRE_FALSE(tb.redo());
+  REQUIRE(waitFor([&] {return peakOf({1024, 1280}) == 0.5f;}, 1));
+  frames = readAt(900, 1000);
+  for (uint i = 0; i < frames.size(); i++) {
+    TapeTime t = 900 + i;
+    REQUIRE(frames[i][0] == (t >= 1000 && t < 1500 ? 0.5 : t));
+    REQUIRE(frames[i][1] == -t);
+  }
+
+  // A lift, slices included
+  tb.trackSlices[0].addSlice({3000, 4000});
+  tb.goTo(3500);
+  tb.preProcess();
+  tb.lift(track);
+  REQUIRE_FALSE(tb.trackSlices[0].inSlice(3500));
+  REQUIRE(waitFor([&] {return peakOf({3072, 3840}) == 0;}, 1));
+  REQUIRE(tb.undo());
+  REQUIRE(tb.trackSlices[0].inSlice(3500));
+  REQUIRE(waitFor([&] {return peakOf({3072, 3840});}, 3839));
+  frames = readAt(3000, 1000);
+  for (uint i = 0; i < frames.size(); i++) {
+    REQUIRE(frames[i][0] == 3000 + i);
+  }
+
+  // Undoing the take went back to the frames it was recorded over
+  REQUIRE(tb.undo());
+  REQUIRE(waitFor([&] {return peakOf({1024, 1280});}, 1279));
+  tb.exit();
+
+  TapeFile file (tapePath);
+  std::vector<float> lane (500);
+  file.readLane(0, 1000, lane.data(), 500);
+  for (uint i = 0; i < 500; i++) {
+    REQUIRE(lane[i] == 1000 + i);
+  }
+  file.close();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer stores only what is recorded on sparse tapes", "[TapeBuffer]") {
+  GLOB.project->sparseTape = true;
+  writeTestTape(0);
+  tb.init();
+
+  // Far into the tape, with silence before and after the take
+  tb.goTo(200000);
+  tb.preProcess();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1000));
+  std::vector<AudioFrame> frames (1000);
+  tb.readInto(frames.data(), frames.size(), TapeBuffer::Direction::FW);
+  std::vector<float> rec (1000, 0.f);
+  std::fill(rec.begin() + 200, rec.begin() + 700, 0.5f);
+  tb.writeLane(rec.data(), rec.size(), 1, TapeBuffer::Direction::FW, 0,
+    writemode::Replace());
+  tb.exit();
+
+  TapeFile file (tapePath);
+  REQUIRE(file.size() == 500);
+  REQUIRE(file.editList(0).size() == 0);
+  std::vector<float> track (2000);
+  file.readTrack(file.editList(1), {199000, 201000}, track.data());
+  for (uint i = 0; i < track.size(); i++) {
+    TapeTime t = 199000 + i;
+    REQUIRE(track[i] == (t >= 200200 && t < 200700 ? 0.5 : 0));
+  }
+  file.close();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer packs the tape away from the playpoint", "[TapeBuffer]") {
+  const int size = 2 * TapeBuffer::RingBuffer::SIZE;
+  GLOB.project->packTape = true;
+  writeTestTape(size);
+  std::remove(TapeFile::packedPath(tapePath).c_str());
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+
+  // Until it stops growing
+  auto packedSize = [] {
+    std::ifstream packed (TapeFile::packedPath(tapePath), std::ios::ate);
+    return packed ? int(packed.tellg()) : 0;
+  };
+  REQUIRE(waitFor(packedSize, 1));
+  for (int last = -1; last != packedSize();) {
+    last = packedSize();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  std::vector<AudioFrame> frames (1000);
+  REQUIRE(tb.readInto(frames.data(), 1000, TapeBuffer::Direction::FW) == 1000);
+  REQUIRE(frames[999][1] == -999);
+  tb.exit();
+
+  TapeFile file (tapePath);
+  uint blocks = file.packableBlocks(0);
+  REQUIRE_FALSE(file.isPacked(0, 0));
+  REQUIRE(file.isPacked(0, blocks - 1));
+  std::vector<float> track (size);
+  REQUIRE(file.readLane(1, 0, track.data(), size) == size);
+  for (int i = 0; i < size; i++) {
+    REQUIRE(track[i] == -float(i));
+  }
+  file.close();
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer counts underruns and overruns", "[TapeBuffer]") {
+  writeTestTape(TapeBuffer::RingBuffer::SIZE);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+  auto &stats = tb.stats;
+  REQUIRE(stats.latency[TapeStats::READ].count() > 0);
+
+  tb.preProcess();
+  REQUIRE(stats.fillFW.count() == 1);
+  REQUIRE(stats.fillFW.largest() > 1024);
+  REQUIRE(stats.fillBW.largest() == 0);
+
+  // Nothing before the start of the tape, and that's no underrun
+  std::vector<AudioFrame> frames (1000);
+  REQUIRE(tb.readInto(frames.data(), 1000, TapeBuffer::Direction::BW) == 0);
+  REQUIRE(stats.underruns[1] == 0);
+
+  // Ahead of the loaded window
+  int loaded = tb.lengthFW();
+  std::vector<AudioFrame> lots (loaded + 100);
+  REQUIRE(tb.readInto(lots.data(), lots.size(), TapeBuffer::Direction::FW) == loaded);
+  REQUIRE(stats.underruns[0] == 1);
+  REQUIRE(stats.underrunFrames[0] == 100);
+
+  // Behind the start of the tape
+  tb.goTo(0);
+  REQUIRE(tb.writeFrom(frames.data(), 1000, TapeBuffer::Direction::FW) == 0);
+  REQUIRE(stats.overruns[0] == 1);
+  REQUIRE(stats.overrunFrames[0] == 1000);
+  REQUIRE(stats.overruns[1] == 0);
+
+  REQUIRE(stats.summary().find("Underruns: FW 1 (100 frames)") != std::string::npos);
+  stats.reset();
+  REQUIRE(stats.underruns[0] == 0);
+  REQUIRE(stats.fillFW.count() == 0);
+}
+
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer loads ahead the way the tape moves", "[TapeBuffer]") {
+  const int size = TapeBuffer::RingBuffer::SIZE;
+  writeTestTape(size * 4);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 1024));
+  // Stopped, only a part of the ring is used
+  auto stopped = PrefetchPolicy::plan(0, 0, size, 2048);
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, stopped.fw));
+  REQUIRE(tb.lengthFW() < size / 2);
+
+  // Spooling, most of it is ahead
+  tb.setSpeed(5, 5);
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, size * 3 / 4));
+
+  // Rewinding, it is behind
+  tb.goTo(size * 2);
+  tb.preProcess();
+  tb.setSpeed(-1, -1);
+  REQUIRE(waitFor([&] {return tb.lengthBW();}, size / 2));
+  REQUIRE(tb.lengthFW() < size / 2);
+
+  std::vector<AudioFrame> frames (1000);
+  REQUIRE(tb.readInto(frames.data(), 1000, TapeBuffer::Direction::BW) == 1000);
+  REQUIRE(frames[0][0] == size * 2 - 1);
+  REQUIRE(tb.stats.reads[PrefetchPolicy::PLAYING] == 1);
+  REQUIRE(tb.stats.starvedShare(PrefetchPolicy::PLAYING) == 0);
+  REQUIRE(tb.stats.summary().find("Starved reads: stopped 0.0%, playing 0.0%") != std::string::npos);
+}
+
+/*
+ * Per-callback cost of reading and overdubbing one block, using the old
+ * per-frame vector/std::function path, the span API and the lane kernels.
+ * Hidden, run with `tests "[.bench]"`
+ */
+TEST_CASE_METHOD(TapeBufferFixture, "TapeBuffer read/write benchmark", "[.bench]") {
+  using clock = std::chrono::steady_clock;
+  writeTestTape(TapeBuffer::RingBuffer::SIZE);
+  tb.init();
+  REQUIRE(waitFor([&] {return tb.lengthFW();}, 8192));
+
+  const int iterations = 20000;
+  std::vector<AudioFrame> block (1024, AudioFrame(0.1));
+  std::vector<float> mono (1024, 0.1);
+  std::vector<AudioFrame> legacyRing (TapeBuffer::RingBuffer::SIZE);
+  auto overdub = [](AudioFrame o, AudioFrame n) {
+    o[1] += n[1];
+    return o;
+  };
+
+  for (uint nframes : {64u, 128u, 256u, 1024u}) {
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      // Old path: interleaved ring, allocating reads, by value writes,
+      // type erased write func
+      std::vector<AudioFrame> fw;
+      for (uint f = 0; f < nframes; f++) {
+        fw.push_back(legacyRing[(tb.position() + f) % legacyRing.size()]);
+      }
+      std::vector<AudioFrame> data (block.begin(), block.begin() + nframes);
+      std::function<AudioFrame(AudioFrame, AudioFrame)> func = overdub;
+      for (uint f = 0; f < nframes; f++) {
+        auto &frame = legacyRing[(tb.position() + f) % legacyRing.size()];
+        frame = func(frame, data[f]);
+      }
+    }
+    auto legacy = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      tb.readInto(block.data(), nframes, TapeBuffer::Direction::FW);
+      tb.writeFrom(block.data(), nframes, TapeBuffer::Direction::FW, 0, overdub);
+      tb.readInto(block.data(), nframes, TapeBuffer::Direction::BW);
+    }
+    auto span = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      tb.readInto(block.data(), nframes, TapeBuffer::Direction::FW);
+      tb.writeLane(mono.data(), nframes, 1, TapeBuffer::Direction::FW, 0,
+        writemode::Overdub());
+      tb.readInto(block.data(), nframes, TapeBuffer::Direction::BW);
+    }
+    auto lane = clock::now() - start;
+
+    using ns = std::chrono::nanoseconds;
+    fmt::print("{:>5} frames: legacy {:>8} ns/cycle, span {:>8} ns/cycle, "
+      "lane {:>8} ns/cycle\n",
+      nframes,
+      std::chrono::duration_cast<ns>(legacy).count() / iterations,
+      std::chrono::duration_cast<ns>(span).count() / iterations,
+      std::chrono::duration_cast<ns>(lane).count() / iterations);
+  }
+
+  tb.exit();
+}
@@ -0,0 +1,392 @@
+#include "../testing.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+#include "util/tapefile.h"
+
+using namespace top1;
+
+namespace {
+
+void removeTape(std::string path) {
+  std::remove(path.c_str());
+  std::remove(TapeFile::packedPath(path).c_str());
+  std::remove(TapeFile::slicesPath(path).c_str());
+  for (uint l = 0; l < 4; l++) {
+    std::remove(TapeFile::trackPath(path, l).c_str());
+    std::remove(TapeFile::packedPath(TapeFile::trackPath(path, l)).c_str());
+  }
+}
+
+}
+
+TEST_CASE("TapeFile track access", "[TapeFile]") {
+  const std::string path = "test-tapefile.tape";
+  removeTape(path);
+
+  std::array<std::vector<float>, 4> tracks;
+  for (uint l = 0; l < 4; l++) {
+    tracks[l].resize(5000);
+    for (uint i = 0; i < 5000; i++) tracks[l][i] = l * 10000 + i;
+  }
+  TapeFile::ConstLanes src = {{
+      tracks[0].data(), tracks[1].data(), tracks[2].data(), tracks[3].data()
+    }};
+
+  auto checkTracks = [&] (TapeFile &file) {
+    std::array<std::vector<float>, 4> read;
+    for (auto &t : read) t.resize(6000, -1);
+    REQUIRE(file.readLanes(0, {{
+            read[0].data(), read[1].data(), read[2].data(), read[3].data()
+          }}, 6000) == 5000);
+    for (uint l = 0; l < 4; l++) {
+      for (uint i = 0; i < 5000; i++) {
+        REQUIRE(read[l][i] == tracks[l][i]);
+      }
+      // Silence past the end
+      for (uint i = 5000; i < 6000; i++) {
+        REQUIRE(read[l][i] == 0);
+      }
+    }
+  };
+
+  SECTION("Interleaved") {
+    TapeFile file (path);
+    REQUIRE(!file.planar());
+    REQUIRE(file.writeLanes(0, src, 5000) == 5000);
+    checkTracks(file);
+
+    // Single tracks
+    std::vector<float> ones (100, 1);
+    file.writeLane(2, 1000, ones.data(), 100);
+    tracks[2].assign(tracks[2].size(), 0);
+    REQUIRE(file.readLane(2, 1000, tracks[2].data(), 200) == 200);
+    for (uint i = 0; i < 200; i++) {
+      REQUIRE(tracks[2][i] == (i < 100 ? 1 : 21000 + i));
+    }
+    file.seek(1000);
+    TapeFile::AudioFrame frame;
+    file.read(&frame, 1);
+    REQUIRE(frame[1] == 11000);
+    file.close();
+
+    // Tapes with interleaved audio stay interleaved
+    file.open(path);
+    REQUIRE(!file.makePlanar());
+    REQUIRE(!std::ifstream(TapeFile::trackPath(path, 0)));
+    file.close();
+  }
+
+  SECTION("Planar") {
+    {
+      TapeFile file (path);
+      REQUIRE(file.makePlanar());
+      REQUIRE(file.writeLanes(0, src, 5000) == 5000);
+      checkTracks(file);
+    }
+    // The tape itself holds no audio
+    TapeFile file (path);
+    REQUIRE(file.planar());
+    REQUIRE(file.size() == 0);
+    checkTracks(file);
+
+    SndFile<1> track (TapeFile::trackPath(path, 3));
+    REQUIRE(track.size() == 5000);
+    float sample;
+    track.seek(10);
+    track.read(&sample, 1);
+    REQUIRE(sample == 30010);
+  }
+
+  removeTape(path);
+}
+
+TEST_CASE("TapeFile adds metadata to old tapes", "[TapeFile]") {
+  const std::string path = "test-tapefile-old.tape";
+  removeTape(path);
+  std::vector<TapeFile::AudioFrame> frames (5000);
+  for (uint i = 0; i < frames.size(); i++) frames[i][1] = i;
+
+  // Without the TOP1 chunk, the audio follows the format
+  {
+    SndFile<4> old (path);
+    old.write(frames.data(), frames.size());
+  }
+  // And without room for the RF64 sizes
+  test::stripDs64(path);
+
+  for (int reopen = 0; reopen < 2; reopen++) {
+    // Moved through the stream, then read through the mapping
+    TapeFile file;
+    file.useMmap = reopen > 0;
+    file.open(path);
+    REQUIRE(file.size() == 5000);
+    std::vector<float> lane (5000);
+    REQUIRE(file.readLane(1, 0, lane.data(), 5000) == 5000);
+    for (uint i = 0; i < 5000; i++) {
+      REQUIRE(lane[i] == i);
+    }
+    REQUIRE(file.edits.tracks[1].count == 1);
+    file.slices.tracks[1].count = 1;
+    file.slices.tracks[1].slices[0] = {100, 200};
+  }
+
+  TapeFile file (path);
+  REQUIRE(file.slices.tracks[1].count == 1);
+  REQUIRE(file.slices.tracks[1].slices[0].outPos == 200);
+  file.close();
+  std::ifstream raw (path, std::ios::binary);
+  char id[4];
+  raw.seekg(12);
+  raw.read(id, 4);
+  REQUIRE(std::string(id, 4) == "JUNK");
+  raw.close();
+  removeTape(path);
+}
+
+TEST_CASE("TapeFile keeps edits past 2^31 frames", "[TapeFile]") {
+  const std::string path = "test-tapefile-long.tape";
+  removeTape(path);
+  const TapeTime far = TapeTime(3) << 30;
+  EditList list ({
+      {0, far, 0, 0},
+      {far, far + 100, 2, far + 1000},
+      {far + 100, EditList::END, 1, far + 100}});
+  {
+    TapeFile file (path);
+    file.setEditList(1, list);
+    file.writeEdits(1);
+    file.setSliceList(1, {{u4b(far), u4b(far + 10)}});
+    file.writeSlices(1);
+  }
+  {
+    TapeFile file (path);
+    REQUIRE(file.editList(1).regions() == list.regions());
+    REQUIRE(file.sliceList(1)[0].outPos == far + 10);
+
+    // OLD_END is open only in tapes of version 1
+    REQUIRE(file.edits.tracks[1].regions[2].outPos == TapeFile::RegionData::END);
+    file.edits.tracks[1].regions[2].outPos = TapeFile::RegionData::OLD_END;
+    REQUIRE(file.editList(1).regions().back().out == TapeFile::RegionData::OLD_END);
+    file.top1Chunk.version = 1;
+    REQUIRE(file.editList(1).regions().back().out == EditList::END);
+  }
+  {
+    // Which are upgraded as they are opened
+    TapeFile file (path);
+    REQUIRE(file.top1Chunk.version == 2);
+    REQUIRE(file.edits.tracks[1].regions[2].outPos == TapeFile::RegionData::END);
+    REQUIRE(file.editList(1).regions() == list.regions());
+
+    // Positions that don't fit are not saved
+    file.setEditList(1, EditList({{0, TapeTime(1) << 32, 0, 0}}));
+    REQUIRE(file.editList(1).regions() == list.regions());
+  }
+  removeTape(path);
+}
+
+TEST_CASE("TapeFile saves no more than MAX_REGIONS edits", "[TapeFile]") {
+  const std::string path = "test-tapefile-regions.tape";
+  removeTape(path);
+  const uint max = TapeFile::MAX_REGIONS;
+  std::vector<EditList::Region> regions;
+  for (TapeTime i = 0; i < max + 10; i++) {
+    regions.push_back({i * 10, i * 10 + 10, 1, i * 20});
+  }
+  TapeFile file (path);
+  file.setEditList(2, EditList(regions));
+  REQUIRE(file.edits.tracks[2].count == max);
+  REQUIRE(file.editList(2).regions().back() == regions[max - 1]);
+  file.close();
+  removeTape(path);
+}
+
+TEST_CASE("TapeFile can be read while it is written", "[TapeFile]") {
+  const std::string path = "test-tapefile-shared.tape";
+  removeTape(path);
+  std::vector<float> take (5000);
+  for (uint i = 0; i < take.size(); i++) take[i] = 1 + i;
+
+  TapeFile writer (path);
+  writer.writeLane(2, 0, take.data(), take.size());
+  writer.flush();
+  {
+    TapeFile reader;
+    reader.readOnly = true;
+    reader.open(path);
+    REQUIRE_FALSE(reader.error);
+    REQUIRE(reader.mapped());
+    std::vector<float> lane (5000);
+    REQUIRE(reader.readLane(2, 0, lane.data(), 5000) == 5000);
+    REQUIRE(lane == take);
+  }
+  // The reader left the file as it was
+  writer.writeLane(2, 5000, take.data(), take.size());
+  writer.close();
+  TapeFile file (path);
+  REQUIRE(file.size() == 10000);
+  std::vector<float> lane (10000);
+  REQUIRE(file.readLane(2, 0, lane.data(), 10000) == 10000);
+  REQUIRE(lane[9999] == 5000);
+  file.close();
+
+  TapeFile none;
+  none.readOnly = true;
+  none.open("test-tapefile-none.tape");
+  REQUIRE(none.error);
+  REQUIRE_FALSE(std::ifstream("test-tapefile-none.tape"));
+  removeTape(path);
+}
+
+TEST_CASE("TapeFile keeps any number of slices", "[TapeFile]") {
+  const std::string path = "test-tapefile-slices.tape";
+  removeTape(path);
+  const uint count = TapeFile::MAX_SLICES * 3;
+  std::vector<TapeFile::SliceData> many;
+  for (u4b i = 0; i < count; i++) many.push_back({i * 10, i * 10 + 5});
+
+  {
+    TapeFile file (path);
+    file.setSliceList(1, many);
+    file.setSliceList(2, {{1, 2}});
+    file.writeSlices(1);
+    REQUIRE(file.slices.tracks[1].count == TapeFile::MAX_SLICES);
+  }
+  REQUIRE(std::ifstream(TapeFile::slicesPath(path)));
+  {
+    TapeFile file (path);
+    auto list = file.sliceList(1);
+    REQUIRE(list.size() == count);
+    REQUIRE(list.back().outPos == (count - 1) * 10 + 5);
+    REQUIRE(file.sliceList(2).size() == 1);
+    REQUIRE(file.sliceList(0).empty());
+
+    // Saved by something that only knows the tape
+    file.slices.tracks[1].slices[0].outPos = 7;
+  }
+  {
+    TapeFile file (path);
+    auto list = file.sliceList(1);
+    REQUIRE(list.size() == TapeFile::MAX_SLICES);
+    REQUIRE(list[0].outPos == 7);
+
+    // Not needed anymore
+    file.setSliceList(1, {{0, 10}});
+    file.writeSlices(1);
+  }
+  REQUIRE_FALSE(std::ifstream(TapeFile::slicesPath(path)));
+  removeTape(path);
+}
+
+TEST_CASE("TapeFile converts between dense and sparse tapes", "[TapeFile]") {
+  const std::string dense = "test-tapefile-dense.tape";
+  const std::string sparse = "test-tapefile-sparse.tape";
+  const std::string back = "test-tapefile-back.tape";
+  for (auto &path : {dense, sparse, back}) removeTape(path);
+
+  // Track 1 is silent until far into the tape, track 2 right after
+  std::vector<float> take (5000);
+  for (uint i = 0; i < take.size(); i++) take[i] = 1 + i;
+  {
+    TapeFile file (dense);
+    file.writeLane(0, 100000, take.data(), take.size());
+    file.writeLane(1, 0, take.data(), take.size());
+    file.slices.tracks[0].count = 1;
+    file.slices.tracks[0].slices[0] = {100000, 105000};
+  }
+  REQUIRE(TapeFile::convert(dense, sparse, true));
+  REQUIRE(TapeFile::convert(sparse, back, false));
+  REQUIRE_FALSE(TapeFile::convert("test-tapefile-none.tape", back, true));
+
+  auto checkTracks = [&] (TapeFile &file) {
+    std::vector<float> track (110000);
+    file.readTrack(file.editList(0), {0, 110000}, track.data());
+    for (uint i = 0; i < track.size(); i++) {
+      REQUIRE(track[i] == (i >= 100000 && i < 105000 ? i - 99999 : 0));
+    }
+    file.readTrack(file.editList(1), {0, 110000}, track.data());
+    for (uint i = 0; i < track.size(); i++) {
+      REQUIRE(track[i] == (i < 5000 ? i + 1 : 0));
+    }
+    REQUIRE(file.slices.tracks[0].count == 1);
+    REQUIRE(file.slices.tracks[0].slices[0].outPos == 105000);
+  };
+
+  {
+    TapeFile file (sparse);
+    // The blocks the takes touch, stored from the start
+    REQUIRE(file.size() <= 2 * TapeFile::CONVERT_BLOCK);
+    REQUIRE(file.editList(2).size() == 0);
+    checkTracks(file);
+  }
+  {
+    // Each track in its own lane again
+    TapeFile file (back);
+    REQUIRE(file.size() == 105000);
+    REQUIRE(file.editList(0).isIdentity({0, 105000}, 0));
+    std::vector<float> lane (5000);
+    file.readLane(0, 100000, lane.data(), lane.size());
+    REQUIRE(lane == take);
+    checkTracks(file);
+  }
+  for (auto &path : {dense, sparse, back}) removeTape(path);
+}
+
+TEST_CASE("TapeFile packs blocks it doesn't play", "[TapeFile]") {
+  const std::string path = "test-tapefile-packed.tape";
+  const uint block = PackedStore::BLOCK;
+  const uint nframes = 5 * block + 100;
+  std::array<std::vector<float>, 4> tracks;
+  for (uint l = 0; l < 4; l++) {
+    tracks[l].resize(nframes);
+    for (uint i = 0; i < nframes; i++) {
+      tracks[l][i] = std::sin(0.01 * (l + 1) * i) + test::fRand(-1e-3, 1e-3);
+    }
+  }
+
+  for (bool planar : {false, true}) {
+    CAPTURE(planar);
+    removeTape(path);
+    auto readTrack = [&] (TapeFile &file, uint lane) {
+      std::vector<float> read (nframes);
+      REQUIRE(file.readLane(lane, 0, read.data(), nframes) == nframes);
+      return read;
+    };
+    {
+      TapeFile file (path);
+      if (planar) file.makePlanar();
+      file.writeLanes(0, {{tracks[0].data(), tracks[1].data(),
+            tracks[2].data(), tracks[3].data()}}, nframes);
+      REQUIRE(file.canPack());
+      REQUIRE(file.packableBlocks(1) == 5);
+      REQUIRE(file.packBlock(1, 1));
+      REQUIRE(file.packBlock(1, 3));
+      REQUIRE_FALSE(file.packBlock(1, 5));
+      REQUIRE(file.isPacked(1, 3));
+      REQUIRE(file.isPacked(0, 3) == !planar);
+      REQUIRE(file.packedBytes() > 0);
+      for (uint l = 0; l < 4; l++) REQUIRE(readTrack(file, l) == tracks[l]);
+    }
+
+    // Still packed when opened again, until written to
+    TapeFile file (path);
+    REQUIRE(file.isPacked(1, 1));
+    REQUIRE(file.isPacked(1, 3));
+    for (uint l = 0; l < 4; l++) REQUIRE(readTrack(file, l) == tracks[l]);
+    std::vector<float> ones (10, 1.f);
+    file.writeLane(1, 3 * block + 50, ones.data(), ones.size());
+    std::copy(ones.begin(), ones.end(), tracks[1].begin() + 3 * block + 50);
+    REQUIRE(file.isPacked(1, 1));
+    REQUIRE_FALSE(file.isPacked(1, 3));
+    for (uint l = 0; l < 4; l++) REQUIRE(readTrack(file, l) == tracks[l]);
+    file.close();
+
+    TapeFile reopened (path);
+    REQUIRE_FALSE(reopened.isPacked(1, 3));
+    for (uint l = 0; l < 4; l++) REQUIRE(readTrack(reopened, l) == tracks[l]);
+    reopened.close();
+  }
+  removeTape(path);
+}
@@ -0,0 +1,91 @@
+#include "../testing.h"
+
+#include <chrono>
+#include <vector>
+
+#include "util/write-modes.h"
+
+using namespace top1;
+
+namespace {
+
+/** Overdub the way the kernels did before, one loop for any stride */
+void overdubStrided(float *tape, int stride, const float *in, uint n) {
+  for (uint i = 0; i < n; i++, tape += stride) {
+    *tape += in[i];
+  }
+}
+
+}
+
+TEST_CASE("Write mode kernels", "[writemode]") {
+  // Odd lengths, so the ends of vectorized loops are covered
+  for (uint n : {0u, 1u, 7u, 64u, 1001u}) {
+    std::vector<float> in (n), tape (n + 2, 1);
+    for (uint i = 0; i < n; i++) in[i] = i;
+
+    SECTION(fmt::format("{} frames", n)) {
+      SECTION("Forwards") {
+        writemode::OverdubDecay{0.5}.write<1>(tape.data() + 1, in.data(), n);
+        for (uint i = 0; i < n; i++) REQUIRE(tape[i + 1] == 0.5f + i);
+        writemode::Replace().write<1>(tape.data() + 1, in.data(), n);
+        for (uint i = 0; i < n; i++) REQUIRE(tape[i + 1] == i);
+      }
+      SECTION("Backwards") {
+        writemode::Overdub().write<-1>(tape.data() + n, in.data(), n);
+        for (uint i = 0; i < n; i++) REQUIRE(tape[n - i] == 1.f + i);
+      }
+      SECTION("Punched in backwards") {
+        writemode::Punch punch (64);
+        punch.write<-1>(tape.data() + n, in.data(), n);
+        for (uint i = 0; i < n; i++) {
+          float gain = std::min(i + 1, 64u) / 64.f;
+          REQUIRE(tape[n - i] == Approx(1 + gain * (i - 1.f)));
+        }
+      }
+      // Nothing around is touched
+      REQUIRE(tape.front() == 1);
+      REQUIRE(tape.back() == 1);
+    }
+  }
+}
+
+/*
+ * The kernels against a loop with the stride known only at run time, as
+ * they were. Hidden, run with `tests "[.bench]"`.
+ */
+TEST_CASE("Write mode benchmark", "[.bench]") {
+  using clock = std::chrono::steady_clock;
+  using ns = std::chrono::nanoseconds;
+  const int iterations = 200000;
+  std::vector<float> tape (4096), in (4096, 0.001);
+  // Not a constant the compiler could specialize the loop for
+  volatile int stride = 1;
+
+  for (uint n : {64u, 256u, 1024u}) {
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      overdubStrided(tape.data(), stride, in.data(), n);
+    }
+    auto strided = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      writemode::Overdub().write<1>(tape.data(), in.data(), n);
+    }
+    auto forwards = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      writemode::Overdub().write<-1>(tape.data() + n - 1, in.data(), n);
+    }
+    auto backwards = clock::now() - start;
+
+    fmt::print("{:>5} frames: strided {:>6} ns, forwards {:>6} ns, "
+      "backwards {:>6} ns\n", n,
+      std::chrono::duration_cast<ns>(strided).count() / iterations,
+      std::chrono::duration_cast<ns>(forwards).count() / iterations,
+      std::chrono::duration_cast<ns>(backwards).count() / iterations);
+  }
+  REQUIRE(tape[0] > 0);
+}